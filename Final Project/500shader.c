@@ -16,11 +16,11 @@ simpler than it looks here. In pseudocode, the core idea is 10 steps:
 The code below is much longer than 10 steps, only because it has lots of error
 checking. */
 
-/* Compiles a shader from GLSL source code. type is either GL_VERTEX_SHADER or
-GL_FRAGMENT_SHADER. If an error occurs, then returns 0. Otherwise, returns a
-compiled shader, which the user must eventually deallocate with glDeleteShader.
-(But usually this function is called from makeProgram, which calls
-glDeleteShader on the user's behalf.) */
+/* Compiles a shader from GLSL source code. type is GL_VERTEX_SHADER,
+GL_GEOMETRY_SHADER, or GL_FRAGMENT_SHADER. If an error occurs, then returns 0.
+Otherwise, returns a compiled shader, which the user must eventually deallocate
+with glDeleteShader. (But usually this function is called from makeProgram,
+which calls glDeleteShader on the user's behalf.) */
 GLuint makeShader(GLenum type, const GLchar *shaderCode) {
 	GLuint shader = glCreateShader(type);
 	if (shader == 0) {
@@ -44,27 +44,42 @@ GLuint makeShader(GLenum type, const GLchar *shaderCode) {
 	return shader;
 }
 
-/* Compiles and links a shader program from two pieces of GLSL source code. If
-an error occurs, then returns 0. Otherwise, returns a shader program, which the
-user should eventually deallocate using glDeleteProgram. */
-GLuint makeProgram(GLchar *vertexCode, GLchar *fragmentCode) {
-	GLuint vertexShader, fragmentShader, program;
+/* Compiles and links a shader program from three pieces of GLSL source code.
+geometryCode may be NULL, for a program without a geometry shader. If an error
+occurs, then returns 0. Otherwise, returns a shader program, which the user
+should eventually deallocate using glDeleteProgram. */
+GLuint makeProgramGeometry(GLchar *vertexCode, GLchar *geometryCode,
+		GLchar *fragmentCode) {
+	GLuint vertexShader, geometryShader = 0, fragmentShader, program;
 	vertexShader = makeShader(GL_VERTEX_SHADER, vertexCode);
 	if (vertexShader == 0)
 		return 0;
+	if (geometryCode != NULL) {
+		geometryShader = makeShader(GL_GEOMETRY_SHADER, geometryCode);
+		if (geometryShader == 0) {
+			glDeleteShader(vertexShader);
+			return 0;
+		}
+	}
 	fragmentShader = makeShader(GL_FRAGMENT_SHADER, fragmentCode);
 	if (fragmentShader == 0) {
 		glDeleteShader(vertexShader);
+		if (geometryShader != 0)
+			glDeleteShader(geometryShader);
 		return 0;
 	}
 	program = glCreateProgram();
 	if (program == 0) {
 		fprintf(stderr, "makeProgram: glCreateProgram failed\n");
 		glDeleteShader(vertexShader);
+		if (geometryShader != 0)
+			glDeleteShader(geometryShader);
 		glDeleteShader(fragmentShader);
 		return 0;
 	}
     glAttachShader(program, vertexShader);
+	if (geometryShader != 0)
+		glAttachShader(program, geometryShader);
     glAttachShader(program, fragmentShader);
     glLinkProgram(program);
     GLint status;
@@ -77,6 +92,8 @@ GLuint makeProgram(GLchar *vertexCode, GLchar *fragmentCode) {
 		fprintf(stderr, "makeProgram: glGetProgramInfoLog:\n%s\n", infoLog);
 		free(infoLog);
     	glDeleteShader(vertexShader);
+		if (geometryShader != 0)
+			glDeleteShader(geometryShader);
 		glDeleteShader(fragmentShader);
 		glDeleteProgram(program);
 		return 0;
@@ -84,10 +101,19 @@ GLuint makeProgram(GLchar *vertexCode, GLchar *fragmentCode) {
     /* Success. The shaders are built into the program and don't need to be
     remembered separately, so delete them. */
     glDeleteShader(vertexShader);
+	if (geometryShader != 0)
+		glDeleteShader(geometryShader);
     glDeleteShader(fragmentShader);
     return program;
 }
 
+/* Compiles and links a shader program from two pieces of GLSL source code. If
+an error occurs, then returns 0. Otherwise, returns a shader program, which the
+user should eventually deallocate using glDeleteProgram. */
+GLuint makeProgram(GLchar *vertexCode, GLchar *fragmentCode) {
+	return makeProgramGeometry(vertexCode, NULL, fragmentCode);
+}
+
 /* Checks the validity of a shader program against the rest of the current
 OpenGL state. Call it optionally after makeProgram, setting up textures, etc.
 Returns 0 if okay, non-zero if error. */
@@ -19,6 +19,14 @@ struct camCamera {
 	GLdouble distance;
 	GLdouble phi, theta;
 	GLdouble target[3];
+	/* Cached from the low-level interface by camUpdate. Which of them are up to
+	date is recorded in cached, whose bits are set by camUpdate and cleared by
+	the setters. A camera that starts zeroed, or that is set up entirely
+	through the setters, caches nothing stale. */
+	GLuint cached;
+	GLdouble view[4][4], proj[4][4], viewProj[4][4];
+	GLdouble planes[6][4];
+	GLfloat viewProjGL[4][4];
 };
 
 
@@ -34,29 +42,52 @@ struct camCamera {
 #define camPROJF 4
 #define camPROJN 5
 
+/* The bits of cached. camCACHEDVIEW covers view (the inverse isometry C^-1),
+camCACHEDPROJ covers proj (the projection P), and camCACHEDPRODUCT covers
+everything derived from both: viewProj (P C^-1), its GLfloat version, and the
+frustum planes. */
+#define camCACHEDVIEW 1
+#define camCACHEDPROJ 2
+#define camCACHEDPRODUCT 4
+
+/* Helper functions for the setters. Mark the cached matrices that depend on
+the camera's isometry, or on its projection, as stale. */
+void camDirtyView(camCamera *cam) {
+	cam->cached &= ~(camCACHEDVIEW | camCACHEDPRODUCT);
+}
+
+void camDirtyProjection(camCamera *cam) {
+	cam->cached &= ~(camCACHEDPROJ | camCACHEDPRODUCT);
+}
+
 /* Sets the camera's rotation. */
 void camSetRotation(camCamera *cam, GLdouble rot[3][3]) {
 	vecCopy(9, (GLdouble *)rot, (GLdouble *)(cam->rotation));
+	camDirtyView(cam);
 }
 
 /* Sets the camera's translation. */
 void camSetTranslation(camCamera *cam, GLdouble transl[3]) {
 	vecCopy(3, transl, cam->translation);
+	camDirtyView(cam);
 }
 
 /* Sets the projection type, to either camORTHOGRAPHIC or camPERSPECTIVE. */
 void camSetProjectionType(camCamera *cam, GLuint projType) {
 	cam->projectionType = projType;
+	camDirtyProjection(cam);
 }
 
 /* Sets all six projection parameters. */
 void camSetProjection(camCamera *cam, GLdouble proj[6]) {
 	vecCopy(6, proj, cam->projection);
+	camDirtyProjection(cam);
 }
 
 /* Sets one of the six projection parameters. */
 void camSetOneProjection(camCamera *cam, GLuint i, GLdouble value) {
 	cam->projection[i] = value;
+	camDirtyProjection(cam);
 }
 
 /* Sets the camera's rotation and translation, in a manner suitable for third-
@@ -73,6 +104,7 @@ void camLookAt(camCamera *cam, GLdouble target[3], GLdouble rho, GLdouble phi,
 	mat33BasisRotation(yStd, zStd, y, z, cam->rotation);
 	vecScale(3, rho, z, cam->translation);
 	vecAdd(3, target, cam->translation, cam->translation);
+	camDirtyView(cam);
 }
 
 /* Sets the camera's rotation and translation, in a manner suitable for first-
@@ -89,6 +121,7 @@ void camLookFrom(camCamera *cam, GLdouble position[3], GLdouble phi,
 	vec3Spherical(1.0, M_PI / 2.0 - phi, theta + M_PI, y);
 	mat33BasisRotation(yStd, negZStd, y, negZ, cam->rotation);
 	vecCopy(3, position, cam->translation);
+	camDirtyView(cam);
 }
 
 /* Sets the projection type and the six projection parameters, based on the
@@ -114,29 +147,124 @@ void camSetFrustum(camCamera *cam, GLuint projType, GLdouble fovy,
 	cam->projection[camPROJB] = -cam->projection[camPROJT];
 	cam->projection[camPROJR] = cam->projection[camPROJT] * width / height;
 	cam->projection[camPROJL] = -cam->projection[camPROJR];
+	camDirtyProjection(cam);
 }
 
-/* viewingLoc is a shader location for a uniform 4x4 matrix. This function
-loads that location with the camera's inverse isometry and projection --- that
-is, P C^-1, in the notation of our software graphics engine. */
-void camRender(camCamera *cam, GLint viewingLoc) {
-  GLdouble camInv[4][4], projCamInv[4][4], proj[4][4];
-	GLfloat viewing[4][4];
-  mat44InverseIsometry(cam->rotation, cam->translation, camInv);
-	if (cam->projectionType == camORTHOGRAPHIC) {
+/* Brings the camera's cached matrices up to date, recomputing only what the
+setters have changed since the last update. The inverse isometry C^-1 goes
+into view, the projection P into proj, and P C^-1 (in the notation of our
+software graphics engine) into viewProj and, converted for OpenGL, into
+viewProjGL. The six planes of the viewing volume go into planes; see
+camFrustumPlanes. After calling this function, the caller may read those
+members directly, until the next setter. */
+void camUpdate(camCamera *cam) {
+	int i, k;
+	if (cam->cached == (camCACHEDVIEW | camCACHEDPROJ | camCACHEDPRODUCT))
+		return;
+	if (!(cam->cached & camCACHEDVIEW))
+		mat44InverseIsometry(cam->rotation, cam->translation, cam->view);
+	if (!(cam->cached & camCACHEDPROJ)) {
+		if (cam->projectionType == camORTHOGRAPHIC) {
 			mat44Orthographic(cam->projection[0], cam->projection[1],
-												cam->projection[2], cam->projection[3],
-												cam->projection[4], cam->projection[5], proj);
-	} else if (cam->projectionType == camPERSPECTIVE) {
+				cam->projection[2], cam->projection[3], cam->projection[4],
+				cam->projection[5], cam->proj);
+		} else if (cam->projectionType == camPERSPECTIVE) {
 			mat44Perspective(cam->projection[0], cam->projection[1],
-											 cam->projection[2], cam->projection[3],
-											 cam->projection[4], cam->projection[5], proj);
-	} else {
+				cam->projection[2], cam->projection[3], cam->projection[4],
+				cam->projection[5], cam->proj);
+		} else {
 			printf("ERROR: the camera doesn't have a valid projection type\n");
+			mat44Identity(cam->proj);
+		}
+	}
+	mat444Multiply(cam->proj, cam->view, cam->viewProj);
+	mat44OpenGL(cam->viewProj, cam->viewProjGL);
+	/* The planes are the sums and differences of the last row of P C^-1 with
+	its other rows, because the viewing volume is where -w <= x, y, z <= w
+	after projection. */
+	for (i = 0; i < 3; i += 1)
+		for (k = 0; k < 4; k += 1) {
+			cam->planes[2 * i][k] = cam->viewProj[3][k] + cam->viewProj[i][k];
+			cam->planes[2 * i + 1][k] = cam->viewProj[3][k] -
+				cam->viewProj[i][k];
+		}
+	for (i = 0; i < 6; i += 1) {
+		GLdouble len = vec3Length(cam->planes[i]);
+		if (len != 0.0)
+			vecScale(4, 1.0 / len, cam->planes[i], cam->planes[i]);
+	}
+	cam->cached = camCACHEDVIEW | camCACHEDPROJ | camCACHEDPRODUCT;
+}
+
+/* Computes the camera's inverse isometry and projection --- that is, P C^-1,
+in the notation of our software graphics engine. */
+void camViewingMatrix(camCamera *cam, GLdouble projCamInv[4][4]) {
+	camUpdate(cam);
+	mat44Copy(cam->viewProj, projCamInv);
+}
+
+/* viewingLoc is a shader location for a uniform 4x4 matrix. This function
+loads that location with the camera's inverse isometry and projection --- that
+is, P C^-1, in the notation of our software graphics engine. If the camera has
+not changed since the last call, then nothing is recomputed. */
+void camRender(camCamera *cam, GLint viewingLoc) {
+	camUpdate(cam);
+	glUniformMatrix4fv(viewingLoc, 1, GL_FALSE, (GLfloat *)cam->viewProjGL);
+}
+
+/* Extracts the six planes of the camera's viewing volume, in world
+coordinates, from the cached P C^-1. Each plane (a, b, c, d) is normalized so
+that (a, b, c) is a unit vector pointing into the viewing volume, and
+a x + b y + c z + d is the signed distance from the plane to the point
+(x, y, z). A point is inside the viewing volume if and only if all six
+distances are non-negative. */
+void camFrustumPlanes(camCamera *cam, GLdouble planes[6][4]) {
+	camUpdate(cam);
+	vecCopy(24, (GLdouble *)cam->planes, (GLdouble *)planes);
+}
+
+/* Computes the eight corners of the camera's viewing volume, in world
+coordinates: the four corners of the near rectangle, followed by the four
+corners of the far rectangle. */
+void camFrustumCorners(camCamera *cam, GLdouble corners[8][3]) {
+	GLdouble local[3], scale;
+	int i;
+	for (i = 0; i < 8; i += 1) {
+		local[2] = cam->projection[i < 4 ? camPROJN : camPROJF];
+		/* The far rectangle of a perspective frustum is the near one scaled. */
+		if (cam->projectionType == camPERSPECTIVE)
+			scale = local[2] / cam->projection[camPROJN];
+		else
+			scale = 1.0;
+		local[0] = scale * cam->projection[i % 2 == 0 ? camPROJL : camPROJR];
+		local[1] = scale * cam->projection[i % 4 < 2 ? camPROJB : camPROJT];
+		mat331Multiply(cam->rotation, local, corners[i]);
+		vecAdd(3, corners[i], cam->translation, corners[i]);
+	}
+}
+
+/* Returns 0 if the given world-space bounds are certainly outside the viewing
+volume described by planes (as from camFrustumPlanes), and 1 if they might be
+inside. The bounds are a sphere of the given center and radius, and a box of
+the given center and half-size, aligned with the world axes. A negative radius
+means that the bounds are unknown, so the answer is 1. */
+int camFrustumContains(GLdouble planes[6][4], GLdouble center[3],
+		GLdouble radius, GLdouble halfSize[3]) {
+	int i;
+	GLdouble dist, reach;
+	if (radius < 0.0)
+		return 1;
+	for (i = 0; i < 6; i += 1) {
+		dist = vecDot(3, planes[i], center) + planes[i][3];
+		if (dist < -radius)
+			return 0;
+		/* The sphere straddles the plane; maybe the box is tighter. */
+		reach = fabs(planes[i][0]) * halfSize[0] +
+			fabs(planes[i][1]) * halfSize[1] + fabs(planes[i][2]) * halfSize[2];
+		if (dist < -reach)
+			return 0;
 	}
-  mat444Multiply(proj, camInv, projCamInv);
-  mat44OpenGL(projCamInv, viewing);
-  glUniformMatrix4fv(viewingLoc, 1, GL_FALSE, (GLfloat *)viewing);
+	return 1;
 }
 
 
@@ -61,6 +61,22 @@ void lightShineFrom(lightLight *light, GLdouble position[3], GLdouble phi,
 }
 
 
+/* Returns the distance from the light at which its attenuation falls to
+cutoff (for example, 1.0 / 256.0), or -1.0 if it never does. Beyond that
+distance, the light can be ignored. */
+GLdouble lightRange(lightLight *light, GLdouble cutoff) {
+	GLdouble a0 = light->attenuation[0] - 1.0 / cutoff;
+	GLdouble a1 = light->attenuation[1], a2 = light->attenuation[2];
+	/* Solve a2 d^2 + a1 d + a0 = 0 for the positive root. */
+	if (a0 >= 0.0)
+		return 0.0;
+	if (a2 > 0.0)
+		return (-a1 + sqrt(a1 * a1 - 4.0 * a2 * a0)) / (2.0 * a2);
+	if (a1 > 0.0)
+		return -a0 / a1;
+	return -1.0;
+}
+
 
 /*** OpenGL ***/
 
@@ -15,6 +15,9 @@ struct meshMesh {
 	GLuint triNum, vertNum, attrDim;
 	GLuint *tri;						/* triNum * 3 GLuints */
 	GLdouble *vert;					/* vertNum * attrDim GLdoubles */
+	/* Bounding box center +- halfSize, and bounding sphere about the same
+	center. A negative radius means that the bounds are unknown. */
+	GLdouble center[3], halfSize[3], radius;
 	GLuint meshType;
 	dGeomID geom;
 	dBodyID body;
@@ -26,6 +29,13 @@ struct meshGLMesh {
   	GLuint *attrDims;
   	GLuint *vaos;
 	GLuint buffers[2];
+	/* A tightly packed stream of float positions, for depth-only passes, or 0
+	if there is none. See meshGLPositionsInitialize. */
+	GLuint positionBuffer;
+	GLdouble center[3], halfSize[3], radius;
+	/* Where the mesh lives in an indirect batch, if packed is non-zero. */
+	GLuint packed, firstIndex;
+	GLint baseVertex;
 	GLuint meshType;
 	dGeomID geom;
 	dBodyID body;
@@ -45,6 +55,7 @@ int meshInitialize(meshMesh *mesh, GLuint triNum, GLuint vertNum,
 		mesh->triNum = triNum;
 		mesh->vertNum = vertNum;
 		mesh->attrDim = attrDim;
+		mesh->radius = -1.0;
 	}
 	return (mesh->tri == NULL);
 }
@@ -86,6 +97,39 @@ GLdouble *meshGetVertexPointer(meshMesh *mesh, GLuint vert) {
 		return NULL;
 }
 
+/* Assumes that attributes 0, 1, 2 are XYZ. Computes the mesh's bounding box
+and a bounding sphere about the box's center, for culling. The 3D convenience
+initializers call this function for you. If you fill in a mesh's vertices
+yourself, then call it afterwards; until then, the bounds are unknown and the
+mesh is never culled. */
+void meshComputeBounds(meshMesh *mesh) {
+	GLuint i, k;
+	GLdouble lo[3], hi[3], *v, diff[3], dist;
+	if (mesh->vertNum == 0 || mesh->attrDim < 3) {
+		mesh->radius = -1.0;
+		return;
+	}
+	vecCopy(3, mesh->vert, lo);
+	vecCopy(3, mesh->vert, hi);
+	for (i = 1; i < mesh->vertNum; i += 1) {
+		v = meshGetVertexPointer(mesh, i);
+		for (k = 0; k < 3; k += 1) {
+			lo[k] = fmin(lo[k], v[k]);
+			hi[k] = fmax(hi[k], v[k]);
+		}
+	}
+	vecAdd(3, lo, hi, mesh->center);
+	vecScale(3, 0.5, mesh->center, mesh->center);
+	vecSubtract(3, hi, mesh->center, mesh->halfSize);
+	mesh->radius = 0.0;
+	for (i = 0; i < mesh->vertNum; i += 1) {
+		vecSubtract(3, meshGetVertexPointer(mesh, i), mesh->center, diff);
+		dist = vecLength(3, diff);
+		if (dist > mesh->radius)
+			mesh->radius = dist;
+	}
+}
+
 /* Deallocates the resources backing the mesh. This function must be called
 when you are finished using a mesh. */
 void meshDestroy(meshMesh *mesh) {
@@ -106,6 +150,11 @@ int meshGLInitialize(meshGLMesh *meshGL, meshMesh *mesh, GLuint attrNum,
     meshGL->meshType = mesh->meshType;
     meshGL->body = mesh->body;
     meshGL->geom = mesh->geom;
+    vecCopy(3, mesh->center, meshGL->center);
+    vecCopy(3, mesh->halfSize, meshGL->halfSize);
+    meshGL->radius = mesh->radius;
+    meshGL->packed = 0;
+    meshGL->positionBuffer = 0;
 
     meshGL->attrDims = (GLuint *)malloc((attrNum + vaoNum) * sizeof(GLuint));
     
@@ -159,6 +208,7 @@ void meshGLVAOInitialize(meshGLMesh *meshGL, GLuint index, GLint attrLocs[]) {
 
 
 	int offsetCount = 0;
+	glBindBuffer(GL_ARRAY_BUFFER, meshGL->buffers[0]);
 	for ( i = 0; i < meshGL->attrNum; i++) {
 		glEnableVertexAttribArray(attrLocs[i]);
 		glVertexAttribPointer(attrLocs[i], meshGL->attrDims[i], GL_DOUBLE, GL_FALSE,
@@ -173,6 +223,56 @@ void meshGLVAOInitialize(meshGLMesh *meshGL, GLuint index, GLint attrLocs[]) {
 	glBindVertexArray(0);
 }
 
+/* Gives the already-initialized OpenGL mesh a second vertex buffer, holding
+just the first three coordinates of each of mesh's vertices (its position) as
+floats. A depth-only pass, such as the shadow pass, reads 12 bytes per vertex
+from it, instead of the whole interleaved vertex. mesh must be the mesh that
+meshGL was initialized from. Returns 0 on success, non-zero on failure. The
+buffer is deallocated by meshGLDestroy. */
+int meshGLPositionsInitialize(meshGLMesh *meshGL, meshMesh *mesh) {
+	GLuint i;
+	if (mesh->attrDim < 3)
+		return 1;
+	GLfloat *positions = (GLfloat *)malloc(mesh->vertNum * 3 * sizeof(GLfloat));
+	if (positions == NULL)
+		return 2;
+	for (i = 0; i < mesh->vertNum; i += 1)
+		vecOpenGL(3, meshGetVertexPointer(mesh, i), &positions[i * 3]);
+	glGenBuffers(1, &(meshGL->positionBuffer));
+	glBindBuffer(GL_ARRAY_BUFFER, meshGL->positionBuffer);
+	glBufferData(GL_ARRAY_BUFFER, mesh->vertNum * 3 * sizeof(GLfloat),
+		(GLvoid *)positions, GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	free(positions);
+	return 0;
+}
+
+/* Like meshGLVAOInitialize, but the VAO at that index reads only positions,
+from the buffer made by meshGLPositionsInitialize, at positionLoc. If the mesh
+has no such buffer, then the VAO reads positions from the interleaved buffer
+instead. */
+void meshGLPositionVAOInitialize(meshGLMesh *meshGL, GLuint index,
+		GLint positionLoc) {
+	if (index > meshGL->vaoNum - 1) {
+		printf("Mesh Error: meshGLPositionVAOInitialize index out of range\n");
+		return;
+	}
+	glBindVertexArray(meshGL->vaos[index]);
+	glEnableVertexAttribArray(positionLoc);
+	if (meshGL->positionBuffer != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, meshGL->positionBuffer);
+		glVertexAttribPointer(positionLoc, 3, GL_FLOAT, GL_FALSE,
+			3 * sizeof(GLfloat), BUFFER_OFFSET(0));
+	} else {
+		glBindBuffer(GL_ARRAY_BUFFER, meshGL->buffers[0]);
+		glVertexAttribPointer(positionLoc, 3, GL_DOUBLE, GL_FALSE,
+			meshGL->attrDim * sizeof(GLdouble), BUFFER_OFFSET(0));
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshGL->buffers[1]);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
 /* Renders the already-initialized OpenGL mesh. attrDims is an array of length
 attrNum. For each i, its ith entry is the dimension of the ith attribute
 vector. Similarly, attrLocs is an array of length attrNum, giving the location
@@ -183,10 +283,19 @@ void meshGLRender(meshGLMesh *meshGL, GLuint index) {
 		glBindVertexArray(0);
 }
 
+/* Draws the already-initialized OpenGL mesh, assuming that the caller has
+already bound one of its VAOs. Unlike meshGLRender, this function does not bind
+or unbind anything, so a caller drawing many meshes can skip redundant binds. */
+void meshGLDraw(meshGLMesh *meshGL) {
+		glDrawElements(GL_TRIANGLES, meshGL->triNum * 3, GL_UNSIGNED_INT, BUFFER_OFFSET(0));
+}
+
 /* Deallocates the resources backing the initialized OpenGL mesh. */
 void meshGLDestroy(meshGLMesh *meshGL) {
 		// delete buffers
 		glDeleteBuffers(2, meshGL->buffers);
+		if (meshGL->positionBuffer != 0)
+			glDeleteBuffers(1, &(meshGL->positionBuffer));
 		// delete VAOs
 		int i;
 		for (i = 0; i < meshGL->vaoNum; i ++) {
@@ -210,13 +319,13 @@ int meshInitializeRectangle(meshMesh *mesh, GLdouble left, GLdouble right,
 		meshSetTriangle(mesh, 0, 0, 1, 2);
 		meshSetTriangle(mesh, 1, 0, 2, 3);
 		GLdouble attr[4];
-		vecSet(4, attr, left, bottom, 0.0, 0.0);
+		vec4Set(attr, left, bottom, 0.0, 0.0);
 		meshSetVertex(mesh, 0, attr);
-		vecSet(4, attr, right, bottom, 1.0, 0.0);
+		vec4Set(attr, right, bottom, 1.0, 0.0);
 		meshSetVertex(mesh, 1, attr);
-		vecSet(4, attr, right, top, 1.0, 1.0);
+		vec4Set(attr, right, top, 1.0, 1.0);
 		meshSetVertex(mesh, 2, attr);
-		vecSet(4, attr, left, top, 0.0, 1.0);
+		vec4Set(attr, left, top, 0.0, 1.0);
 		meshSetVertex(mesh, 3, attr);
 	}
 	//Create TriMesh struct dTriMesh DataID rectData = dGeomTriMeshDataCreate();
@@ -241,7 +350,7 @@ int meshInitializeEllipse(meshMesh *mesh, GLdouble x, GLdouble y,
 			theta = i * 2.0 * M_PI / sideNum;
 			cosTheta = cos(theta);
 			sinTheta = sin(theta);
-			vecSet(4, attr, x + rx * cosTheta, y + ry * sinTheta,
+			vec4Set(attr, x + rx * cosTheta, y + ry * sinTheta,
 				0.5 * cosTheta + 0.5, 0.5 * sinTheta + 0.5);
 			meshSetVertex(mesh, i + 1, attr);
 		}
@@ -249,6 +358,180 @@ int meshInitializeEllipse(meshMesh *mesh, GLdouble x, GLdouble y,
 	return error;
 }
 
+/*** Welding ***/
+
+/* Generated and imported meshes often contain several vertices with the same
+attributes, which waste memory here and on the GPU, and which make
+meshSmoothNormals shade a smooth surface as if it were creased. They may also
+contain vertices that no triangle uses. meshWeld merges every vertex into an
+earlier, kept vertex whose position is within posTol of its own, in every
+coordinate, and whose other attributes are within attrTol of its own, again in
+every coordinate. So vertices that merely share a position, such as those
+along a texture seam or a flat-shaded edge, stay apart, unless attrTol is
+negative, in which case only the positions are compared, and the surviving
+vertex's other attributes win. Then meshWeld discards the unused vertices and
+the triangles that have collapsed, renumbers the remaining vertices in their
+original order, and recomputes the bounds. To find nearby vertices quickly,
+it hashes the vertices into a grid of cubes of side posTol, and searches only
+the 27 cubes around each vertex. For example, to remove exact duplicates and
+unused vertices, without changing the look of the mesh at all:
+	meshWeld(&mesh, 0.0, 0.0); */
+
+/* Returns the index of the grid cube, of side tol, containing x. If tol is 0,
+then every distinct value gets a cube of its own. */
+long long meshWeldCell(GLdouble x, GLdouble tol) {
+	long long cell;
+	if (tol <= 0.0) {
+		/* Adding 0.0 makes -0.0 into 0.0, so that the two weld. */
+		x += 0.0;
+		memcpy(&cell, &x, sizeof(cell));
+		return cell;
+	}
+	x = floor(x / tol);
+	if (x > 1.0e18)
+		return 1000000000000000000LL;
+	if (x < -1.0e18)
+		return -1000000000000000000LL;
+	return (long long)x;
+}
+
+/* Returns a hash of the grid cube with indices cell. */
+GLuint meshWeldHash(const long long cell[3]) {
+	unsigned long long h = (unsigned long long)cell[0] * 0x9E3779B97F4A7C15ULL;
+	h ^= (unsigned long long)cell[1] * 0xC2B2AE3D27D4EB4FULL;
+	h ^= (unsigned long long)cell[2] * 0x165667B19E3779F9ULL;
+	return (GLuint)(h ^ (h >> 29) ^ (h >> 47));
+}
+
+/* Returns 1 if vertices a and b are close enough to weld, and 0 if not. */
+int meshWeldClose(const GLdouble a[], const GLdouble b[], GLuint attrDim,
+		GLdouble posTol, GLdouble attrTol) {
+	GLuint k;
+	for (k = 0; k < 3; k += 1)
+		if (fabs(a[k] - b[k]) > posTol)
+			return 0;
+	if (attrTol >= 0.0)
+		for (k = 3; k < attrDim; k += 1)
+			if (fabs(a[k] - b[k]) > attrTol)
+				return 0;
+	return 1;
+}
+
+/* Assumes that attributes 0, 1, 2 are XYZ. Welds the mesh's vertices, as
+described above, in place. Any tolerance of 0 requires an exact match. Returns
+0 on success, non-zero on failure, in which case the mesh is unchanged. */
+int meshWeld(meshMesh *mesh, GLdouble posTol, GLdouble attrTol) {
+	GLuint i, k, tableSize = 1, vertNum = 0, triNum = 0, found, *tri;
+	GLint di, dj, dk, reach = (posTol > 0.0 ? 1 : 0);
+	long long cell[3], near[3];
+	GLdouble *v;
+	if (mesh->attrDim < 3 || posTol < 0.0) {
+		fprintf(stderr, "meshWeld: need XYZ and posTol >= 0.\n");
+		return 1;
+	}
+	while (tableSize < mesh->vertNum)
+		tableSize *= 2;
+	/* The table holds, for each hash, the first kept vertex with that hash,
+	plus 1, and next chains on to the others. newOf maps each old vertex to its
+	new index, plus 1, or to 0 if it is unused. */
+	GLuint *table = (GLuint *)calloc((size_t)tableSize + 2 * mesh->vertNum,
+		sizeof(GLuint));
+	if (table == NULL) {
+		fprintf(stderr, "meshWeld: calloc failed.\n");
+		return 2;
+	}
+	GLuint *next = &table[tableSize], *newOf = &next[mesh->vertNum];
+	/* Mark the used vertices, and reject bad indices before changing
+	anything. */
+	for (i = 0; i < mesh->triNum * 3; i += 1) {
+		if (mesh->tri[i] >= mesh->vertNum) {
+			fprintf(stderr, "meshWeld: vertex index %d out of range.\n",
+				mesh->tri[i]);
+			free(table);
+			return 3;
+		}
+		newOf[mesh->tri[i]] = 1;
+	}
+	/* Weld each used vertex to an earlier kept one, or keep it. Because kept
+	vertices only move down, they can be compacted as they go. */
+	for (i = 0; i < mesh->vertNum; i += 1) {
+		if (newOf[i] == 0)
+			continue;
+		v = meshGetVertexPointer(mesh, i);
+		for (k = 0; k < 3; k += 1)
+			cell[k] = meshWeldCell(v[k], posTol);
+		found = 0;
+		for (di = -reach; di <= reach && found == 0; di += 1)
+			for (dj = -reach; dj <= reach && found == 0; dj += 1)
+				for (dk = -reach; dk <= reach && found == 0; dk += 1) {
+					near[0] = cell[0] + di;
+					near[1] = cell[1] + dj;
+					near[2] = cell[2] + dk;
+					found = table[meshWeldHash(near) & (tableSize - 1)];
+					while (found != 0 && !meshWeldClose(
+							&(mesh->vert[(found - 1) * mesh->attrDim]), v,
+							mesh->attrDim, posTol, attrTol))
+						found = next[found - 1];
+				}
+		if (found != 0)
+			newOf[i] = found;
+		else {
+			GLuint hash = meshWeldHash(cell) & (tableSize - 1);
+			vecCopy(mesh->attrDim, v, &(mesh->vert[vertNum * mesh->attrDim]));
+			next[vertNum] = table[hash];
+			table[hash] = vertNum + 1;
+			vertNum += 1;
+			newOf[i] = vertNum;
+		}
+	}
+	/* Renumber the triangles, dropping the ones that have collapsed. */
+	for (i = 0; i < mesh->triNum; i += 1) {
+		tri = meshGetTrianglePointer(mesh, i);
+		GLuint a = newOf[tri[0]] - 1, b = newOf[tri[1]] - 1;
+		GLuint c = newOf[tri[2]] - 1;
+		if (a != b && b != c && c != a) {
+			meshSetTriangle(mesh, triNum, a, b, c);
+			triNum += 1;
+		}
+	}
+	/* The collapsed triangles may have been the only users of some vertices,
+	so drop those, too, in the same way. */
+	if (triNum < mesh->triNum) {
+		memset(newOf, 0, vertNum * sizeof(GLuint));
+		for (i = 0; i < triNum * 3; i += 1)
+			newOf[mesh->tri[i]] = 1;
+		k = 0;
+		for (i = 0; i < vertNum; i += 1)
+			if (newOf[i] != 0) {
+				vecCopy(mesh->attrDim, &(mesh->vert[i * mesh->attrDim]),
+					&(mesh->vert[k * mesh->attrDim]));
+				k += 1;
+				newOf[i] = k;
+			}
+		for (i = 0; i < triNum * 3; i += 1)
+			mesh->tri[i] = newOf[mesh->tri[i]] - 1;
+		vertNum = k;
+	}
+	free(table);
+	/* The vertices follow the triangles in memory, so slide them down after
+	the surviving triangles, and give back the rest. */
+	GLdouble *vert = (GLdouble *)&(mesh->tri[triNum * 3]);
+	memmove(vert, mesh->vert, (size_t)vertNum * mesh->attrDim *
+		sizeof(GLdouble));
+	mesh->triNum = triNum;
+	mesh->vertNum = vertNum;
+	size_t size = triNum * 3 * sizeof(GLuint) +
+		(size_t)vertNum * mesh->attrDim * sizeof(GLdouble);
+	GLuint *shrunk = (size > 0 ? (GLuint *)realloc(mesh->tri, size) : NULL);
+	if (shrunk != NULL)
+		mesh->tri = shrunk;
+	mesh->vert = (GLdouble *)&(mesh->tri[triNum * 3]);
+	meshComputeBounds(mesh);
+	return 0;
+}
+
+
+
 /*** Convenience initializers: 3D ***/
 
 /* Assumes that attributes 0, 1, 2 are XYZ. Assumes that the vertices of the
@@ -335,54 +618,55 @@ int meshInitializeBox(meshMesh *mesh, GLdouble left, GLdouble right,
 		meshSetTriangle(mesh, 11, 20, 22, 23);
 		/* Make the vertices after 0, using vertex 0 as temporary storage. */
 		GLdouble *v = mesh->vert;
-		vecSet(8, v, right, bottom, base, 1.0, 0.0, 0.0, 0.0, -1.0);
+		vec8Set(v, right, bottom, base, 1.0, 0.0, 0.0, 0.0, -1.0);
 		meshSetVertex(mesh, 1, v);
-		vecSet(8, v, right, top, base, 1.0, 1.0, 0.0, 0.0, -1.0);
+		vec8Set(v, right, top, base, 1.0, 1.0, 0.0, 0.0, -1.0);
 		meshSetVertex(mesh, 2, v);
-		vecSet(8, v, left, top, base, 0.0, 1.0, 0.0, 0.0, -1.0);
+		vec8Set(v, left, top, base, 0.0, 1.0, 0.0, 0.0, -1.0);
 		meshSetVertex(mesh, 3, v);
-		vecSet(8, v, left, bottom, lid, 0.0, 0.0, 0.0, 0.0, 1.0);
+		vec8Set(v, left, bottom, lid, 0.0, 0.0, 0.0, 0.0, 1.0);
 		meshSetVertex(mesh, 4, v);
-		vecSet(8, v, right, bottom, lid, 1.0, 0.0, 0.0, 0.0, 1.0);
+		vec8Set(v, right, bottom, lid, 1.0, 0.0, 0.0, 0.0, 1.0);
 		meshSetVertex(mesh, 5, v);
-		vecSet(8, v, right, top, lid, 1.0, 1.0, 0.0, 0.0, 1.0);
+		vec8Set(v, right, top, lid, 1.0, 1.0, 0.0, 0.0, 1.0);
 		meshSetVertex(mesh, 6, v);
-		vecSet(8, v, left, top, lid, 0.0, 1.0, 0.0, 0.0, 1.0);
+		vec8Set(v, left, top, lid, 0.0, 1.0, 0.0, 0.0, 1.0);
 		meshSetVertex(mesh, 7, v);
-		vecSet(8, v, left, top, base, 0.0, 1.0, 0.0, 1.0, 0.0);
+		vec8Set(v, left, top, base, 0.0, 1.0, 0.0, 1.0, 0.0);
 		meshSetVertex(mesh, 8, v);
-		vecSet(8, v, right, top, base, 1.0, 1.0, 0.0, 1.0, 0.0);
+		vec8Set(v, right, top, base, 1.0, 1.0, 0.0, 1.0, 0.0);
 		meshSetVertex(mesh, 9, v);
-		vecSet(8, v, right, top, lid, 1.0, 1.0, 0.0, 1.0, 0.0);
+		vec8Set(v, right, top, lid, 1.0, 1.0, 0.0, 1.0, 0.0);
 		meshSetVertex(mesh, 10, v);
-		vecSet(8, v, left, top, lid, 0.0, 1.0, 0.0, 1.0, 0.0);
+		vec8Set(v, left, top, lid, 0.0, 1.0, 0.0, 1.0, 0.0);
 		meshSetVertex(mesh, 11, v);
-		vecSet(8, v, left, bottom, base, 0.0, 0.0, 0.0, -1.0, 0.0);
+		vec8Set(v, left, bottom, base, 0.0, 0.0, 0.0, -1.0, 0.0);
 		meshSetVertex(mesh, 12, v);
-		vecSet(8, v, right, bottom, base, 1.0, 0.0, 0.0, -1.0, 0.0);
+		vec8Set(v, right, bottom, base, 1.0, 0.0, 0.0, -1.0, 0.0);
 		meshSetVertex(mesh, 13, v);
-		vecSet(8, v, right, bottom, lid, 1.0, 0.0, 0.0, -1.0, 0.0);
+		vec8Set(v, right, bottom, lid, 1.0, 0.0, 0.0, -1.0, 0.0);
 		meshSetVertex(mesh, 14, v);
-		vecSet(8, v, left, bottom, lid, 0.0, 0.0, 0.0, -1.0, 0.0);
+		vec8Set(v, left, bottom, lid, 0.0, 0.0, 0.0, -1.0, 0.0);
 		meshSetVertex(mesh, 15, v);
-		vecSet(8, v, right, top, base, 1.0, 1.0, 1.0, 0.0, 0.0);
+		vec8Set(v, right, top, base, 1.0, 1.0, 1.0, 0.0, 0.0);
 		meshSetVertex(mesh, 16, v);
-		vecSet(8, v, right, bottom, base, 1.0, 0.0, 1.0, 0.0, 0.0);
+		vec8Set(v, right, bottom, base, 1.0, 0.0, 1.0, 0.0, 0.0);
 		meshSetVertex(mesh, 17, v);
-		vecSet(8, v, right, bottom, lid, 1.0, 0.0, 1.0, 0.0, 0.0);
+		vec8Set(v, right, bottom, lid, 1.0, 0.0, 1.0, 0.0, 0.0);
 		meshSetVertex(mesh, 18, v);
-		vecSet(8, v, right, top, lid, 1.0, 1.0, 1.0, 0.0, 0.0);
+		vec8Set(v, right, top, lid, 1.0, 1.0, 1.0, 0.0, 0.0);
 		meshSetVertex(mesh, 19, v);
-		vecSet(8, v, left, top, base, 0.0, 1.0, -1.0, 0.0, 0.0);
+		vec8Set(v, left, top, base, 0.0, 1.0, -1.0, 0.0, 0.0);
 		meshSetVertex(mesh, 20, v);
-		vecSet(8, v, left, bottom, base, 0.0, 0.0, -1.0, 0.0, 0.0);
+		vec8Set(v, left, bottom, base, 0.0, 0.0, -1.0, 0.0, 0.0);
 		meshSetVertex(mesh, 21, v);
-		vecSet(8, v, left, bottom, lid, 0.0, 0.0, -1.0, 0.0, 0.0);
+		vec8Set(v, left, bottom, lid, 0.0, 0.0, -1.0, 0.0, 0.0);
 		meshSetVertex(mesh, 22, v);
-		vecSet(8, v, left, top, lid, 0.0, 1.0, -1.0, 0.0, 0.0);
+		vec8Set(v, left, top, lid, 0.0, 1.0, -1.0, 0.0, 0.0);
 		meshSetVertex(mesh, 23, v);
 		/* Now make vertex 0 for realsies. */
-		vecSet(8, v, left, bottom, base, 0.0, 0.0, 0.0, 0.0, -1.0);
+		vec8Set(v, left, bottom, base, 0.0, 0.0, 0.0, 0.0, -1.0);
+		meshComputeBounds(mesh);
 
 
 		/* ODE additions */
@@ -456,13 +740,13 @@ int meshInitializeRevolution(meshMesh *mesh, GLuint zNum, GLdouble z[],
 		GLdouble p[3], q[3], o[3];
 		for (j = 1; j <= zNum - 2; j += 1) {
 			// Form the sideNum + 1 vertices in the jth layer.
-			vecSet(3, p, z[j + 1] - z[j], 0.0, r[j] - r[j + 1]);
+			vec3Set(p, z[j + 1] - z[j], 0.0, r[j] - r[j + 1]);
 			vecUnit(3, p, p);
-			vecSet(3, q, z[j] - z[j - 1], 0.0, r[j - 1] - r[j]);
+			vec3Set(q, z[j] - z[j - 1], 0.0, r[j - 1] - r[j]);
 			vecUnit(3, q, q);
 			vecAdd(3, p, q, o);
 			vecUnit(3, o, o);
-			vecSet(8, v, r[j], 0.0, z[j], 1.0, t[j], o[0], o[1], o[2]);
+			vec8Set(v, r[j], 0.0, z[j], 1.0, t[j], o[0], o[1], o[2]);
 			meshSetVertex(mesh, j * (sideNum + 1), v);
 			v[3] = 0.0;
 			meshSetVertex(mesh, (j - 1) * (sideNum + 1) + 1, v);
@@ -474,10 +758,11 @@ int meshInitializeRevolution(meshMesh *mesh, GLuint zNum, GLdouble z[],
 			}
 		}
 		/* Form the top vertex. */
-		vecSet(8, v, 0.0, 0.0, z[zNum - 1], 0.0, 0.0, 0.0, 0.0, 1.0);
+		vec8Set(v, 0.0, 0.0, z[zNum - 1], 0.0, 0.0, 0.0, 0.0, 1.0);
 		meshSetVertex(mesh, mesh->vertNum - 1, v);
 		/* Finally form the bottom vertex. */
-		vecSet(8, v, 0.0, 0.0, z[0], 0.0, 0.0, 0.0, 0.0, -1.0);
+		vec8Set(v, 0.0, 0.0, z[0], 0.0, 0.0, 0.0, 0.0, -1.0);
+		meshComputeBounds(mesh);
 	}
 	return error;
 }
@@ -608,7 +893,7 @@ int meshInitializeLandscape(meshMesh *mesh, GLuint width, GLuint height,
 		for (i = 0; i < width; i += 1)
 			for (j = 0; j < height; j += 1) {
 				vert = meshGetVertexPointer(mesh, i * height + j);
-				vecSet(3 + 2 + 3, vert, i * spacing, j * spacing,
+				vec8Set(vert, i * spacing, j * spacing,
 					data[i * height + j], (GLdouble)i, (GLdouble)j,
 					0.0, 0.0, 0.0);
 			}
@@ -634,6 +919,7 @@ int meshInitializeLandscape(meshMesh *mesh, GLuint width, GLuint height,
 			}
 		/* Set the normals. */
 		meshSmoothNormals(mesh, 5);
+		meshComputeBounds(mesh);
 	}
 	return error;
 }
@@ -641,8 +927,8 @@ int meshInitializeLandscape(meshMesh *mesh, GLuint width, GLuint height,
 /* Given a landscape, such as that built by meshInitializeLandscape. Builds a
 new landscape mesh by extracting triangles based on how horizontal they are. If
 noMoreThan is true, then triangles are kept that deviate from horizontal by no more than angle. If noMoreThan is false, then triangles are kept that deviate
-from horizontal by more than angle. Don't forget to call meshDestroy when
-finished. Warning: May contain extraneous vertices not used by any triangle. */
+from horizontal by more than angle. The vertices that no kept triangle uses
+are welded away. Don't forget to call meshDestroy when finished. */
 int meshInitializeDissectedLandscape(meshMesh *mesh, meshMesh *land,
 		GLdouble angle, GLuint noMoreThan) {
 	GLuint error, i, j = 0, triNum = 0;
@@ -677,8 +963,303 @@ int meshInitializeDissectedLandscape(meshMesh *mesh, meshMesh *land,
 				j += 1;
 			}
 		}
+		/* Drop the unused vertices, which also computes the bounds. If that
+		fails, the vertices just waste memory, but the bounds must still be
+		computed. */
+		if (meshWeld(mesh, 0.0, 0.0) != 0)
+			meshComputeBounds(mesh);
 		/* Reset the normals, to make the cliff edges appear sharper. */
 		meshSmoothNormals(mesh, 5);
 	}
 	return error;
-}
\ No newline at end of file
+}
+
+
+
+/*** Parallel normals ***/
+
+/* meshFlatNormals and meshSmoothNormals, above, are simple, but on a landscape
+of millions of vertices they dominate the loading time. The functions in this
+section compute the same normals, bit for bit, on several threads, without
+locks or atomics. Each job owns a range of triangles and a range of vertices,
+and the work goes in two passes, with the threads joined in between:
+	1. Each job computes the unit normals of its triangles, in batches of
+	meshNORMALBATCH laid out one coordinate per array, so that the compiler
+	can vectorize them. Meanwhile it lists, in order, the corners of its
+	triangles whose vertices belong to other jobs, one list per other job.
+	2. Each job adds the normals onto its own vertices in triangle order, just
+	as meshSmoothNormals does: first from the earlier jobs' lists, then from
+	its own triangles, and then from the later jobs' lists.
+So every triangle is read a constant number of times, whatever the number of
+threads, and, in a mesh whose nearby triangles share nearby vertices, the
+lists are short. On one thread, the serial functions are simply called. For
+example:
+	if (meshSmoothNormalsParallel(&mesh, 5, 0) != 0)
+		meshSmoothNormals(&mesh, 5); */
+
+#define meshTHREADMAX 16
+#define meshNORMALBATCH 64
+/* Meshes with fewer triangles than this are not worth starting threads for. */
+#define meshPARALLELMIN 16384
+
+/* One thread's share of the work. The triNormals array is shared by all of
+the jobs. To save a division per corner, vertex v belongs to job
+(v * vertScale) >> 32. */
+typedef struct meshNormalJob meshNormalJob;
+struct meshNormalJob {
+	meshMesh *mesh;
+	meshNormalJob *jobs;
+	GLuint n, smooth, pass;
+	GLuint triStart, triEnd, vertStart, vertEnd;
+	unsigned long long vertScale;
+	GLdouble *triNormals;
+	/* corners[j] lists the corners, as indices into mesh->tri, of this job's
+	triangles whose vertices belong to job j. */
+	GLuint *corners[meshTHREADMAX];
+	GLuint cornerNum[meshTHREADMAX], cornerCap[meshTHREADMAX];
+	/* Set in pass 1 if a vertex index is out of range or memory runs out. */
+	int error;
+};
+
+/* Helper function for meshNormalBatch. Appends corner to the job's list for
+the job owning its vertex. Returns 0 on success, non-zero on failure. */
+int meshNormalList(meshNormalJob *job, GLuint owner, GLuint corner) {
+	if (job->cornerNum[owner] == job->cornerCap[owner]) {
+		GLuint cap = (job->cornerCap[owner] == 0 ? 1024 :
+			2 * job->cornerCap[owner]);
+		GLuint *corners = (GLuint *)realloc(job->corners[owner],
+			cap * sizeof(GLuint));
+		if (corners == NULL)
+			return 1;
+		job->corners[owner] = corners;
+		job->cornerCap[owner] = cap;
+	}
+	job->corners[owner][job->cornerNum[owner]] = corner;
+	job->cornerNum[owner] += 1;
+	return 0;
+}
+
+/* Helper function for meshNormalWork. Computes the unit normals of the num
+triangles starting at triangle start, as meshTrueNormal does, into
+triNormals, and lists their corners that belong to other jobs. Returns 0 on
+success, non-zero on failure. */
+int meshNormalBatch(meshNormalJob *job, GLuint start, GLuint num) {
+	meshMesh *mesh = job->mesh;
+	GLuint dim = mesh->attrDim, own = (GLuint)(job - job->jobs), i, j, k;
+	GLuint owner, *tri;
+	GLdouble e1[3][meshNORMALBATCH], e2[3][meshNORMALBATCH];
+	GLdouble cross[3][meshNORMALBATCH], len[meshNORMALBATCH];
+	GLdouble *a, *b, *c, *normal = &(job->triNormals[3 * start]);
+	/* Gather the edges, one coordinate per array. */
+	for (i = 0; i < num; i += 1) {
+		tri = &(mesh->tri[3 * (start + i)]);
+		for (j = 0; j < 3; j += 1) {
+			if (tri[j] >= mesh->vertNum)
+				return 1;
+			owner = (GLuint)((tri[j] * job->vertScale) >> 32);
+			if (owner != own && meshNormalList(job, owner,
+					3 * (start + i) + j) != 0)
+				return 2;
+		}
+		a = &(mesh->vert[tri[0] * dim]);
+		b = &(mesh->vert[tri[1] * dim]);
+		c = &(mesh->vert[tri[2] * dim]);
+		for (k = 0; k < 3; k += 1) {
+			e1[k][i] = b[k] - a[k];
+			e2[k][i] = c[k] - a[k];
+		}
+	}
+	/* Cross, measure, and divide, a whole batch at a time. As in vecUnit, a
+	zero normal stays zero. */
+	for (i = 0; i < num; i += 1) {
+		cross[0][i] = e1[1][i] * e2[2][i] - e1[2][i] * e2[1][i];
+		cross[1][i] = e1[2][i] * e2[0][i] - e1[0][i] * e2[2][i];
+		cross[2][i] = e1[0][i] * e2[1][i] - e1[1][i] * e2[0][i];
+	}
+	for (i = 0; i < num; i += 1) {
+		len[i] = sqrt(cross[0][i] * cross[0][i] + cross[1][i] * cross[1][i] +
+			cross[2][i] * cross[2][i]);
+		len[i] = (len[i] == 0.0 ? 1.0 : len[i]);
+	}
+	for (k = 0; k < 3; k += 1)
+		for (i = 0; i < num; i += 1)
+			cross[k][i] = cross[k][i] / len[i];
+	for (i = 0; i < num; i += 1)
+		for (k = 0; k < 3; k += 1)
+			normal[3 * i + k] = cross[k][i];
+	return 0;
+}
+
+/* Helper function for meshNormalWork. Adds the unit normal of the triangle
+with the given corner onto that corner's vertex normal, or, if the job is
+flat, replaces it. */
+void meshNormalApply(meshNormalJob *job, GLuint corner) {
+	meshMesh *mesh = job->mesh;
+	GLdouble *triNormal = &(job->triNormals[corner / 3 * 3]);
+	GLdouble *normal = &(mesh->vert[mesh->tri[corner] * mesh->attrDim +
+		job->n]);
+	if (job->smooth)
+		vecAdd(3, triNormal, normal, normal);
+	else
+		vecCopy(3, triNormal, normal);
+}
+
+/* Helper function for meshNormalsParallel. Does the job's share of the pass
+described above. In pass 2, sets the normals of the job's vertices: the
+normalized sum of their triangles' normals if smooth is non-zero, and
+otherwise the normal of their last triangle, as in meshFlatNormals. */
+void *meshNormalWork(void *arg) {
+	meshNormalJob *job = (meshNormalJob *)arg, *other;
+	meshMesh *mesh = job->mesh;
+	GLuint own = (GLuint)(job - job->jobs), i, j, v, *tri = mesh->tri;
+	GLdouble *normal, len;
+	if (job->pass == 1) {
+		for (i = job->triStart; i < job->triEnd && job->error == 0;
+				i += meshNORMALBATCH)
+			job->error = meshNormalBatch(job, i,
+				(job->triEnd - i < meshNORMALBATCH ? job->triEnd - i :
+				meshNORMALBATCH));
+		return NULL;
+	}
+	if (job->smooth)
+		for (v = job->vertStart; v < job->vertEnd; v += 1)
+			vec3Set(&(mesh->vert[v * mesh->attrDim + job->n]), 0.0, 0.0, 0.0);
+	/* The jobs' triangle ranges are in order, so this is triangle order. */
+	for (j = 0; j < own; j += 1) {
+		other = &(job->jobs[j]);
+		for (i = 0; i < other->cornerNum[own]; i += 1)
+			meshNormalApply(job, other->corners[own][i]);
+	}
+	for (i = 3 * job->triStart; i < 3 * job->triEnd; i += 1)
+		if (((tri[i] * job->vertScale) >> 32) == own)
+			meshNormalApply(job, i);
+	for (j = own + 1; job->jobs[j].mesh != NULL; j += 1) {
+		other = &(job->jobs[j]);
+		for (i = 0; i < other->cornerNum[own]; i += 1)
+			meshNormalApply(job, other->corners[own][i]);
+	}
+	if (job->smooth)
+		for (v = job->vertStart; v < job->vertEnd; v += 1) {
+			normal = &(mesh->vert[v * mesh->attrDim + job->n]);
+			len = sqrt(normal[0] * normal[0] + normal[1] * normal[1] +
+				normal[2] * normal[2]);
+			if (len != 0.0) {
+				normal[0] = normal[0] / len;
+				normal[1] = normal[1] / len;
+				normal[2] = normal[2] / len;
+			}
+		}
+	return NULL;
+}
+
+/* Helper function for meshNormalsParallel. Runs the given pass of all of the
+jobs, the first on this thread, and returns once they are all done. If a
+thread cannot start, then its job runs here, too. */
+void meshNormalPass(meshNormalJob jobs[], GLuint threadNum, GLuint pass) {
+	pthread_t threads[meshTHREADMAX];
+	int started[meshTHREADMAX];
+	GLuint i;
+	for (i = 0; i < threadNum; i += 1)
+		jobs[i].pass = pass;
+	for (i = 1; i < threadNum; i += 1)
+		started[i] = (pthread_create(&(threads[i]), NULL, meshNormalWork,
+			&(jobs[i])) == 0);
+	meshNormalWork(&(jobs[0]));
+	for (i = 1; i < threadNum; i += 1)
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			meshNormalWork(&(jobs[i]));
+}
+
+/* Helper function for meshFlatNormalsParallel and meshSmoothNormalsParallel.
+Returns 0 on success, non-zero on failure. */
+int meshNormalsParallel(meshMesh *mesh, GLuint n, GLuint smooth,
+		GLuint threadNum) {
+	/* One more job than needed, whose NULL mesh marks the end. */
+	meshNormalJob jobs[meshTHREADMAX + 1];
+	GLuint i, j;
+	int error = 0;
+	if (threadNum == 0) {
+		long procNum = sysconf(_SC_NPROCESSORS_ONLN);
+		threadNum = (procNum < 1 ? 1 : (GLuint)procNum);
+		if (threadNum > meshTHREADMAX)
+			threadNum = meshTHREADMAX;
+	}
+	if (threadNum > meshTHREADMAX) {
+		fprintf(stderr, "meshNormalsParallel: threadNum %d not in 0...%d.\n",
+			threadNum, meshTHREADMAX);
+		return 1;
+	}
+	if (mesh->attrDim < 3 || n + 3 > mesh->attrDim) {
+		fprintf(stderr, "meshNormalsParallel: attributes %d...%d not in "
+			"3...%d.\n", n, n + 2, mesh->attrDim - 1);
+		return 2;
+	}
+	if (threadNum == 1 || mesh->triNum < meshPARALLELMIN) {
+		if (smooth)
+			meshSmoothNormals(mesh, n);
+		else
+			meshFlatNormals(mesh, n);
+		return 0;
+	}
+	GLdouble *triNormals = (GLdouble *)malloc((size_t)mesh->triNum * 3 *
+		sizeof(GLdouble));
+	if (triNormals == NULL) {
+		fprintf(stderr, "meshNormalsParallel: malloc failed.\n");
+		return 3;
+	}
+	/* Since v < vertNum, (v * vertScale) >> 32 < threadNum. Job i starts at
+	the first vertex that maps to i. */
+	unsigned long long vertScale = ((unsigned long long)threadNum << 32) /
+		mesh->vertNum;
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < threadNum; i += 1) {
+		jobs[i].mesh = mesh;
+		jobs[i].jobs = jobs;
+		jobs[i].n = n;
+		jobs[i].smooth = smooth;
+		jobs[i].triStart = (GLuint)((GLdouble)mesh->triNum * i / threadNum);
+		jobs[i].triEnd = (GLuint)((GLdouble)mesh->triNum * (i + 1) /
+			threadNum);
+		jobs[i].vertScale = vertScale;
+		jobs[i].vertStart = (GLuint)((((unsigned long long)i << 32) +
+			vertScale - 1) / vertScale);
+		jobs[i].vertEnd = (GLuint)((((unsigned long long)(i + 1) << 32) +
+			vertScale - 1) / vertScale);
+		if (jobs[i].vertEnd > mesh->vertNum || i == threadNum - 1)
+			jobs[i].vertEnd = mesh->vertNum;
+		if (jobs[i].vertStart > jobs[i].vertEnd)
+			jobs[i].vertStart = jobs[i].vertEnd;
+		jobs[i].triNormals = triNormals;
+	}
+	meshNormalPass(jobs, threadNum, 1);
+	for (i = 0; i < threadNum; i += 1)
+		if (jobs[i].error != 0)
+			error = jobs[i].error;
+	if (error == 1)
+		fprintf(stderr, "meshNormalsParallel: vertex index out of range.\n");
+	else if (error != 0)
+		fprintf(stderr, "meshNormalsParallel: realloc failed.\n");
+	else
+		meshNormalPass(jobs, threadNum, 2);
+	for (i = 0; i < threadNum; i += 1)
+		for (j = 0; j < threadNum; j += 1)
+			free(jobs[i].corners[j]);
+	free(triNormals);
+	return (error == 0 ? 0 : 3 + error);
+}
+
+/* Like meshFlatNormals, but on threadNum threads (at most meshTHREADMAX), or
+on one thread per processor if threadNum is 0. Returns 0 on success, non-zero
+on failure, in which case the normals are unchanged. */
+int meshFlatNormalsParallel(meshMesh *mesh, GLuint n, GLuint threadNum) {
+	return meshNormalsParallel(mesh, n, 0, threadNum);
+}
+
+/* Like meshSmoothNormals, but on threadNum threads, as in
+meshFlatNormalsParallel. Returns 0 on success, non-zero on failure, in which
+case the normals are unchanged. */
+int meshSmoothNormalsParallel(meshMesh *mesh, GLuint n, GLuint threadNum) {
+	return meshNormalsParallel(mesh, n, 1, threadNum);
+}
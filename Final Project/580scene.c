@@ -1,9 +1,10 @@
 /*** Creation and destruction ***/
 /* Feel free to read from this struct's members, but don't write to them except
-through the accessor functions. */
+through the accessor functions. The rotation is a unit quaternion, with w
+first, as in ODE. */
 typedef struct sceneNode sceneNode; //supports ode and has ode mesh
 struct sceneNode {
-	GLdouble rotation[3][3];
+	GLdouble quaternion[4];
 	GLdouble translation[3];
 	GLuint unifDim;
 	GLdouble *unif;
@@ -12,6 +13,14 @@ struct sceneNode {
   	GLint texNum;
   	texTexture **tex;
 	int kinematic;
+	/* World-space bounds of the mesh, as of the last sceneFlatUpdate. */
+	GLdouble center[3], halfSize[3], radius;
+	/* Whether the rotation or translation changed since the last
+	sceneFlatUpdate. */
+	GLuint dirty;
+	/* Whether the node is expected to stay put (so that its shadow can be
+	cached), and whether that changed since the last sceneFlatUpdate. */
+	GLuint isStatic, staticChanged;
 };
 
 /* Initializes a sceneNode struct. The translation and rotation are initialized to trivial values. The user must remember to call sceneDestroy or
@@ -26,12 +35,16 @@ int sceneInitialize(sceneNode *node, GLuint unifDim, GLuint texNum,
       return 1;
   	node->tex = (texTexture **)&(node->unif[unifDim]);
   	node->texNum = texNum;
-  	mat33Identity(node->rotation);
-	vecSet(3, node->translation, 0.0, 0.0, 0.0);
+  	quatIdentity(node->quaternion);
+	vec3Set(node->translation, 0.0, 0.0, 0.0);
 	node->unifDim = unifDim;
 	node->meshGL = meshGL;
 	node->firstChild = firstChild;
 	node->nextSibling = nextSibling;
+	node->radius = -1.0;
+	node->dirty = 1;
+	node->isStatic = 0;
+	node->staticChanged = 0;
     return 0;
 }
 
@@ -59,27 +72,62 @@ void sceneSetOneUniform(sceneNode *node, int index, double unif) {
 }
 
 /* Calls sceneDestroy recursively on the node's descendants and younger
-siblings, and then on the node itself. */
+siblings, and then on the node itself. Recurses only into children, and loops
+over siblings, so that long sibling lists don't exhaust the stack. */
 void sceneDestroyRecursively(sceneNode *node) {
-	if (node->firstChild != NULL)
-		sceneDestroyRecursively(node->firstChild);
-	if (node->nextSibling != NULL)
-		sceneDestroyRecursively(node->nextSibling);
-	sceneDestroy(node);
+	sceneNode *sibling;
+	while (node != NULL) {
+		if (node->firstChild != NULL)
+			sceneDestroyRecursively(node->firstChild);
+		sibling = node->nextSibling;
+		sceneDestroy(node);
+		node = sibling;
+	}
 }
 
-/* Sets the node's rotation. */
-//Changed GLdouble to const dReal
-void sceneSetRotation(sceneNode *node, const dReal *rot[3][3]) {
-	vecCopy(9, (GLdouble *)rot, (GLdouble *)(node->rotation));
+/* Sets the node's rotation, as a unit quaternion such as ODE's
+dBodyGetQuaternion gives. Marks the node dirty, unless the rotation is
+unchanged. */
+void sceneSetQuaternion(sceneNode *node, const dReal q[4]) {
+	if (node->quaternion[0] != q[0] || node->quaternion[1] != q[1] ||
+			node->quaternion[2] != q[2] || node->quaternion[3] != q[3]) {
+		vec4Set(node->quaternion, q[0], q[1], q[2], q[3]);
+		node->dirty = 1;
+	}
+}
+
+/* Sets the node's rotation from a rotation matrix. Marks the node dirty,
+unless the rotation is unchanged. */
+void sceneSetRotation(sceneNode *node, GLdouble rot[3][3]) {
+	GLdouble q[4];
+	quatFromRotation(rot, q);
+	if (memcmp(q, node->quaternion, 4 * sizeof(GLdouble)) != 0) {
+		vec4Set(node->quaternion, q[0], q[1], q[2], q[3]);
+		node->dirty = 1;
+	}
 }
 
-/* Sets the node's translation. */
+/* Sets the node's translation. Marks the node dirty, unless the translation is
+unchanged. */
 //Changed GLdouble to dReal
 void sceneSetTranslation(sceneNode *node, const dReal transl[3]) {
-	node->translation[0] = (GLdouble) transl[0];
-	node->translation[1] = (GLdouble) transl[1];
-	node->translation[2] = (GLdouble) transl[2];
+	if (node->translation[0] != transl[0] ||
+			node->translation[1] != transl[1] ||
+			node->translation[2] != transl[2]) {
+		node->translation[0] = (GLdouble) transl[0];
+		node->translation[1] = (GLdouble) transl[1];
+		node->translation[2] = (GLdouble) transl[2];
+		node->dirty = 1;
+	}
+}
+
+/* Sets whether the node is static (not expected to move). Static nodes can be
+drawn separately, into cached layers such as a shadow map's static layer. */
+void sceneSetStatic(sceneNode *node, GLuint isStatic) {
+	if ((isStatic != 0) != (node->isStatic != 0)) {
+		node->isStatic = (isStatic != 0);
+		node->staticChanged = 1;
+	}
 }
 
 /* Sets the scene's mesh. */
@@ -100,10 +148,9 @@ void sceneSetNextSibling(sceneNode *node, sceneNode *sibling) {
 /* Adds a sibling to the given node. The sibling shows up as the youngest of
 its siblings. */
 void sceneAddSibling(sceneNode *node, sceneNode *sibling) {
-	if (node->nextSibling == NULL)
-		node->nextSibling = sibling;
-	else
-		sceneAddSibling(node->nextSibling, sibling);
+	while (node->nextSibling != NULL)
+		node = node->nextSibling;
+	node->nextSibling = sibling;
 }
 
 /* Adds a child to the given node. The child shows up as the youngest of its
@@ -119,12 +166,10 @@ void sceneAddChild(sceneNode *node, sceneNode *child) {
 equality of pointers. If the sibling is not present, then has no effect (fails
 silently). */
 void sceneRemoveSibling(sceneNode *node, sceneNode *sibling) {
-	if (node->nextSibling == NULL)
-		return;
-	else if (node->nextSibling == sibling)
+	while (node->nextSibling != NULL && node->nextSibling != sibling)
+		node = node->nextSibling;
+	if (node->nextSibling == sibling)
 		node->nextSibling = sibling->nextSibling;
-	else
-		sceneRemoveSibling(node->nextSibling, sibling);
 }
 
 /* Removes a child from the given node. Equality of nodes is assessed as
@@ -157,11 +202,12 @@ void sceneSetOneTexture(sceneNode *node, int index, texTexture *tex) {
 
 
 /* Renders the node, its younger siblings, and their descendants. parent is the
-modeling matrix at the parent of the node. If the node has no parent, then this
-matrix is the 4x4 identity matrix. Loads the modeling transformation into
-modelingLoc. The attribute information exists to be passed to meshGLRender. The
-uniform information is analogous, but sceneRender loads it, not meshGLRender. */
-void sceneRender(sceneNode *node, GLdouble parent[4][4], GLint modelingLoc,
+modeling matrix at the parent of the node, as a 3x4 affine matrix. If the node
+has no parent, then this matrix is the identity (see mat34Identity). Loads the
+modeling transformation into modelingLoc, which is a mat3x4. The attribute
+information exists to be passed to meshGLRender. The uniform information is
+analogous, but sceneRender loads it, not meshGLRender. */
+void sceneRender(sceneNode *node, GLdouble parent[3][4], GLint modelingLoc,
 		GLuint unifNum, GLuint unifDims[], GLint unifLocs[], GLuint VAOindex, GLint *textureLocs) {
 	int i;
 	// printf("sceneRender\n");
@@ -211,14 +257,14 @@ void sceneRender(sceneNode *node, GLdouble parent[4][4], GLint modelingLoc,
 
 
 	/* Set the uniform modeling matrix. */
-	GLdouble selfIsom[4][4], parentMultiplied[4][4];
-	GLfloat pmGL[4][4];
+	GLdouble selfIsom[3][4], parentMultiplied[3][4];
+	GLfloat pmGL[3][4];
 
-	mat44Isometry(node->rotation, node->translation, selfIsom);
+	mat34QuaternionIsometry(node->quaternion, node->translation, selfIsom);
 
-	mat444Multiply(parent, selfIsom, parentMultiplied);
-	mat44OpenGL(parentMultiplied, pmGL);
-	glUniformMatrix4fv(modelingLoc, 1, GL_FALSE, (GLfloat *)pmGL);
+	mat34Compose(parent, selfIsom, parentMultiplied);
+	mat34OpenGL(parentMultiplied, pmGL);
+	glUniformMatrix3x4fv(modelingLoc, 1, GL_FALSE, (GLfloat *)pmGL);
 
 
 	/* Set the other uniforms. */
@@ -315,3 +361,201 @@ void sceneRender(sceneNode *node, GLdouble parent[4][4], GLint modelingLoc,
 								unifNum, unifDims, unifLocs, VAOindex, textureLocs);
 	}
 }
+
+/* Updates the node's world-space bounds from its mesh's bounds, given the
+node's modeling matrix. The modeling matrix is an isometry, so the sphere keeps
+its radius, and the box grows to enclose its rotated self. */
+void sceneUpdateBounds(sceneNode *node, GLdouble modeling[3][4]) {
+	meshGLMesh *meshGL = node->meshGL;
+	int i;
+	node->radius = meshGL->radius;
+	if (node->radius < 0.0)
+		return;
+	mat34TransformPoint(modeling, meshGL->center, node->center);
+	for (i = 0; i < 3; i += 1)
+		node->halfSize[i] = fabs(modeling[i][0]) * meshGL->halfSize[0] +
+			fabs(modeling[i][1]) * meshGL->halfSize[1] +
+			fabs(modeling[i][2]) * meshGL->halfSize[2];
+}
+
+
+
+/*** Flattened scene ***/
+
+/* A flattened scene lists the nodes of a scene graph in an array, with every
+parent before its children. Each entry caches the node's modeling matrix (its
+parent's modeling matrix times its own isometry, as a 3x4 affine matrix).
+sceneFlatUpdate recomputes only the entries whose nodes are dirty, or whose
+parents were just recomputed, and all traversals are loops over the array
+rather than recursions. Feel free to read from this struct's members, but
+don't write to them. */
+typedef struct sceneFlat sceneFlat;
+struct sceneFlat {
+	GLuint nodeNum;
+	sceneNode **nodes;
+	GLint *parents;					/* index of the parent, or -1 */
+	GLdouble (*modeling)[3][4];
+	GLuint *moved;					/* recomputed in the last update */
+	/* Whether the last update changed the set of static nodes or moved one of
+	them, so that anything cached from the static nodes is stale. */
+	GLuint staticChanged;
+};
+
+/* Flattens the scene graph rooted at root (the root, its younger siblings,
+and their descendants), using an explicit stack instead of recursion. The
+flattened scene does not notice later changes to the graph's structure (adding
+or removing children, etc.); after such changes, destroy it and initialize it
+again. All entries start dirty. Returns 0 on success, non-zero on failure. On
+success, the user must call sceneFlatDestroy when finished. */
+int sceneFlatInitialize(sceneFlat *flat, sceneNode *root) {
+	GLuint nodeNum = 0, top = 0, capacity = 64, i;
+	sceneNode *node;
+	/* Walk the graph twice, first to count the nodes and then to fill in the
+	arrays. Every node on the stack is the eldest of the siblings that remain to
+	be visited under its parent. */
+	sceneNode **stack = (sceneNode **)malloc(capacity * sizeof(sceneNode *));
+	GLint *stackParents = (GLint *)malloc(capacity * sizeof(GLint));
+	if (stack == NULL || stackParents == NULL) {
+		free(stack);
+		free(stackParents);
+		return 1;
+	}
+	flat->nodes = NULL;
+	for (i = 0; i < 2; i += 1) {
+		nodeNum = 0;
+		top = 0;
+		if (root != NULL) {
+			stack[0] = root;
+			stackParents[0] = -1;
+			top = 1;
+		}
+		while (top > 0) {
+			top -= 1;
+			node = stack[top];
+			GLint parent = stackParents[top];
+			if (node->nextSibling != NULL || node->firstChild != NULL)
+				if (top + 2 > capacity) {
+					capacity *= 2;
+					sceneNode **newStack = (sceneNode **)realloc(stack,
+						capacity * sizeof(sceneNode *));
+					GLint *newParents = (GLint *)realloc(stackParents,
+						capacity * sizeof(GLint));
+					if (newStack != NULL)
+						stack = newStack;
+					if (newParents != NULL)
+						stackParents = newParents;
+					if (newStack == NULL || newParents == NULL) {
+						free(stack);
+						free(stackParents);
+						free(flat->nodes);
+						return 2;
+					}
+				}
+			if (i == 1) {
+				flat->nodes[nodeNum] = node;
+				flat->parents[nodeNum] = parent;
+				node->dirty = 1;
+			}
+			if (node->nextSibling != NULL) {
+				stack[top] = node->nextSibling;
+				stackParents[top] = parent;
+				top += 1;
+			}
+			if (node->firstChild != NULL) {
+				stack[top] = node->firstChild;
+				stackParents[top] = nodeNum;
+				top += 1;
+			}
+			nodeNum += 1;
+		}
+		if (i == 0) {
+			flat->nodes = (sceneNode **)malloc(nodeNum * (sizeof(sceneNode *) +
+				sizeof(GLint) + sizeof(GLuint) + 12 * sizeof(GLdouble)) + 1);
+			if (flat->nodes == NULL) {
+				free(stack);
+				free(stackParents);
+				return 3;
+			}
+			/* The matrices go first in the block, for alignment. */
+			flat->modeling = (GLdouble (*)[3][4])flat->nodes;
+			flat->nodes = (sceneNode **)&(flat->modeling[nodeNum]);
+			flat->parents = (GLint *)&(flat->nodes[nodeNum]);
+			flat->moved = (GLuint *)&(flat->parents[nodeNum]);
+		}
+	}
+	free(stack);
+	free(stackParents);
+	flat->nodeNum = nodeNum;
+	flat->staticChanged = 0;
+	return 0;
+}
+
+/* Deallocates the resources backing the flattened scene. Does not destroy the
+nodes. */
+void sceneFlatDestroy(sceneFlat *flat) {
+	free(flat->modeling);
+}
+
+/* Recomputes the cached modeling matrices and world-space bounds of the dirty
+nodes and their descendants, and marks them clean. A node whose static flag
+changed also counts as recomputed. Returns the number of entries recomputed. */
+GLuint sceneFlatUpdate(sceneFlat *flat) {
+	GLuint i, movedNum = 0;
+	GLint parent;
+	GLdouble selfIsom[3][4];
+	sceneNode *node;
+	flat->staticChanged = 0;
+	for (i = 0; i < flat->nodeNum; i += 1) {
+		node = flat->nodes[i];
+		parent = flat->parents[i];
+		if (node->dirty || node->staticChanged ||
+				(parent >= 0 && flat->moved[parent])) {
+			if (node->isStatic || node->staticChanged)
+				flat->staticChanged = 1;
+			mat34QuaternionIsometry(node->quaternion, node->translation,
+				selfIsom);
+			if (parent >= 0)
+				mat34Compose(flat->modeling[parent], selfIsom,
+					flat->modeling[i]);
+			else
+				mat34Copy(selfIsom, flat->modeling[i]);
+			sceneUpdateBounds(node, flat->modeling[i]);
+			node->dirty = 0;
+			node->staticChanged = 0;
+			flat->moved[i] = 1;
+			movedNum += 1;
+		} else
+			flat->moved[i] = 0;
+	}
+	return movedNum;
+}
+
+/* Adds the draws of all nodes in the flattened scene to queue, for sorted
+submission by queueRender, using the modeling matrices cached by the last
+sceneFlatUpdate. program is the shader program that will draw them. If planes
+is not NULL, then it holds the six planes of a viewing volume (as from
+camFrustumPlanes), and nodes whose bounds lie outside that volume are skipped.
+which is sceneALL, sceneSTATIC (only the static nodes), or sceneDYNAMIC (only
+the others). Returns 0 on success, non-zero on failure. */
+#define sceneALL 0
+#define sceneSTATIC 1
+#define sceneDYNAMIC 2
+int sceneFlatQueue(sceneFlat *flat, GLuint program, GLdouble planes[6][4],
+		GLuint which, queueQueue *queue) {
+	GLuint i;
+	sceneNode *node;
+	for (i = 0; i < flat->nodeNum; i += 1) {
+		node = flat->nodes[i];
+		if ((which == sceneSTATIC && !node->isStatic) ||
+				(which == sceneDYNAMIC && node->isStatic))
+			continue;
+		if (planes != NULL &&
+				!camFrustumContains(planes, node->center, node->radius,
+					node->halfSize))
+			continue;
+		if (queueAdd(queue, program, node->texNum, node->tex, node->meshGL,
+				flat->modeling[i], node->unif) != 0)
+			return 1;
+	}
+	return 0;
+}
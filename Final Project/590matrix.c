@@ -11,6 +11,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+/* On x86, the 4x4 kernels use SSE2, which every x86-64 processor has, and AVX
+where the compiler allows it (as with -mavx). Elsewhere, such as on ARM Macs,
+they fall back to plain C. Either way the results are the same, because the
+vector code adds the products in the same order as the plain code. */
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define matSIMD 1
+#else
+#define matSIMD 0
+#endif
+
 /*** 2 x 2 Matrices ***/
 
 /* Pretty-prints the given matrix, with one line of text per row of matrix. */
@@ -225,6 +236,24 @@ void mat44Copy(GLdouble start[4][4], GLdouble end[4][4]) {
 
 /* Multiplies m by n, placing the answer in mTimesN. */
 void mat444Multiply(GLdouble m[4][4], GLdouble n[4][4], GLdouble mTimesN[4][4]) {
+#if matSIMD
+  /* Each row of the product is a combination of the rows of n, two entries
+  at a time. */
+  __m128d n00 = _mm_loadu_pd(&n[0][0]), n02 = _mm_loadu_pd(&n[0][2]);
+  __m128d n10 = _mm_loadu_pd(&n[1][0]), n12 = _mm_loadu_pd(&n[1][2]);
+  __m128d n20 = _mm_loadu_pd(&n[2][0]), n22 = _mm_loadu_pd(&n[2][2]);
+  __m128d n30 = _mm_loadu_pd(&n[3][0]), n32 = _mm_loadu_pd(&n[3][2]);
+  for (int i = 0; i < 4; i += 1) {
+    __m128d m0 = _mm_set1_pd(m[i][0]), m1 = _mm_set1_pd(m[i][1]);
+    __m128d m2 = _mm_set1_pd(m[i][2]), m3 = _mm_set1_pd(m[i][3]);
+    __m128d lo = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(m0, n00),
+      _mm_mul_pd(m1, n10)), _mm_mul_pd(m2, n20)), _mm_mul_pd(m3, n30));
+    __m128d hi = _mm_add_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(m0, n02),
+      _mm_mul_pd(m1, n12)), _mm_mul_pd(m2, n22)), _mm_mul_pd(m3, n32));
+    _mm_storeu_pd(&mTimesN[i][0], lo);
+    _mm_storeu_pd(&mTimesN[i][2], hi);
+  }
+#else
   mTimesN[0][0] = (m[0][0] * n[0][0]) + (m[0][1] * n[1][0]) + (m[0][2] * n[2][0]) + (m[0][3] * n[3][0]);
   mTimesN[0][1] = (m[0][0] * n[0][1]) + (m[0][1] * n[1][1]) + (m[0][2] * n[2][1]) + (m[0][3] * n[3][1]);
   mTimesN[0][2] = (m[0][0] * n[0][2]) + (m[0][1] * n[1][2]) + (m[0][2] * n[2][2]) + (m[0][3] * n[3][2]);
@@ -244,7 +273,7 @@ void mat444Multiply(GLdouble m[4][4], GLdouble n[4][4], GLdouble mTimesN[4][4])
   mTimesN[3][1] = (m[3][0] * n[0][1]) + (m[3][1] * n[1][1]) + (m[3][2] * n[2][1]) + (m[3][3] * n[3][1]);
   mTimesN[3][2] = (m[3][0] * n[0][2]) + (m[3][1] * n[1][2]) + (m[3][2] * n[2][2]) + (m[3][3] * n[3][2]);
   mTimesN[3][3] = (m[3][0] * n[0][3]) + (m[3][1] * n[1][3]) + (m[3][2] * n[2][3]) + (m[3][3] * n[3][3]);
-
+#endif
 }
 
 /* Multiplies m by v, placing the answer in mTimesV. */
@@ -393,9 +422,405 @@ matrices. Second, C matrices are implicitly stored one-row-after-another, while
 OpenGL expects matrices to be stored one-column-after-another. This function
 plows through both of those obstacles. */
 void mat44OpenGL(GLdouble m[4][4], GLfloat openGL[4][4]) {
+#if matSIMD
+	/* Convert each row to floats, and then transpose in registers. */
+	__m128 rows[4];
+	for (int i = 0; i < 4; i += 1)
+#ifdef __AVX__
+		rows[i] = _mm256_cvtpd_ps(_mm256_loadu_pd(m[i]));
+#else
+		rows[i] = _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(&m[i][0])),
+			_mm_cvtpd_ps(_mm_loadu_pd(&m[i][2])));
+#endif
+	_MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+	for (int i = 0; i < 4; i += 1)
+		_mm_storeu_ps(openGL[i], rows[i]);
+#else
 	for (int i = 0; i < 4; i += 1) {
 		for (int j = 0; j < 4; j += 1) {
 			openGL[i][j] = m[j][i];
 		}
 	}
+#endif
+}
+
+
+
+/*** Quaternions ***/
+
+/* A rotation can also be stored as a unit quaternion q = (w, x, y, z), with w
+first as in ODE's dQuaternion, so that ODE's quaternions copy straight in.
+It takes 4 numbers rather than 9, interpolates smoothly (see quatSlerp), and
+stays a rotation under repeated multiplication, up to a cheap normalization.
+The rotation through the angle alpha about the unit axis u is
+(cos(alpha / 2), sin(alpha / 2) u). The functions below assume unit
+quaternions unless noted. */
+
+/* Sets the quaternion to the identity rotation. */
+void quatIdentity(GLdouble q[4]) {
+	vec4Set(q, 1.0, 0.0, 0.0, 0.0);
+}
+
+/* Builds the quaternion for the rotation through the angle alpha (in radians)
+about the length-1 3D vector axis, as mat33AngleAxisRotation does. */
+void quatAngleAxis(GLdouble alpha, GLdouble axis[3], GLdouble q[4]) {
+	GLdouble sine = sin(alpha * 0.5);
+	vec4Set(q, cos(alpha * 0.5), sine * axis[0], sine * axis[1],
+		sine * axis[2]);
+}
+
+/* Multiplies q by r, placing the answer in qTimesR. The product rotates by r
+first and then by q, just as the product of their matrices would. The output
+may be the same as either input. */
+void quatMultiply(GLdouble q[4], GLdouble r[4], GLdouble qTimesR[4]) {
+	GLdouble w = q[0] * r[0] - q[1] * r[1] - q[2] * r[2] - q[3] * r[3];
+	GLdouble x = q[0] * r[1] + q[1] * r[0] + q[2] * r[3] - q[3] * r[2];
+	GLdouble y = q[0] * r[2] - q[1] * r[3] + q[2] * r[0] + q[3] * r[1];
+	GLdouble z = q[0] * r[3] + q[1] * r[2] - q[2] * r[1] + q[3] * r[0];
+	vec4Set(qTimesR, w, x, y, z);
+}
+
+/* Places the conjugate of q, which is the inverse rotation, into qConj. */
+void quatConjugate(GLdouble q[4], GLdouble qConj[4]) {
+	vec4Set(qConj, q[0], -q[1], -q[2], -q[3]);
+}
+
+/* Rotates the 3D vector v by q, placing the answer in qV. Costs about half as
+much as building the matrix first. The output may be the same as v. */
+void quatRotate(GLdouble q[4], GLdouble v[3], GLdouble qV[3]) {
+	/* v + w t + u x t, where u is q's vector part and t = 2 u x v. */
+	GLdouble t[3], uCrossT[3];
+	vec3Cross(&q[1], v, t);
+	vec3Scale(2.0, t, t);
+	vec3Cross(&q[1], t, uCrossT);
+	vec3Set(qV, v[0] + q[0] * t[0] + uCrossT[0],
+		v[1] + q[0] * t[1] + uCrossT[1], v[2] + q[0] * t[2] + uCrossT[2]);
+}
+
+/* Builds the rotation matrix of q. */
+void quatRotation(GLdouble q[4], GLdouble rot[3][3]) {
+	GLdouble w = q[0], x = q[1], y = q[2], z = q[3];
+	rot[0][0] = 1.0 - 2.0 * (y * y + z * z);
+	rot[0][1] = 2.0 * (x * y - w * z);
+	rot[0][2] = 2.0 * (x * z + w * y);
+	rot[1][0] = 2.0 * (x * y + w * z);
+	rot[1][1] = 1.0 - 2.0 * (x * x + z * z);
+	rot[1][2] = 2.0 * (y * z - w * x);
+	rot[2][0] = 2.0 * (x * z - w * y);
+	rot[2][1] = 2.0 * (y * z + w * x);
+	rot[2][2] = 1.0 - 2.0 * (x * x + y * y);
+}
+
+/* Finds the unit quaternion of the rotation matrix rot. Of the two
+quaternions q and -q, which give the same rotation, returns the one with
+w >= 0. */
+void quatFromRotation(GLdouble rot[3][3], GLdouble q[4]) {
+	GLdouble trace = rot[0][0] + rot[1][1] + rot[2][2], s;
+	/* Divide by the largest of the four components, for accuracy. */
+	if (trace > 0.0) {
+		s = 2.0 * sqrt(1.0 + trace);
+		vec4Set(q, 0.25 * s, (rot[2][1] - rot[1][2]) / s,
+			(rot[0][2] - rot[2][0]) / s, (rot[1][0] - rot[0][1]) / s);
+	} else if (rot[0][0] > rot[1][1] && rot[0][0] > rot[2][2]) {
+		s = 2.0 * sqrt(1.0 + rot[0][0] - rot[1][1] - rot[2][2]);
+		vec4Set(q, (rot[2][1] - rot[1][2]) / s, 0.25 * s,
+			(rot[0][1] + rot[1][0]) / s, (rot[0][2] + rot[2][0]) / s);
+	} else if (rot[1][1] > rot[2][2]) {
+		s = 2.0 * sqrt(1.0 + rot[1][1] - rot[0][0] - rot[2][2]);
+		vec4Set(q, (rot[0][2] - rot[2][0]) / s, (rot[0][1] + rot[1][0]) / s,
+			0.25 * s, (rot[1][2] + rot[2][1]) / s);
+	} else {
+		s = 2.0 * sqrt(1.0 + rot[2][2] - rot[0][0] - rot[1][1]);
+		vec4Set(q, (rot[1][0] - rot[0][1]) / s, (rot[0][2] + rot[2][0]) / s,
+			(rot[1][2] + rot[2][1]) / s, 0.25 * s);
+	}
+	if (q[0] < 0.0)
+		vecScale(4, -1.0, q, q);
+}
+
+/* Interpolates between q (at t = 0) and r (at t = 1) along the shorter way
+around, by blending the two and normalizing. Cheaper than quatSlerp, and good
+enough when q and r are close, as between two steps of a simulation, although
+the angular speed is not quite constant. */
+void quatNlerp(GLdouble q[4], GLdouble r[4], GLdouble t, GLdouble qr[4]) {
+	GLdouble s = (vecDot(4, q, r) < 0.0 ? -t : t);
+	GLdouble blend[4];
+	vec4Set(blend, (1.0 - t) * q[0] + s * r[0], (1.0 - t) * q[1] + s * r[1],
+		(1.0 - t) * q[2] + s * r[2], (1.0 - t) * q[3] + s * r[3]);
+	vecUnit(4, blend, qr);
+}
+
+/* Interpolates between q (at t = 0) and r (at t = 1) along the shorter way
+around, at constant angular speed. */
+void quatSlerp(GLdouble q[4], GLdouble r[4], GLdouble t, GLdouble qr[4]) {
+	GLdouble cosine = vecDot(4, q, r), sign = 1.0, angle, a, b;
+	if (cosine < 0.0) {
+		cosine = -cosine;
+		sign = -1.0;
+	}
+	/* Nearly equal rotations would divide by nearly 0. */
+	if (cosine > 0.9995) {
+		quatNlerp(q, r, t, qr);
+		return;
+	}
+	angle = acos(cosine);
+	a = sin((1.0 - t) * angle) / sin(angle);
+	b = sign * sin(t * angle) / sin(angle);
+	vec4Set(qr, a * q[0] + b * r[0], a * q[1] + b * r[1],
+		a * q[2] + b * r[2], a * q[3] + b * r[3]);
+}
+
+/* Composes two isometries, each a rotation (as a quaternion) followed by a
+translation: first (q2, trans2) and then (q1, trans1). Places the rotation
+and translation of the composite into q and trans, so that, for example, a
+node's world transform is its parent's composed with its own. The outputs may
+be the same as either input. */
+void quatComposeIsometry(GLdouble q1[4], GLdouble trans1[3], GLdouble q2[4],
+		GLdouble trans2[3], GLdouble q[4], GLdouble trans[3]) {
+	GLdouble rotated[3];
+	quatRotate(q1, trans2, rotated);
+	vec3Add(rotated, trans1, trans);
+	quatMultiply(q1, q2, q);
+}
+
+/* Like mat44Isometry, but with the rotation given as a quaternion. */
+void mat44QuaternionIsometry(GLdouble q[4], GLdouble trans[3],
+		GLdouble isom[4][4]) {
+	GLdouble rot[3][3];
+	quatRotation(q, rot);
+	mat44Isometry(rot, trans, isom);
+}
+
+
+
+/*** 3 x 4 affine matrices ***/
+
+/* Every modeling transformation in the scene is an isometry, whose 4x4 matrix
+always has bottom row 0 0 0 1. A 3x4 affine matrix stores only the top three
+rows: the 3x3 rotation on the left and the translation in the last column. The
+bottom row is implied, so composing two of them takes 36 multiplications
+rather than the 64 of mat444Multiply, and inverting an isometry is a
+transpose. mat34OpenGL converts one for upload as a GLSL mat3x4, which costs
+12 floats rather than 16. */
+
+/* Sets the matrix to the identity transformation. */
+void mat34Identity(GLdouble m[3][4]) {
+	for (int i = 0; i < 3; i += 1)
+		for (int j = 0; j < 4; j += 1)
+			m[i][j] = (i == j ? 1.0 : 0.0);
+}
+
+/* Copies start into end. */
+void mat34Copy(GLdouble start[3][4], GLdouble end[3][4]) {
+	for (int i = 0; i < 3; i += 1)
+		for (int j = 0; j < 4; j += 1)
+			end[i][j] = start[i][j];
+}
+
+/* Like mat44Isometry, but forms the 3x4 affine matrix. */
+void mat34Isometry(GLdouble rot[3][3], GLdouble trans[3],
+		GLdouble isom[3][4]) {
+	for (int i = 0; i < 3; i += 1) {
+		isom[i][0] = rot[i][0];
+		isom[i][1] = rot[i][1];
+		isom[i][2] = rot[i][2];
+		isom[i][3] = trans[i];
+	}
+}
+
+/* Like mat44QuaternionIsometry, but forms the 3x4 affine matrix. */
+void mat34QuaternionIsometry(GLdouble q[4], GLdouble trans[3],
+		GLdouble isom[3][4]) {
+	GLdouble rot[3][3];
+	quatRotation(q, rot);
+	mat34Isometry(rot, trans, isom);
+}
+
+/* Like mat44InverseIsometry, but forms the 3x4 affine matrix. */
+void mat34InverseIsometry(GLdouble rot[3][3], GLdouble trans[3],
+		GLdouble isom[3][4]) {
+	for (int i = 0; i < 3; i += 1) {
+		isom[i][0] = rot[0][i];
+		isom[i][1] = rot[1][i];
+		isom[i][2] = rot[2][i];
+		isom[i][3] = -(rot[0][i] * trans[0] + rot[1][i] * trans[1] +
+			rot[2][i] * trans[2]);
+	}
+}
+
+/* Assumes that m is an isometry. Places its inverse into mInv, which must not
+be m. */
+void mat34InvertIsometry(GLdouble m[3][4], GLdouble mInv[3][4]) {
+	for (int i = 0; i < 3; i += 1) {
+		mInv[i][0] = m[0][i];
+		mInv[i][1] = m[1][i];
+		mInv[i][2] = m[2][i];
+		mInv[i][3] = -(m[0][i] * m[0][3] + m[1][i] * m[1][3] +
+			m[2][i] * m[2][3]);
+	}
+}
+
+/* Multiplies the affine matrices m and n, as if each had the bottom row
+0 0 0 1, so that mTimesN performs n and then m. mTimesN must not be m or n. */
+void mat34Compose(GLdouble m[3][4], GLdouble n[3][4],
+		GLdouble mTimesN[3][4]) {
+	for (int i = 0; i < 3; i += 1) {
+		for (int j = 0; j < 4; j += 1)
+			mTimesN[i][j] = m[i][0] * n[0][j] + m[i][1] * n[1][j] +
+				m[i][2] * n[2][j];
+		mTimesN[i][3] += m[i][3];
+	}
+}
+
+/* Transforms the point p (with implied fourth coordinate 1). mP must not be
+p. */
+void mat34TransformPoint(GLdouble m[3][4], GLdouble p[3], GLdouble mP[3]) {
+	for (int i = 0; i < 3; i += 1)
+		mP[i] = m[i][0] * p[0] + m[i][1] * p[1] + m[i][2] * p[2] + m[i][3];
+}
+
+/* Transforms the direction or normal d (with implied fourth coordinate 0), by
+the left 3x3 part of m alone. For an isometry, that part is a rotation, which
+is its own inverse transpose, so normals stay normal. mD must not be d. */
+void mat34TransformNormal(GLdouble m[3][4], GLdouble d[3], GLdouble mD[3]) {
+	for (int i = 0; i < 3; i += 1)
+		mD[i] = m[i][0] * d[0] + m[i][1] * d[1] + m[i][2] * d[2];
+}
+
+/* Fills in the full 4x4 matrix, for code that still works in 4x4. */
+void mat44Affine(GLdouble m[3][4], GLdouble full[4][4]) {
+	for (int i = 0; i < 3; i += 1)
+		for (int j = 0; j < 4; j += 1)
+			full[i][j] = m[i][j];
+	full[3][0] = 0.0;
+	full[3][1] = 0.0;
+	full[3][2] = 0.0;
+	full[3][3] = 1.0;
+}
+
+/* Converts the matrix to GLfloats for glUniformMatrix3x4fv (with transpose
+GL_FALSE) or for a mat3x4 in a std430 buffer. No transposition is needed: a
+GLSL mat3x4 has 3 columns of 4 entries each, and each of those columns receives
+one of our rows. So, in the shader, the matrix acts from the right:
+	uniform mat3x4 modeling;
+	...
+	vec3 world = vec4(position, 1.0) * modeling;
+	vec3 normalDir = vec4(normal, 0.0) * modeling; */
+void mat34OpenGL(GLdouble m[3][4], GLfloat openGL[3][4]) {
+	for (int i = 0; i < 3; i += 1)
+		for (int j = 0; j < 4; j += 1)
+			openGL[i][j] = m[i][j];
+}
+
+
+
+/*** Batched float kernels ***/
+
+/* The functions below work on GLfloat matrices that are already in OpenGL's
+layout, one column after another, as mat44OpenGL produces them. So each
+openGL[j] is the jth column of the matrix. They suit work that ends up in
+OpenGL anyway, such as per-draw modeling matrices, and the batched versions
+let a caller handle a whole array of matrices or points in one call, with no
+per-element function call overhead and no conversions in between. The output
+may be the same array as any input, except where noted. */
+
+/* Multiplies m by n, placing the answer in mTimesN. */
+void matGL444Multiply(GLfloat m[4][4], GLfloat n[4][4],
+		GLfloat mTimesN[4][4]) {
+#if matSIMD
+	__m128 m0 = _mm_loadu_ps(m[0]), m1 = _mm_loadu_ps(m[1]);
+	__m128 m2 = _mm_loadu_ps(m[2]), m3 = _mm_loadu_ps(m[3]);
+	__m128 col[4];
+	for (int j = 0; j < 4; j += 1)
+		col[j] = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(m0, _mm_set1_ps(n[j][0])),
+			_mm_mul_ps(m1, _mm_set1_ps(n[j][1]))),
+			_mm_mul_ps(m2, _mm_set1_ps(n[j][2]))),
+			_mm_mul_ps(m3, _mm_set1_ps(n[j][3])));
+	for (int j = 0; j < 4; j += 1)
+		_mm_storeu_ps(mTimesN[j], col[j]);
+#else
+	GLfloat col[4][4];
+	for (int j = 0; j < 4; j += 1)
+		for (int i = 0; i < 4; i += 1)
+			col[j][i] = m[0][i] * n[j][0] + m[1][i] * n[j][1] +
+				m[2][i] * n[j][2] + m[3][i] * n[j][3];
+	for (int j = 0; j < 4; j += 1)
+		for (int i = 0; i < 4; i += 1)
+			mTimesN[j][i] = col[j][i];
+#endif
+}
+
+/* Multiplies m by the 4-column v, placing the answer in mTimesV. */
+void matGL441Multiply(GLfloat m[4][4], GLfloat v[4], GLfloat mTimesV[4]) {
+#if matSIMD
+	__m128 sum = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+		_mm_mul_ps(_mm_loadu_ps(m[0]), _mm_set1_ps(v[0])),
+		_mm_mul_ps(_mm_loadu_ps(m[1]), _mm_set1_ps(v[1]))),
+		_mm_mul_ps(_mm_loadu_ps(m[2]), _mm_set1_ps(v[2]))),
+		_mm_mul_ps(_mm_loadu_ps(m[3]), _mm_set1_ps(v[3])));
+	_mm_storeu_ps(mTimesV, sum);
+#else
+	GLfloat sum[4];
+	for (int i = 0; i < 4; i += 1)
+		sum[i] = m[0][i] * v[0] + m[1][i] * v[1] + m[2][i] * v[2] +
+			m[3][i] * v[3];
+	for (int i = 0; i < 4; i += 1)
+		mTimesV[i] = sum[i];
+#endif
+}
+
+/* Converts num matrices at once, as mat44OpenGL does. */
+void mat44OpenGLBatch(GLuint num, GLdouble m[][4][4],
+		GLfloat openGL[][4][4]) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat44OpenGL(m[k], openGL[k]);
+}
+
+/* Multiplies m by each of the num matrices ns, placing the answers in
+mTimesNs. For example, m could be a camera's viewing matrix and ns the
+modeling matrices of everything in view. */
+void matGL444MultiplyBatch(GLfloat m[4][4], GLuint num, GLfloat ns[][4][4],
+		GLfloat mTimesNs[][4][4]) {
+	for (GLuint k = 0; k < num; k += 1)
+		matGL444Multiply(m, ns[k], mTimesNs[k]);
+}
+
+/* Multiplies m by each of the num 4-columns vs, placing the answers in
+mTimesVs. */
+void matGL441MultiplyBatch(GLfloat m[4][4], GLuint num, GLfloat vs[][4],
+		GLfloat mTimesVs[][4]) {
+#if matSIMD
+	__m128 m0 = _mm_loadu_ps(m[0]), m1 = _mm_loadu_ps(m[1]);
+	__m128 m2 = _mm_loadu_ps(m[2]), m3 = _mm_loadu_ps(m[3]);
+	for (GLuint k = 0; k < num; k += 1) {
+		__m128 v = _mm_loadu_ps(vs[k]);
+		__m128 sum = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+			_mm_mul_ps(m0, _mm_shuffle_ps(v, v, _MM_SHUFFLE(0, 0, 0, 0))),
+			_mm_mul_ps(m1, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1)))),
+			_mm_mul_ps(m2, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2)))),
+			_mm_mul_ps(m3, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3))));
+		_mm_storeu_ps(mTimesVs[k], sum);
+	}
+#else
+	for (GLuint k = 0; k < num; k += 1)
+		matGL441Multiply(m, vs[k], mTimesVs[k]);
+#endif
+}
+
+/* Composes the world matrices of a hierarchy of num nodes, listed so that
+every node comes after its parent (as in a sceneFlat). parents[k] is the index
+of node k's parent, or -1 if it has none. Each world[k] becomes
+world[parents[k]] times locals[k], or just locals[k] for a root. world must
+not be the same array as locals. */
+void matGL444ComposeBatch(GLuint num, GLint parents[], GLfloat locals[][4][4],
+		GLfloat world[][4][4]) {
+	for (GLuint k = 0; k < num; k += 1) {
+		if (parents[k] >= 0)
+			matGL444Multiply(world[parents[k]], locals[k], world[k]);
+		else
+			for (int j = 0; j < 4; j += 1)
+				for (int i = 0; i < 4; i += 1)
+					world[k][j][i] = locals[k][j][i];
+	}
 }
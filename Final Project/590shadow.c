@@ -5,47 +5,47 @@ typedef struct shadowProgram shadowProgram;
 struct shadowProgram {
 	GLuint program;
 	GLint *attrLocs;
-	GLint viewingLoc, modelingLoc;
+	GLint viewingLoc, modelingLoc, instanceLoc;
+	/* Only for shadow atlases and cubes. Otherwise -1. */
+	GLint lightNumLoc, viewingsLoc, regionsLoc, lightPosLoc, farLoc;
 };
 
-/* Creates a shadow-mapping shader program. attrNum is the number of attributes
-in meshes that will be drawn using the shadow program. Assumes that the 0th
-attribute is 3D position. Provides uniforms for the modeling and viewing
-matrices. Assumes that no other attributes or uniforms affect the placement of
-geometry. One shadow program can be used with multiple shadow maps, as long as
-attrNum is correct. In particular, if all meshes in the application have the
-same attrNum, then the application needs only one shadow program. Returns 0 on
-success, non-zero on failure. On success, the user must call
-shadowProgramDestroy when finished with the shadow program. */
-int shadowProgramInitialize(shadowProgram *prog, GLuint attrNum) {
+/* Helper function for the shadow program initializers below. geometryCode may
+be NULL. fragmentCode may be NULL, for a fragment shader that does nothing. */
+int shadowProgramInitializeCode(shadowProgram *prog, GLuint attrNum,
+		GLchar *vertexCode, GLchar *geometryCode, GLchar *fragmentCode) {
 	prog->attrLocs = (GLint *)malloc(attrNum * sizeof(GLint));
 	if (prog->attrLocs == NULL) {
 		fprintf(stderr, "shadowProgramInitialize: malloc failed.\n");
 		return 1;
 	}
-	/* The vertex shader produces just geometry --- no texture coordinates,
-	lighting information, or any of that. */
-	GLchar vertexCode[] = "\
-		#version 140\n\
-		uniform mat4 viewing;\
-		uniform mat4 modeling;\
-		in vec3 position;\
-		void main(void) {\
-			gl_Position = viewing * modeling * vec4(position, 1.0);\
-		}";
 	/* We must have a fragment shader, but we don't actually care what colors
 	it produces. */
-	GLchar fragmentCode[] = "\
+	GLchar colorCode[] = "\
 		#version 140\n\
 		out vec4 fragColor;\
 		void main(void) {\
 			fragColor = vec4(1.0, 1.0, 1.0, 1.0);\
 		}";
-	prog->program = makeProgram(vertexCode, fragmentCode);
+	prog->program = makeProgramGeometry(vertexCode, geometryCode,
+		(fragmentCode == NULL ? colorCode : fragmentCode));
 	if (prog->program == 0) {
 		free(prog->attrLocs);
 		return 2;
 	}
+	/* Pin the attribute locations and relink, so that every shadow program
+	can draw through the same VAOs. */
+	GLint status;
+	glBindAttribLocation(prog->program, 0, "position");
+	glBindAttribLocation(prog->program, 1, "instance");
+	glLinkProgram(prog->program);
+	glGetProgramiv(prog->program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		fprintf(stderr, "shadowProgramInitialize: glLinkProgram failed.\n");
+		glDeleteProgram(prog->program);
+		free(prog->attrLocs);
+		return 3;
+	}
 	/* Set up the locations. Only one of the attribute locations is meaningful.
 	The others are harmless dummy locations. */
 	glUseProgram(prog->program);
@@ -54,9 +54,222 @@ int shadowProgramInitialize(shadowProgram *prog, GLuint attrNum) {
 		prog->attrLocs[i] = -1;
 	prog->viewingLoc = glGetUniformLocation(prog->program, "viewing");
 	prog->modelingLoc = glGetUniformLocation(prog->program, "modeling");
+	prog->instanceLoc = glGetAttribLocation(prog->program, "instance");
+	prog->lightNumLoc = glGetUniformLocation(prog->program, "lightNum");
+	prog->viewingsLoc = glGetUniformLocation(prog->program, "viewings");
+	prog->regionsLoc = glGetUniformLocation(prog->program, "regions");
+	prog->lightPosLoc = glGetUniformLocation(prog->program, "lightPos");
+	prog->farLoc = glGetUniformLocation(prog->program, "far");
 	return 0;
 }
 
+/* Creates a shadow-mapping shader program. attrNum is the number of attributes
+in meshes that will be drawn using the shadow program. Assumes that the 0th
+attribute is 3D position. Provides uniforms for the modeling and viewing
+matrices. Assumes that no other attributes or uniforms affect the placement of
+geometry. One shadow program can be used with multiple shadow maps, as long as
+attrNum is correct. In particular, if all meshes in the application have the
+same attrNum, then the application needs only one shadow program. Returns 0 on
+success, non-zero on failure. On success, the user must call
+shadowProgramDestroy when finished with the shadow program. */
+int shadowProgramInitialize(shadowProgram *prog, GLuint attrNum) {
+	/* The vertex shader produces just geometry --- no texture coordinates,
+	lighting information, or any of that. */
+	GLchar vertexCode[] = "\
+		#version 140\n\
+		uniform mat4 viewing;\
+		uniform mat3x4 modeling;\
+		in vec3 position;\
+		void main(void) {\
+			vec3 world = vec4(position, 1.0) * modeling;\
+			gl_Position = viewing * vec4(world, 1.0);\
+		}";
+	return shadowProgramInitializeCode(prog, attrNum, vertexCode, NULL, NULL);
+}
+
+/* Like shadowProgramInitialize, but for drawing through an indirect batch on
+OpenGL 4.3 or later. Instead of a modeling uniform (modelingLoc is -1), the
+modeling matrices come from the batch's per-draw data, located through the
+instance attribute at instanceLoc. */
+int shadowProgramInitializeIndirect(shadowProgram *prog, GLuint attrNum) {
+	GLchar vertexCode[] = "\
+		#version 430\n\
+		uniform mat4 viewing;\
+		struct Instance {\
+			mat3x4 modeling;\
+			vec4 unif;\
+		};\
+		layout(std430, binding = 0) buffer Instances {\
+			Instance instances[];\
+		};\
+		in vec3 position;\
+		in uint instance;\
+		void main(void) {\
+			vec3 world = vec4(position, 1.0) * instances[instance].modeling;\
+			gl_Position = viewing * vec4(world, 1.0);\
+		}";
+	return shadowProgramInitializeCode(prog, attrNum, vertexCode, NULL, NULL);
+}
+
+/* The most lights in a shadow atlas. */
+#define shadowATLASMAX 8
+
+/* Helper function for shadowProgramInitializeAtlas and
+shadowProgramInitializeCube, whose geometry shaders draw each triangle several
+times. The vertex shader only places the geometry in the world, and the
+geometry shader does the rest. fragmentBody may be NULL. If indirect is
+non-zero, then the program draws through an indirect batch on OpenGL 4.3, as
+in shadowProgramInitializeIndirect. */
+int shadowProgramInitializeLayered(shadowProgram *prog, GLuint attrNum,
+		int indirect, GLchar *geometryBody, GLchar *fragmentBody) {
+	GLchar header[96];
+	if (indirect)
+		snprintf(header, sizeof(header),
+			"#version 430\n#define INDIRECT 1\n#define LIGHTMAX %d\n"
+			"#define VERTEXMAX %d\n", shadowATLASMAX, 3 * shadowATLASMAX);
+	else
+		snprintf(header, sizeof(header),
+			"#version 150\n#define INDIRECT 0\n#define LIGHTMAX %d\n"
+			"#define VERTEXMAX %d\n", shadowATLASMAX, 3 * shadowATLASMAX);
+	GLchar vertexBody[] = "\
+		in vec3 position;\n\
+		#if INDIRECT\n\
+		struct Instance {\
+			mat3x4 modeling;\
+			vec4 unif;\
+		};\
+		layout(std430, binding = 0) buffer Instances {\
+			Instance instances[];\
+		};\
+		in uint instance;\n\
+		#else\n\
+		uniform mat3x4 modeling;\n\
+		#endif\n\
+		void main(void) {\n\
+			#if INDIRECT\n\
+			mat3x4 modeling = instances[instance].modeling;\n\
+			#endif\n\
+			gl_Position = vec4(vec4(position, 1.0) * modeling, 1.0);\
+		}";
+	GLuint geometrySize = strlen(geometryBody) + sizeof(header);
+	GLuint fragmentSize = (fragmentBody == NULL ? 0 : strlen(fragmentBody)) +
+		sizeof(header);
+	GLchar vertexCode[sizeof(vertexBody) + sizeof(header)];
+	GLchar *geometryCode = (GLchar *)malloc(geometrySize + fragmentSize);
+	if (geometryCode == NULL) {
+		fprintf(stderr, "shadowProgramInitialize: malloc failed.\n");
+		return 4;
+	}
+	GLchar *fragmentCode = &(geometryCode[geometrySize]);
+	snprintf(vertexCode, sizeof(vertexCode), "%s%s", header, vertexBody);
+	snprintf(geometryCode, geometrySize, "%s%s", header, geometryBody);
+	if (fragmentBody != NULL)
+		snprintf(fragmentCode, fragmentSize, "%s%s", header, fragmentBody);
+	int error = shadowProgramInitializeCode(prog, attrNum, vertexCode,
+		geometryCode, (fragmentBody == NULL ? NULL : fragmentCode));
+	free(geometryCode);
+	return error;
+}
+
+/* Creates a shader program for drawing the casters of every light of a shadow
+atlas in one pass (see shadowAtlasRender). For each triangle, the geometry
+shader emits one copy per light that can see it, projected into that light's
+region of the atlas and clipped to the region by gl_ClipDistance. Requires
+OpenGL 3.2. If indirect is non-zero, then the program draws through an
+indirect batch on OpenGL 4.3, as in shadowProgramInitializeIndirect. The other
+arguments and the return value are as in shadowProgramInitialize. */
+int shadowProgramInitializeAtlas(shadowProgram *prog, GLuint attrNum,
+		int indirect) {
+	/* Each region is given as the scale and offset that take the light's
+	normalized device coordinates to the atlas's. A triangle that is entirely
+	outside one plane of a light's viewing volume is not emitted for it. */
+	GLchar geometryBody[] = "\
+		layout(triangles) in;\
+		layout(triangle_strip, max_vertices = VERTEXMAX) out;\
+		uniform int lightNum;\
+		uniform mat4 viewings[LIGHTMAX];\
+		uniform vec4 regions[LIGHTMAX];\
+		void main(void) {\
+			for (int i = 0; i < lightNum; i += 1) {\
+				if (regions[i].x == 0.0)\
+					continue;\
+				vec4 clip0 = viewings[i] * gl_in[0].gl_Position;\
+				vec4 clip1 = viewings[i] * gl_in[1].gl_Position;\
+				vec4 clip2 = viewings[i] * gl_in[2].gl_Position;\
+				vec3 w = vec3(clip0.w, clip1.w, clip2.w);\
+				vec3 x = vec3(clip0.x, clip1.x, clip2.x);\
+				vec3 y = vec3(clip0.y, clip1.y, clip2.y);\
+				vec3 z = vec3(clip0.z, clip1.z, clip2.z);\
+				if (all(lessThan(x, -w)) || all(greaterThan(x, w)) ||\
+						all(lessThan(y, -w)) || all(greaterThan(y, w)) ||\
+						all(lessThan(z, -w)) || all(greaterThan(z, w)))\
+					continue;\
+				for (int k = 0; k < 3; k += 1) {\
+					vec4 clip = (k == 0 ? clip0 : (k == 1 ? clip1 : clip2));\
+					gl_ClipDistance[0] = clip.w + clip.x;\
+					gl_ClipDistance[1] = clip.w - clip.x;\
+					gl_ClipDistance[2] = clip.w + clip.y;\
+					gl_ClipDistance[3] = clip.w - clip.y;\
+					gl_Position = vec4(\
+						clip.xy * regions[i].xy + regions[i].zw * clip.w,\
+						clip.zw);\
+					EmitVertex();\
+				}\
+				EndPrimitive();\
+			}\
+		}";
+	return shadowProgramInitializeLayered(prog, attrNum, indirect,
+		geometryBody, NULL);
+}
+
+/* Creates a shader program for drawing the casters of an omnidirectional
+light into all six faces of a shadow cube in one pass (see shadowCubeRender).
+For each triangle, the geometry shader emits one copy per face that can see
+it, routed to that face by gl_Layer. Instead of the usual depth, the fragment
+shader stores each fragment's distance from the light, divided by the far
+distance, so that the lighting shader can compare distances without knowing
+which face it samples. Requires OpenGL 3.2. indirect, the other arguments, and
+the return value are as in shadowProgramInitializeAtlas. */
+int shadowProgramInitializeCube(shadowProgram *prog, GLuint attrNum,
+		int indirect) {
+	GLchar geometryBody[] = "\
+		layout(triangles) in;\
+		layout(triangle_strip, max_vertices = 18) out;\
+		uniform mat4 viewings[6];\
+		out vec3 worldPos;\
+		void main(void) {\
+			for (int face = 0; face < 6; face += 1) {\
+				vec4 clip0 = viewings[face] * gl_in[0].gl_Position;\
+				vec4 clip1 = viewings[face] * gl_in[1].gl_Position;\
+				vec4 clip2 = viewings[face] * gl_in[2].gl_Position;\
+				vec3 w = vec3(clip0.w, clip1.w, clip2.w);\
+				vec3 x = vec3(clip0.x, clip1.x, clip2.x);\
+				vec3 y = vec3(clip0.y, clip1.y, clip2.y);\
+				vec3 z = vec3(clip0.z, clip1.z, clip2.z);\
+				if (all(lessThan(x, -w)) || all(greaterThan(x, w)) ||\
+						all(lessThan(y, -w)) || all(greaterThan(y, w)) ||\
+						all(lessThan(z, -w)) || all(greaterThan(z, w)))\
+					continue;\
+				for (int k = 0; k < 3; k += 1) {\
+					gl_Layer = face;\
+					worldPos = vec3(gl_in[k].gl_Position);\
+					gl_Position = (k == 0 ? clip0 : (k == 1 ? clip1 : clip2));\
+					EmitVertex();\
+				}\
+				EndPrimitive();\
+			}\
+		}";
+	GLchar fragmentBody[] = "\
+		uniform vec3 lightPos;\
+		uniform float far;\
+		in vec3 worldPos;\
+		void main(void) {\
+			gl_FragDepth = length(worldPos - lightPos) / far;\
+		}";
+	return shadowProgramInitializeLayered(prog, attrNum, indirect,
+		geometryBody, fragmentBody);
+}
+
 /* Deallocates the resources backing the shadow program. */
 void shadowProgramDestroy(shadowProgram *prog) {
 	free(prog->attrLocs);
@@ -67,24 +280,47 @@ void shadowProgramDestroy(shadowProgram *prog) {
 
 /*** Shadow map ***/
 
+/* A shadow map can cache the shadows of static geometry (the ground, kinematic
+bodies, sleeping bodies) in a second depth texture, its static layer. The
+static layer is redrawn only when the light's camera changes or the user calls
+shadowMapInvalidate. Each frame, shadowMapRender starts the shadow map from a
+copy of the static layer, so only the moving casters need to be drawn on top.
+An application that never draws a static layer gets an ordinary shadow map.
+
+The shadow map's camera can cover the light's whole cone (shadowMapUpdate) or
+be fitted, each frame, to the part of the scene that the viewer can see
+(shadowMapFit). A fitted camera has a narrower field of view and tighter near
+and far planes, and renders into just the lower-left region of the textures
+that it needs, so that a texel covers about the same angle as it would in the
+whole texture with the whole cone. So a fitted shadow map gives the same
+quality from less memory traffic, or better quality at the same size. */
+
 /* Feel free to read from this struct's members, but don't alter them. */
 typedef struct shadowMap shadowMap;
 struct shadowMap {
 	GLuint width, height;
 	GLuint texture, fbo;
 	camCamera camera;
+	GLuint staticTexture, staticFbo;
+	int staticValid;
+	/* The light's camera, as of the last shadowMapUpdate or shadowMapFit, and
+	the region of the textures that it renders into. */
+	GLdouble rotation[3][3], translation[3], fovy, far, near;
+	GLuint regionWidth, regionHeight;
+	/* The last fit, as the tangent of half the field of view and positive
+	distances to the near and far planes, and the light's rotation when it was
+	made. fitTan is 0 if there is none. */
+	GLdouble fitTan, fitNear, fitFar, fitLight[3][3];
 };
 
-/* The application needs one shadow map per active light (unless the light
-doesn't cast shadows). The width and height must be powers of 2. Returns 0 on
-success, non-zero on failure. On success, the user must call shadowMapDestroy
-when finished with the shadow map. */
-int shadowMapInitialize(shadowMap *map, GLuint width, GLuint height) {
+/* Helper function for shadowMapInitialize. Creates one depth texture and a
+framebuffer object that renders into it. Returns 0 on success, non-zero on
+failure. */
+int shadowMapInitializeTarget(GLuint width, GLuint height, GLuint *texture,
+		GLuint *fbo) {
 	/* Create a texture. */
-	map->width = width;
-	map->height = height;
-	glGenTextures(1, &(map->texture));
-	glBindTexture(GL_TEXTURE_2D, map->texture);
+	glGenTextures(1, texture);
+	glBindTexture(GL_TEXTURE_2D, *texture);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32, width, height, 0,
 		GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
 	/* Set the filtering, comparison, and wrapping modes. */
@@ -98,47 +334,432 @@ int shadowMapInitialize(shadowMap *map, GLuint width, GLuint height) {
 	/* We are finished configuring the texture. */
 	glBindTexture(GL_TEXTURE_2D, 0);
 	/* Create a framebuffer object, attach the texture, and disable color. */
-	glGenFramebuffers(1, &(map->fbo));
-	glBindFramebuffer(GL_FRAMEBUFFER, map->fbo);
-	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, map->texture, 0);
+	glGenFramebuffers(1, fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, *texture, 0);
 	glDrawBuffer(GL_NONE);
 	glReadBuffer(GL_NONE);
 	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
 	if (status != GL_FRAMEBUFFER_COMPLETE) {
     	fprintf(stderr,
     		"shadowMapInitialize: glCheckFramebufferStatus: %d\n", status);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteTextures(1, texture);
+		glDeleteFramebuffers(1, fbo);
     	return 1;
 	}
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	return 0;
 }
 
+/* The application needs one shadow map per active light (unless the light
+doesn't cast shadows, or shares a shadow atlas with others). The width and height must be powers of 2. Returns 0 on
+success, non-zero on failure. On success, the user must call shadowMapDestroy
+when finished with the shadow map. */
+int shadowMapInitialize(shadowMap *map, GLuint width, GLuint height) {
+	map->width = width;
+	map->height = height;
+	map->staticValid = 0;
+	mat33Identity(map->rotation);
+	vec3Set(map->translation, 0.0, 0.0, 0.0);
+	map->fovy = -1.0;
+	map->regionWidth = width;
+	map->regionHeight = height;
+	map->fitTan = 0.0;
+	if (shadowMapInitializeTarget(width, height, &(map->texture),
+			&(map->fbo)) != 0)
+		return 1;
+	if (shadowMapInitializeTarget(width, height, &(map->staticTexture),
+			&(map->staticFbo)) != 0) {
+		glDeleteTextures(1, &(map->texture));
+		glDeleteFramebuffers(1, &(map->fbo));
+		return 2;
+	}
+	return 0;
+}
+
 /* Deallocates the resources backing the shadow map. */
 void shadowMapDestroy(shadowMap *map) {
 	glDeleteTextures(1, &(map->texture));
 	glDeleteFramebuffers(1, &(map->fbo));
+	glDeleteTextures(1, &(map->staticTexture));
+	glDeleteFramebuffers(1, &(map->staticFbo));
+}
+
+/* Marks the static layer stale, for example because a static caster moved or
+stopped being static. */
+void shadowMapInvalidate(shadowMap *map) {
+	map->staticValid = 0;
 }
 
 
 
 /*** Rendering **/
 
-/* Prepares a shadow map for rendering into it. */
-void shadowMapRender(shadowMap *map, shadowProgram *prog, lightLight *light,
-		GLdouble far, GLdouble near) {
-	glViewport(0, 0, map->width, map->height);
-	glBindFramebuffer(GL_FRAMEBUFFER, map->fbo);
-	glClear(GL_DEPTH_BUFFER_BIT);
-	glUseProgram(prog->program);
-	/* Configure the shadow map's camera to match the light. Invert the focal
-	length and ratio parameters from far and near. Only the ratio of width and
-	height matters --- not width and height. */
-	camSetRotation(&(map->camera), light->rotation);
-	camSetTranslation(&(map->camera), light->translation);
+/* The most vertices that shadowMapFit's clipping handles per polygon. */
+#define shadowCLIPMAX 32
+
+/* Configures cam to look from the given rotation and translation (usually a
+light's) with the given field of view and planes (negative numbers, as in
+camSetFrustum), with a square aspect. */
+void shadowLightCamera(camCamera *cam, GLdouble rotation[3][3],
+		GLdouble translation[3], GLdouble fovy, GLdouble far, GLdouble near) {
+	/* Invert the focal length and ratio parameters from far and near. Only the
+	ratio of width and height matters --- not width and height. */
+	camSetRotation(cam, rotation);
+	camSetTranslation(cam, translation);
 	GLdouble focal = sqrt(near * far);
 	GLdouble ratio = -far / focal;
-	camSetFrustum(&(map->camera), camPERSPECTIVE, light->spotAngle, focal,
-		ratio, 1.0, 1.0);
+	camSetFrustum(cam, camPERSPECTIVE, fovy, focal, ratio, 1.0, 1.0);
+}
+
+/* Computes the matrix that follows a shadow camera's P C^-1 to place its
+viewing volume in a region of a texture. x and y are the region's lower-left
+corner and width and height its size, all in texels of a texture of the given
+size. */
+void shadowRegionMatrix(GLuint x, GLuint y, GLuint width, GLuint height,
+		GLuint texWidth, GLuint texHeight, GLdouble region[4][4]) {
+	GLdouble sx = (GLdouble)width / texWidth;
+	GLdouble sy = (GLdouble)height / texHeight;
+	/* Map x in [-w, w] to the region's [2 x / texWidth - 1, ...] w, and
+	similarly y. */
+	mat44Identity(region);
+	region[0][0] = sx;
+	region[0][3] = (2.0 * x + width) / texWidth - 1.0;
+	region[1][1] = sy;
+	region[1][3] = (2.0 * y + height) / texHeight - 1.0;
+}
+
+/* Helper function for shadowMapUpdate and shadowMapFit. Configures the shadow
+map's camera to look from the given rotation and translation (usually a
+light's, or aimed off its axis by a fit) with the given field of view and
+planes, rendering into the given region of the textures. Marks the static
+layer stale if anything changed. */
+void shadowMapSetCamera(shadowMap *map, GLdouble rotation[3][3],
+		GLdouble translation[3], GLdouble fovy, GLdouble far, GLdouble near,
+		GLuint regionWidth, GLuint regionHeight) {
+	if (memcmp(map->rotation, rotation, 9 * sizeof(GLdouble)) == 0 &&
+			memcmp(map->translation, translation, 3 * sizeof(GLdouble)) == 0 &&
+			map->fovy == fovy && map->far == far && map->near == near &&
+			map->regionWidth == regionWidth && map->regionHeight == regionHeight)
+		return;
+	mat33Copy(rotation, map->rotation);
+	vecCopy(3, translation, map->translation);
+	map->fovy = fovy;
+	map->far = far;
+	map->near = near;
+	map->regionWidth = regionWidth;
+	map->regionHeight = regionHeight;
+	map->staticValid = 0;
+	shadowLightCamera(&(map->camera), rotation, translation, fovy, far, near);
+}
+
+/* Configures the shadow map's camera to cover the light's whole cone, between
+the given far and near planes (negative numbers, as in camSetFrustum), using
+the whole textures. Marks the static layer stale if the camera changed. Call
+this function or shadowMapFit before shadowMapStaticRender and
+shadowMapRender. The application can then cull against map->camera. */
+void shadowMapUpdate(shadowMap *map, lightLight *light, GLdouble far,
+		GLdouble near) {
+	map->fitTan = 0.0;
+	shadowMapSetCamera(map, light->rotation, light->translation,
+		light->spotAngle, far, near, map->width, map->height);
+}
+
+/* Helper for shadowMapFit. Accumulates the extent of a set of points as seen
+from a camera with the given rotation and translation, which looks down its
+negative z-axis. lo and hi bound the points' x / depth and y / depth, and
+minDepth and maxDepth their depths. whole is non-zero if some point lies
+beside or behind the camera, so that no window in front of it can hold them
+all. */
+typedef struct shadowFit shadowFit;
+struct shadowFit {
+	GLdouble rotation[3][3], translation[3];
+	GLdouble lo[2], hi[2], minDepth, maxDepth;
+	int whole;
+};
+
+/* Helper function for shadowMapFit. Starts an empty fit as seen from the
+given rotation and translation. */
+void shadowFitBegin(shadowFit *fit, GLdouble rotation[3][3],
+		GLdouble translation[3]) {
+	mat33Copy(rotation, fit->rotation);
+	vecCopy(3, translation, fit->translation);
+	fit->lo[0] = fit->lo[1] = fit->minDepth = HUGE_VAL;
+	fit->hi[0] = fit->hi[1] = fit->maxDepth = -HUGE_VAL;
+	fit->whole = 0;
+}
+
+/* Helper function for shadowMapFit. Widens the fit to include the point. */
+void shadowFitPoint(shadowFit *fit, GLdouble point[3]) {
+	GLdouble rotInv[3][3], diff[3], local[3], depth;
+	GLuint k;
+	mat33Transpose(fit->rotation, rotInv);
+	vecSubtract(3, point, fit->translation, diff);
+	mat331Multiply(rotInv, diff, local);
+	depth = -local[2];
+	if (depth <= 0.0)
+		fit->whole = 1;
+	else
+		for (k = 0; k < 2; k += 1) {
+			fit->lo[k] = fmin(fit->lo[k], local[k] / depth);
+			fit->hi[k] = fmax(fit->hi[k], local[k] / depth);
+		}
+	fit->minDepth = fmin(fit->minDepth, depth);
+	fit->maxDepth = fmax(fit->maxDepth, depth);
+}
+
+/* Helper function for shadowMapFit. Returns the tangent of half the field of
+view of the square window, centered on the camera's axis, that holds the
+fit. */
+GLdouble shadowFitTan(shadowFit *fit) {
+	return fmax(fmax(-fit->lo[0], fit->hi[0]), fmax(-fit->lo[1], fit->hi[1]));
+}
+
+/* Helper function for shadowMapFit. Clips the convex polygon of vertNum
+vertices in verts against the plane, keeping the side where the signed distance
+is non-negative, in place. Returns the new number of vertices, which is at most
+vertNum + 1. */
+GLuint shadowMapClipPolygon(GLuint vertNum, GLdouble verts[][3],
+		GLdouble plane[4]) {
+	GLdouble clipped[shadowCLIPMAX][3], dist[shadowCLIPMAX], t;
+	GLuint i, j, clippedNum = 0;
+	for (i = 0; i < vertNum; i += 1)
+		dist[i] = vecDot(3, plane, verts[i]) + plane[3];
+	for (i = 0; i < vertNum && clippedNum + 2 <= shadowCLIPMAX; i += 1) {
+		j = (i + 1) % vertNum;
+		if (dist[i] >= 0.0)
+			vecCopy(3, verts[i], clipped[clippedNum++]);
+		if ((dist[i] >= 0.0) != (dist[j] >= 0.0)) {
+			t = dist[i] / (dist[i] - dist[j]);
+			vecSubtract(3, verts[j], verts[i], clipped[clippedNum]);
+			vecScale(3, t, clipped[clippedNum], clipped[clippedNum]);
+			vecAdd(3, verts[i], clipped[clippedNum], clipped[clippedNum]);
+			clippedNum += 1;
+		}
+	}
+	for (i = 0; i < clippedNum; i += 1)
+		vecCopy(3, clipped[i], verts[i]);
+	return clippedNum;
+}
+
+/* Helper function for shadowMapFit. Finds the vertices of the convex region
+where the box from lo to hi meets the planeNum half-spaces in planes (as from
+camFrustumPlanes). Each face of the region lies in one of the planes or one of
+the box's faces, so the region's vertices are found by clipping a huge square
+in each such plane against all of the others. Adds each vertex to the fit. */
+void shadowFitClippedBox(shadowFit *fit, GLdouble lo[3], GLdouble hi[3],
+		GLuint planeNum, GLdouble planes[][4]) {
+	GLdouble all[shadowCLIPMAX][4], verts[shadowCLIPMAX][3];
+	GLdouble center[3], u[3], v[3], axis[3], size;
+	GLuint i, j, k, vertNum, allNum = planeNum + 6;
+	for (i = 0; i < planeNum; i += 1)
+		vecCopy(4, planes[i], all[i]);
+	for (k = 0; k < 3; k += 1) {
+		vec4Set(all[planeNum + 2 * k], 0.0, 0.0, 0.0, -lo[k]);
+		all[planeNum + 2 * k][k] = 1.0;
+		vec4Set(all[planeNum + 2 * k + 1], 0.0, 0.0, 0.0, hi[k]);
+		all[planeNum + 2 * k + 1][k] = -1.0;
+	}
+	/* The square must reach past the box in every direction. */
+	vecSubtract(3, hi, lo, u);
+	vecAdd(3, hi, lo, v);
+	size = 4.0 * (vecLength(3, u) + vecLength(3, v)) + 1.0;
+	for (i = 0; i < allNum; i += 1) {
+		/* Build a square in plane i, centered at the plane's point nearest the
+		origin. */
+		vecScale(3, -all[i][3], all[i], center);
+		k = (fabs(all[i][0]) < fabs(all[i][1]) ? 0 : 1);
+		k = (fabs(all[i][k]) < fabs(all[i][2]) ? k : 2);
+		vec3Set(axis, 0.0, 0.0, 0.0);
+		axis[k] = 1.0;
+		vec3Cross(all[i], axis, u);
+		vecUnit(3, u, u);
+		vec3Cross(all[i], u, v);
+		vecScale(3, size, u, u);
+		vecScale(3, size, v, v);
+		vecAdd(3, center, u, verts[0]);
+		vecAdd(3, verts[0], v, verts[0]);
+		vecSubtract(3, center, u, verts[1]);
+		vecAdd(3, verts[1], v, verts[1]);
+		vecSubtract(3, center, u, verts[2]);
+		vecSubtract(3, verts[2], v, verts[2]);
+		vecAdd(3, center, u, verts[3]);
+		vecSubtract(3, verts[3], v, verts[3]);
+		vertNum = 4;
+		for (j = 0; j < allNum && vertNum > 0; j += 1)
+			if (j != i)
+				vertNum = shadowMapClipPolygon(vertNum, verts, all[j]);
+		for (j = 0; j < vertNum; j += 1)
+			shadowFitPoint(fit, verts[j]);
+	}
+}
+
+/* Helper function for shadowMapFit. Adds to the fit the parts of the nodes'
+bounding boxes that lie inside all planeNum planes. Boxes outside some plane
+are skipped, the corners of boxes inside all of them are added, and only boxes
+that straddle a plane are clipped. Returns the number of boxes that were not
+skipped. */
+GLuint shadowFitNodes(shadowFit *fit, sceneFlat *flat, GLuint planeNum,
+		GLdouble planes[][4]) {
+	GLdouble lo[3], hi[3], corner[3], dist, reach;
+	GLuint i, j, k, nodeNum = 0;
+	int straddles;
+	sceneNode *node;
+	for (i = 0; i < flat->nodeNum; i += 1) {
+		node = flat->nodes[i];
+		straddles = 0;
+		for (j = 0; j < planeNum; j += 1) {
+			dist = vecDot(3, planes[j], node->center) + planes[j][3];
+			reach = fabs(planes[j][0]) * node->halfSize[0] +
+				fabs(planes[j][1]) * node->halfSize[1] +
+				fabs(planes[j][2]) * node->halfSize[2];
+			if (dist < -reach)
+				break;
+			if (dist < reach)
+				straddles = 1;
+		}
+		if (j < planeNum)
+			continue;
+		nodeNum += 1;
+		vecSubtract(3, node->center, node->halfSize, lo);
+		vecAdd(3, node->center, node->halfSize, hi);
+		if (straddles)
+			shadowFitClippedBox(fit, lo, hi, planeNum, planes);
+		else
+			for (k = 0; k < 8; k += 1) {
+				corner[0] = (k % 2 == 0 ? lo[0] : hi[0]);
+				corner[1] = (k % 4 < 2 ? lo[1] : hi[1]);
+				corner[2] = (k < 4 ? lo[2] : hi[2]);
+				shadowFitPoint(fit, corner);
+			}
+	}
+	return nodeNum;
+}
+
+/* Helper function for shadowMapFit. Fits the receivers, the parts of the
+nodes' boxes inside the 12 planes of the viewing volume and the light's cone,
+as seen from the given rotation and the light's translation. Then pulls the
+fit's near depth in to the casters: the parts of the nodes' boxes inside the
+window that holds the receivers, no deeper than them, and no nearer than
+near. Returns the number of receivers. */
+GLuint shadowFitScene(shadowFit *fit, GLdouble rotation[3][3],
+		lightLight *light, sceneFlat *flat, GLdouble planes[12][4],
+		GLdouble near) {
+	shadowFit casters;
+	camCamera window;
+	GLdouble windowPlanes[6][4], tanFit;
+	GLuint receiverNum;
+	shadowFitBegin(fit, rotation, light->translation);
+	receiverNum = shadowFitNodes(fit, flat, 12, planes);
+	if (receiverNum == 0 || fit->whole)
+		return receiverNum;
+	tanFit = shadowFitTan(fit);
+	shadowLightCamera(&window, rotation, light->translation, 2.0 * atan(tanFit),
+		-fit->maxDepth, near);
+	camFrustumPlanes(&window, windowPlanes);
+	shadowFitBegin(&casters, rotation, light->translation);
+	if (shadowFitNodes(&casters, flat, 6, windowPlanes) > 0)
+		fit->minDepth = fmin(fit->minDepth, casters.minDepth);
+	return receiverNum;
+}
+
+/* Like shadowMapUpdate, but fits the camera to the receivers that matter: the
+parts of the nodes' bounding boxes (from the last sceneFlatUpdate) that lie in
+both the viewing volume of cam and the light's cone. The camera stays at the
+light, but turns to aim at the middle of the receivers, and its field of view
+is narrowed to them. Its far plane is pulled in to them, and its near plane is
+pushed out to the nearest caster, clipped by its box, in front of them. far
+and near are the loosest planes allowed. The region of the textures shrinks
+with the field of view, keeping the texels' angular size. To keep the static
+layer valid while things move, the fit is padded a little, and kept as long
+as the receivers and casters still lie inside it and it is not much too loose.
+If the bounds of some node are unknown, then the camera covers the whole
+cone. */
+void shadowMapFit(shadowMap *map, lightLight *light, camCamera *cam,
+		sceneFlat *flat, GLdouble far, GLdouble near) {
+	GLdouble planes[12][4], local[3], up[3], axes[3][3], aim[3][3];
+	GLdouble rotation[3][3], tanSpot = tan(light->spotAngle * 0.5), tanFit;
+	GLdouble spread;
+	GLuint i, receiverNum;
+	shadowFit fit, aimed;
+	camCamera cone;
+	for (i = 0; i < flat->nodeNum; i += 1)
+		if (flat->nodes[i]->radius < 0.0) {
+			shadowMapUpdate(map, light, far, near);
+			return;
+		}
+	/* The planes of the viewing volume and of the light's whole cone. */
+	shadowLightCamera(&cone, light->rotation, light->translation,
+		light->spotAngle, far, near);
+	camFrustumPlanes(cam, planes);
+	camFrustumPlanes(&cone, &planes[6]);
+	/* Keep the last fit if it still holds, so that the static layer stays
+	valid. */
+	if (map->fitTan != 0.0 &&
+			memcmp(map->fitLight, light->rotation, 9 * sizeof(GLdouble)) == 0 &&
+			memcmp(map->translation, light->translation,
+				3 * sizeof(GLdouble)) == 0) {
+		receiverNum = shadowFitScene(&fit, map->rotation, light, flat, planes,
+			near);
+		if (receiverNum == 0)
+			return;
+		/* A fit that has drifted off the axis could be re-aimed, so judge
+		its size by its extent rather than by its reach from the axis. */
+		tanFit = fmin(shadowFitTan(&fit), tanSpot);
+		spread = 0.5 * fmax(fit.hi[0] - fit.lo[0], fit.hi[1] - fit.lo[1]);
+		if (!fit.whole && tanFit <= map->fitTan &&
+				spread >= 0.7 * map->fitTan &&
+				fmax(fit.minDepth, -near) >= map->fitNear &&
+				fmax(fit.minDepth, -near) <= 2.0 * map->fitNear &&
+				fmin(fit.maxDepth, -far) <= map->fitFar)
+			return;
+	}
+	/* Fit along the light's axis, then aim at the middle of the receivers and
+	fit again. Keep whichever window is narrower. */
+	receiverNum = shadowFitScene(&fit, light->rotation, light, flat, planes,
+		near);
+	if (receiverNum == 0 || fit.whole) {
+		if (receiverNum > 0 || map->fitTan == 0.0)
+			shadowMapUpdate(map, light, far, near);
+		return;
+	}
+	vec3Set(local, -0.5 * (fit.lo[0] + fit.hi[0]),
+		-0.5 * (fit.lo[1] + fit.hi[1]), 1.0);
+	vecUnit(3, local, axes[2]);
+	vec3Set(up, 0.0, 1.0, 0.0);
+	vec3Cross(up, axes[2], axes[0]);
+	vecUnit(3, axes[0], axes[0]);
+	vec3Cross(axes[2], axes[0], axes[1]);
+	mat33Columns(axes[0], axes[1], axes[2], aim);
+	mat333Multiply(light->rotation, aim, rotation);
+	shadowFitScene(&aimed, rotation, light, flat, planes, near);
+	if (aimed.whole || shadowFitTan(&aimed) >= shadowFitTan(&fit))
+		mat33Copy(light->rotation, rotation);
+	else
+		fit = aimed;
+	/* Pad the new fit. */
+	mat33Copy(light->rotation, map->fitLight);
+	map->fitTan = fmin(1.1 * shadowFitTan(&fit), tanSpot);
+	map->fitNear = fmax(0.9 * fit.minDepth, -near);
+	map->fitFar = fmin(1.1 * fit.maxDepth, -far);
+	/* Round the region up to a multiple of 16 texels. */
+	GLuint regionWidth = (GLuint)ceil(map->width * map->fitTan / tanSpot);
+	GLuint regionHeight = (GLuint)ceil(map->height * map->fitTan / tanSpot);
+	regionWidth = (regionWidth + 15) / 16 * 16;
+	regionHeight = (regionHeight + 15) / 16 * 16;
+	shadowMapSetCamera(map, rotation, light->translation,
+		2.0 * atan(map->fitTan), -map->fitFar, -map->fitNear,
+		(regionWidth < map->width ? regionWidth : map->width),
+		(regionHeight < map->height ? regionHeight : map->height));
+}
+
+/* Helper function for the functions below. Binds the framebuffer object and
+sets up the program and polygon offset for depth rendering. */
+void shadowMapBegin(shadowMap *map, shadowProgram *prog, GLuint fbo) {
+	glViewport(0, 0, map->regionWidth, map->regionHeight);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glUseProgram(prog->program);
 	camRender(&(map->camera), prog->viewingLoc);
 	/* Use OpenGL's polygon offset feature to push the depth values slightly
 	away from the light. This prevents a lit triangle from fighting with itself
@@ -150,14 +771,52 @@ void shadowMapRender(shadowMap *map, shadowProgram *prog, lightLight *light,
 	it assumes closed surfaces, and we don't seem to need it right now. */
 }
 
+/* If the static layer is stale, then prepares it for rendering into it and
+returns 1. The application should then draw its static casters and call
+shadowMapUnrender. Otherwise, returns 0, and nothing needs to be drawn. */
+int shadowMapStaticRender(shadowMap *map, shadowProgram *prog) {
+	if (map->staticValid)
+		return 0;
+	shadowMapBegin(map, prog, map->staticFbo);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	map->staticValid = 1;
+	return 1;
+}
+
+/* Prepares a shadow map for rendering into it. If the static layer is valid,
+then the shadow map starts as a copy of it, and only the dynamic casters need
+to be drawn. Otherwise, the shadow map starts empty. */
+void shadowMapRender(shadowMap *map, shadowProgram *prog) {
+	if (map->staticValid) {
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, map->staticFbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, map->fbo);
+		glBlitFramebuffer(0, 0, map->regionWidth, map->regionHeight, 0, 0,
+			map->regionWidth, map->regionHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+		shadowMapBegin(map, prog, map->fbo);
+	} else {
+		shadowMapBegin(map, prog, map->fbo);
+		glClear(GL_DEPTH_BUFFER_BIT);
+	}
+}
+
 void shadowMapUnrender() {
 	glDisable(GL_POLYGON_OFFSET_FILL);
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
+/* Loads viewingLoc with the shadow map's camera's P C^-1, followed by the
+scaling that maps its viewing volume onto the region of the texture in use
+(which is the identity when the whole texture is in use). Binds the texture. */
 void shadowRender(shadowMap *map, GLint viewingLoc, GLenum textureUnit,
 		GLint textureUnitIndex, GLint textureLoc) {
-	camRender(&(map->camera), viewingLoc);
+	GLdouble projCamInv[4][4], region[4][4], viewing[4][4];
+	GLfloat viewingGL[4][4];
+	shadowRegionMatrix(0, 0, map->regionWidth, map->regionHeight, map->width,
+		map->height, region);
+	camViewingMatrix(&(map->camera), projCamInv);
+	mat444Multiply(region, projCamInv, viewing);
+	mat44OpenGL(viewing, viewingGL);
+	glUniformMatrix4fv(viewingLoc, 1, GL_FALSE, (GLfloat *)viewingGL);
 	glActiveTexture(textureUnit);
     glEnable(GL_TEXTURE_2D);
     glBindTexture(GL_TEXTURE_2D, map->texture);
@@ -169,3 +828,398 @@ void shadowUnrender(GLenum textureUnit) {
     glDisable(GL_TEXTURE_2D);
     glBindTexture(GL_TEXTURE_2D, 0);
 }
+
+
+
+/*** Shadow atlas ***/
+
+/* A shadow atlas serves several spot lights from one depth texture, instead
+of one shadow map per light. Each frame, shadowAtlasUpdate divides the texture
+into square regions, one per light, sized by how much of the screen the light
+can affect: a bright light near the viewer gets a big region, and a light whose
+reach is off screen gets none. Then one pass of a program from
+shadowProgramInitializeAtlas draws every caster into every region that it
+falls in, so that N lights cost one pass over the scene rather than N. The
+lighting shader indexes into the atlas with one matrix per light, from
+shadowRenderAtlas. Lights other than spot lights get no region. */
+
+/* The smallest region, in texels, and the attenuation below which a light is
+considered out of reach. */
+#define shadowATLASMIN 64
+#define shadowATLASCUTOFF (1.0 / 256.0)
+
+/* Feel free to read from this struct's members, but don't alter them. */
+typedef struct shadowAtlas shadowAtlas;
+struct shadowAtlas {
+	GLuint size;
+	GLuint texture, fbo;
+	GLuint lightNum;
+	camCamera cameras[shadowATLASMAX];
+	/* Each light's region, as the x and y of its lower-left corner and its
+	side, in texels. A side of 0 means that the light has no region. */
+	GLuint regions[shadowATLASMAX][3];
+	GLdouble importance[shadowATLASMAX];
+};
+
+/* The size (the width and height) must be a power of 2. Returns 0 on success,
+non-zero on failure. On success, the user must call shadowAtlasDestroy when
+finished with the atlas. */
+int shadowAtlasInitialize(shadowAtlas *atlas, GLuint size) {
+	atlas->size = size;
+	atlas->lightNum = 0;
+	return shadowMapInitializeTarget(size, size, &(atlas->texture),
+		&(atlas->fbo));
+}
+
+/* Deallocates the resources backing the atlas. */
+void shadowAtlasDestroy(shadowAtlas *atlas) {
+	glDeleteTextures(1, &(atlas->texture));
+	glDeleteFramebuffers(1, &(atlas->fbo));
+}
+
+/* Helper function for shadowAtlasUpdate. Estimates the fraction of the screen
+that the light can affect: the screen area of the sphere that it reaches,
+weighted by its brightness. Returns 0 if that sphere is outside cam's viewing
+volume. */
+GLdouble shadowAtlasImportance(lightLight *light, GLdouble range,
+		camCamera *cam) {
+	GLdouble planes[6][4], halfSize[3], diff[3], dist, coverage;
+	camFrustumPlanes(cam, planes);
+	vec3Set(halfSize, range, range, range);
+	if (!camFrustumContains(planes, light->translation, range, halfSize))
+		return 0.0;
+	/* Compare the sphere's angular or actual radius to the screen's. */
+	if (cam->projectionType == camPERSPECTIVE) {
+		vecSubtract(3, light->translation, cam->translation, diff);
+		dist = vecLength(3, diff);
+		coverage = (dist <= range ? 1.0 : range / dist) *
+			-cam->projection[camPROJN] / cam->projection[camPROJT];
+	} else
+		coverage = range / cam->projection[camPROJT];
+	coverage = fmin(coverage, 1.0);
+	return coverage * coverage * fmax(light->color[0],
+		fmax(light->color[1], light->color[2]));
+}
+
+/* Configures the atlas for the given lights (at most shadowATLASMAX), as seen
+by cam, and lays out their regions. Each light's camera covers its whole cone,
+between near and the nearer of far and the light's reach (negative numbers, as
+in camSetFrustum). The regions are powers of 2 in size, with areas roughly
+proportional to the lights' importance, and are packed in Morton order from
+the largest down, so that they never overlap. Call this function before
+shadowAtlasRender. Returns 0 on success, or non-zero if there are too many
+lights. */
+int shadowAtlasUpdate(shadowAtlas *atlas, GLuint lightNum,
+		lightLight *lights[], camCamera *cam, GLdouble far, GLdouble near) {
+	GLuint i, j, order[shadowATLASMAX], side, largest, area, offset, cell, bit;
+	GLdouble range, total = 0.0;
+	if (lightNum > shadowATLASMAX) {
+		fprintf(stderr, "shadowAtlasUpdate: more than %d lights.\n",
+			shadowATLASMAX);
+		return 1;
+	}
+	atlas->lightNum = lightNum;
+	for (i = 0; i < lightNum; i += 1) {
+		atlas->importance[i] = 0.0;
+		if (lights[i]->lightType != lightSPOT)
+			continue;
+		range = lightRange(lights[i], shadowATLASCUTOFF);
+		if (range < 0.0 || range > -far)
+			range = -far;
+		shadowLightCamera(&(atlas->cameras[i]), lights[i]->rotation,
+			lights[i]->translation, lights[i]->spotAngle, -range, near);
+		atlas->importance[i] = shadowAtlasImportance(lights[i], range, cam);
+		total += atlas->importance[i];
+	}
+	/* Size the regions. While they don't fit, halve the largest. */
+	area = 0;
+	for (i = 0; i < lightNum; i += 1) {
+		atlas->regions[i][2] = 0;
+		if (atlas->importance[i] <= 0.0)
+			continue;
+		side = shadowATLASMIN;
+		while (side < atlas->size &&
+				2 * side <= atlas->size * sqrt(atlas->importance[i] / total))
+			side *= 2;
+		atlas->regions[i][2] = side;
+		area += side * side;
+	}
+	while (area > atlas->size * atlas->size) {
+		largest = 0;
+		for (i = 1; i < lightNum; i += 1)
+			if (atlas->regions[i][2] > atlas->regions[largest][2])
+				largest = i;
+		side = atlas->regions[largest][2];
+		if (side <= shadowATLASMIN)
+			break;
+		atlas->regions[largest][2] = side / 2;
+		area -= side * side - side * side / 4;
+	}
+	/* Sort the lights from largest region to smallest. */
+	for (i = 0; i < lightNum; i += 1) {
+		for (j = i; j > 0 &&
+				atlas->regions[order[j - 1]][2] < atlas->regions[i][2]; j -= 1)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+	/* Squares whose sides are powers of 2, placed in decreasing order at
+	consecutive Morton offsets, are always aligned to their own size. */
+	offset = 0;
+	for (j = 0; j < lightNum; j += 1) {
+		i = order[j];
+		side = atlas->regions[i][2];
+		if (side == 0)
+			continue;
+		if (offset + side * side > atlas->size * atlas->size) {
+			atlas->regions[i][2] = 0;
+			continue;
+		}
+		atlas->regions[i][0] = 0;
+		atlas->regions[i][1] = 0;
+		cell = offset / (shadowATLASMIN * shadowATLASMIN);
+		for (bit = 0; (cell >> (2 * bit)) != 0; bit += 1) {
+			atlas->regions[i][0] |= ((cell >> (2 * bit)) & 1) << bit;
+			atlas->regions[i][1] |= ((cell >> (2 * bit + 1)) & 1) << bit;
+		}
+		atlas->regions[i][0] *= shadowATLASMIN;
+		atlas->regions[i][1] *= shadowATLASMIN;
+		offset += side * side;
+	}
+	return 0;
+}
+
+/* Prepares the atlas for rendering into it with a program from
+shadowProgramInitializeAtlas, and clears it. The application should then draw
+all of its shadow casters once, and call shadowAtlasUnrender. */
+void shadowAtlasRender(shadowAtlas *atlas, shadowProgram *prog) {
+	GLdouble projCamInv[4][4];
+	GLfloat viewings[shadowATLASMAX][4][4], regions[shadowATLASMAX][4];
+	GLuint i, k;
+	for (i = 0; i < atlas->lightNum; i += 1) {
+		GLuint side = atlas->regions[i][2];
+		if (side == 0) {
+			/* The geometry shader skips lights whose scale is 0. */
+			mat44Identity(projCamInv);
+			mat44OpenGL(projCamInv, viewings[i]);
+			for (k = 0; k < 4; k += 1)
+				regions[i][k] = 0.0f;
+			continue;
+		}
+		camViewingMatrix(&(atlas->cameras[i]), projCamInv);
+		mat44OpenGL(projCamInv, viewings[i]);
+		regions[i][0] = (GLfloat)side / atlas->size;
+		regions[i][1] = (GLfloat)side / atlas->size;
+		regions[i][2] = (2.0 * atlas->regions[i][0] + side) / atlas->size - 1.0;
+		regions[i][3] = (2.0 * atlas->regions[i][1] + side) / atlas->size - 1.0;
+	}
+	glViewport(0, 0, atlas->size, atlas->size);
+	glBindFramebuffer(GL_FRAMEBUFFER, atlas->fbo);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glUseProgram(prog->program);
+	glUniform1i(prog->lightNumLoc, atlas->lightNum);
+	glUniformMatrix4fv(prog->viewingsLoc, atlas->lightNum, GL_FALSE,
+		(GLfloat *)viewings);
+	glUniform4fv(prog->regionsLoc, atlas->lightNum, (GLfloat *)regions);
+	for (k = 0; k < 4; k += 1)
+		glEnable(GL_CLIP_DISTANCE0 + k);
+	/* The same polygon offset as in shadowMapBegin. */
+	glEnable(GL_POLYGON_OFFSET_FILL);
+	glPolygonOffset(2.0, 4.0);
+}
+
+void shadowAtlasUnrender() {
+	GLuint k;
+	for (k = 0; k < 4; k += 1)
+		glDisable(GL_CLIP_DISTANCE0 + k);
+	shadowMapUnrender();
+}
+
+/* Loads viewingLocs[i] with the matrix that takes world coordinates to the
+ith light's region of the atlas, in the manner of shadowRender, for each light
+of the last shadowAtlasUpdate. A light without a region gets a matrix that puts
+every point at depth 0, so that it is always lit. Binds the texture. */
+void shadowRenderAtlas(shadowAtlas *atlas, GLint viewingLocs[],
+		GLenum textureUnit, GLint textureUnitIndex, GLint textureLoc) {
+	GLdouble projCamInv[4][4], region[4][4], viewing[4][4];
+	GLfloat viewingGL[4][4];
+	GLuint i;
+	for (i = 0; i < atlas->lightNum; i += 1) {
+		if (atlas->regions[i][2] == 0) {
+			mat44Identity(viewing);
+			viewing[0][0] = 0.0;
+			viewing[1][1] = 0.0;
+			viewing[2][2] = 0.0;
+			viewing[2][3] = -1.0;
+		} else {
+			shadowRegionMatrix(atlas->regions[i][0], atlas->regions[i][1],
+				atlas->regions[i][2], atlas->regions[i][2], atlas->size,
+				atlas->size, region);
+			camViewingMatrix(&(atlas->cameras[i]), projCamInv);
+			mat444Multiply(region, projCamInv, viewing);
+		}
+		mat44OpenGL(viewing, viewingGL);
+		glUniformMatrix4fv(viewingLocs[i], 1, GL_FALSE, (GLfloat *)viewingGL);
+	}
+	glActiveTexture(textureUnit);
+	glBindTexture(GL_TEXTURE_2D, atlas->texture);
+	glUniform1i(textureLoc, textureUnitIndex);
+}
+
+void shadowUnrenderAtlas(GLenum textureUnit) {
+	glActiveTexture(textureUnit);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+
+/*** Shadow cube ***/
+
+/* An omnidirectional light sees in every direction, so its shadows are kept
+in a cube map with one depth face per axis direction. The six faces are drawn
+in one pass over the scene, with a program from shadowProgramInitializeCube,
+whose geometry shader sends each triangle to the faces that can see it. Each
+texel holds the distance from the light to the nearest caster, divided by the
+far distance. The lighting shader looks up the cube in the direction from the
+light to the fragment, with the fragment's own scaled distance as the
+reference, in a samplerCubeShadow. */
+
+/* Feel free to read from this struct's members, but don't alter them. */
+typedef struct shadowCube shadowCube;
+struct shadowCube {
+	GLuint size;
+	GLuint texture, fbo;
+	/* One camera per face, in the order of GL_TEXTURE_CUBE_MAP_POSITIVE_X
+	and so on, and their common far distance. */
+	camCamera cameras[6];
+	GLdouble far;
+};
+
+/* The size (the width and height of each face) must be a power of 2. Returns
+0 on success, non-zero on failure. On success, the user must call
+shadowCubeDestroy when finished with the cube. */
+int shadowCubeInitialize(shadowCube *cube, GLuint size) {
+	GLuint face;
+	cube->size = size;
+	cube->far = 1.0;
+	glGenTextures(1, &(cube->texture));
+	glBindTexture(GL_TEXTURE_CUBE_MAP, cube->texture);
+	for (face = 0; face < 6; face += 1)
+		glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, 0,
+			GL_DEPTH_COMPONENT32, size, size, 0, GL_DEPTH_COMPONENT, GL_FLOAT,
+			NULL);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_MODE,
+		GL_COMPARE_REF_TO_TEXTURE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+	/* Filter across the seams between faces. */
+	glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+	/* Attaching the whole cube makes the framebuffer layered, so that
+	gl_Layer picks the face. */
+	glGenFramebuffers(1, &(cube->fbo));
+	glBindFramebuffer(GL_FRAMEBUFFER, cube->fbo);
+	glFramebufferTexture(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, cube->texture, 0);
+	glDrawBuffer(GL_NONE);
+	glReadBuffer(GL_NONE);
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		fprintf(stderr,
+			"shadowCubeInitialize: glCheckFramebufferStatus: %d\n", status);
+		glDeleteTextures(1, &(cube->texture));
+		glDeleteFramebuffers(1, &(cube->fbo));
+		return 1;
+	}
+	return 0;
+}
+
+/* Deallocates the resources backing the cube. */
+void shadowCubeDestroy(shadowCube *cube) {
+	glDeleteTextures(1, &(cube->texture));
+	glDeleteFramebuffers(1, &(cube->fbo));
+}
+
+/* Configures the cube's six cameras to look from the light along the positive
+and negative axes, each with a 90-degree field of view, between the given far
+and near planes (negative numbers, as in camSetFrustum). The faces' up
+directions follow OpenGL's cube map conventions. Call this function before
+shadowCubeRender. */
+void shadowCubeUpdate(shadowCube *cube, lightLight *light, GLdouble far,
+		GLdouble near) {
+	/* The forward and up directions of the faces. */
+	GLdouble forwards[6][3] = {
+		{1.0, 0.0, 0.0}, {-1.0, 0.0, 0.0}, {0.0, 1.0, 0.0},
+		{0.0, -1.0, 0.0}, {0.0, 0.0, 1.0}, {0.0, 0.0, -1.0}};
+	GLdouble ups[6][3] = {
+		{0.0, -1.0, 0.0}, {0.0, -1.0, 0.0}, {0.0, 0.0, 1.0},
+		{0.0, 0.0, -1.0}, {0.0, -1.0, 0.0}, {0.0, -1.0, 0.0}};
+	GLdouble rotation[3][3], back[3], right[3];
+	GLuint face, i;
+	cube->far = -far;
+	for (face = 0; face < 6; face += 1) {
+		/* The camera looks down its negative z-axis, with y up. */
+		vecScale(3, -1.0, forwards[face], back);
+		vec3Cross(ups[face], back, right);
+		for (i = 0; i < 3; i += 1) {
+			rotation[i][0] = right[i];
+			rotation[i][1] = ups[face][i];
+			rotation[i][2] = back[i];
+		}
+		shadowLightCamera(&(cube->cameras[face]), rotation, light->translation,
+			M_PI / 2.0, far, near);
+	}
+}
+
+/* Computes the six planes (as from camFrustumPlanes) of the box that contains
+all six faces' viewing volumes, for culling the casters of the cube's pass. */
+void shadowCubePlanes(shadowCube *cube, GLdouble planes[6][4]) {
+	GLdouble *center = cube->cameras[0].translation;
+	GLuint k;
+	for (k = 0; k < 3; k += 1) {
+		vec4Set(planes[2 * k], 0.0, 0.0, 0.0, cube->far - center[k]);
+		planes[2 * k][k] = 1.0;
+		vec4Set(planes[2 * k + 1], 0.0, 0.0, 0.0, cube->far + center[k]);
+		planes[2 * k + 1][k] = -1.0;
+	}
+}
+
+/* Prepares the cube for rendering into all six faces with a program from
+shadowProgramInitializeCube, and clears it. The application should then draw
+its shadow casters once, and call shadowMapUnrender. Because the program
+writes its own depths, polygon offset does not apply; the lighting shader
+should subtract a small bias from its reference distance instead. */
+void shadowCubeRender(shadowCube *cube, shadowProgram *prog) {
+	GLdouble projCamInvs[6][4][4];
+	GLfloat viewings[6][4][4], position[3];
+	GLuint face;
+	for (face = 0; face < 6; face += 1)
+		camViewingMatrix(&(cube->cameras[face]), projCamInvs[face]);
+	mat44OpenGLBatch(6, projCamInvs, viewings);
+	vecOpenGL(3, cube->cameras[0].translation, position);
+	glViewport(0, 0, cube->size, cube->size);
+	glBindFramebuffer(GL_FRAMEBUFFER, cube->fbo);
+	glClear(GL_DEPTH_BUFFER_BIT);
+	glUseProgram(prog->program);
+	glUniformMatrix4fv(prog->viewingsLoc, 6, GL_FALSE, (GLfloat *)viewings);
+	glUniform3fv(prog->lightPosLoc, 1, position);
+	glUniform1f(prog->farLoc, cube->far);
+}
+
+/* Loads farLoc with the cube's far distance, by which the lighting shader
+divides its distances from the light, and binds the cube's texture. */
+void shadowRenderCube(shadowCube *cube, GLint farLoc, GLenum textureUnit,
+		GLint textureUnitIndex, GLint textureLoc) {
+	glUniform1f(farLoc, cube->far);
+	glActiveTexture(textureUnit);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, cube->texture);
+	glUniform1i(textureLoc, textureUnitIndex);
+}
+
+void shadowUnrenderCube(GLenum textureUnit) {
+	glActiveTexture(textureUnit);
+	glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+}
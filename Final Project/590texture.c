@@ -4,22 +4,29 @@
 #define STBI_FAILURE_USERMSG
 
 /* Feel free to read from this struct's members, but don't write to them except
-through the accessor functions. */
+through the accessor functions. target is GL_TEXTURE_2D, or GL_TEXTURE_2D_ARRAY
+for a texture array of layerNum layers. renderNum counts the calls to
+texRender, so that a memory budget can tell which textures are in use. */
 typedef struct texTexture texTexture;
 struct texTexture {
 	GLuint width, height, texelDim;
 	GLuint openGL;
+	GLenum target;
+	GLuint layerNum;
+	GLuint renderNum;
 };
 
-/* minification and magnification should be GL_NEAREST or GL_LINEAR. leftRight
-and bottomTop should be one of GL_CLAMP, GL_REPEAT, etc. */
+/* minification and magnification should be GL_NEAREST or GL_LINEAR, although
+minification may also be a mipmapping filter such as GL_LINEAR_MIPMAP_LINEAR
+if the texture has mipmaps. leftRight and bottomTop should be one of GL_CLAMP,
+GL_REPEAT, etc. */
 void texSetFilteringBorder(texTexture *tex, GLint minification,
 		GLint magnification, GLint leftRight, GLint bottomTop) {
-	glBindTexture(GL_TEXTURE_2D, tex->openGL);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minification);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, magnification);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, leftRight);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, bottomTop);
+	glBindTexture(tex->target, tex->openGL);
+	glTexParameteri(tex->target, GL_TEXTURE_MIN_FILTER, minification);
+	glTexParameteri(tex->target, GL_TEXTURE_MAG_FILTER, magnification);
+	glTexParameteri(tex->target, GL_TEXTURE_WRAP_S, leftRight);
+	glTexParameteri(tex->target, GL_TEXTURE_WRAP_T, bottomTop);
 }
 
 /* Loads the given image file into an OpenGL texture. The width and height of
@@ -45,10 +52,16 @@ int texInitializeFile(texTexture *tex, char *path, GLint minification,
 		fprintf(stderr, "texInitializeFile: %d != 3 channels.\n", texelDim);
 		return 2;
 	}
-	/* Load the data into OpenGL. */
+	/* Load the data into OpenGL. The rows of a 3-channel image are not padded
+to multiples of 4 bytes, as OpenGL assumes by default. */
 	glGenTextures(1, &(tex->openGL));
+	tex->target = GL_TEXTURE_2D;
+	tex->layerNum = 1;
+	tex->renderNum = 0;
 	texSetFilteringBorder(tex, minification, magnification, leftRight, bottomTop);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
 	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, rawData);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
 	stbi_image_free(rawData);
 	if (glGetError() != GL_NO_ERROR) {
 		fprintf(stderr, "texInitializeFile: OpenGL error.\n");
@@ -74,8 +87,9 @@ void texRender(texTexture *tex, GLenum textureUnit, GLint textureUnitIndex,
 		GLint textureLoc) {
 		glActiveTexture(textureUnit);
     glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, tex->openGL);
+    glBindTexture(tex->target, tex->openGL);
     glUniform1i(textureLoc, textureUnitIndex);
+	tex->renderNum += 1;
 }
 
 /* At the end of rendering a frame, the renderer calls this function, to unhook
@@ -84,5 +98,1089 @@ GL_TEXTURE0. */
 void texUnrender(texTexture *tex, GLenum textureUnit) {
 		glActiveTexture(textureUnit);
     glDisable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    glBindTexture(tex->target, 0);
+}
+
+
+/*** Memory ***/
+
+/* Returns the number of mipmap levels that the texture holds. */
+GLuint texLevelNum(texTexture *tex) {
+	GLint width, maxLevel;
+	GLuint levelNum = 0;
+	glBindTexture(tex->target, tex->openGL);
+	glGetTexParameteriv(tex->target, GL_TEXTURE_MAX_LEVEL, &maxLevel);
+	while ((GLint)levelNum <= maxLevel) {
+		glGetTexLevelParameteriv(tex->target, levelNum, GL_TEXTURE_WIDTH,
+			&width);
+		if (width == 0)
+			break;
+		levelNum += 1;
+	}
+	glBindTexture(tex->target, 0);
+	return levelNum;
+}
+
+/* Returns the number of bytes of GPU memory that the texture occupies, summed
+over its mipmap levels and layers. For an uncompressed texture, this is only
+an estimate, which assumes that OpenGL pads each RGB texel to 4 bytes, as most
+drivers do. */
+GLsizeiptr texMemorySize(texTexture *tex) {
+	GLint width, height, depth, compressed, size;
+	GLuint level, levelNum = texLevelNum(tex);
+	GLsizeiptr total = 0;
+	glBindTexture(tex->target, tex->openGL);
+	for (level = 0; level < levelNum; level += 1) {
+		glGetTexLevelParameteriv(tex->target, level, GL_TEXTURE_COMPRESSED,
+			&compressed);
+		if (compressed) {
+			glGetTexLevelParameteriv(tex->target, level,
+				GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+			total += size;
+		} else {
+			glGetTexLevelParameteriv(tex->target, level, GL_TEXTURE_WIDTH,
+				&width);
+			glGetTexLevelParameteriv(tex->target, level, GL_TEXTURE_HEIGHT,
+				&height);
+			glGetTexLevelParameteriv(tex->target, level, GL_TEXTURE_DEPTH,
+				&depth);
+			total += (GLsizeiptr)width * height * depth * 4;
+		}
+	}
+	glBindTexture(tex->target, 0);
+	return total;
+}
+
+/* Frees the texture's largest mipmap level, so that the next level down
+becomes level 0 and the texture shrinks to about a quarter of its memory. The
+texture keeps its filtering and wrapping, but gets a new OpenGL name, since
+OpenGL cannot shrink a texture in place; so do not call this function while
+the texture is bound, or while a texture loader still owes it an image. The
+levels make a round trip through CPU memory, which is slow, but this function
+is meant for rare moments of memory pressure. Returns 0 on success, non-zero
+on failure (in particular, if the texture has only one level), in which case
+the texture is unchanged. */
+int texDropLevel(texTexture *tex) {
+	GLint params[4], format, compressed, width, height, depth, size;
+	GLuint level, levelNum = texLevelNum(tex), openGL;
+	GLubyte *data;
+	if (levelNum < 2)
+		return 1;
+	glGenTextures(1, &openGL);
+	glBindTexture(tex->target, tex->openGL);
+	glGetTexParameteriv(tex->target, GL_TEXTURE_MIN_FILTER, &params[0]);
+	glGetTexParameteriv(tex->target, GL_TEXTURE_MAG_FILTER, &params[1]);
+	glGetTexParameteriv(tex->target, GL_TEXTURE_WRAP_S, &params[2]);
+	glGetTexParameteriv(tex->target, GL_TEXTURE_WRAP_T, &params[3]);
+	glGetTexLevelParameteriv(tex->target, 0, GL_TEXTURE_INTERNAL_FORMAT,
+		&format);
+	glGetTexLevelParameteriv(tex->target, 0, GL_TEXTURE_COMPRESSED,
+		&compressed);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	for (level = 1; level < levelNum; level += 1) {
+		glBindTexture(tex->target, tex->openGL);
+		glGetTexLevelParameteriv(tex->target, level, GL_TEXTURE_WIDTH, &width);
+		glGetTexLevelParameteriv(tex->target, level, GL_TEXTURE_HEIGHT,
+			&height);
+		glGetTexLevelParameteriv(tex->target, level, GL_TEXTURE_DEPTH, &depth);
+		if (compressed)
+			glGetTexLevelParameteriv(tex->target, level,
+				GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &size);
+		else
+			size = width * height * depth * 3;
+		data = (GLubyte *)malloc(size);
+		if (data == NULL) {
+			fprintf(stderr, "texDropLevel: malloc failed.\n");
+			break;
+		}
+		if (compressed)
+			glGetCompressedTexImage(tex->target, level, data);
+		else
+			glGetTexImage(tex->target, level, GL_RGB, GL_UNSIGNED_BYTE, data);
+		glBindTexture(tex->target, openGL);
+		if (tex->target == GL_TEXTURE_2D_ARRAY && compressed)
+			glCompressedTexImage3D(tex->target, level - 1, format, width,
+				height, depth, 0, size, data);
+		else if (tex->target == GL_TEXTURE_2D_ARRAY)
+			glTexImage3D(tex->target, level - 1, format, width, height, depth,
+				0, GL_RGB, GL_UNSIGNED_BYTE, data);
+		else if (compressed)
+			glCompressedTexImage2D(tex->target, level - 1, format, width,
+				height, 0, size, data);
+		else
+			glTexImage2D(tex->target, level - 1, format, width, height, 0,
+				GL_RGB, GL_UNSIGNED_BYTE, data);
+		free(data);
+	}
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	/* Check that the new texture got its smallest level. */
+	glBindTexture(tex->target, openGL);
+	width = 0;
+	if (level == levelNum)
+		glGetTexLevelParameteriv(tex->target, levelNum - 2, GL_TEXTURE_WIDTH,
+			&width);
+	if (width == 0) {
+		fprintf(stderr, "texDropLevel: could not copy the levels.\n");
+		glBindTexture(tex->target, 0);
+		glDeleteTextures(1, &openGL);
+		return 2;
+	}
+	glTexParameteri(tex->target, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(tex->target, GL_TEXTURE_MAX_LEVEL, levelNum - 2);
+	glDeleteTextures(1, &(tex->openGL));
+	tex->openGL = openGL;
+	texSetFilteringBorder(tex, params[0], params[1], params[2], params[3]);
+	glBindTexture(tex->target, 0);
+	tex->width = (tex->width > 1 ? tex->width / 2 : 1);
+	tex->height = (tex->height > 1 ? tex->height / 2 : 1);
+	return 0;
+}
+
+
+/*** Compressed mipmap cache ***/
+
+/* Decoding a large JPEG takes far longer than uploading it, and a texture
+without mipmaps samples poorly when minified. So texCacheLoad builds, from an
+image file, a full chain of mipmaps compressed to BC1 (also called DXT1), which
+stores each 4x4 block of texels in 8 bytes. The result is saved beside the
+image, in a file with the extension .texcache, stamped with a hash of the
+image file's bytes. On later runs, if the hash still matches, the cache file is
+mapped into memory and handed to OpenGL as it is, with no decoding at all. BC1
+has no alpha, which suits the RGB images that this module supports. */
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+#define texCACHEMAGIC 0x31435854
+#define texCACHEVERSION 1
+#define texCACHEHEADER 8
+#define texLEVELMAX 16
+
+/* Feel free to read from this struct's members, but don't write to them. The
+levels are stored from largest to smallest, level i at data + offsets[i]. */
+typedef struct texCache texCache;
+struct texCache {
+	GLuint width, height, levelNum;
+	const GLubyte *data;
+	GLsizeiptr size, offsets[texLEVELMAX];
+	/* Where the levels live: either a mapping of the cache file or memory
+	from malloc. */
+	void *base;
+	size_t baseSize;
+	int mapped;
+};
+
+/* Returns 1 if the OpenGL implementation accepts BC1 textures, 0 if not. */
+int texCompressionIsSupported(void) {
+	GLint formatNum, i, found = 0;
+	glGetIntegerv(GL_NUM_COMPRESSED_TEXTURE_FORMATS, &formatNum);
+	GLint *formats = (GLint *)malloc(formatNum * sizeof(GLint) + 1);
+	if (formats == NULL)
+		return 0;
+	glGetIntegerv(GL_COMPRESSED_TEXTURE_FORMATS, formats);
+	for (i = 0; i < formatNum; i += 1)
+		if (formats[i] == GL_COMPRESSED_RGB_S3TC_DXT1_EXT)
+			found = 1;
+	free(formats);
+	return found;
+}
+
+/* Returns the 64-bit FNV-1a hash of the bytes. */
+GLuint64 texHash(const GLubyte *bytes, size_t size) {
+	GLuint64 hash = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < size; i += 1)
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	return hash;
+}
+
+/* Returns the number of bytes in a BC1 image of the given size. */
+GLsizeiptr texBC1Size(GLuint width, GLuint height) {
+	return (GLsizeiptr)((width + 3) / 4) * ((height + 3) / 4) * 8;
+}
+
+/* Helper function for texBC1EncodeBlock. Packs an RGB color into 5:6:5. */
+GLuint texBC1Pack(GLdouble rgb[3]) {
+	GLint r = (GLint)(fmin(fmax(rgb[0], 0.0), 255.0) * 31.0 / 255.0 + 0.5);
+	GLint g = (GLint)(fmin(fmax(rgb[1], 0.0), 255.0) * 63.0 / 255.0 + 0.5);
+	GLint b = (GLint)(fmin(fmax(rgb[2], 0.0), 255.0) * 31.0 / 255.0 + 0.5);
+	return (r << 11) | (g << 5) | b;
+}
+
+/* Helper function for texBC1EncodeBlock. Unpacks a 5:6:5 color. */
+void texBC1Unpack(GLuint packed, GLdouble rgb[3]) {
+	GLuint r = (packed >> 11) & 31, g = (packed >> 5) & 63, b = packed & 31;
+	vec3Set(rgb, (GLdouble)((r << 3) | (r >> 2)),
+		(GLdouble)((g << 2) | (g >> 4)), (GLdouble)((b << 3) | (b >> 2)));
+}
+
+/* Compresses 16 RGB texels, in rows from the bottom, into one 8-byte BC1
+block. The two endpoint colors are the texels that lie farthest apart along
+the block's principal axis, found by power iteration on the covariance. */
+void texBC1EncodeBlock(GLubyte texels[16][3], GLubyte block[8]) {
+	GLdouble mean[3] = {0.0, 0.0, 0.0}, cov[3][3], axis[3], next[3];
+	GLdouble colors[16][3], palette[4][3], proj, lo, hi, best = 0.0, dist;
+	GLuint i, j, k, loIndex = 0, hiIndex = 0, c0, c1, t, indices = 0;
+	for (i = 0; i < 16; i += 1) {
+		vec3Set(colors[i], (GLdouble)texels[i][0], (GLdouble)texels[i][1],
+			(GLdouble)texels[i][2]);
+		vecAdd(3, mean, colors[i], mean);
+	}
+	vecScale(3, 1.0 / 16.0, mean, mean);
+	for (j = 0; j < 3; j += 1)
+		for (k = 0; k < 3; k += 1) {
+			cov[j][k] = 0.0;
+			for (i = 0; i < 16; i += 1)
+				cov[j][k] += (colors[i][j] - mean[j]) * (colors[i][k] - mean[k]);
+		}
+	vec3Set(axis, 1.0, 1.0, 1.0);
+	for (i = 0; i < 4; i += 1) {
+		mat331Multiply(cov, axis, next);
+		if (vecUnit(3, next, axis) == 0.0) {
+			vec3Set(axis, 1.0, 1.0, 1.0);
+			break;
+		}
+	}
+	lo = hi = vecDot(3, colors[0], axis);
+	for (i = 1; i < 16; i += 1) {
+		proj = vecDot(3, colors[i], axis);
+		if (proj < lo) {
+			lo = proj;
+			loIndex = i;
+		}
+		if (proj > hi) {
+			hi = proj;
+			hiIndex = i;
+		}
+	}
+	/* BC1 blends four colors only when the first endpoint is greater. */
+	c0 = texBC1Pack(colors[hiIndex]);
+	c1 = texBC1Pack(colors[loIndex]);
+	if (c0 < c1) {
+		t = c0;
+		c0 = c1;
+		c1 = t;
+	}
+	texBC1Unpack(c0, palette[0]);
+	texBC1Unpack(c1, palette[1]);
+	for (j = 0; j < 3; j += 1) {
+		palette[2][j] = (2.0 * palette[0][j] + palette[1][j]) / 3.0;
+		palette[3][j] = (palette[0][j] + 2.0 * palette[1][j]) / 3.0;
+	}
+	if (c0 != c1)
+		for (i = 0; i < 16; i += 1) {
+			t = 0;
+			for (k = 0; k < 4; k += 1) {
+				vecSubtract(3, colors[i], palette[k], next);
+				dist = vecDot(3, next, next);
+				if (k == 0 || dist < best) {
+					best = dist;
+					t = k;
+				}
+			}
+			indices |= t << (2 * i);
+		}
+	block[0] = c0 & 255;
+	block[1] = c0 >> 8;
+	block[2] = c1 & 255;
+	block[3] = c1 >> 8;
+	for (i = 0; i < 4; i += 1)
+		block[4 + i] = (indices >> (8 * i)) & 255;
+}
+
+/* Compresses a width x height RGB image into BC1. The image's partial blocks,
+at its right and top edges, repeat the edge texels. */
+void texBC1Encode(const GLubyte *rgb, GLuint width, GLuint height,
+		GLubyte *bc1) {
+	GLubyte texels[16][3];
+	GLuint bx, by, i, j, x, y;
+	for (by = 0; by < (height + 3) / 4; by += 1)
+		for (bx = 0; bx < (width + 3) / 4; bx += 1) {
+			for (j = 0; j < 4; j += 1)
+				for (i = 0; i < 4; i += 1) {
+					x = (4 * bx + i < width ? 4 * bx + i : width - 1);
+					y = (4 * by + j < height ? 4 * by + j : height - 1);
+					memcpy(texels[4 * j + i], &rgb[3 * (y * width + x)], 3);
+				}
+			texBC1EncodeBlock(texels, bc1);
+			bc1 += 8;
+		}
+}
+
+/* Shrinks a width x height RGB image to the next mipmap level, whose width
+and height are halved (rounding down, but to no less than 1), by averaging
+2x2 boxes. */
+void texDownsample(const GLubyte *rgb, GLuint width, GLuint height,
+		GLubyte *half) {
+	GLuint halfW = (width > 1 ? width / 2 : 1);
+	GLuint halfH = (height > 1 ? height / 2 : 1);
+	GLuint x, y, c, x1, y1;
+	for (y = 0; y < halfH; y += 1)
+		for (x = 0; x < halfW; x += 1) {
+			x1 = (2 * x + 1 < width ? 2 * x + 1 : width - 1);
+			y1 = (2 * y + 1 < height ? 2 * y + 1 : height - 1);
+			for (c = 0; c < 3; c += 1)
+				half[3 * (y * halfW + x) + c] = (GLubyte)((
+					rgb[3 * (2 * y * width + 2 * x) + c] +
+					rgb[3 * (2 * y * width + x1) + c] +
+					rgb[3 * (y1 * width + 2 * x) + c] +
+					rgb[3 * (y1 * width + x1) + c] + 2) / 4);
+		}
+}
+
+/* Resizes a width x height RGB image to newWidth x newHeight. Each new texel
+averages the old texels that its footprint covers, so that shrinking a large
+image does not alias. */
+void texResample(const GLubyte *rgb, GLuint width, GLuint height,
+		GLubyte *resized, GLuint newWidth, GLuint newHeight) {
+	GLuint x, y, i, j, c, x0, x1, y0, y1, sum[3];
+	for (y = 0; y < newHeight; y += 1) {
+		y0 = (GLuint)((GLuint64)y * height / newHeight);
+		y1 = (GLuint)(((GLuint64)y + 1) * height / newHeight);
+		if (y1 <= y0)
+			y1 = y0 + 1;
+		for (x = 0; x < newWidth; x += 1) {
+			x0 = (GLuint)((GLuint64)x * width / newWidth);
+			x1 = (GLuint)(((GLuint64)x + 1) * width / newWidth);
+			if (x1 <= x0)
+				x1 = x0 + 1;
+			sum[0] = sum[1] = sum[2] = 0;
+			for (j = y0; j < y1; j += 1)
+				for (i = x0; i < x1; i += 1)
+					for (c = 0; c < 3; c += 1)
+						sum[c] += rgb[3 * (j * width + i) + c];
+			for (c = 0; c < 3; c += 1)
+				resized[3 * (y * newWidth + x) + c] = (GLubyte)(
+					(sum[c] + (x1 - x0) * (y1 - y0) / 2) /
+					((x1 - x0) * (y1 - y0)));
+		}
+	}
+}
+
+/* Helper function for texCacheLoad. Fills in the level sizes and offsets from
+the width and height, and returns the total size. */
+GLsizeiptr texCacheLayOut(texCache *cache, GLuint width, GLuint height) {
+	cache->width = width;
+	cache->height = height;
+	cache->levelNum = 0;
+	cache->size = 0;
+	while (cache->levelNum < texLEVELMAX) {
+		cache->offsets[cache->levelNum] = cache->size;
+		cache->size += texBC1Size(width, height);
+		cache->levelNum += 1;
+		if (width == 1 && height == 1)
+			break;
+		width = (width > 1 ? width / 2 : 1);
+		height = (height > 1 ? height / 2 : 1);
+	}
+	return cache->size;
+}
+
+/* Helper function for texCacheLoad. Tries to map a cache file that matches the
+hash. Returns 0 on success, non-zero on failure. */
+int texCacheMap(texCache *cache, const char *cachePath, GLuint64 hash,
+		GLuint width, GLuint height) {
+	struct stat info;
+	GLuint *header;
+	int fd = open(cachePath, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &info) != 0 ||
+			info.st_size < (off_t)(texCACHEHEADER * sizeof(GLuint))) {
+		close(fd);
+		return 2;
+	}
+	cache->baseSize = info.st_size;
+	cache->base = mmap(NULL, cache->baseSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache->base == MAP_FAILED)
+		return 3;
+	header = (GLuint *)cache->base;
+	if (header[0] != texCACHEMAGIC || header[1] != texCACHEVERSION ||
+			header[2] != (GLuint)hash || header[3] != (GLuint)(hash >> 32) ||
+			header[4] == 0 || header[5] == 0 ||
+			(width != 0 && (header[4] != width || header[5] != height)) ||
+			texCacheLayOut(cache, header[4], header[5]) + texCACHEHEADER *
+			sizeof(GLuint) != cache->baseSize) {
+		munmap(cache->base, cache->baseSize);
+		return 4;
+	}
+	cache->data = (const GLubyte *)&header[texCACHEHEADER];
+	cache->mapped = 1;
+	return 0;
+}
+
+/* Helper function for texCacheLoad. Decodes the image, resizes it if
+newWidth is not 0, compresses its mipmap chain, and tries to save it to the
+cache file. Returns 0 on success, non-zero on failure. */
+int texCacheBuild(texCache *cache, const char *path, const char *cachePath,
+		const GLubyte *bytes, size_t size, GLuint64 hash, GLuint newWidth,
+		GLuint newHeight) {
+	int width, height, texelDim;
+	GLuint level, w, h;
+	GLuint *header;
+	GLubyte *rgb, *half, *temp, *decoded;
+	rgb = stbi_load_from_memory(bytes, size, &width, &height, &texelDim, 3);
+	decoded = rgb;
+	if (rgb == NULL) {
+		fprintf(stderr, "texCacheLoad: failed to decode %s.\n", path);
+		return 1;
+	}
+	if (newWidth != 0 && (newWidth != (GLuint)width ||
+			newHeight != (GLuint)height)) {
+		temp = (GLubyte *)malloc(3 * newWidth * newHeight);
+		if (temp == NULL) {
+			fprintf(stderr, "texCacheLoad: malloc failed.\n");
+			stbi_image_free(rgb);
+			return 2;
+		}
+		texResample(rgb, width, height, temp, newWidth, newHeight);
+		stbi_image_free(decoded);
+		decoded = NULL;
+		rgb = temp;
+		width = newWidth;
+		height = newHeight;
+	}
+	cache->baseSize = texCacheLayOut(cache, width, height) +
+		texCACHEHEADER * sizeof(GLuint);
+	cache->base = malloc(cache->baseSize);
+	half = (GLubyte *)malloc(3 * (width / 2 + 1) * (height / 2 + 1));
+	if (cache->base == NULL || half == NULL) {
+		fprintf(stderr, "texCacheLoad: malloc failed.\n");
+		free(cache->base);
+		free(half);
+		if (rgb == decoded)
+			stbi_image_free(rgb);
+		else
+			free(rgb);
+		return 2;
+	}
+	header = (GLuint *)cache->base;
+	header[0] = texCACHEMAGIC;
+	header[1] = texCACHEVERSION;
+	header[2] = (GLuint)hash;
+	header[3] = (GLuint)(hash >> 32);
+	header[4] = width;
+	header[5] = height;
+	header[6] = cache->levelNum;
+	header[7] = 0;
+	cache->data = (const GLubyte *)&header[texCACHEHEADER];
+	cache->mapped = 0;
+	/* The levels shrink in place, ping-ponging between rgb and half, which is
+	big enough for every level after the first. */
+	w = width;
+	h = height;
+	for (level = 0; level < cache->levelNum; level += 1) {
+		texBC1Encode(rgb, w, h, (GLubyte *)cache->data + cache->offsets[level]);
+		if (level + 1 < cache->levelNum) {
+			texDownsample(rgb, w, h, half);
+			w = (w > 1 ? w / 2 : 1);
+			h = (h > 1 ? h / 2 : 1);
+			temp = rgb;
+			rgb = half;
+			half = temp;
+		}
+	}
+	/* At most one of the buffers came from STB Image. */
+	if (rgb == decoded) {
+		stbi_image_free(rgb);
+		free(half);
+	} else if (half == decoded) {
+		free(rgb);
+		stbi_image_free(half);
+	} else {
+		free(rgb);
+		free(half);
+	}
+	/* Write to a temporary file and rename it, so that no other process ever
+	maps a half-written cache. Failure here costs only speed later. */
+	char *tempPath = (char *)malloc(strlen(cachePath) + 5);
+	if (tempPath == NULL)
+		return 0;
+	sprintf(tempPath, "%s.tmp", cachePath);
+	FILE *file = fopen(tempPath, "wb");
+	if (file == NULL ||
+			fwrite(cache->base, 1, cache->baseSize, file) != cache->baseSize) {
+		fprintf(stderr, "texCacheLoad: could not write %s.\n", tempPath);
+		if (file != NULL)
+			fclose(file);
+		remove(tempPath);
+	} else if (fclose(file) != 0 || rename(tempPath, cachePath) != 0) {
+		fprintf(stderr, "texCacheLoad: could not write %s.\n", cachePath);
+		remove(tempPath);
+	}
+	free(tempPath);
+	return 0;
+}
+
+/* Loads the compressed mipmap chain for the image file at path, from its
+cache file if that is up to date, and otherwise by building it and saving a
+new cache file. If width is not 0, then the image is first resized to width x
+height, and the cache file's name records that size. Safe to call from any
+thread, since it makes no OpenGL calls. Returns 0 on success, non-zero on
+failure. On success, the user must call texCacheDestroy when finished with the
+cache. */
+int texCacheLoad(texCache *cache, const char *path, GLuint width,
+		GLuint height) {
+	FILE *file;
+	long size;
+	GLubyte *bytes;
+	GLuint64 hash;
+	int error;
+	/* Hash the image file's bytes, which decoding would need anyway. */
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "texCacheLoad: could not open %s.\n", path);
+		return 1;
+	}
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	bytes = (GLubyte *)malloc(size > 0 ? size : 1);
+	if (bytes == NULL || fread(bytes, 1, size, file) != (size_t)size) {
+		fprintf(stderr, "texCacheLoad: could not read %s.\n", path);
+		fclose(file);
+		free(bytes);
+		return 2;
+	}
+	fclose(file);
+	hash = texHash(bytes, size);
+	char *cachePath = (char *)malloc(strlen(path) + 32);
+	if (cachePath == NULL) {
+		free(bytes);
+		return 3;
+	}
+	if (width == 0)
+		sprintf(cachePath, "%s.texcache", path);
+	else
+		sprintf(cachePath, "%s.%ux%u.texcache", path, width, height);
+	error = 0;
+	if (texCacheMap(cache, cachePath, hash, width, height) != 0)
+		error = texCacheBuild(cache, path, cachePath, bytes, size, hash, width,
+			height);
+	free(cachePath);
+	free(bytes);
+	return error;
+}
+
+/* Deallocates the resources backing the cache. */
+void texCacheDestroy(texCache *cache) {
+	if (cache->mapped)
+		munmap(cache->base, cache->baseSize);
+	else
+		free(cache->base);
+}
+
+/* Loads every level of layerNum caches of the same size into the texture that
+is bound to target, which is GL_TEXTURE_2D (and then layerNum is 1) or
+GL_TEXTURE_2D_ARRAY. cache is any one of them. data holds the levels in order
+and, within each level, the layers in order, which for a single cache is just
+cache->data. If the levels have been copied into the bound
+GL_PIXEL_UNPACK_BUFFER, then data is instead that copy's offset in the
+buffer. */
+void texCacheUpload(texCache *cache, GLenum target, GLuint layerNum,
+		const GLubyte *data) {
+	GLuint level, w = cache->width, h = cache->height;
+	glTexParameteri(target, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(target, GL_TEXTURE_MAX_LEVEL, cache->levelNum - 1);
+	for (level = 0; level < cache->levelNum; level += 1) {
+		if (target == GL_TEXTURE_2D_ARRAY)
+			glCompressedTexImage3D(target, level,
+				GL_COMPRESSED_RGB_S3TC_DXT1_EXT, w, h, layerNum, 0,
+				layerNum * texBC1Size(w, h),
+				data + layerNum * cache->offsets[level]);
+		else
+			glCompressedTexImage2D(target, level,
+				GL_COMPRESSED_RGB_S3TC_DXT1_EXT, w, h, 0, texBC1Size(w, h),
+				data + cache->offsets[level]);
+		w = (w > 1 ? w / 2 : 1);
+		h = (h > 1 ? h / 2 : 1);
+	}
+}
+
+/* Like texInitializeFile, except that the texture gets a full chain of
+compressed mipmaps, through the cache described above. Then minification may
+be a mipmapping filter such as GL_LINEAR_MIPMAP_LINEAR. Returns 0 on success,
+non-zero on failure. On success, the user must call texDestroy when finished
+with the texture. */
+int texInitializeFileCached(texTexture *tex, char *path, GLint minification,
+		GLint magnification, GLint leftRight, GLint bottomTop) {
+	texCache cache;
+	if (texCacheLoad(&cache, path, 0, 0) != 0)
+		return 1;
+	glGenTextures(1, &(tex->openGL));
+	tex->target = GL_TEXTURE_2D;
+	tex->layerNum = 1;
+	tex->renderNum = 0;
+	texSetFilteringBorder(tex, minification, magnification, leftRight,
+		bottomTop);
+	texCacheUpload(&cache, GL_TEXTURE_2D, 1, cache.data);
+	texCacheDestroy(&cache);
+	if (glGetError() != GL_NO_ERROR) {
+		fprintf(stderr, "texInitializeFileCached: OpenGL error.\n");
+		glDeleteTextures(1, &(tex->openGL));
+		return 2;
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	tex->width = cache.width;
+	tex->height = cache.height;
+	tex->texelDim = 3;
+	return 0;
+}
+
+
+/*** Asynchronous loading ***/
+
+/* A texture loader decodes image files on a pool of worker threads, so that
+the program can start rendering before its textures are ready. Each texture
+starts out as a one-texel gray placeholder, which the shaders can sample as
+usual. Once per frame, the OpenGL thread calls texLoaderUpload, which copies
+the finished images into their textures through a pixel buffer object. If
+OpenGL supports BC1, then the workers go through texCacheLoad, so the textures
+get compressed mipmaps and later runs skip decoding; otherwise they get plain
+RGB, with mipmaps generated by OpenGL if minification calls for them. The
+texTexture keeps its OpenGL name throughout, so whatever refers to it (scene
+nodes, render queues, indirect batches) needs no update when the real image
+arrives. For example:
+	texLoaderInitialize(&loader, 4);
+	texInitializeFileAsync(&loader, &tex, "grass.jpg",
+		GL_LINEAR_MIPMAP_LINEAR, ...);
+	...
+	while (...) {
+		texLoaderUpload(&loader, 1);
+		render();
+	}
+	texLoaderDestroy(&loader);
+	texDestroy(&tex);
+The loader also builds texture arrays, with texInitializeArrayAsync. A texture
+array holds several images of one size and format as layers, which a shader
+samples with a sampler2DArray and a layer number:
+	uniform sampler2DArray texture0;
+	...
+	vec3 diffuse = vec3(texture(texture0, vec3(st, layer)));
+Since the array is a single texture, draws that use different layers need no
+texture bind between them, and can share one indirect draw call. Each image
+is resized, if necessary, to the array's size. Each layer is decoded as its
+own job, but the array is uploaded only once all of its layers are ready. */
+
+#define texLOADERTHREADMAX 8
+#define texPENDING 0
+#define texDECODING 1
+#define texDECODED 2
+#define texFAILED 3
+#define texDONE 4
+
+/* A job decodes one image: a whole 2D texture, or one layer of an array. The
+jobs of an array's layers are consecutive. */
+typedef struct texJob texJob;
+struct texJob {
+	texTexture *tex;
+	char *path;
+	GLuint layer, newWidth, newHeight;
+	GLint minification;
+	int status, width, height;
+	/* Either the decoded image, from STB Image unless it was resized, or, if
+	the loader is compressing, the cache. */
+	unsigned char *rawData;
+	int resized;
+	texCache cache;
+};
+
+/* Feel free to read from this struct's members, but don't write to them. The
+jobs are guarded by the mutex. */
+typedef struct texLoader texLoader;
+struct texLoader {
+	pthread_t threads[texLOADERTHREADMAX];
+	GLuint threadNum;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quitting, compressed;
+	texJob *jobs;
+	GLuint jobNum, jobCapacity, outstandingNum, failedNum;
+	GLuint pbo;
+};
+
+/* Helper function for the loader. Frees whatever a decoded job holds. */
+void texLoaderRelease(texLoader *loader, texJob *job) {
+	if (job->status != texDECODED)
+		return;
+	if (loader->compressed)
+		texCacheDestroy(&(job->cache));
+	else if (job->resized)
+		free(job->rawData);
+	else
+		stbi_image_free(job->rawData);
+	job->rawData = NULL;
+}
+
+/* Helper function for texLoaderWork. Decodes the job's image, without the
+cache, into RGB, resizing it if the job asks. Returns the image, or NULL on
+failure. */
+unsigned char *texLoaderDecode(const char *path, GLuint newWidth,
+		GLuint newHeight, int *width, int *height, int *resized) {
+	int texelDim;
+	unsigned char *rawData, *resizedData;
+	*resized = 0;
+	rawData = stbi_load(path, width, height, &texelDim, 3);
+	if (rawData == NULL || newWidth == 0 ||
+			((int)newWidth == *width && (int)newHeight == *height))
+		return rawData;
+	resizedData = (unsigned char *)malloc(3 * newWidth * newHeight);
+	if (resizedData != NULL) {
+		texResample(rawData, *width, *height, resizedData, newWidth,
+			newHeight);
+		*width = newWidth;
+		*height = newHeight;
+		*resized = 1;
+	}
+	stbi_image_free(rawData);
+	return resizedData;
+}
+
+/* Helper function for texLoaderInitialize. The body of each worker thread. It
+repeatedly claims a pending job and decodes its file, until the loader
+quits. */
+void *texLoaderWork(void *arg) {
+	texLoader *loader = (texLoader *)arg;
+	GLuint i, newWidth, newHeight;
+	int width, height, resized = 0, error;
+	char *path;
+	unsigned char *rawData = NULL;
+	texCache cache;
+	pthread_mutex_lock(&(loader->mutex));
+	while (!loader->quitting) {
+		for (i = 0; i < loader->jobNum; i += 1)
+			if (loader->jobs[i].status == texPENDING)
+				break;
+		if (i == loader->jobNum) {
+			pthread_cond_wait(&(loader->cond), &(loader->mutex));
+			continue;
+		}
+		loader->jobs[i].status = texDECODING;
+		path = loader->jobs[i].path;
+		newWidth = loader->jobs[i].newWidth;
+		newHeight = loader->jobs[i].newHeight;
+		/* Decode outside the lock. Jobs may be added, and the array moved, in
+		the meantime, so the job is found again by index afterward. */
+		pthread_mutex_unlock(&(loader->mutex));
+		if (loader->compressed) {
+			error = texCacheLoad(&cache, path, newWidth, newHeight);
+			width = cache.width;
+			height = cache.height;
+		} else {
+			rawData = texLoaderDecode(path, newWidth, newHeight, &width,
+				&height, &resized);
+			error = (rawData == NULL);
+		}
+		pthread_mutex_lock(&(loader->mutex));
+		if (loader->compressed)
+			loader->jobs[i].cache = cache;
+		else {
+			loader->jobs[i].rawData = rawData;
+			loader->jobs[i].resized = resized;
+		}
+		loader->jobs[i].width = width;
+		loader->jobs[i].height = height;
+		loader->jobs[i].status = (error != 0 ? texFAILED : texDECODED);
+	}
+	pthread_mutex_unlock(&(loader->mutex));
+	return NULL;
+}
+
+/* Starts a loader with threadNum (at most texLOADERTHREADMAX) worker threads.
+Returns 0 on success, non-zero on failure. On success, the user must call
+texLoaderDestroy when finished with the loader. */
+int texLoaderInitialize(texLoader *loader, GLuint threadNum) {
+	if (threadNum < 1 || threadNum > texLOADERTHREADMAX) {
+		fprintf(stderr, "texLoaderInitialize: %d threads not in 1...%d.\n",
+			threadNum, texLOADERTHREADMAX);
+		return 1;
+	}
+	loader->quitting = 0;
+	loader->compressed = texCompressionIsSupported();
+	loader->jobs = NULL;
+	loader->jobNum = 0;
+	loader->jobCapacity = 0;
+	loader->outstandingNum = 0;
+	loader->failedNum = 0;
+	if (pthread_mutex_init(&(loader->mutex), NULL) != 0) {
+		fprintf(stderr, "texLoaderInitialize: pthread_mutex_init failed.\n");
+		return 2;
+	}
+	if (pthread_cond_init(&(loader->cond), NULL) != 0) {
+		fprintf(stderr, "texLoaderInitialize: pthread_cond_init failed.\n");
+		pthread_mutex_destroy(&(loader->mutex));
+		return 3;
+	}
+	for (loader->threadNum = 0; loader->threadNum < threadNum;
+			loader->threadNum += 1)
+		if (pthread_create(&(loader->threads[loader->threadNum]), NULL,
+				texLoaderWork, loader) != 0) {
+			fprintf(stderr, "texLoaderInitialize: pthread_create failed.\n");
+			break;
+		}
+	/* Fewer threads than requested still get the job done. */
+	if (loader->threadNum == 0) {
+		pthread_cond_destroy(&(loader->cond));
+		pthread_mutex_destroy(&(loader->mutex));
+		return 4;
+	}
+	glGenBuffers(1, &(loader->pbo));
+	return 0;
+}
+
+/* Stops the worker threads, waiting for any decodes in progress, and
+deallocates the loader's resources. Textures that were never finished keep
+their placeholders. */
+void texLoaderDestroy(texLoader *loader) {
+	GLuint i;
+	pthread_mutex_lock(&(loader->mutex));
+	loader->quitting = 1;
+	pthread_cond_broadcast(&(loader->cond));
+	pthread_mutex_unlock(&(loader->mutex));
+	for (i = 0; i < loader->threadNum; i += 1)
+		pthread_join(loader->threads[i], NULL);
+	for (i = 0; i < loader->jobNum; i += 1) {
+		texLoaderRelease(loader, &(loader->jobs[i]));
+		free(loader->jobs[i].path);
+	}
+	free(loader->jobs);
+	pthread_cond_destroy(&(loader->cond));
+	pthread_mutex_destroy(&(loader->mutex));
+	glDeleteBuffers(1, &(loader->pbo));
+}
+
+/* Helper function for texInitializeFileAsync and texInitializeArrayAsync.
+Makes the placeholder and queues one job per layer. Returns 0 on success,
+non-zero on failure. */
+int texLoaderEnqueue(texLoader *loader, texTexture *tex, GLenum target,
+		GLuint layerNum, char *paths[], GLuint width, GLuint height,
+		GLint minification, GLint magnification, GLint leftRight,
+		GLint bottomTop) {
+	GLuint i;
+	GLubyte *gray = (GLubyte *)malloc(3 * layerNum);
+	if (gray == NULL) {
+		fprintf(stderr, "texLoaderEnqueue: malloc failed.\n");
+		return 1;
+	}
+	memset(gray, 128, 3 * layerNum);
+	pthread_mutex_lock(&(loader->mutex));
+	if (loader->jobNum + layerNum > loader->jobCapacity) {
+		GLuint capacity = 2 * loader->jobCapacity + layerNum + 8;
+		texJob *jobs = (texJob *)realloc(loader->jobs,
+			capacity * sizeof(texJob));
+		if (jobs == NULL) {
+			pthread_mutex_unlock(&(loader->mutex));
+			fprintf(stderr, "texLoaderEnqueue: realloc failed.\n");
+			free(gray);
+			return 2;
+		}
+		loader->jobs = jobs;
+		loader->jobCapacity = capacity;
+	}
+	for (i = 0; i < layerNum; i += 1) {
+		texJob *job = &(loader->jobs[loader->jobNum + i]);
+		job->path = (char *)malloc(strlen(paths[i]) + 1);
+		if (job->path == NULL) {
+			pthread_mutex_unlock(&(loader->mutex));
+			fprintf(stderr, "texLoaderEnqueue: malloc failed.\n");
+			while (i > 0) {
+				i -= 1;
+				free(loader->jobs[loader->jobNum + i].path);
+			}
+			free(gray);
+			return 3;
+		}
+		strcpy(job->path, paths[i]);
+		job->tex = tex;
+		job->layer = i;
+		job->newWidth = width;
+		job->newHeight = height;
+		job->minification = minification;
+		job->status = texPENDING;
+		job->rawData = NULL;
+		job->resized = 0;
+	}
+	/* The placeholder. */
+	glGenTextures(1, &(tex->openGL));
+	tex->target = target;
+	tex->layerNum = layerNum;
+	tex->renderNum = 0;
+	texSetFilteringBorder(tex, minification, magnification, leftRight,
+		bottomTop);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	if (target == GL_TEXTURE_2D_ARRAY)
+		glTexImage3D(target, 0, GL_RGB, 1, 1, layerNum, 0, GL_RGB,
+			GL_UNSIGNED_BYTE, gray);
+	else
+		glTexImage2D(target, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE,
+			gray);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glBindTexture(target, 0);
+	free(gray);
+	tex->width = 1;
+	tex->height = 1;
+	tex->texelDim = 3;
+	loader->jobNum += layerNum;
+	loader->outstandingNum += layerNum;
+	pthread_cond_broadcast(&(loader->cond));
+	pthread_mutex_unlock(&(loader->mutex));
+	return 0;
+}
+
+/* Like texInitializeFile, except that the file is decoded in the background.
+The texture is immediately usable, as a placeholder, and receives the image
+during some later texLoaderUpload. Returns 0 on success, non-zero on failure.
+Problems with the file itself are reported by texLoaderUpload, in which case
+the placeholder stays. Either way, the user must call texDestroy when finished
+with the texture. */
+int texInitializeFileAsync(texLoader *loader, texTexture *tex, char *path,
+		GLint minification, GLint magnification, GLint leftRight,
+		GLint bottomTop) {
+	return texLoaderEnqueue(loader, tex, GL_TEXTURE_2D, 1, &path, 0, 0,
+		minification, magnification, leftRight, bottomTop);
+}
+
+/* Like texInitializeFileAsync, except that the texture is an array of
+layerNum layers, whose images are the files at paths, resized to width x
+height. If layerNum is 1, then width and height may be 0, to keep the image's
+own size. */
+int texInitializeArrayAsync(texLoader *loader, texTexture *tex,
+		GLuint layerNum, char *paths[], GLuint width, GLuint height,
+		GLint minification, GLint magnification, GLint leftRight,
+		GLint bottomTop) {
+	if (layerNum == 0 || (layerNum > 1 && (width == 0 || height == 0))) {
+		fprintf(stderr, "texInitializeArrayAsync: %d layers of %d x %d.\n",
+			layerNum, width, height);
+		return 1;
+	}
+	return texLoaderEnqueue(loader, tex, GL_TEXTURE_2D_ARRAY, layerNum, paths,
+		width, height, minification, magnification, leftRight, bottomTop);
+}
+
+/* Helper function for texLoaderUpload. Copies the decoded images, or the
+caches, of a texture's jobs into the texture, through the loader's pixel
+buffer object. Returns 0 on success, non-zero on failure. */
+int texLoaderCopy(texLoader *loader, texJob jobs[]) {
+	texTexture *tex = jobs[0].tex;
+	GLuint i, level;
+	GLsizeiptr size, levelSize;
+	GLubyte *pixels;
+	for (i = 1; i < tex->layerNum; i += 1)
+		if (jobs[i].width != jobs[0].width || jobs[i].height != jobs[0].height) {
+			fprintf(stderr, "texLoaderUpload: %s is not the size of %s.\n",
+				jobs[i].path, jobs[0].path);
+			return 1;
+		}
+	if (loader->compressed)
+		size = jobs[0].cache.size;
+	else
+		size = (GLsizeiptr)jobs[0].width * jobs[0].height * 3;
+	/* Respecifying the buffer's storage lets the driver hand out fresh memory,
+	rather than wait for the previous upload to finish. */
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, loader->pbo);
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, tex->layerNum * size, NULL,
+		GL_STREAM_DRAW);
+	pixels = (GLubyte *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0,
+		tex->layerNum * size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (pixels == NULL) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		fprintf(stderr, "texLoaderUpload: glMapBufferRange failed.\n");
+		return 2;
+	}
+	/* Compressed levels go level by level, and within each level layer by
+	layer, as texCacheUpload expects. */
+	if (loader->compressed)
+		for (level = 0; level < jobs[0].cache.levelNum; level += 1) {
+			levelSize = (level + 1 < jobs[0].cache.levelNum ?
+				jobs[0].cache.offsets[level + 1] : size) -
+				jobs[0].cache.offsets[level];
+			for (i = 0; i < tex->layerNum; i += 1)
+				memcpy(pixels + tex->layerNum * jobs[0].cache.offsets[level] +
+					i * levelSize,
+					jobs[i].cache.data + jobs[i].cache.offsets[level],
+					levelSize);
+		}
+	else
+		for (i = 0; i < tex->layerNum; i += 1)
+			memcpy(pixels + i * size, jobs[i].rawData, size);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	glBindTexture(tex->target, tex->openGL);
+	if (loader->compressed)
+		texCacheUpload(&(jobs[0].cache), tex->target, tex->layerNum, NULL);
+	else {
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+		if (tex->target == GL_TEXTURE_2D_ARRAY)
+			glTexImage3D(tex->target, 0, GL_RGB, jobs[0].width,
+				jobs[0].height, tex->layerNum, 0, GL_RGB, GL_UNSIGNED_BYTE,
+				NULL);
+		else
+			glTexImage2D(tex->target, 0, GL_RGB, jobs[0].width,
+				jobs[0].height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		if (jobs[0].minification != GL_NEAREST &&
+				jobs[0].minification != GL_LINEAR)
+			glGenerateMipmap(tex->target);
+	}
+	glBindTexture(tex->target, 0);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	tex->width = jobs[0].width;
+	tex->height = jobs[0].height;
+	return 0;
+}
+
+/* To be called on the OpenGL thread, typically once per frame. Uploads up to
+maxUploads of the textures whose images have all finished decoding, and
+reports any files that failed. Returns the number of images still
+outstanding. */
+GLuint texLoaderUpload(texLoader *loader, GLuint maxUploads) {
+	GLuint i, k, layerNum, uploadNum = 0;
+	int failed;
+	pthread_mutex_lock(&(loader->mutex));
+	for (i = 0; i < loader->jobNum && uploadNum < maxUploads;
+			i += layerNum) {
+		texJob *jobs = &(loader->jobs[i]);
+		layerNum = jobs[0].tex->layerNum;
+		if (jobs[0].status == texDONE)
+			continue;
+		/* Wait for every layer. */
+		failed = 0;
+		for (k = 0; k < layerNum; k += 1)
+			if (jobs[k].status == texFAILED)
+				failed = 1;
+			else if (jobs[k].status != texDECODED)
+				break;
+		if (k < layerNum)
+			continue;
+		if (failed) {
+			/* STB Image's reason is shared among threads, so it is not
+			trustworthy here. */
+			for (k = 0; k < layerNum; k += 1)
+				if (jobs[k].status == texFAILED)
+					fprintf(stderr, "texLoaderUpload: failed to load %s.\n",
+						jobs[k].path);
+		} else
+			failed = (texLoaderCopy(loader, jobs) != 0);
+		for (k = 0; k < layerNum; k += 1) {
+			texLoaderRelease(loader, &(jobs[k]));
+			jobs[k].status = texDONE;
+		}
+		loader->outstandingNum -= layerNum;
+		loader->failedNum += failed;
+		uploadNum += 1;
+	}
+	i = loader->outstandingNum;
+	pthread_mutex_unlock(&(loader->mutex));
+	return i;
+}
+
+/* Blocks until every texture requested so far has been uploaded (or has
+failed). Returns 0 if they all succeeded, non-zero if not. */
+int texLoaderFinish(texLoader *loader) {
+	struct timespec nap = {0, 1000000};
+	while (texLoaderUpload(loader, loader->jobCapacity) > 0)
+		nanosleep(&nap, NULL);
+	return (loader->failedNum != 0);
 }
@@ -0,0 +1,278 @@
+/*** Render queue ***/
+
+/* A render queue collects the draws of one pass (the shadow pass or the main
+pass, for example) instead of issuing them in scene-graph order. Each draw is
+tagged with a sort key built from its shader program, its set of textures, its
+mesh, and its depth from the eye. After sorting, draws that share state are
+adjacent, so queueRender can skip redundant glUseProgram, texture, and VAO
+binds. Within equal state, draws are front-to-back, so that the depth test can
+reject hidden fragments early. Everything in this demo is opaque. */
+
+/* Josh says to assume a maximum of 8 concurrent textures. */
+#define queueTEXNUM 8
+
+/* Feel free to read from this struct's members, but don't write to them. */
+typedef struct queueItem queueItem;
+struct queueItem {
+	GLuint program;
+	GLuint texNum;
+	texTexture *tex[queueTEXNUM];
+	meshGLMesh *meshGL;
+	GLdouble depth;
+	GLfloat modeling[3][4];
+	GLdouble *unif;
+};
+
+/* Sorting moves these small records around, rather than the items. */
+typedef struct queueKey queueKey;
+struct queueKey {
+	unsigned long long key;
+	GLuint item;
+};
+
+/* Feel free to read from this struct's members, but don't write to them except
+through the accessor functions. */
+typedef struct queueQueue queueQueue;
+struct queueQueue {
+	GLuint itemNum, itemCapacity;
+	queueItem *items;
+	queueKey *keys;
+	/* Texture sets seen since queueBegin, so that each gets a small id. */
+	GLuint texSetNum, texSetCapacity;
+	texTexture **texSets;
+	/* Settings of the pass, fixed at initialization. */
+	GLuint vaoIndex, unifNum, texLocNum;
+	GLint modelingLoc;
+	GLuint *unifDims;
+	GLint *unifLocs, *textureLocs;
+	/* The eye, for depth sorting. */
+	GLdouble eye[3], forward[3];
+};
+
+/* Initializes a render queue for a pass that draws meshes with VAO vaoIndex.
+modelingLoc, unifNum, unifDims, and unifLocs are as in sceneRender. texLocNum
+is the number of texture units that the pass samples, and textureLocs holds
+their sampler locations. A pass that samples no textures, such as the shadow
+pass, can pass 0 and NULL, and then no textures are bound at all. The arrays
+are copied. Returns 0 on success, non-zero on failure. On success, the user
+must call queueDestroy when finished with the queue. */
+int queueInitialize(queueQueue *queue, GLuint vaoIndex, GLint modelingLoc,
+		GLuint unifNum, GLuint unifDims[], GLint unifLocs[], GLuint texLocNum,
+		GLint textureLocs[]) {
+	GLuint i;
+	if (texLocNum > queueTEXNUM) {
+		fprintf(stderr, "queueInitialize: more than %d textures.\n",
+			queueTEXNUM);
+		return 1;
+	}
+	queue->unifDims = (GLuint *)malloc((unifNum + 1) * sizeof(GLuint) +
+		(unifNum + texLocNum + 1) * sizeof(GLint));
+	if (queue->unifDims == NULL)
+		return 2;
+	queue->unifLocs = (GLint *)&(queue->unifDims[unifNum + 1]);
+	queue->textureLocs = &(queue->unifLocs[unifNum]);
+	for (i = 0; i < unifNum; i += 1) {
+		queue->unifDims[i] = unifDims[i];
+		queue->unifLocs[i] = unifLocs[i];
+	}
+	for (i = 0; i < texLocNum; i += 1)
+		queue->textureLocs[i] = textureLocs[i];
+	queue->vaoIndex = vaoIndex;
+	queue->modelingLoc = modelingLoc;
+	queue->unifNum = unifNum;
+	queue->texLocNum = texLocNum;
+	queue->itemNum = 0;
+	queue->itemCapacity = 0;
+	queue->items = NULL;
+	queue->keys = NULL;
+	queue->texSetNum = 0;
+	queue->texSetCapacity = 0;
+	queue->texSets = NULL;
+	vec3Set(queue->eye, 0.0, 0.0, 0.0);
+	vec3Set(queue->forward, 0.0, 0.0, -1.0);
+	return 0;
+}
+
+/* Deallocates the resources backing the queue. */
+void queueDestroy(queueQueue *queue) {
+	free(queue->unifDims);
+	free(queue->items);
+	free(queue->keys);
+	free(queue->texSets);
+}
+
+/* Empties the queue, to start a new frame. Depths are measured from cam, which
+looks down the negative z-axis of its rotation. */
+void queueBegin(queueQueue *queue, camCamera *cam) {
+	queue->itemNum = 0;
+	queue->texSetNum = 0;
+	vecCopy(3, cam->translation, queue->eye);
+	queue->forward[0] = -cam->rotation[0][2];
+	queue->forward[1] = -cam->rotation[1][2];
+	queue->forward[2] = -cam->rotation[2][2];
+}
+
+/* Returns a small id for the given set of textures, which is the same for
+every draw in this frame that uses the same textures in the same units.
+Returns queueTEXSETNONE if memory runs out. */
+#define queueTEXSETNONE 0xFFFF
+GLuint queueTextureSet(queueQueue *queue, GLuint texNum, texTexture *tex[]) {
+	GLuint i, k;
+	for (i = 0; i < queue->texSetNum; i += 1) {
+		for (k = 0; k < queue->texLocNum; k += 1)
+			if (queue->texSets[i * queueTEXNUM + k] !=
+					(k < texNum ? tex[k] : NULL))
+				break;
+		if (k == queue->texLocNum)
+			return i;
+	}
+	if (queue->texSetNum == queue->texSetCapacity) {
+		GLuint capacity = 2 * queue->texSetCapacity + 8;
+		texTexture **texSets = (texTexture **)realloc(queue->texSets,
+			capacity * queueTEXNUM * sizeof(texTexture *));
+		if (texSets == NULL)
+			return queueTEXSETNONE;
+		queue->texSets = texSets;
+		queue->texSetCapacity = capacity;
+	}
+	for (k = 0; k < queueTEXNUM; k += 1)
+		queue->texSets[queue->texSetNum * queueTEXNUM + k] =
+			(k < texNum ? tex[k] : NULL);
+	queue->texSetNum += 1;
+	return queue->texSetNum - 1;
+}
+
+/* Packs the sort key. From most to least significant: 8 bits of program, 16
+bits of texture set, 16 bits of mesh (its VAO name), and 24 bits of depth.
+Non-negative floats sort in the same order as their bit patterns, so the top 24
+bits of the float depth make a monotonic key. Draws behind the eye get depth 0.
+Collisions in the truncated fields only cost some batching, because
+queueRender compares the actual state before skipping a bind. */
+unsigned long long queueSortKey(GLuint program, GLuint texSet, GLuint vao,
+		GLdouble depth) {
+	GLfloat depthF = (depth > 0.0 ? (GLfloat)depth : 0.0f);
+	GLuint depthBits;
+	memcpy(&depthBits, &depthF, sizeof(GLuint));
+	return ((unsigned long long)(program & 0xFF) << 56) |
+		((unsigned long long)(texSet & 0xFFFF) << 40) |
+		((unsigned long long)(vao & 0xFFFF) << 24) |
+		(unsigned long long)(depthBits >> 8);
+}
+
+/* Adds a draw of meshGL with the given program, textures, modeling matrix, and
+uniforms. The modeling matrix is copied (and converted for OpenGL), but the
+uniforms and textures must stay unchanged until queueRender. Returns 0 on
+success, non-zero on failure. */
+int queueAdd(queueQueue *queue, GLuint program, GLuint texNum,
+		texTexture *tex[], meshGLMesh *meshGL, GLdouble modeling[3][4],
+		GLdouble *unif) {
+	GLuint i;
+	if (queue->itemNum == queue->itemCapacity) {
+		GLuint capacity = 2 * queue->itemCapacity + 64;
+		queueItem *items = (queueItem *)realloc(queue->items,
+			capacity * sizeof(queueItem));
+		if (items == NULL)
+			return 1;
+		queue->items = items;
+		queueKey *keys = (queueKey *)realloc(queue->keys,
+			capacity * sizeof(queueKey));
+		if (keys == NULL)
+			return 1;
+		queue->keys = keys;
+		queue->itemCapacity = capacity;
+	}
+	queueItem *item = &(queue->items[queue->itemNum]);
+	item->program = program;
+	item->texNum = (texNum < queue->texLocNum ? texNum : queue->texLocNum);
+	for (i = 0; i < item->texNum; i += 1)
+		item->tex[i] = tex[i];
+	item->meshGL = meshGL;
+	item->unif = unif;
+	mat34OpenGL(modeling, item->modeling);
+	/* The depth of the modeling origin along the line of sight. */
+	GLdouble origin[3] = {modeling[0][3], modeling[1][3], modeling[2][3]};
+	vecSubtract(3, origin, queue->eye, origin);
+	item->depth = vecDot(3, origin, queue->forward);
+	GLuint texSet = queueTextureSet(queue, item->texNum, item->tex);
+	queue->keys[queue->itemNum].key = queueSortKey(program, texSet,
+		meshGL->vaos[queue->vaoIndex], item->depth);
+	queue->keys[queue->itemNum].item = queue->itemNum;
+	queue->itemNum += 1;
+	return 0;
+}
+
+/* Comparison function for qsort. */
+int queueCompareKeys(const void *a, const void *b) {
+	unsigned long long keyA = ((const queueKey *)a)->key;
+	unsigned long long keyB = ((const queueKey *)b)->key;
+	if (keyA < keyB)
+		return -1;
+	else if (keyA > keyB)
+		return 1;
+	else
+		return 0;
+}
+
+/* Sorts the queued draws by their keys. */
+void queueSort(queueQueue *queue) {
+	qsort(queue->keys, queue->itemNum, sizeof(queueKey), queueCompareKeys);
+}
+
+/* Loads the item's uniforms into the pass's uniform locations, as sceneRender
+does for a node. */
+void queueRenderUniforms(queueQueue *queue, queueItem *item) {
+	GLuint i, curUnifIdx = 0;
+	GLfloat unif[4];
+	for (i = 0; i < queue->unifNum; i += 1) {
+		if (queue->unifDims[i] < 1 || queue->unifDims[i] > 4) {
+			printf("Queue Error: A uniform dimension exceeds 4\n");
+			continue;
+		}
+		vecOpenGL(queue->unifDims[i], &item->unif[curUnifIdx], unif);
+		if (queue->unifDims[i] == 1)
+			glUniform1fv(queue->unifLocs[i], 1, unif);
+		else if (queue->unifDims[i] == 2)
+			glUniform2fv(queue->unifLocs[i], 1, unif);
+		else if (queue->unifDims[i] == 3)
+			glUniform3fv(queue->unifLocs[i], 1, unif);
+		else
+			glUniform4fv(queue->unifLocs[i], 1, unif);
+		curUnifIdx += queue->unifDims[i];
+	}
+}
+
+/* Sorts and submits the queued draws, binding each program, texture, and VAO
+only when it differs from the one already bound. Afterwards, unbinds the
+textures and the VAO. Any uniforms that are shared by the whole pass (the
+viewing matrix, the lights, etc.) must already be loaded into every program
+that the queue uses. */
+void queueRender(queueQueue *queue) {
+	GLuint i, k, program = 0, vao = 0;
+	texTexture *bound[queueTEXNUM] = {NULL};
+	queueSort(queue);
+	for (i = 0; i < queue->itemNum; i += 1) {
+		queueItem *item = &(queue->items[queue->keys[i].item]);
+		if (item->program != program) {
+			program = item->program;
+			glUseProgram(program);
+		}
+		for (k = 0; k < item->texNum; k += 1)
+			if (item->tex[k] != bound[k]) {
+				texRender(item->tex[k], GL_TEXTURE0 + k, k,
+					queue->textureLocs[k]);
+				bound[k] = item->tex[k];
+			}
+		if (item->meshGL->vaos[queue->vaoIndex] != vao) {
+			vao = item->meshGL->vaos[queue->vaoIndex];
+			glBindVertexArray(vao);
+		}
+		glUniformMatrix3x4fv(queue->modelingLoc, 1, GL_FALSE,
+			(GLfloat *)item->modeling);
+		queueRenderUniforms(queue, item);
+		meshGLDraw(item->meshGL);
+	}
+	glBindVertexArray(0);
+	for (k = 0; k < queueTEXNUM; k += 1)
+		if (bound[k] != NULL)
+			texUnrender(bound[k], GL_TEXTURE0 + k);
+}
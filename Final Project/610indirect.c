@@ -0,0 +1,359 @@
+/*** Indirect rendering ***/
+
+/* On OpenGL 4.3 and later, an indirect batch packs many meshes into one shared
+vertex buffer and one shared triangle buffer. A whole sorted render queue can
+then be submitted with glMultiDrawElementsIndirect: one command per draw, read
+by the GPU from a buffer, instead of one glDrawElements (plus binds and
+uniform uploads) per draw. The per-draw data --- the modeling matrix and the
+node's other uniforms --- goes into a shader storage buffer. GLSL 4.30 has no
+gl_DrawID without ARB_shader_draw_parameters, so the batch uses the classic
+replacement: each command's baseInstance is the index of its draw, and an
+instanced vertex attribute (divisor 1) over the array 0, 1, 2, ... turns
+baseInstance + gl_InstanceID into that index. A vertex shader reads its draw's
+data like this:
+	struct Instance {
+		mat3x4 modeling;
+		vec4 unif;
+	};
+	layout(std430, binding = 0) buffer Instances {
+		Instance instances[];
+	};
+	in uint instance;
+	...
+	mat3x4 modeling = instances[instance].modeling;
+The node's uniforms (at most indirectUNIFDIM GLdoubles, as listed by the
+queue's unifDims) are packed one after another into unif. On OpenGL 3.2 the
+batch is unavailable, and the queue should be drawn with queueRender, which
+draws each mesh with its own VAOs as before. */
+
+#define indirectUNIFDIM 4
+#define indirectINSTANCEDIM (12 + indirectUNIFDIM)
+#define indirectINSTANCEBINDING 0
+
+/* The layout that glMultiDrawElementsIndirect expects. */
+typedef struct indirectCommand indirectCommand;
+struct indirectCommand {
+	GLuint count, instanceCount, firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
+/* Feel free to read from this struct's members, but don't write to them. */
+typedef struct indirectBatch indirectBatch;
+struct indirectBatch {
+	GLuint meshNum, vertNum, triNum, attrNum, attrDim, vaoNum;
+	GLuint *attrDims;
+	GLuint *vaos;
+	GLuint buffers[2];
+	/* Packed float positions, if every mesh has them, or 0. */
+	GLuint positionBuffer;
+	/* Per-draw buffers, which hold up to capacity draws, and their copies in
+	main memory. */
+	GLuint capacity;
+	GLuint commandBuffer, instanceBuffer, instanceIndexBuffer;
+	indirectCommand *commands;
+	GLfloat *instances;
+};
+
+/* Returns 1 if the current OpenGL context can run indirect batches, and 0 if
+not. */
+int indirectIsSupported(void) {
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	return (major > 4 || (major == 4 && minor >= 3));
+}
+
+/* Makes the per-draw buffers big enough for drawNum draws. Returns 0 on
+success, non-zero on failure. */
+int indirectReserve(indirectBatch *batch, GLuint drawNum) {
+	GLuint capacity, i;
+	if (drawNum <= batch->capacity)
+		return 0;
+	capacity = batch->capacity;
+	while (capacity < drawNum)
+		capacity = 2 * capacity + 64;
+	indirectCommand *commands = (indirectCommand *)malloc(
+		capacity * (sizeof(indirectCommand) + sizeof(GLuint) +
+		indirectINSTANCEDIM * sizeof(GLfloat)));
+	if (commands == NULL)
+		return 1;
+	free(batch->commands);
+	batch->commands = commands;
+	batch->instances = (GLfloat *)&(commands[capacity]);
+	/* The instance indices are 0, 1, 2, ... forever. */
+	GLuint *indices = (GLuint *)&(batch->instances[capacity *
+		indirectINSTANCEDIM]);
+	for (i = 0; i < capacity; i += 1)
+		indices[i] = i;
+	glBindBuffer(GL_ARRAY_BUFFER, batch->instanceIndexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, capacity * sizeof(GLuint), indices,
+		GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	batch->capacity = capacity;
+	return 0;
+}
+
+/* Deallocates the resources backing the batch. Does not destroy the meshes. */
+void indirectDestroy(indirectBatch *batch) {
+	glDeleteBuffers(2, batch->buffers);
+	if (batch->positionBuffer != 0)
+		glDeleteBuffers(1, &(batch->positionBuffer));
+	glDeleteBuffers(1, &(batch->commandBuffer));
+	glDeleteBuffers(1, &(batch->instanceBuffer));
+	glDeleteBuffers(1, &(batch->instanceIndexBuffer));
+	glDeleteVertexArrays(batch->vaoNum, batch->vaos);
+	free(batch->attrDims);
+	free(batch->commands);
+}
+
+/* Packs the meshNum OpenGL meshes in meshGLs into one batch, by copying their
+buffers on the GPU. All of the meshes must have the same attributes as the
+first one. Records each mesh's place in the shared buffers in the mesh itself
+(see meshGL->packed), so a mesh can belong to at most one batch. vaoNum is as
+in meshGLInitialize. Returns 0 on success, non-zero on failure. On success, the
+user must call indirectDestroy when finished with the batch. */
+int indirectInitialize(indirectBatch *batch, GLuint meshNum,
+		meshGLMesh *meshGLs[], GLuint vaoNum) {
+	GLuint i, k, vertNum = 0, triNum = 0, positioned = 1;
+	if (meshNum == 0)
+		return 1;
+	for (i = 0; i < meshNum; i += 1) {
+		if (meshGLs[i]->attrNum != meshGLs[0]->attrNum ||
+				meshGLs[i]->attrDim != meshGLs[0]->attrDim) {
+			fprintf(stderr, "indirectInitialize: mesh %d has other attributes.\n",
+				i);
+			return 2;
+		}
+		for (k = 0; k < meshGLs[0]->attrNum; k += 1)
+			if (meshGLs[i]->attrDims[k] != meshGLs[0]->attrDims[k]) {
+				fprintf(stderr,
+					"indirectInitialize: mesh %d has other attributes.\n", i);
+				return 2;
+			}
+		vertNum += meshGLs[i]->vertNum;
+		triNum += meshGLs[i]->triNum;
+		if (meshGLs[i]->positionBuffer == 0)
+			positioned = 0;
+	}
+	batch->attrDims = (GLuint *)malloc((meshGLs[0]->attrNum + vaoNum) *
+		sizeof(GLuint));
+	if (batch->attrDims == NULL)
+		return 3;
+	for (k = 0; k < meshGLs[0]->attrNum; k += 1)
+		batch->attrDims[k] = meshGLs[0]->attrDims[k];
+	batch->vaos = &(batch->attrDims[meshGLs[0]->attrNum]);
+	glGenVertexArrays(vaoNum, batch->vaos);
+	batch->meshNum = meshNum;
+	batch->vertNum = vertNum;
+	batch->triNum = triNum;
+	batch->attrNum = meshGLs[0]->attrNum;
+	batch->attrDim = meshGLs[0]->attrDim;
+	batch->vaoNum = vaoNum;
+	/* Allocate the shared buffers and copy the meshes into them. Triangles are
+	copied unchanged; each command's baseVertex offsets their indices. */
+	glGenBuffers(2, batch->buffers);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, batch->buffers[0]);
+	glBufferData(GL_COPY_WRITE_BUFFER,
+		vertNum * batch->attrDim * sizeof(GLdouble), NULL, GL_STATIC_DRAW);
+	vertNum = 0;
+	for (i = 0; i < meshNum; i += 1) {
+		glBindBuffer(GL_COPY_READ_BUFFER, meshGLs[i]->buffers[0]);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+			vertNum * batch->attrDim * sizeof(GLdouble),
+			meshGLs[i]->vertNum * batch->attrDim * sizeof(GLdouble));
+		meshGLs[i]->baseVertex = vertNum;
+		vertNum += meshGLs[i]->vertNum;
+	}
+	/* The position streams are packed in the same order, so the same
+	baseVertex works for both. */
+	batch->positionBuffer = 0;
+	if (positioned) {
+		glGenBuffers(1, &(batch->positionBuffer));
+		glBindBuffer(GL_COPY_WRITE_BUFFER, batch->positionBuffer);
+		glBufferData(GL_COPY_WRITE_BUFFER, vertNum * 3 * sizeof(GLfloat), NULL,
+			GL_STATIC_DRAW);
+		for (i = 0; i < meshNum; i += 1) {
+			glBindBuffer(GL_COPY_READ_BUFFER, meshGLs[i]->positionBuffer);
+			glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+				meshGLs[i]->baseVertex * 3 * sizeof(GLfloat),
+				meshGLs[i]->vertNum * 3 * sizeof(GLfloat));
+		}
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, batch->buffers[1]);
+	glBufferData(GL_COPY_WRITE_BUFFER, triNum * 3 * sizeof(GLuint), NULL,
+		GL_STATIC_DRAW);
+	triNum = 0;
+	for (i = 0; i < meshNum; i += 1) {
+		glBindBuffer(GL_COPY_READ_BUFFER, meshGLs[i]->buffers[1]);
+		glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0,
+			triNum * 3 * sizeof(GLuint), meshGLs[i]->triNum * 3 * sizeof(GLuint));
+		meshGLs[i]->firstIndex = triNum * 3;
+		meshGLs[i]->packed = 1;
+		triNum += meshGLs[i]->triNum;
+	}
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	/* Create the per-draw buffers. */
+	glGenBuffers(1, &(batch->commandBuffer));
+	glGenBuffers(1, &(batch->instanceBuffer));
+	glGenBuffers(1, &(batch->instanceIndexBuffer));
+	batch->capacity = 0;
+	batch->commands = NULL;
+	batch->instances = NULL;
+	if (indirectReserve(batch, meshNum) != 0) {
+		indirectDestroy(batch);
+		return 4;
+	}
+	return 0;
+}
+
+/* Helper function for the VAO initializers below. Sets up the instance
+attribute and the triangles in the bound VAO, and unbinds it. */
+void indirectVAOFinish(indirectBatch *batch, GLint instanceLoc) {
+	if (instanceLoc >= 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, batch->instanceIndexBuffer);
+		glEnableVertexAttribArray(instanceLoc);
+		glVertexAttribIPointer(instanceLoc, 1, GL_UNSIGNED_INT, 0,
+			BUFFER_OFFSET(0));
+		glVertexAttribDivisor(instanceLoc, 1);
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch->buffers[1]);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/* Like meshGLVAOInitialize, but for the shared buffers. attrLocs is
+batch->attrNum locations in the active shader program, and instanceLoc is the
+location of its uint instance attribute. */
+void indirectVAOInitialize(indirectBatch *batch, GLuint index,
+		GLint attrLocs[], GLint instanceLoc) {
+	GLuint i, stride = 0, offset = 0;
+	if (index >= batch->vaoNum) {
+		printf("Indirect Error: indirectVAOInitialize index out of range\n");
+		return;
+	}
+	glBindVertexArray(batch->vaos[index]);
+	for (i = 0; i < batch->attrNum; i += 1)
+		stride += batch->attrDims[i];
+	glBindBuffer(GL_ARRAY_BUFFER, batch->buffers[0]);
+	for (i = 0; i < batch->attrNum; i += 1) {
+		if (attrLocs[i] >= 0) {
+			glEnableVertexAttribArray(attrLocs[i]);
+			glVertexAttribPointer(attrLocs[i], batch->attrDims[i], GL_DOUBLE,
+				GL_FALSE, stride * sizeof(GLdouble),
+				BUFFER_OFFSET(offset * sizeof(GLdouble)));
+		}
+		offset += batch->attrDims[i];
+	}
+	indirectVAOFinish(batch, instanceLoc);
+}
+
+/* Like meshGLPositionVAOInitialize, but for the shared buffers. The VAO reads
+the packed float positions if every mesh had them, and the interleaved
+positions otherwise. */
+void indirectPositionVAOInitialize(indirectBatch *batch, GLuint index,
+		GLint positionLoc, GLint instanceLoc) {
+	if (index >= batch->vaoNum) {
+		printf("Indirect Error: indirectPositionVAOInitialize index out of "
+			"range\n");
+		return;
+	}
+	glBindVertexArray(batch->vaos[index]);
+	glEnableVertexAttribArray(positionLoc);
+	if (batch->positionBuffer != 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, batch->positionBuffer);
+		glVertexAttribPointer(positionLoc, 3, GL_FLOAT, GL_FALSE,
+			3 * sizeof(GLfloat), BUFFER_OFFSET(0));
+	} else {
+		glBindBuffer(GL_ARRAY_BUFFER, batch->buffers[0]);
+		glVertexAttribPointer(positionLoc, 3, GL_DOUBLE, GL_FALSE,
+			batch->attrDim * sizeof(GLdouble), BUFFER_OFFSET(0));
+	}
+	indirectVAOFinish(batch, instanceLoc);
+}
+
+/* Returns 1 if the two items use the same program and textures. */
+int indirectSameState(queueItem *a, queueItem *b) {
+	GLuint k;
+	if (a->program != b->program || a->texNum != b->texNum)
+		return 0;
+	for (k = 0; k < a->texNum; k += 1)
+		if (a->tex[k] != b->tex[k])
+			return 0;
+	return 1;
+}
+
+/* Sorts the queue and submits it through the batch, using the batch's VAO at
+the queue's vaoIndex. Every mesh in the queue must be packed into this batch,
+and the queue's uniforms must total at most indirectUNIFDIM. Issues one
+glMultiDrawElementsIndirect per run of draws that share a program and textures;
+a pass that samples no textures, such as the shadow pass, is a single call.
+Returns 0 on success, non-zero on failure (in which case nothing is drawn, and
+the caller can fall back to queueRender, but only with programs that take the
+modeling matrix and uniforms as ordinary uniforms, not from the batch's
+per-draw data). */
+int indirectRender(indirectBatch *batch, queueQueue *queue) {
+	GLuint i, k, start, unifDim = 0, program = 0;
+	texTexture *bound[queueTEXNUM] = {NULL};
+	for (i = 0; i < queue->unifNum; i += 1)
+		unifDim += queue->unifDims[i];
+	if (unifDim > indirectUNIFDIM || indirectReserve(batch, queue->itemNum) != 0)
+		return 1;
+	queueSort(queue);
+	/* Write the commands and the per-draw data in sorted order. */
+	for (i = 0; i < queue->itemNum; i += 1) {
+		queueItem *item = &(queue->items[queue->keys[i].item]);
+		if (!item->meshGL->packed)
+			return 2;
+		batch->commands[i].count = item->meshGL->triNum * 3;
+		batch->commands[i].instanceCount = 1;
+		batch->commands[i].firstIndex = item->meshGL->firstIndex;
+		batch->commands[i].baseVertex = item->meshGL->baseVertex;
+		batch->commands[i].baseInstance = i;
+		GLfloat *instance = &(batch->instances[i * indirectINSTANCEDIM]);
+		memcpy(instance, item->modeling, 12 * sizeof(GLfloat));
+		vecOpenGL(unifDim, item->unif, &instance[12]);
+		for (k = unifDim; k < indirectUNIFDIM; k += 1)
+			instance[12 + k] = 0.0;
+	}
+	/* Upload them, orphaning last pass's storage. */
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, batch->commandBuffer);
+	glBufferData(GL_DRAW_INDIRECT_BUFFER,
+		queue->itemNum * sizeof(indirectCommand), batch->commands,
+		GL_STREAM_DRAW);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, batch->instanceBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER,
+		queue->itemNum * indirectINSTANCEDIM * sizeof(GLfloat), batch->instances,
+		GL_STREAM_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, indirectINSTANCEBINDING,
+		batch->instanceBuffer);
+	glBindVertexArray(batch->vaos[queue->vaoIndex]);
+	/* Draw each run of equal state with one call. */
+	start = 0;
+	for (i = 1; i <= queue->itemNum; i += 1) {
+		queueItem *first = &(queue->items[queue->keys[start].item]);
+		if (i < queue->itemNum &&
+				indirectSameState(first, &(queue->items[queue->keys[i].item])))
+			continue;
+		if (first->program != program) {
+			program = first->program;
+			glUseProgram(program);
+		}
+		for (k = 0; k < first->texNum; k += 1)
+			if (first->tex[k] != bound[k]) {
+				texRender(first->tex[k], GL_TEXTURE0 + k, k,
+					queue->textureLocs[k]);
+				bound[k] = first->tex[k];
+			}
+		glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+			BUFFER_OFFSET(start * sizeof(indirectCommand)), i - start, 0);
+		start = i;
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	for (k = 0; k < queueTEXNUM; k += 1)
+		if (bound[k] != NULL)
+			texUnrender(bound[k], GL_TEXTURE0 + k);
+	return 0;
+}
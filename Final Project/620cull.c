@@ -0,0 +1,562 @@
+/*** GPU culling ***/
+
+/* On OpenGL 4.3 and later, a culler moves the work of sceneFlatQueue onto the
+GPU. Every node of a flattened scene gets a record in a shader storage buffer:
+its modeling matrix, its uniforms, the bounds of its mesh, and its place in an
+indirect batch. Each frame, one compute dispatch tests every record against
+the viewing volume of every pass (the shadow camera and the main camera, for
+example) and appends the survivors to that pass's indirect commands and
+per-draw data, in the layout that indirectRender uses. Then each pass is drawn
+with glMultiDrawElementsIndirect, without the CPU ever seeing which nodes
+survived. The CPU's only per-node work is uploading the records of the nodes
+that moved, so its cost does not grow with the number of visible nodes.
+
+Within a pass, the commands are grouped by texture set. At initialization, the
+nodes are sorted into groups of equal textures, and each group gets a fixed
+range of the pass's commands, as long as the group. The compute shader claims
+slots in the range with an atomic counter, and the commands past the last
+claimed slot are left zeroed (instanceCount 0), so the GPU skips them. On
+OpenGL 4.6, glMultiDrawElementsIndirectCount reads the counter instead, and
+the zeroed tail is not even read. A pass that samples no textures, such as the
+shadow pass, is one group and one draw call. Unlike the render queue, the
+commands are not sorted by depth.
+
+A pass can also keep only the static nodes or only the others, for example to
+draw a shadow map's static layer and dynamic casters separately. */
+
+#define cullPASSMAX 8
+#define cullOBJECTBINDING 1
+#define cullGROUPBINDING 2
+#define cullCOMMANDBINDING 3
+#define cullCOUNTERBINDING 4
+#define cullLOCALSIZE 64
+
+/* Flags of a pass. cullGROUPED means that the pass samples the nodes' textures
+(and so needs its commands grouped by texture set). cullSTATIC and cullDYNAMIC
+keep only the static nodes or only the others. */
+#define cullGROUPED 1
+#define cullSTATIC 2
+#define cullDYNAMIC 4
+
+/* The record of one node, in the std430 layout of the compute shader. The last
+entry of halfSize is 1 if the node is static and 0 if not. draw holds the
+command's count, firstIndex, baseVertex, and the node's group. */
+typedef struct cullObject cullObject;
+struct cullObject {
+	GLfloat modeling[12];
+	GLfloat unif[4];
+	GLfloat bounds[4];				/* center and radius, in mesh coordinates */
+	GLfloat halfSize[4];
+	GLuint draw[4];
+};
+
+/* Feel free to read from this struct's members, but don't write to them. */
+typedef struct cullCuller cullCuller;
+struct cullCuller {
+	GLuint objectNum, groupNum, passNum;
+	GLuint flags[cullPASSMAX];
+	/* For each group, its first object (whose textures the group uses), its
+	first command within a pass, and its length. */
+	GLuint *groupNodes, *groupStarts, *groupSizes;
+	/* Each node's index in the object buffer, and the records in main memory,
+	in the same order. */
+	GLuint *slots;
+	cullObject *objects;
+	GLuint program;
+	GLint objectNumLoc, groupNumLoc, passNumLoc, flagsLoc, planesLoc;
+	GLuint objectBuffer, groupBuffer, commandBuffer, instanceBuffer,
+		counterBuffer;
+	int countSupported;
+};
+
+/* Returns 1 if the two nodes use the same textures. */
+int cullSameTextures(sceneNode *a, sceneNode *b) {
+	GLint k;
+	if (a->texNum != b->texNum)
+		return 0;
+	for (k = 0; k < a->texNum; k += 1)
+		if (a->tex[k] != b->tex[k])
+			return 0;
+	return 1;
+}
+
+/* Copies the flattened scene's cached modeling matrix, the node's uniforms, and
+its static flag into the node's record. */
+void cullRecord(cullCuller *cull, sceneFlat *flat, GLuint i) {
+	GLuint k;
+	sceneNode *node = flat->nodes[i];
+	cullObject *object = &(cull->objects[cull->slots[i]]);
+	mat34OpenGL(flat->modeling[i], (GLfloat (*)[4])object->modeling);
+	vecOpenGL(node->unifDim, node->unif, object->unif);
+	for (k = node->unifDim; k < 4; k += 1)
+		object->unif[k] = 0.0;
+	object->halfSize[3] = (node->isStatic ? 1.0 : 0.0);
+}
+
+/* Deallocates the resources backing the culler. */
+void cullDestroy(cullCuller *cull) {
+	glDeleteBuffers(1, &(cull->objectBuffer));
+	glDeleteBuffers(1, &(cull->groupBuffer));
+	glDeleteBuffers(1, &(cull->commandBuffer));
+	glDeleteBuffers(1, &(cull->instanceBuffer));
+	glDeleteBuffers(1, &(cull->counterBuffer));
+	glDeleteProgram(cull->program);
+	free(cull->objects);
+}
+
+/* Initializes a culler for the nodes of the flattened scene, all of whose
+meshes must be packed into batch, and whose uniforms must total at most
+indirectUNIFDIM. passNum is the number of passes (at most cullPASSMAX), and
+flags[p] holds the flags of pass p (see cullGROUPED, etc.). Like the flattened
+scene, the culler does not notice later changes to the graph's structure or the
+nodes' textures.
+Returns 0 on success, non-zero on failure. On success, the user must call
+cullDestroy when finished with the culler. */
+int cullInitialize(cullCuller *cull, sceneFlat *flat, indirectBatch *batch,
+		GLuint passNum, GLuint flags[]) {
+	GLuint i, j, g, objectNum = flat->nodeNum;
+	sceneNode *node;
+	if (passNum > cullPASSMAX || objectNum == 0)
+		return 1;
+	for (i = 0; i < objectNum; i += 1) {
+		node = flat->nodes[i];
+		if (!node->meshGL->packed || node->unifDim > indirectUNIFDIM) {
+			fprintf(stderr, "cullInitialize: node %d does not fit the batch.\n",
+				i);
+			return 2;
+		}
+	}
+	/* The per-draw data of pass p starts at instance p * objectNum, so the
+	batch's instance indices must reach that far. */
+	if (indirectReserve(batch, passNum * objectNum) != 0)
+		return 3;
+	cull->groupNodes = (GLuint *)malloc(objectNum * (4 * sizeof(GLuint) +
+		sizeof(cullObject)) + 16);
+	if (cull->groupNodes == NULL)
+		return 4;
+	cull->objects = (cullObject *)cull->groupNodes;
+	cull->groupNodes = (GLuint *)&(cull->objects[objectNum]);
+	cull->groupStarts = &(cull->groupNodes[objectNum]);
+	cull->groupSizes = &(cull->groupStarts[objectNum]);
+	cull->slots = &(cull->groupSizes[objectNum]);
+	/* Sort the nodes into groups of equal textures, giving each group a
+	contiguous run of slots. */
+	cull->groupNum = 0;
+	for (i = 0; i < objectNum; i += 1) {
+		for (g = 0; g < cull->groupNum; g += 1)
+			if (cullSameTextures(flat->nodes[cull->groupNodes[g]],
+					flat->nodes[i]))
+				break;
+		if (g == cull->groupNum) {
+			cull->groupNodes[g] = i;
+			cull->groupSizes[g] = 0;
+			cull->groupNum += 1;
+		}
+		cull->groupSizes[g] += 1;
+	}
+	for (g = 0; g < cull->groupNum; g += 1)
+		cull->groupStarts[g] = (g == 0 ? 0 :
+			cull->groupStarts[g - 1] + cull->groupSizes[g - 1]);
+	for (g = 0, j = 0; g < cull->groupNum; g += 1)
+		for (i = 0; i < objectNum; i += 1)
+			if (cullSameTextures(flat->nodes[cull->groupNodes[g]],
+					flat->nodes[i])) {
+				cull->slots[i] = j;
+				node = flat->nodes[i];
+				cullObject *object = &(cull->objects[j]);
+				vecOpenGL(3, node->meshGL->center, object->bounds);
+				object->bounds[3] = node->meshGL->radius;
+				vecOpenGL(3, node->meshGL->halfSize, object->halfSize);
+				object->draw[0] = node->meshGL->triNum * 3;
+				object->draw[1] = node->meshGL->firstIndex;
+				object->draw[2] = (GLuint)node->meshGL->baseVertex;
+				object->draw[3] = g;
+				cullRecord(cull, flat, i);
+				j += 1;
+			}
+	cull->objectNum = objectNum;
+	cull->passNum = passNum;
+	for (i = 0; i < cullPASSMAX; i += 1)
+		cull->flags[i] = (i < passNum ? flags[i] : 0);
+	/* The compute shader handles one object per invocation. Its flags and
+	planes arrays are sized for cullPASSMAX passes. */
+	GLchar computeCode[] = "\
+		#version 430\n\
+		layout(local_size_x = 64) in;\
+		struct Object {\
+			mat3x4 modeling;\
+			vec4 unif;\
+			vec4 bounds;\
+			vec4 halfSize;\
+			uvec4 draw;\
+		};\
+		struct Command {\
+			uint count;\
+			uint instanceCount;\
+			uint firstIndex;\
+			int baseVertex;\
+			uint baseInstance;\
+		};\
+		struct Instance {\
+			mat3x4 modeling;\
+			vec4 unif;\
+		};\
+		layout(std430, binding = 0) writeonly buffer Instances {\
+			Instance instances[];\
+		};\
+		layout(std430, binding = 1) readonly buffer Objects {\
+			Object objects[];\
+		};\
+		layout(std430, binding = 2) readonly buffer Groups {\
+			uint groupStarts[];\
+		};\
+		layout(std430, binding = 3) writeonly buffer Commands {\
+			Command commands[];\
+		};\
+		layout(std430, binding = 4) buffer Counters {\
+			uint counters[];\
+		};\
+		uniform uint objectNum;\
+		uniform uint groupNum;\
+		uniform uint passNum;\
+		uniform uint flags[8];\
+		uniform vec4 planes[48];\
+		void main(void) {\
+			uint i = gl_GlobalInvocationID.x;\
+			if (i >= objectNum)\
+				return;\
+			Object object = objects[i];\
+			vec3 center = vec4(object.bounds.xyz, 1.0) * object.modeling;\
+			mat3 absolute = mat3(abs(object.modeling[0].xyz),\
+				abs(object.modeling[1].xyz), abs(object.modeling[2].xyz));\
+			vec3 halfSize = object.halfSize.xyz * absolute;\
+			for (uint p = 0u; p < passNum; p += 1u) {\
+				bool grouped = ((flags[p] & 1u) != 0u);\
+				bool inside = true;\
+				if ((flags[p] & 2u) != 0u && object.halfSize.w == 0.0)\
+					inside = false;\
+				if ((flags[p] & 4u) != 0u && object.halfSize.w != 0.0)\
+					inside = false;\
+				if (inside && object.bounds.w >= 0.0)\
+					for (uint j = 0u; j < 6u; j += 1u) {\
+						vec4 plane = planes[p * 6u + j];\
+						float dist = dot(plane.xyz, center) + plane.w;\
+						float reach = dot(abs(plane.xyz), halfSize);\
+						if (dist < -object.bounds.w || dist < -reach)\
+							inside = false;\
+					}\
+				if (!inside)\
+					continue;\
+				uint group = (grouped ? object.draw.w : 0u);\
+				uint start = (grouped ? groupStarts[group] : 0u);\
+				uint k = p * objectNum + start +\
+					atomicAdd(counters[p * groupNum + group], 1u);\
+				commands[k].count = object.draw.x;\
+				commands[k].instanceCount = 1u;\
+				commands[k].firstIndex = object.draw.y;\
+				commands[k].baseVertex = int(object.draw.z);\
+				commands[k].baseInstance = k;\
+				instances[k].modeling = object.modeling;\
+				instances[k].unif = object.unif;\
+			}\
+		}";
+	GLuint shader = makeShader(GL_COMPUTE_SHADER, computeCode);
+	if (shader == 0) {
+		free(cull->objects);
+		return 5;
+	}
+	cull->program = glCreateProgram();
+	glAttachShader(cull->program, shader);
+	glLinkProgram(cull->program);
+	glDeleteShader(shader);
+	GLint linkSuccess;
+	glGetProgramiv(cull->program, GL_LINK_STATUS, &linkSuccess);
+	if (linkSuccess != GL_TRUE) {
+		fprintf(stderr, "cullInitialize: linking failed.\n");
+		glDeleteProgram(cull->program);
+		free(cull->objects);
+		return 6;
+	}
+	cull->objectNumLoc = glGetUniformLocation(cull->program, "objectNum");
+	cull->groupNumLoc = glGetUniformLocation(cull->program, "groupNum");
+	cull->passNumLoc = glGetUniformLocation(cull->program, "passNum");
+	cull->flagsLoc = glGetUniformLocation(cull->program, "flags");
+	cull->planesLoc = glGetUniformLocation(cull->program, "planes");
+	/* Create the buffers. Only the objects are ever written by the CPU. */
+	glGenBuffers(1, &(cull->objectBuffer));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->objectBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, objectNum * sizeof(cullObject),
+		cull->objects, GL_DYNAMIC_DRAW);
+	glGenBuffers(1, &(cull->groupBuffer));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->groupBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, cull->groupNum * sizeof(GLuint),
+		cull->groupStarts, GL_STATIC_DRAW);
+	glGenBuffers(1, &(cull->commandBuffer));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->commandBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER,
+		passNum * objectNum * sizeof(indirectCommand), NULL, GL_DYNAMIC_COPY);
+	glGenBuffers(1, &(cull->instanceBuffer));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->instanceBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER,
+		passNum * objectNum * indirectINSTANCEDIM * sizeof(GLfloat), NULL,
+		GL_DYNAMIC_COPY);
+	glGenBuffers(1, &(cull->counterBuffer));
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->counterBuffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER,
+		passNum * cull->groupNum * sizeof(GLuint), NULL, GL_DYNAMIC_COPY);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	GLint major = 0, minor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &major);
+	glGetIntegerv(GL_MINOR_VERSION, &minor);
+	cull->countSupported = (major > 4 || (major == 4 && minor >= 6));
+	return 0;
+}
+
+/* Uploads the records of the nodes that moved in the last sceneFlatUpdate,
+coalescing neighboring records into one upload. A node's uniforms are uploaded
+only when it moves. */
+void cullUpload(cullCuller *cull, sceneFlat *flat) {
+	GLuint i, first = cull->objectNum, last = 0;
+	for (i = 0; i < flat->nodeNum; i += 1)
+		if (flat->moved[i])
+			cullRecord(cull, flat, i);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->objectBuffer);
+	for (i = 0; i <= flat->nodeNum; i += 1) {
+		if (i < flat->nodeNum && flat->moved[i] && first == cull->objectNum) {
+			first = cull->slots[i];
+			last = first;
+		} else if (i < flat->nodeNum && flat->moved[i] &&
+				cull->slots[i] == last + 1)
+			last += 1;
+		else if (first != cull->objectNum) {
+			glBufferSubData(GL_SHADER_STORAGE_BUFFER,
+				first * sizeof(cullObject),
+				(last - first + 1) * sizeof(cullObject),
+				&(cull->objects[first]));
+			first = cull->objectNum;
+			if (i < flat->nodeNum && flat->moved[i]) {
+				first = cull->slots[i];
+				last = first;
+			}
+		}
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+/* Culls the nodes for every pass at once. Call it after sceneFlatUpdate, and
+before any cullRender in this frame. planes[p] holds the six planes of pass p's
+viewing volume (as from camFrustumPlanes). */
+void cullCull(cullCuller *cull, sceneFlat *flat, GLdouble planes[][6][4]) {
+	GLuint p, j;
+	GLfloat planesF[cullPASSMAX * 6][4];
+	GLuint zero = 0;
+	cullUpload(cull, flat);
+	for (p = 0; p < cull->passNum; p += 1)
+		for (j = 0; j < 6; j += 1)
+			vecOpenGL(4, planes[p][j], planesF[p * 6 + j]);
+	/* Zero the counters and the commands, so that unclaimed commands draw
+	nothing. */
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->counterBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER,
+		GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->commandBuffer);
+	glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER,
+		GL_UNSIGNED_INT, &zero);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	glUseProgram(cull->program);
+	glUniform1ui(cull->objectNumLoc, cull->objectNum);
+	glUniform1ui(cull->groupNumLoc, cull->groupNum);
+	glUniform1ui(cull->passNumLoc, cull->passNum);
+	glUniform1uiv(cull->flagsLoc, cullPASSMAX, cull->flags);
+	glUniform4fv(cull->planesLoc, cull->passNum * 6, (GLfloat *)planesF);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, indirectINSTANCEBINDING,
+		cull->instanceBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, cullOBJECTBINDING,
+		cull->objectBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, cullGROUPBINDING,
+		cull->groupBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, cullCOMMANDBINDING,
+		cull->commandBuffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, cullCOUNTERBINDING,
+		cull->counterBuffer);
+	glDispatchCompute((cull->objectNum + cullLOCALSIZE - 1) / cullLOCALSIZE, 1,
+		1);
+	/* The draws read the commands, the counters, and the per-draw data. */
+	glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+/* Draws pass p's survivors of the last cullCull, with the given program and
+the batch's VAO at vaoIndex. If the pass is cullGROUPED, then the program
+samples the nodes' textures (at most texLocNum of them) at the sampler locations
+textureLocs. Any uniforms that are shared by the whole pass must already be
+loaded into the program. */
+void cullRender(cullCuller *cull, sceneFlat *flat, indirectBatch *batch,
+		GLuint p, GLuint program, GLuint vaoIndex, GLuint texLocNum,
+		GLint textureLocs[]) {
+	GLuint g, k, start, size, grouped = cull->flags[p] & cullGROUPED;
+	GLuint groupNum = (grouped ? cull->groupNum : 1);
+	texTexture *bound[queueTEXNUM] = {NULL};
+	glUseProgram(program);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, indirectINSTANCEBINDING,
+		cull->instanceBuffer);
+	glBindVertexArray(batch->vaos[vaoIndex]);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, cull->commandBuffer);
+	if (cull->countSupported)
+		glBindBuffer(GL_PARAMETER_BUFFER, cull->counterBuffer);
+	for (g = 0; g < groupNum; g += 1) {
+		start = p * cull->objectNum;
+		size = cull->objectNum;
+		if (grouped) {
+			sceneNode *node = flat->nodes[cull->groupNodes[g]];
+			for (k = 0; k < (GLuint)node->texNum && k < texLocNum &&
+					k < queueTEXNUM; k += 1)
+				if (node->tex[k] != bound[k]) {
+					texRender(node->tex[k], GL_TEXTURE0 + k, k, textureLocs[k]);
+					bound[k] = node->tex[k];
+				}
+			start += cull->groupStarts[g];
+			size = cull->groupSizes[g];
+		}
+		if (cull->countSupported)
+			glMultiDrawElementsIndirectCount(GL_TRIANGLES, GL_UNSIGNED_INT,
+				BUFFER_OFFSET(start * sizeof(indirectCommand)),
+				(GLintptr)((p * cull->groupNum + g) * sizeof(GLuint)), size, 0);
+		else
+			glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+				BUFFER_OFFSET(start * sizeof(indirectCommand)), size, 0);
+	}
+	glBindVertexArray(0);
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	if (cull->countSupported)
+		glBindBuffer(GL_PARAMETER_BUFFER, 0);
+	for (k = 0; k < queueTEXNUM; k += 1)
+		if (bound[k] != NULL)
+			texUnrender(bound[k], GL_TEXTURE0 + k);
+}
+
+/* Helper function for cullVerify. Returns 1 if the node certainly survives pass
+p on the CPU, 0 if it certainly does not, and -1 if it lies so close to one of
+the planes that the GPU's float arithmetic might decide either way. */
+int cullExpected(cullCuller *cull, sceneNode *node, GLuint p,
+		GLdouble planes[6][4]) {
+	GLdouble halfSize[3], eps, radius = node->radius;
+	int loose, tight;
+	GLuint k;
+	if ((cull->flags[p] & cullSTATIC) && !node->isStatic)
+		return 0;
+	if ((cull->flags[p] & cullDYNAMIC) && node->isStatic)
+		return 0;
+	if (radius < 0.0)
+		return 1;
+	eps = 1.0e-4 * (vecLength(3, node->center) + radius + 1.0);
+	for (k = 0; k < 3; k += 1)
+		halfSize[k] = node->halfSize[k] + eps;
+	loose = camFrustumContains(planes, node->center, radius + eps, halfSize);
+	for (k = 0; k < 3; k += 1)
+		halfSize[k] = fmax(node->halfSize[k] - eps, 0.0);
+	tight = camFrustumContains(planes, node->center, fmax(radius - eps, 0.0),
+		halfSize);
+	return (loose == tight ? tight : -1);
+}
+
+/* Reads back the commands, per-draw data, and counters that the last cullCull
+wrote, and checks them against culling each pass on the CPU with
+camFrustumContains. Each claimed command must be a node of its group, drawn
+once, and every command past the claimed ones must draw nothing. Nodes so
+close to a plane that float and double arithmetic may disagree are not held
+against the GPU. Prints a summary of each pass to stream. This stalls the
+pipeline, so it is only for debugging. Returns 0 if the GPU and the CPU agree,
+and non-zero otherwise. */
+int cullVerify(cullCuller *cull, sceneFlat *flat, GLdouble planes[][6][4],
+		FILE *stream) {
+	GLuint p, g, c, i, j, k, start, size, groupNum, claimed;
+	GLuint objectNum = cull->objectNum, counterNum = cull->passNum *
+		cull->groupNum, commandNum = cull->passNum * objectNum;
+	GLuint gpuNum, cpuNum, borderNum, wrongNum, totalWrong = 0;
+	int expected;
+	cullObject *object;
+	indirectCommand *command;
+	indirectCommand *commands = (indirectCommand *)malloc(
+		commandNum * (sizeof(indirectCommand) +
+		indirectINSTANCEDIM * sizeof(GLfloat) + sizeof(GLuint)) +
+		counterNum * sizeof(GLuint));
+	if (commands == NULL)
+		return 2;
+	GLfloat *instances = (GLfloat *)&(commands[commandNum]);
+	GLuint *counters = (GLuint *)&(instances[commandNum *
+		indirectINSTANCEDIM]);
+	GLuint *found = &(counters[counterNum]);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->commandBuffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+		commandNum * sizeof(indirectCommand), commands);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->instanceBuffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+		commandNum * indirectINSTANCEDIM * sizeof(GLfloat), instances);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, cull->counterBuffer);
+	glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0,
+		counterNum * sizeof(GLuint), counters);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	for (p = 0; p < cull->passNum; p += 1) {
+		/* Match each claimed command to an unmatched object of its group, by
+		its draw and its per-draw data. */
+		memset(&(found[p * objectNum]), 0, objectNum * sizeof(GLuint));
+		groupNum = (cull->flags[p] & cullGROUPED ? cull->groupNum : 1);
+		gpuNum = 0;
+		wrongNum = 0;
+		for (g = 0; g < groupNum; g += 1) {
+			start = (groupNum > 1 ? cull->groupStarts[g] : 0);
+			size = (groupNum > 1 ? cull->groupSizes[g] : objectNum);
+			claimed = counters[p * cull->groupNum + g];
+			if (claimed > size) {
+				wrongNum += claimed - size;
+				claimed = size;
+			}
+			gpuNum += claimed;
+			for (c = 0; c < size; c += 1) {
+				k = p * objectNum + start + c;
+				command = &(commands[k]);
+				if (c >= claimed) {
+					if (command->instanceCount != 0)
+						wrongNum += 1;
+					continue;
+				}
+				for (j = start; j < start + size; j += 1) {
+					object = &(cull->objects[j]);
+					if (!found[p * objectNum + j] &&
+							command->count == object->draw[0] &&
+							command->firstIndex == object->draw[1] &&
+							command->baseVertex == (GLint)object->draw[2] &&
+							command->instanceCount == 1 &&
+							command->baseInstance == k &&
+							memcmp(&(instances[k * indirectINSTANCEDIM]),
+								object->modeling,
+								indirectINSTANCEDIM * sizeof(GLfloat)) == 0)
+						break;
+				}
+				if (j == start + size)
+					wrongNum += 1;
+				else
+					found[p * objectNum + j] = 1;
+			}
+		}
+		/* Compare the matched objects with the CPU's verdicts. */
+		cpuNum = 0;
+		borderNum = 0;
+		for (i = 0; i < flat->nodeNum; i += 1) {
+			expected = cullExpected(cull, flat->nodes[i], p, planes[p]);
+			if (expected < 0)
+				borderNum += 1;
+			else {
+				cpuNum += expected;
+				if ((GLuint)expected != found[p * objectNum + cull->slots[i]])
+					wrongNum += 1;
+			}
+		}
+		fprintf(stream, "cullVerify: pass %u: GPU drew %u, CPU %u, %u near a "
+			"plane, %u mismatched.\n", p, gpuNum, cpuNum, borderNum, wrongNum);
+		totalWrong += wrongNum;
+	}
+	free(commands);
+	return (totalWrong == 0 ? 0 : 1);
+}
@@ -0,0 +1,457 @@
+/*** Clustered lighting ***/
+
+/* A cluster grid lets one shader pass light the scene with hundreds of
+lights, while each fragment pays only for the lights that can reach it. The
+camera's viewing volume is divided into a grid of clusters: dimX by dimY tiles
+across the screen, and dimZ slices in depth, which grow exponentially from the
+near plane to the far plane so that clusters stay roughly cube-shaped. Each
+frame, clusterUpdate finds, on the CPU, which lights can reach which clusters,
+by each light's range (from its attenuation) and, for spot lights, its cone.
+The results go to the GPU in three buffers:
+	* the lights themselves, in a uniform block,
+	* for each cluster, the offset and length of its run in the index list, in
+	a texture buffer of two unsigned integers per texel, and
+	* the index list, in a texture buffer of one unsigned integer per texel.
+A fragment shader finds its cluster from gl_FragCoord and its depth, and loops
+over just that cluster's lights:
+	struct Light {
+		vec4 position;
+		vec4 color;
+		vec4 attenuation;
+		vec4 direction;
+	};
+	layout(std140) uniform Lights {
+		Light lights[CLUSTERLIGHTMAX];
+	};
+	uniform usamplerBuffer clusterGrid;
+	uniform usamplerBuffer clusterIndices;
+	uniform ivec3 clusterDims;
+	uniform vec4 clusterScale;
+	uniform vec2 clusterDepth;
+	uniform vec3 clusterForward;
+	...
+	float depth = dot(fragPos - camPos, clusterForward);
+	ivec2 tile = ivec2(gl_FragCoord.xy * clusterScale.xy + clusterScale.zw);
+	int slice = int(log(depth / clusterDepth.x) * clusterDepth.y);
+	(clamp tile and slice to the grid)
+	uvec2 run = texelFetch(clusterGrid,
+		(slice * clusterDims.y + tile.y) * clusterDims.x + tile.x).rg;
+	for (uint k = 0u; k < run.y; k += 1u) {
+		Light light = lights[texelFetch(clusterIndices, int(run.x + k)).r];
+		...
+	}
+In a light's record, position.w is its type (lightOMNI, etc.), color.w is the
+cosine of half of its spot angle (-2 if it has no cone), attenuation.w is its
+range, and direction is the direction in which it shines. direction.w is the
+index of the light's shadow in a shadow atlas, or -1 if it casts none, so that
+shadowed and unshadowed lights can share one loop. A uniform block and
+texture buffers, rather than shader storage buffers, keep the grid available
+on OpenGL 3.2. The uniform block limits the lights to clusterLIGHTMAX, which
+fits in the 16 KB that every implementation allows. */
+
+#define clusterLIGHTMAX 256
+#define clusterLIGHTDIM 16
+#define clusterBINDING 1
+/* The attenuation below which a light is considered out of reach. */
+#define clusterCUTOFF (1.0 / 256.0)
+
+/* Feel free to read from this struct's members, but don't write to them. */
+typedef struct clusterGrid clusterGrid;
+struct clusterGrid {
+	GLuint dimX, dimY, dimZ, clusterNum;
+	/* For each cluster, its offset and length in the index list. */
+	GLuint *runs;
+	/* The index list, and the (cluster, light) pairs that it is sorted from,
+	both of which hold up to pairCapacity entries. */
+	GLuint pairNum, pairCapacity;
+	GLuint *indices, *pairs;
+	/* Each cluster's bounding sphere, in camera coordinates. */
+	GLdouble *spheres;
+	GLuint lightNum;
+	GLfloat lights[clusterLIGHTMAX][clusterLIGHTDIM];
+	/* The camera's near and far distances, its conversion from normalized
+	device coordinates, and its forward direction, as of the last
+	clusterUpdate. */
+	GLdouble near, far, scaleX, scaleY, forward[3];
+	int perspective;
+	GLuint lightBuffer, runBuffer, indexBuffer;
+	GLuint runTexture, indexTexture;
+};
+
+/* Initializes a grid of dimX by dimY by dimZ clusters. Returns 0 on success,
+non-zero on failure. On success, the user must call clusterDestroy when
+finished with the grid. */
+int clusterInitialize(clusterGrid *grid, GLuint dimX, GLuint dimY,
+		GLuint dimZ) {
+	grid->dimX = dimX;
+	grid->dimY = dimY;
+	grid->dimZ = dimZ;
+	grid->clusterNum = dimX * dimY * dimZ;
+	grid->runs = (GLuint *)malloc(grid->clusterNum * 2 * sizeof(GLuint) +
+		grid->clusterNum * 4 * sizeof(GLdouble));
+	if (grid->runs == NULL) {
+		fprintf(stderr, "clusterInitialize: malloc failed.\n");
+		return 1;
+	}
+	grid->spheres = (GLdouble *)&(grid->runs[grid->clusterNum * 2]);
+	grid->pairNum = 0;
+	grid->pairCapacity = 0;
+	grid->indices = NULL;
+	grid->pairs = NULL;
+	grid->lightNum = 0;
+	grid->near = 1.0;
+	grid->far = 2.0;
+	grid->scaleX = 0.0;
+	grid->scaleY = 0.0;
+	grid->perspective = -1;
+	vec3Set(grid->forward, 0.0, 0.0, -1.0);
+	glGenBuffers(1, &(grid->lightBuffer));
+	glBindBuffer(GL_UNIFORM_BUFFER, grid->lightBuffer);
+	glBufferData(GL_UNIFORM_BUFFER,
+		clusterLIGHTMAX * clusterLIGHTDIM * sizeof(GLfloat), NULL,
+		GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glGenBuffers(1, &(grid->runBuffer));
+	glGenBuffers(1, &(grid->indexBuffer));
+	glBindBuffer(GL_TEXTURE_BUFFER, grid->runBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, grid->clusterNum * 2 * sizeof(GLuint),
+		NULL, GL_STREAM_DRAW);
+	/* A texture buffer must not be empty, so the index list starts with room
+	for one index. */
+	glBindBuffer(GL_TEXTURE_BUFFER, grid->indexBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, sizeof(GLuint), NULL, GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	glGenTextures(1, &(grid->runTexture));
+	glBindTexture(GL_TEXTURE_BUFFER, grid->runTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RG32UI, grid->runBuffer);
+	glGenTextures(1, &(grid->indexTexture));
+	glBindTexture(GL_TEXTURE_BUFFER, grid->indexTexture);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, grid->indexBuffer);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	return 0;
+}
+
+/* Deallocates the resources backing the grid. */
+void clusterDestroy(clusterGrid *grid) {
+	glDeleteTextures(1, &(grid->runTexture));
+	glDeleteTextures(1, &(grid->indexTexture));
+	glDeleteBuffers(1, &(grid->lightBuffer));
+	glDeleteBuffers(1, &(grid->runBuffer));
+	glDeleteBuffers(1, &(grid->indexBuffer));
+	free(grid->runs);
+	free(grid->indices);
+	free(grid->pairs);
+}
+
+/* Helper function for clusterUpdate. Returns the slice that contains the
+positive depth, clamped to the grid. */
+GLint clusterSlice(clusterGrid *grid, GLdouble depth) {
+	GLint slice;
+	if (depth <= grid->near)
+		return 0;
+	slice = (GLint)(log(depth / grid->near) / log(grid->far / grid->near) *
+		grid->dimZ);
+	return (slice < (GLint)grid->dimZ ? slice : (GLint)grid->dimZ - 1);
+}
+
+/* Helper function for clusterUpdate. Returns the tile, along an axis with dim
+tiles, that contains the normalized device coordinate ndc, clamped. */
+GLint clusterTile(GLuint dim, GLdouble ndc) {
+	GLint tile = (GLint)floor((ndc + 1.0) * 0.5 * dim);
+	if (tile < 0)
+		return 0;
+	return (tile < (GLint)dim ? tile : (GLint)dim - 1);
+}
+
+/* Helper function for clusterUpdate. Computes a bounding sphere of each
+cluster, in camera coordinates, from the corners of the cluster. scaleX and
+scaleY convert normalized device coordinates to camera coordinates, at unit
+depth if perspective is non-zero and at any depth if not. */
+void clusterBound(clusterGrid *grid, int perspective, GLdouble scaleX,
+		GLdouble scaleY) {
+	GLuint i, j, k, c;
+	GLdouble lo[3], hi[3], depth[2], x[2], y[2], corner;
+	for (k = 0; k < grid->dimZ; k += 1) {
+		depth[0] = grid->near * pow(grid->far / grid->near,
+			(GLdouble)k / grid->dimZ);
+		depth[1] = grid->near * pow(grid->far / grid->near,
+			(GLdouble)(k + 1) / grid->dimZ);
+		for (j = 0; j < grid->dimY; j += 1)
+			for (i = 0; i < grid->dimX; i += 1) {
+				x[0] = (2.0 * i / grid->dimX - 1.0) * scaleX;
+				x[1] = (2.0 * (i + 1) / grid->dimX - 1.0) * scaleX;
+				y[0] = (2.0 * j / grid->dimY - 1.0) * scaleY;
+				y[1] = (2.0 * (j + 1) / grid->dimY - 1.0) * scaleY;
+				/* The box around the cluster's eight corners. */
+				vec3Set(lo, x[0], y[0], -depth[1]);
+				vec3Set(hi, x[1], y[1], -depth[0]);
+				if (perspective) {
+					vec2Set(lo, x[0] * depth[1], y[0] * depth[1]);
+					vec2Set(hi, x[1] * depth[1], y[1] * depth[1]);
+					for (c = 0; c < 2; c += 1) {
+						corner = x[c] * depth[0];
+						lo[0] = fmin(lo[0], corner);
+						hi[0] = fmax(hi[0], corner);
+						corner = y[c] * depth[0];
+						lo[1] = fmin(lo[1], corner);
+						hi[1] = fmax(hi[1], corner);
+					}
+				}
+				GLdouble *sphere = &(grid->spheres[
+					4 * ((k * grid->dimY + j) * grid->dimX + i)]);
+				vec3Add(lo, hi, sphere);
+				vec3Scale(0.5, sphere, sphere);
+				vec3Subtract(hi, lo, hi);
+				sphere[3] = 0.5 * vec3Length(hi);
+			}
+	}
+}
+
+/* Helper function for clusterUpdate. Returns 1 if the sphere (center and
+radius, in camera coordinates) might meet the spot light's cone, and 0 if
+not. The cone has the given apex, unit axis, cosine and sine of half of its
+angle, and range. */
+int clusterMeetsCone(GLdouble sphere[4], GLdouble apex[3], GLdouble axis[3],
+		GLdouble cosine, GLdouble sine, GLdouble range) {
+	GLdouble v[3], along, across;
+	vec3Subtract(sphere, apex, v);
+	along = vec3Dot(v, axis);
+	if (along > range + sphere[3] || along < -sphere[3])
+		return 0;
+	across = sqrt(fmax(vec3Dot(v, v) - along * along, 0.0));
+	/* The sphere's center's distance from the side of the cone. */
+	return (cosine * across - sine * along <= sphere[3]);
+}
+
+/* Helper function for clusterUpdate. Records that the light reaches the
+cluster. Returns 0 on success, non-zero if memory runs out. */
+int clusterAddPair(clusterGrid *grid, GLuint cluster, GLuint light) {
+	if (grid->pairNum == grid->pairCapacity) {
+		GLuint capacity = 2 * grid->pairCapacity + 1024;
+		GLuint *pairs = (GLuint *)realloc(grid->pairs,
+			capacity * 2 * sizeof(GLuint));
+		if (pairs == NULL)
+			return 1;
+		grid->pairs = pairs;
+		GLuint *indices = (GLuint *)realloc(grid->indices,
+			capacity * sizeof(GLuint));
+		if (indices == NULL)
+			return 1;
+		grid->indices = indices;
+		grid->pairCapacity = capacity;
+	}
+	grid->pairs[2 * grid->pairNum] = cluster;
+	grid->pairs[2 * grid->pairNum + 1] = light;
+	grid->pairNum += 1;
+	return 0;
+}
+
+/* Builds the grid for the given lights (at most clusterLIGHTMAX) as seen by
+cam, and uploads it. If shadows is not NULL, then shadows[n] is the index of
+light n's shadow in a shadow atlas, or -1 if it has none. A light reaches the
+clusters that meet the sphere of its range, or, for a spot light, that also
+meet its cone. Directional lights, and lights whose attenuation never falls
+below the cutoff, reach every cluster. Call it once per frame, after the
+camera and lights have moved. Returns 0 on success, non-zero on failure. */
+int clusterUpdate(clusterGrid *grid, GLuint lightNum, lightLight *lights[],
+		GLint shadows[], camCamera *cam) {
+	GLdouble rotInv[3][3], diff[3], center[3], axis[3], apex[3];
+	GLdouble range, radius, cosine, sine, depth, lo, hi, ndcLo, ndcHi;
+	GLint i, j, k, iLo, iHi, jLo, jHi, kLo, kHi;
+	GLuint n, c, sum;
+	if (lightNum > clusterLIGHTMAX) {
+		fprintf(stderr, "clusterUpdate: more than %d lights.\n",
+			clusterLIGHTMAX);
+		return 1;
+	}
+	/* The camera's depth range and its conversion from normalized device
+	coordinates to camera coordinates. */
+	int perspective = (cam->projectionType == camPERSPECTIVE);
+	GLdouble scaleX = cam->projection[camPROJR];
+	GLdouble scaleY = cam->projection[camPROJT];
+	if (perspective) {
+		scaleX /= -cam->projection[camPROJN];
+		scaleY /= -cam->projection[camPROJN];
+	}
+	if (grid->near != -cam->projection[camPROJN] ||
+			grid->far != -cam->projection[camPROJF] ||
+			grid->scaleX != scaleX || grid->scaleY != scaleY ||
+			grid->perspective != perspective) {
+		grid->near = -cam->projection[camPROJN];
+		grid->far = -cam->projection[camPROJF];
+		grid->scaleX = scaleX;
+		grid->scaleY = scaleY;
+		grid->perspective = perspective;
+		clusterBound(grid, perspective, scaleX, scaleY);
+	}
+	grid->forward[0] = -cam->rotation[0][2];
+	grid->forward[1] = -cam->rotation[1][2];
+	grid->forward[2] = -cam->rotation[2][2];
+	mat33Transpose(cam->rotation, rotInv);
+	grid->pairNum = 0;
+	grid->lightNum = lightNum;
+	for (n = 0; n < lightNum; n += 1) {
+		lightLight *light = lights[n];
+		GLfloat *record = grid->lights[n];
+		range = lightRange(light, clusterCUTOFF);
+		cosine = -1.0;
+		sine = 0.0;
+		if (range < 0.0)
+			range = grid->far + vecLength(3, light->translation) +
+				vecLength(3, cam->translation);
+		vecOpenGL(3, light->translation, record);
+		record[3] = light->lightType;
+		vecOpenGL(3, light->color, &record[4]);
+		record[7] = -2.0f;
+		vecOpenGL(3, light->attenuation, &record[8]);
+		record[11] = range;
+		record[12] = -light->rotation[0][2];
+		record[13] = -light->rotation[1][2];
+		record[14] = -light->rotation[2][2];
+		record[15] = (shadows == NULL ? -1.0f : (GLfloat)shadows[n]);
+		/* A directional light reaches everything. */
+		if (light->lightType == lightDIRECTIONAL) {
+			for (c = 0; c < grid->clusterNum; c += 1)
+				if (clusterAddPair(grid, c, n) != 0)
+					return 2;
+			continue;
+		}
+		/* The light's position and axis in camera coordinates. */
+		vecSubtract(3, light->translation, cam->translation, diff);
+		mat331Multiply(rotInv, diff, apex);
+		vec3Set(diff, -light->rotation[0][2], -light->rotation[1][2],
+			-light->rotation[2][2]);
+		mat331Multiply(rotInv, diff, axis);
+		vecCopy(3, apex, center);
+		radius = range;
+		if (light->lightType == lightSPOT) {
+			cosine = cos(0.5 * light->spotAngle);
+			sine = sin(0.5 * light->spotAngle);
+			record[7] = cosine;
+			/* A narrow cone fits in the sphere through its apex and rim, and a
+			wide one in the sphere around its rim. */
+			if (cosine >= M_SQRT1_2) {
+				radius = 0.5 * range / cosine;
+				vecScale(3, radius, axis, center);
+				vecAdd(3, apex, center, center);
+			} else if (cosine > 0.0) {
+				radius = range * sine;
+				vecScale(3, range * cosine, axis, center);
+				vecAdd(3, apex, center, center);
+			}
+		}
+		/* The clusters in the box around the bounding sphere. */
+		depth = -center[2];
+		lo = fmax(depth - radius, grid->near);
+		hi = fmin(depth + radius, grid->far);
+		if (lo > hi)
+			continue;
+		kLo = clusterSlice(grid, lo);
+		kHi = clusterSlice(grid, hi);
+		/* Over the depths from lo to hi, a coordinate's normalized device
+		coordinate is most extreme at the nearest or farthest depth. */
+		ndcLo = (center[0] - radius) / scaleX;
+		ndcHi = (center[0] + radius) / scaleX;
+		if (perspective) {
+			ndcLo /= (ndcLo < 0.0 ? lo : hi);
+			ndcHi /= (ndcHi > 0.0 ? lo : hi);
+		}
+		if (ndcLo > 1.0 || ndcHi < -1.0)
+			continue;
+		iLo = clusterTile(grid->dimX, ndcLo);
+		iHi = clusterTile(grid->dimX, ndcHi);
+		ndcLo = (center[1] - radius) / scaleY;
+		ndcHi = (center[1] + radius) / scaleY;
+		if (perspective) {
+			ndcLo /= (ndcLo < 0.0 ? lo : hi);
+			ndcHi /= (ndcHi > 0.0 ? lo : hi);
+		}
+		if (ndcLo > 1.0 || ndcHi < -1.0)
+			continue;
+		jLo = clusterTile(grid->dimY, ndcLo);
+		jHi = clusterTile(grid->dimY, ndcHi);
+		/* Test each cluster in the box against the sphere and the cone. */
+		for (k = kLo; k <= kHi; k += 1)
+			for (j = jLo; j <= jHi; j += 1)
+				for (i = iLo; i <= iHi; i += 1) {
+					c = (k * grid->dimY + j) * grid->dimX + i;
+					GLdouble *sphere = &(grid->spheres[4 * c]);
+					vec3Subtract(sphere, center, diff);
+					if (vec3Length(diff) > radius + sphere[3])
+						continue;
+					if (light->lightType == lightSPOT &&
+							!clusterMeetsCone(sphere, apex, axis, cosine, sine,
+								range))
+						continue;
+					if (clusterAddPair(grid, c, n) != 0)
+						return 2;
+				}
+	}
+	/* Sort the pairs into runs, by counting. */
+	for (c = 0; c < grid->clusterNum; c += 1)
+		grid->runs[2 * c + 1] = 0;
+	for (n = 0; n < grid->pairNum; n += 1)
+		grid->runs[2 * grid->pairs[2 * n] + 1] += 1;
+	sum = 0;
+	for (c = 0; c < grid->clusterNum; c += 1) {
+		grid->runs[2 * c] = sum;
+		sum += grid->runs[2 * c + 1];
+		grid->runs[2 * c + 1] = 0;
+	}
+	for (n = 0; n < grid->pairNum; n += 1) {
+		c = grid->pairs[2 * n];
+		grid->indices[grid->runs[2 * c] + grid->runs[2 * c + 1]] =
+			grid->pairs[2 * n + 1];
+		grid->runs[2 * c + 1] += 1;
+	}
+	/* Upload. Respecifying the texture buffers' storage lets the driver hand
+	out fresh memory instead of waiting for last frame's draws. */
+	glBindBuffer(GL_UNIFORM_BUFFER, grid->lightBuffer);
+	glBufferSubData(GL_UNIFORM_BUFFER, 0,
+		lightNum * clusterLIGHTDIM * sizeof(GLfloat), grid->lights);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, grid->runBuffer);
+	glBufferData(GL_TEXTURE_BUFFER, grid->clusterNum * 2 * sizeof(GLuint),
+		grid->runs, GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, grid->indexBuffer);
+	glBufferData(GL_TEXTURE_BUFFER,
+		(grid->pairNum > 0 ? grid->pairNum : 1) * sizeof(GLuint),
+		(grid->pairNum > 0 ? grid->indices : NULL), GL_STREAM_DRAW);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	return 0;
+}
+
+/* Connects the grid to the shader program that is in use: binds the lights
+to the uniform block binding clusterBINDING (to which the program's Lights
+block must be bound, with glUniformBlockBinding), binds the run and index
+textures to texture units textureUnitIndex and textureUnitIndex + 1, and loads
+the other uniforms, as described at the top of this file. viewport is the
+current viewport, as from glGetIntegerv(GL_VIEWPORT, ...). */
+void clusterRender(clusterGrid *grid, GLint viewport[4], GLint dimsLoc,
+		GLint scaleLoc, GLint depthLoc, GLint forwardLoc,
+		GLint textureUnitIndex, GLint gridLoc, GLint indicesLoc) {
+	GLfloat forward[3];
+	glBindBufferBase(GL_UNIFORM_BUFFER, clusterBINDING, grid->lightBuffer);
+	glActiveTexture(GL_TEXTURE0 + textureUnitIndex);
+	glBindTexture(GL_TEXTURE_BUFFER, grid->runTexture);
+	glUniform1i(gridLoc, textureUnitIndex);
+	glActiveTexture(GL_TEXTURE0 + textureUnitIndex + 1);
+	glBindTexture(GL_TEXTURE_BUFFER, grid->indexTexture);
+	glUniform1i(indicesLoc, textureUnitIndex + 1);
+	glUniform3i(dimsLoc, grid->dimX, grid->dimY, grid->dimZ);
+	glUniform4f(scaleLoc, (GLfloat)grid->dimX / viewport[2],
+		(GLfloat)grid->dimY / viewport[3],
+		-(GLfloat)grid->dimX * viewport[0] / viewport[2],
+		-(GLfloat)grid->dimY * viewport[1] / viewport[3]);
+	glUniform2f(depthLoc, grid->near, grid->dimZ / log(grid->far / grid->near));
+	vecOpenGL(3, grid->forward, forward);
+	glUniform3fv(forwardLoc, 1, forward);
+}
+
+/* Unbinds the textures bound by clusterRender. */
+void clusterUnrender(GLint textureUnitIndex) {
+	glActiveTexture(GL_TEXTURE0 + textureUnitIndex);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glActiveTexture(GL_TEXTURE0 + textureUnitIndex + 1);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+}
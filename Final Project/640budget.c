@@ -0,0 +1,312 @@
+/*** Memory budget ***/
+
+/* A memory budget accounts for the GPU memory held by the program's
+resources, and holds the textures to a limit. OpenGL does not report how much
+memory anything occupies, so the budget estimates it: from each texture's
+levels, as texMemorySize measures them, and from the sizes of each mesh's
+buffers and each shadow map's depth textures. Meshes and shadow maps are
+counted but never touched, since the program cannot draw without them. The
+textures are measured again every frame, so that images arriving from a
+texture loader are counted as they arrive.
+
+Once per frame, after the textures have been rendered, the program calls
+budgetUpdate. If the total exceeds the limit, then the budget drops the
+largest mipmap level of the least recently rendered texture (see
+texDropLevel), which frees about three quarters of that texture's memory, and
+repeats until the total fits or no texture can shrink further. A texture never
+shrinks below budgetMINSIZE texels on a side, nor below one level, and a
+texture that fails to shrink is passed over until it changes. For example:
+	budgetInitialize(&budget, 64 * 1024 * 1024);
+	budgetAddTexture(&budget, &tex, "grass");
+	budgetAddMesh(&budget, &meshGL, "ground");
+	...
+	while (...) {
+		render();
+		budgetUpdate(&budget);
+	}
+	budgetPrint(&budget, stderr);
+	budgetDestroy(&budget); */
+
+#define budgetTEXTURE 0
+#define budgetMESH 1
+#define budgetSHADOW 2
+#define budgetOTHER 3
+#define budgetKINDNUM 4
+#define budgetMINSIZE 64
+
+/* One resource. tex is NULL unless the resource is a texture. */
+typedef struct budgetEntry budgetEntry;
+struct budgetEntry {
+	int kind;
+	const char *label;
+	texTexture *tex;
+	GLsizeiptr size;
+	/* For a texture, its OpenGL name and width when last measured, its
+	renderNum when last seen, the frame when it was last rendered, and how many
+	levels the budget has dropped from it. */
+	GLuint openGL, width, renderNum, lastUse, droppedNum;
+	/* Non-zero if the texture failed to shrink when last measured. */
+	int stuck;
+};
+
+/* Feel free to read from this struct's members, but don't write to them. */
+typedef struct budgetBudget budgetBudget;
+struct budgetBudget {
+	GLsizeiptr limit, used;
+	GLsizeiptr sizes[budgetKINDNUM];
+	budgetEntry *entries;
+	GLuint entryNum, entryCapacity;
+	GLuint frame, droppedNum;
+	int overLimit;
+};
+
+/* Initializes an empty budget, whose textures may occupy whatever GPU memory
+the other resources leave of limit bytes. Returns 0 on success, non-zero on
+failure. On success, the user must call budgetDestroy when finished with the
+budget. */
+int budgetInitialize(budgetBudget *budget, GLsizeiptr limit) {
+	int kind;
+	budget->limit = limit;
+	budget->used = 0;
+	for (kind = 0; kind < budgetKINDNUM; kind += 1)
+		budget->sizes[kind] = 0;
+	budget->entries = NULL;
+	budget->entryNum = 0;
+	budget->entryCapacity = 0;
+	budget->frame = 0;
+	budget->droppedNum = 0;
+	budget->overLimit = 0;
+	return 0;
+}
+
+/* Deallocates the resources backing the budget, but not the resources that it
+accounts for. */
+void budgetDestroy(budgetBudget *budget) {
+	free(budget->entries);
+}
+
+/* Helper function for the adding functions. Appends an entry. Returns the
+entry, or NULL on failure. */
+budgetEntry *budgetAdd(budgetBudget *budget, int kind, const char *label,
+		GLsizeiptr size) {
+	budgetEntry *entry;
+	if (budget->entryNum == budget->entryCapacity) {
+		GLuint capacity = 2 * budget->entryCapacity + 16;
+		budgetEntry *entries = (budgetEntry *)realloc(budget->entries,
+			capacity * sizeof(budgetEntry));
+		if (entries == NULL) {
+			fprintf(stderr, "budgetAdd: realloc failed.\n");
+			return NULL;
+		}
+		budget->entries = entries;
+		budget->entryCapacity = capacity;
+	}
+	entry = &(budget->entries[budget->entryNum]);
+	entry->kind = kind;
+	entry->label = label;
+	entry->tex = NULL;
+	entry->size = size;
+	entry->openGL = 0;
+	entry->width = 0;
+	entry->renderNum = 0;
+	entry->lastUse = budget->frame;
+	entry->droppedNum = 0;
+	entry->stuck = 0;
+	budget->entryNum += 1;
+	budget->sizes[kind] += size;
+	budget->used += size;
+	return entry;
+}
+
+/* Accounts for size bytes of some other GPU resource, such as a buffer, of
+the given kind (budgetMESH, budgetSHADOW, or budgetOTHER). The label must stay
+valid for the life of the budget. Returns 0 on success, non-zero on
+failure. */
+int budgetAddBytes(budgetBudget *budget, int kind, const char *label,
+		GLsizeiptr size) {
+	if (kind <= budgetTEXTURE || kind >= budgetKINDNUM) {
+		fprintf(stderr, "budgetAddBytes: kind %d not in 1...%d.\n", kind,
+			budgetKINDNUM - 1);
+		return 1;
+	}
+	return (budgetAdd(budget, kind, label, size) == NULL);
+}
+
+/* Accounts for the texture, which the budget may shrink from now on. The
+texture must stay initialized for the life of the budget. Returns 0 on
+success, non-zero on failure. */
+int budgetAddTexture(budgetBudget *budget, texTexture *tex,
+		const char *label) {
+	budgetEntry *entry = budgetAdd(budget, budgetTEXTURE, label,
+		texMemorySize(tex));
+	if (entry == NULL)
+		return 1;
+	entry->tex = tex;
+	entry->openGL = tex->openGL;
+	entry->width = tex->width;
+	entry->renderNum = tex->renderNum;
+	return 0;
+}
+
+/* Accounts for the mesh's vertex, index, and position buffers. Returns 0 on
+success, non-zero on failure. */
+int budgetAddMesh(budgetBudget *budget, meshGLMesh *meshGL,
+		const char *label) {
+	GLsizeiptr size = (GLsizeiptr)meshGL->vertNum * meshGL->attrDim *
+		sizeof(GLdouble) + (GLsizeiptr)meshGL->triNum * 3 * sizeof(GLuint);
+	if (meshGL->positionBuffer != 0)
+		size += (GLsizeiptr)meshGL->vertNum * 3 * sizeof(GLfloat);
+	return budgetAddBytes(budget, budgetMESH, label, size);
+}
+
+/* Accounts for the shadow map's depth textures, including its cache of the
+static casters, if it has one. Returns 0 on success, non-zero on failure. */
+int budgetAddShadowMap(budgetBudget *budget, shadowMap *sdwMap,
+		const char *label) {
+	GLsizeiptr size = (GLsizeiptr)sdwMap->width * sdwMap->height *
+		sizeof(GLfloat);
+	if (sdwMap->staticTexture != 0)
+		size *= 2;
+	return budgetAddBytes(budget, budgetSHADOW, label, size);
+}
+
+/* Accounts for the shadow atlas's depth texture. Returns 0 on success,
+non-zero on failure. */
+int budgetAddShadowAtlas(budgetBudget *budget, shadowAtlas *atlas,
+		const char *label) {
+	return budgetAddBytes(budget, budgetSHADOW, label,
+		(GLsizeiptr)atlas->size * atlas->size * sizeof(GLfloat));
+}
+
+/* Accounts for the shadow cube's six depth faces. Returns 0 on success,
+non-zero on failure. */
+int budgetAddShadowCube(budgetBudget *budget, shadowCube *cube,
+		const char *label) {
+	return budgetAddBytes(budget, budgetSHADOW, label,
+		(GLsizeiptr)cube->size * cube->size * 6 * sizeof(GLfloat));
+}
+
+/* Accounts for the indirect batch's copies of its meshes and for its per-draw
+buffers, at their current capacity. Returns 0 on success, non-zero on
+failure. */
+int budgetAddBatch(budgetBudget *budget, indirectBatch *batch,
+		const char *label) {
+	GLsizeiptr size = (GLsizeiptr)batch->vertNum * batch->attrDim *
+		sizeof(GLdouble) + (GLsizeiptr)batch->triNum * 3 * sizeof(GLuint);
+	if (batch->positionBuffer != 0)
+		size += (GLsizeiptr)batch->vertNum * 3 * sizeof(GLfloat);
+	size += (GLsizeiptr)batch->capacity * (sizeof(indirectCommand) +
+		indirectINSTANCEDIM * sizeof(GLfloat) + sizeof(GLuint));
+	return budgetAddBytes(budget, budgetMESH, label, size);
+}
+
+/* Helper function for budgetUpdate. Measures the texture again, if it has
+changed since the last measurement. */
+void budgetMeasure(budgetBudget *budget, budgetEntry *entry) {
+	GLsizeiptr size;
+	if (entry->openGL == entry->tex->openGL &&
+			entry->width == entry->tex->width)
+		return;
+	size = texMemorySize(entry->tex);
+	budget->sizes[budgetTEXTURE] += size - entry->size;
+	budget->used += size - entry->size;
+	entry->size = size;
+	entry->openGL = entry->tex->openGL;
+	entry->width = entry->tex->width;
+	entry->stuck = 0;
+}
+
+/* Helper function for budgetUpdate. Returns the least recently rendered
+texture that can still shrink, or NULL if there is none. A texture with only
+one level, such as one without mipmaps, is marked stuck, so that it is
+queried only once. */
+budgetEntry *budgetVictim(budgetBudget *budget) {
+	budgetEntry *entry, *victim = NULL;
+	GLuint i;
+	for (i = 0; i < budget->entryNum; i += 1) {
+		entry = &(budget->entries[i]);
+		if (entry->tex == NULL || entry->stuck ||
+				entry->tex->width < 2 * budgetMINSIZE ||
+				entry->tex->height < 2 * budgetMINSIZE)
+			continue;
+		if (texLevelNum(entry->tex) < 2) {
+			entry->stuck = 1;
+			continue;
+		}
+		if (victim == NULL || entry->lastUse < victim->lastUse ||
+				(entry->lastUse == victim->lastUse &&
+				entry->size > victim->size))
+			victim = entry;
+	}
+	return victim;
+}
+
+/* To be called on the OpenGL thread once per frame, after rendering, when no
+texture is bound. Notes which textures were rendered, measures any that have
+changed, and, while the total exceeds the limit, shrinks the least recently
+rendered textures. Returns the number of levels dropped. */
+GLuint budgetUpdate(budgetBudget *budget) {
+	budgetEntry *entry;
+	GLuint i, droppedNum = 0;
+	budget->frame += 1;
+	for (i = 0; i < budget->entryNum; i += 1) {
+		entry = &(budget->entries[i]);
+		if (entry->tex == NULL)
+			continue;
+		if (entry->renderNum != entry->tex->renderNum) {
+			entry->renderNum = entry->tex->renderNum;
+			entry->lastUse = budget->frame;
+		}
+		budgetMeasure(budget, entry);
+	}
+	while (budget->used > budget->limit) {
+		entry = budgetVictim(budget);
+		if (entry == NULL)
+			break;
+		if (texDropLevel(entry->tex) != 0) {
+			entry->stuck = 1;
+			continue;
+		}
+		budgetMeasure(budget, entry);
+		entry->droppedNum += 1;
+		droppedNum += 1;
+	}
+	budget->droppedNum += droppedNum;
+	/* Complain once per episode of being over the limit, not every frame. */
+	if (budget->used > budget->limit && !budget->overLimit)
+		fprintf(stderr, "budgetUpdate: %.1f MB exceeds the limit of %.1f MB, "
+			"and no texture can shrink further.\n",
+			budget->used / 1048576.0, budget->limit / 1048576.0);
+	budget->overLimit = (budget->used > budget->limit);
+	return droppedNum;
+}
+
+/* Changes the limit, in bytes. Lowering it takes effect at the next
+budgetUpdate. Raising it does not grow any texture back. */
+void budgetSetLimit(budgetBudget *budget, GLsizeiptr limit) {
+	budget->limit = limit;
+}
+
+/* Prints the budget's usage, by kind and by texture, to the given file (such
+as stderr). */
+void budgetPrint(budgetBudget *budget, FILE *file) {
+	const char *kindNames[budgetKINDNUM] = {"textures", "meshes",
+		"shadow maps", "other"};
+	budgetEntry *entry;
+	GLuint i;
+	int kind;
+	fprintf(file, "budget: %.1f of %.1f MB in use.\n",
+		budget->used / 1048576.0, budget->limit / 1048576.0);
+	for (kind = 0; kind < budgetKINDNUM; kind += 1)
+		fprintf(file, "budget:   %-12s %8.1f MB\n", kindNames[kind],
+			budget->sizes[kind] / 1048576.0);
+	for (i = 0; i < budget->entryNum; i += 1) {
+		entry = &(budget->entries[i]);
+		if (entry->tex != NULL)
+			fprintf(file, "budget:   %-12s %8.1f MB, %u x %u x %u, %u levels "
+				"dropped, last rendered %u frames ago\n", entry->label,
+				entry->size / 1048576.0, entry->tex->width,
+				entry->tex->height, entry->tex->layerNum, entry->droppedNum,
+				budget->frame - entry->lastUse);
+	}
+}
@@ -0,0 +1,637 @@
+/*** Streaming terrain ***/
+
+/* A terrain is a landscape too large to keep in memory all at once. Its
+heights live in a file of width * height 32-bit floats, with the height at
+grid point (i, j) at index i * height + j, just as in meshInitializeLandscape.
+The file is mapped into memory rather than read, so the operating system pages
+in only the parts that are used, and drops them again when it needs the space.
+
+The grid is cut into square chunks of chunkSize x chunkSize quads. Only the
+chunks near the camera are in OpenGL. Once per frame, the OpenGL thread calls
+terrainUpdate, which queues the chunks that have come within range, uploads
+some of the chunks that the worker threads have finished building, and evicts
+the chunks that have gone out of range. Then terrainRender draws the loaded
+chunks that are in the camera's viewing volume. For example:
+	GLint attrLocs[3] = {positionLoc, texCoordsLoc, normalLoc};
+	terrainInitialize(&terrain, "heights.raw", 4097, 4097, 64, 1.0,
+		attrLocs, 2);
+	terrainSetDistances(&terrain, 600.0, 80.0);
+	...
+	while (...) {
+		terrainUpdate(&terrain, &cam, 4);
+		...set the shader program and its uniforms...
+		terrainRender(&terrain, &cam);
+	}
+	terrainDestroy(&terrain);
+
+Each chunk has one vertex buffer, at full resolution, with the same attributes
+as meshInitializeLandscape: XYZ, ST, and a normal NOP. The normals come from
+central differences of the heights, so they agree along the borders between
+chunks. The triangles are geomipmapped: at level L, a chunk is drawn with
+every 2^L-th vertex in each direction, and the level grows with the distance
+from the camera. Neighboring chunks are kept within one level of each other.
+Along an edge shared with a coarser neighbor, the chunk's odd edge vertices
+are collapsed onto their even neighbors, so that the edge matches the
+neighbor's exactly and no cracks open. The triangles of every level, under
+every combination of collapsed edges, sit in one element buffer shared by all
+chunks. */
+
+#define terrainLEVELMAX 6
+#define terrainTHREADMAX 8
+#define terrainATTRDIM 8
+#define terrainEMPTY 0
+#define terrainQUEUED 1
+#define terrainBUILDING 2
+#define terrainBUILT 3
+#define terrainLOADED 4
+
+/* The bits of an edge mask, naming the edges of a chunk that meet a coarser
+neighbor: the edges at minimum i, maximum i, minimum j, and maximum j. */
+#define terrainEDGEIMIN 1
+#define terrainEDGEIMAX 2
+#define terrainEDGEJMIN 4
+#define terrainEDGEJMAX 8
+#define terrainMASKNUM 16
+
+/* The status, the vertices, and the bounds are guarded by the terrain's
+mutex. The bounds are written by the worker that builds the chunk. The level
+and the OpenGL names belong to the OpenGL thread. level is -1 unless the chunk
+is loaded. */
+typedef struct terrainChunk terrainChunk;
+struct terrainChunk {
+	int status;
+	GLfloat *vert;
+	GLdouble center[3], halfSize[3], radius;
+	GLint level;
+	GLuint buffer, vao;
+};
+
+/* Feel free to read from this struct's members, but don't write to them,
+except through accessor functions. */
+typedef struct terrainTerrain terrainTerrain;
+struct terrainTerrain {
+	const GLfloat *heights;
+	size_t mappedSize;
+	GLuint width, height, chunkSize, chunkNumI, chunkNumJ, levelNum;
+	GLdouble spacing, loadRadius, evictRadius, lodDistance;
+	GLint attrLocs[3];
+	terrainChunk *chunks;
+	/* The chunks that are not empty, roughly nearest first. */
+	GLuint *resident;
+	GLuint residentNum;
+	GLuint indexBuffer;
+	GLuint indexStart[terrainLEVELMAX][terrainMASKNUM];
+	GLuint indexCount[terrainLEVELMAX][terrainMASKNUM];
+	pthread_t threads[terrainTHREADMAX];
+	GLuint threadNum;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int quitting;
+	/* Statistics from the latest terrainUpdate and terrainRender. */
+	GLuint loadedNum, drawnNum, drawnTriNum;
+};
+
+/* Returns the height at grid point (i, j), clamped to the grid. */
+GLdouble terrainGridHeight(terrainTerrain *terrain, GLint i, GLint j) {
+	if (i < 0)
+		i = 0;
+	else if (i >= (GLint)terrain->width)
+		i = terrain->width - 1;
+	if (j < 0)
+		j = 0;
+	else if (j >= (GLint)terrain->height)
+		j = terrain->height - 1;
+	return terrain->heights[(size_t)i * terrain->height + j];
+}
+
+/* Returns the height of the terrain at world coordinates (x, y), by bilinear
+interpolation of the grid. Outside the grid, the height at the nearest edge is
+used. Safe to call from any thread. */
+GLdouble terrainHeight(terrainTerrain *terrain, GLdouble x, GLdouble y) {
+	GLdouble s = x / terrain->spacing, t = y / terrain->spacing;
+	s = fmin(fmax(s, 0.0), terrain->width - 1.0);
+	t = fmin(fmax(t, 0.0), terrain->height - 1.0);
+	GLint i = (GLint)floor(s), j = (GLint)floor(t);
+	s -= i;
+	t -= j;
+	return (1.0 - s) * ((1.0 - t) * terrainGridHeight(terrain, i, j) +
+		t * terrainGridHeight(terrain, i, j + 1)) +
+		s * ((1.0 - t) * terrainGridHeight(terrain, i + 1, j) +
+		t * terrainGridHeight(terrain, i + 1, j + 1));
+}
+
+/* Helper function for terrainWork. Builds the vertices of the chunk at chunk
+coordinates (ci, cj) into vert, which has room for (chunkSize + 1)^2 vertices,
+and computes the chunk's bounds. */
+void terrainBuild(terrainTerrain *terrain, GLuint ci, GLuint cj,
+		GLfloat *vert, GLdouble center[3], GLdouble halfSize[3]) {
+	GLuint n = terrain->chunkSize, a, b;
+	GLint i, j;
+	GLdouble z, zMin = 0.0, zMax = 0.0, normal[3], s = terrain->spacing;
+	for (a = 0; a <= n; a += 1)
+		for (b = 0; b <= n; b += 1) {
+			i = ci * n + a;
+			j = cj * n + b;
+			z = terrainGridHeight(terrain, i, j);
+			if ((a == 0 && b == 0) || z < zMin)
+				zMin = z;
+			if ((a == 0 && b == 0) || z > zMax)
+				zMax = z;
+			/* Clamping makes the differences one-sided at the grid's edges, so
+			the step shrinks to match. */
+			normal[0] = -(terrainGridHeight(terrain, i + 1, j) -
+				terrainGridHeight(terrain, i - 1, j)) /
+				(((i + 1 < (GLint)terrain->width) + (i > 0)) * s);
+			normal[1] = -(terrainGridHeight(terrain, i, j + 1) -
+				terrainGridHeight(terrain, i, j - 1)) /
+				(((j + 1 < (GLint)terrain->height) + (j > 0)) * s);
+			normal[2] = 1.0;
+			vecUnit(3, normal, normal);
+			GLfloat *v = &vert[(a * (n + 1) + b) * terrainATTRDIM];
+			v[0] = i * s;
+			v[1] = j * s;
+			v[2] = z;
+			v[3] = i;
+			v[4] = j;
+			vecOpenGL(3, normal, &v[5]);
+		}
+	vec3Set(center, (ci * n + 0.5 * n) * s, (cj * n + 0.5 * n) * s,
+		0.5 * (zMin + zMax));
+	vec3Set(halfSize, 0.5 * n * s, 0.5 * n * s, 0.5 * (zMax - zMin));
+}
+
+/* Helper function for terrainInitialize. The body of each worker thread. It
+repeatedly claims the first queued chunk in the resident list, which is
+roughly the nearest, and builds it, until the terrain quits. */
+void *terrainWork(void *arg) {
+	terrainTerrain *terrain = (terrainTerrain *)arg;
+	GLuint k, index, n = terrain->chunkSize;
+	GLdouble center[3], halfSize[3];
+	GLfloat *vert;
+	pthread_mutex_lock(&(terrain->mutex));
+	while (!terrain->quitting) {
+		for (k = 0; k < terrain->residentNum; k += 1)
+			if (terrain->chunks[terrain->resident[k]].status == terrainQUEUED)
+				break;
+		if (k == terrain->residentNum) {
+			pthread_cond_wait(&(terrain->cond), &(terrain->mutex));
+			continue;
+		}
+		index = terrain->resident[k];
+		terrain->chunks[index].status = terrainBUILDING;
+		/* Build outside the lock. Only this thread touches a building chunk,
+		so it can be found again by index afterward. */
+		pthread_mutex_unlock(&(terrain->mutex));
+		vert = (GLfloat *)malloc((n + 1) * (n + 1) * terrainATTRDIM *
+			sizeof(GLfloat));
+		if (vert == NULL)
+			fprintf(stderr, "terrainWork: malloc failed.\n");
+		else
+			terrainBuild(terrain, index / terrain->chunkNumJ,
+				index % terrain->chunkNumJ, vert, center, halfSize);
+		pthread_mutex_lock(&(terrain->mutex));
+		terrainChunk *chunk = &(terrain->chunks[index]);
+		chunk->vert = vert;
+		if (vert != NULL) {
+			vecCopy(3, center, chunk->center);
+			vecCopy(3, halfSize, chunk->halfSize);
+			chunk->radius = vecLength(3, halfSize);
+		}
+		chunk->status = terrainBUILT;
+	}
+	pthread_mutex_unlock(&(terrain->mutex));
+	return NULL;
+}
+
+/* Helper function for terrainIndices. Returns the index, within a chunk's
+vertices, of the vertex at (a, b), after collapsing the odd vertices on the
+edges in mask onto their even neighbors at the given step. */
+GLuint terrainCollapse(GLuint n, GLuint step, GLuint mask, GLuint a,
+		GLuint b) {
+	if (((mask & terrainEDGEIMIN) && a == 0) ||
+			((mask & terrainEDGEIMAX) && a == n))
+		b -= ((b / step) % 2) * step;
+	if (((mask & terrainEDGEJMIN) && b == 0) ||
+			((mask & terrainEDGEJMAX) && b == n))
+		a -= ((a / step) % 2) * step;
+	return a * (n + 1) + b;
+}
+
+/* Helper function for terrainInitialize. Writes the triangles of one level,
+with the edges in mask collapsed, to tri, if tri is not NULL. Triangles that
+collapse to nothing are left out. Returns the number of indices. */
+GLuint terrainIndices(GLuint n, GLuint level, GLuint mask, GLuint *tri) {
+	GLuint step = 1 << level, a, b, k, count = 0, quad[4];
+	for (a = 0; a < n; a += step)
+		for (b = 0; b < n; b += step) {
+			quad[0] = terrainCollapse(n, step, mask, a, b);
+			quad[1] = terrainCollapse(n, step, mask, a + step, b);
+			quad[2] = terrainCollapse(n, step, mask, a + step, b + step);
+			quad[3] = terrainCollapse(n, step, mask, a, b + step);
+			/* The triangles (0, 1, 2) and (0, 2, 3), counterclockwise from
+			above. */
+			for (k = 1; k < 3; k += 1) {
+				if (quad[0] == quad[k] || quad[k] == quad[k + 1] ||
+						quad[k + 1] == quad[0])
+					continue;
+				if (tri != NULL) {
+					tri[count] = quad[0];
+					tri[count + 1] = quad[k];
+					tri[count + 2] = quad[k + 1];
+				}
+				count += 3;
+			}
+		}
+	return count;
+}
+
+/* Helper function for terrainInitialize. Builds the shared element buffer.
+Returns 0 on success, non-zero on failure. */
+int terrainIndexBufferInitialize(terrainTerrain *terrain) {
+	GLuint level, mask, total = 0;
+	for (level = 0; level < terrain->levelNum; level += 1)
+		for (mask = 0; mask < terrainMASKNUM; mask += 1) {
+			terrain->indexStart[level][mask] = total;
+			terrain->indexCount[level][mask] = terrainIndices(
+				terrain->chunkSize, level, mask, NULL);
+			total += terrain->indexCount[level][mask];
+		}
+	GLuint *tri = (GLuint *)malloc(total * sizeof(GLuint));
+	if (tri == NULL) {
+		fprintf(stderr, "terrainInitialize: malloc failed.\n");
+		return 1;
+	}
+	for (level = 0; level < terrain->levelNum; level += 1)
+		for (mask = 0; mask < terrainMASKNUM; mask += 1)
+			terrainIndices(terrain->chunkSize, level, mask,
+				&tri[terrain->indexStart[level][mask]]);
+	glGenBuffers(1, &(terrain->indexBuffer));
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrain->indexBuffer);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, total * sizeof(GLuint),
+		(GLvoid *)tri, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	free(tri);
+	return 0;
+}
+
+/* Initializes the terrain from the heights in the file at path, which must
+hold exactly width * height floats. chunkSize must be a power of two, at least
+2, and it must divide width - 1 and height - 1. Grid point (i, j) sits at world
+coordinates (i * spacing, j * spacing). attrLocs holds the locations of the
+position, texture coordinates, and normal in the shader program that will
+render the terrain. threadNum (at most terrainTHREADMAX) worker threads build
+the chunks. Returns 0 on success, non-zero on failure. On success, the user
+must call terrainDestroy when finished with the terrain. */
+int terrainInitialize(terrainTerrain *terrain, const char *path,
+		GLuint width, GLuint height, GLuint chunkSize, GLdouble spacing,
+		GLint attrLocs[3], GLuint threadNum) {
+	struct stat info;
+	GLuint i;
+	if (chunkSize < 2 || (chunkSize & (chunkSize - 1)) != 0 || width < 2 ||
+			height < 2 || (width - 1) % chunkSize != 0 ||
+			(height - 1) % chunkSize != 0) {
+		fprintf(stderr, "terrainInitialize: %d x %d grid in chunks of %d.\n",
+			width, height, chunkSize);
+		return 1;
+	}
+	if (threadNum < 1 || threadNum > terrainTHREADMAX) {
+		fprintf(stderr, "terrainInitialize: %d threads not in 1...%d.\n",
+			threadNum, terrainTHREADMAX);
+		return 2;
+	}
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "terrainInitialize: cannot open %s.\n", path);
+		return 3;
+	}
+	terrain->mappedSize = (size_t)width * height * sizeof(GLfloat);
+	if (fstat(fd, &info) != 0 || (size_t)info.st_size != terrain->mappedSize) {
+		fprintf(stderr, "terrainInitialize: %s is not %d x %d floats.\n",
+			path, width, height);
+		close(fd);
+		return 4;
+	}
+	void *mapped = mmap(NULL, terrain->mappedSize, PROT_READ, MAP_PRIVATE,
+		fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		fprintf(stderr, "terrainInitialize: mmap failed.\n");
+		return 5;
+	}
+	terrain->heights = (const GLfloat *)mapped;
+	terrain->width = width;
+	terrain->height = height;
+	terrain->chunkSize = chunkSize;
+	terrain->chunkNumI = (width - 1) / chunkSize;
+	terrain->chunkNumJ = (height - 1) / chunkSize;
+	for (terrain->levelNum = 1; terrain->levelNum < terrainLEVELMAX &&
+			(1u << terrain->levelNum) <= chunkSize; terrain->levelNum += 1);
+	terrain->spacing = spacing;
+	terrain->loadRadius = 8.0 * chunkSize * spacing;
+	terrain->evictRadius = 9.0 * chunkSize * spacing;
+	terrain->lodDistance = 2.0 * chunkSize * spacing;
+	for (i = 0; i < 3; i += 1)
+		terrain->attrLocs[i] = attrLocs[i];
+	GLuint chunkNum = terrain->chunkNumI * terrain->chunkNumJ;
+	terrain->chunks = (terrainChunk *)malloc(chunkNum * sizeof(terrainChunk));
+	terrain->resident = (GLuint *)malloc(chunkNum * sizeof(GLuint));
+	if (terrain->chunks == NULL || terrain->resident == NULL) {
+		fprintf(stderr, "terrainInitialize: malloc failed.\n");
+		free(terrain->chunks);
+		free(terrain->resident);
+		munmap(mapped, terrain->mappedSize);
+		return 6;
+	}
+	for (i = 0; i < chunkNum; i += 1) {
+		terrain->chunks[i].status = terrainEMPTY;
+		terrain->chunks[i].vert = NULL;
+		terrain->chunks[i].level = -1;
+	}
+	terrain->residentNum = 0;
+	terrain->loadedNum = 0;
+	terrain->drawnNum = 0;
+	terrain->drawnTriNum = 0;
+	terrain->quitting = 0;
+	if (terrainIndexBufferInitialize(terrain) != 0) {
+		free(terrain->chunks);
+		free(terrain->resident);
+		munmap(mapped, terrain->mappedSize);
+		return 7;
+	}
+	if (pthread_mutex_init(&(terrain->mutex), NULL) != 0) {
+		fprintf(stderr, "terrainInitialize: pthread_mutex_init failed.\n");
+		glDeleteBuffers(1, &(terrain->indexBuffer));
+		free(terrain->chunks);
+		free(terrain->resident);
+		munmap(mapped, terrain->mappedSize);
+		return 8;
+	}
+	if (pthread_cond_init(&(terrain->cond), NULL) != 0) {
+		fprintf(stderr, "terrainInitialize: pthread_cond_init failed.\n");
+		pthread_mutex_destroy(&(terrain->mutex));
+		glDeleteBuffers(1, &(terrain->indexBuffer));
+		free(terrain->chunks);
+		free(terrain->resident);
+		munmap(mapped, terrain->mappedSize);
+		return 9;
+	}
+	for (terrain->threadNum = 0; terrain->threadNum < threadNum;
+			terrain->threadNum += 1)
+		if (pthread_create(&(terrain->threads[terrain->threadNum]), NULL,
+				terrainWork, terrain) != 0) {
+			fprintf(stderr, "terrainInitialize: pthread_create failed.\n");
+			break;
+		}
+	/* Fewer threads than requested still get the job done. */
+	if (terrain->threadNum == 0) {
+		pthread_cond_destroy(&(terrain->cond));
+		pthread_mutex_destroy(&(terrain->mutex));
+		glDeleteBuffers(1, &(terrain->indexBuffer));
+		free(terrain->chunks);
+		free(terrain->resident);
+		munmap(mapped, terrain->mappedSize);
+		return 10;
+	}
+	return 0;
+}
+
+/* Sets how far from the camera, horizontally, chunks are loaded, and the
+distance within which chunks are drawn at full resolution. Beyond that
+distance, each doubling of the distance drops one level of detail. A chunk is
+evicted once it is a chunk's width beyond loadRadius, so that a camera
+hovering at the boundary does not load and evict the same chunks over and
+over. By default, loadRadius is 8 chunks and lodDistance is 2 chunks. */
+void terrainSetDistances(terrainTerrain *terrain, GLdouble loadRadius,
+		GLdouble lodDistance) {
+	terrain->loadRadius = loadRadius;
+	terrain->evictRadius = loadRadius + terrain->chunkSize * terrain->spacing;
+	terrain->lodDistance = lodDistance;
+}
+
+/* Helper function for terrainUpdate. Returns the horizontal distance from the
+point to the center of the chunk at chunk coordinates (ci, cj). */
+GLdouble terrainChunkDistance(terrainTerrain *terrain, GLint ci, GLint cj,
+		GLdouble point[3]) {
+	GLdouble size = terrain->chunkSize * terrain->spacing;
+	GLdouble dx = (ci + 0.5) * size - point[0];
+	GLdouble dy = (cj + 0.5) * size - point[1];
+	return sqrt(dx * dx + dy * dy);
+}
+
+/* Helper function for terrainUpdate. Copies a built chunk's vertices into
+OpenGL and frees them. */
+void terrainUpload(terrainTerrain *terrain, terrainChunk *chunk) {
+	GLuint i, n = terrain->chunkSize, dims[3] = {3, 2, 3}, offset = 0;
+	glGenBuffers(1, &(chunk->buffer));
+	glBindBuffer(GL_ARRAY_BUFFER, chunk->buffer);
+	glBufferData(GL_ARRAY_BUFFER,
+		(n + 1) * (n + 1) * terrainATTRDIM * sizeof(GLfloat),
+		(GLvoid *)chunk->vert, GL_STATIC_DRAW);
+	glGenVertexArrays(1, &(chunk->vao));
+	glBindVertexArray(chunk->vao);
+	for (i = 0; i < 3; i += 1) {
+		if (terrain->attrLocs[i] >= 0) {
+			glEnableVertexAttribArray(terrain->attrLocs[i]);
+			glVertexAttribPointer(terrain->attrLocs[i], dims[i], GL_FLOAT,
+				GL_FALSE, terrainATTRDIM * sizeof(GLfloat),
+				BUFFER_OFFSET(offset * sizeof(GLfloat)));
+		}
+		offset += dims[i];
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrain->indexBuffer);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	free(chunk->vert);
+	chunk->vert = NULL;
+	chunk->level = 0;
+}
+
+/* Helper function for terrainUpdate and terrainDestroy. Releases whatever the
+chunk holds. The chunk must not be building. */
+void terrainUnload(terrainChunk *chunk) {
+	if (chunk->level >= 0) {
+		glDeleteVertexArrays(1, &(chunk->vao));
+		glDeleteBuffers(1, &(chunk->buffer));
+		chunk->level = -1;
+	}
+	free(chunk->vert);
+	chunk->vert = NULL;
+	chunk->status = terrainEMPTY;
+}
+
+/* Helper function for terrainUpdate. Returns the index of the loaded chunk
+next to the chunk at index, across the given edge, or -1 if there is none. */
+GLint terrainNeighbor(terrainTerrain *terrain, GLuint index, GLuint edge) {
+	GLuint ci = index / terrain->chunkNumJ, cj = index % terrain->chunkNumJ;
+	GLint neighbor = -1;
+	if (edge == terrainEDGEIMIN && ci > 0)
+		neighbor = index - terrain->chunkNumJ;
+	else if (edge == terrainEDGEIMAX && ci + 1 < terrain->chunkNumI)
+		neighbor = index + terrain->chunkNumJ;
+	else if (edge == terrainEDGEJMIN && cj > 0)
+		neighbor = index - 1;
+	else if (edge == terrainEDGEJMAX && cj + 1 < terrain->chunkNumJ)
+		neighbor = index + 1;
+	if (neighbor >= 0 && terrain->chunks[neighbor].level < 0)
+		neighbor = -1;
+	return neighbor;
+}
+
+/* Helper function for terrainUpdate. Picks each loaded chunk's level from the
+distance between the camera and the chunk's bounding box. Then lowers levels
+until neighboring chunks are within one level of each other, which is what
+the collapsed edges can stitch. */
+void terrainChooseLevels(terrainTerrain *terrain, GLdouble eye[3]) {
+	GLuint k, e, changed = 1;
+	GLdouble diff[3], dist;
+	GLint level, neighbor;
+	for (k = 0; k < terrain->residentNum; k += 1) {
+		terrainChunk *chunk = &(terrain->chunks[terrain->resident[k]]);
+		if (chunk->level < 0)
+			continue;
+		for (e = 0; e < 3; e += 1)
+			diff[e] = fmax(fabs(eye[e] - chunk->center[e]) -
+				chunk->halfSize[e], 0.0);
+		dist = vecLength(3, diff);
+		level = 0;
+		while (level + 1 < (GLint)terrain->levelNum &&
+				dist >= terrain->lodDistance * (1 << level))
+			level += 1;
+		chunk->level = level;
+	}
+	while (changed) {
+		changed = 0;
+		for (k = 0; k < terrain->residentNum; k += 1) {
+			terrainChunk *chunk = &(terrain->chunks[terrain->resident[k]]);
+			if (chunk->level < 0)
+				continue;
+			for (e = terrainEDGEIMIN; e <= terrainEDGEJMAX; e *= 2) {
+				neighbor = terrainNeighbor(terrain, terrain->resident[k], e);
+				if (neighbor >= 0 &&
+						chunk->level > terrain->chunks[neighbor].level + 1) {
+					chunk->level = terrain->chunks[neighbor].level + 1;
+					changed = 1;
+				}
+			}
+		}
+	}
+}
+
+/* Brings the loaded chunks up to date with the camera. Evicts the chunks that
+are out of range, uploads at most uploadMax of the chunks that the workers
+have built, queues the chunks that have come into range, nearest first, and
+picks every loaded chunk's level of detail. Call this once per frame, from the
+OpenGL thread, before terrainRender. */
+void terrainUpdate(terrainTerrain *terrain, camCamera *cam, GLuint uploadMax) {
+	GLuint k, kept = 0, uploadNum = 0, queuedNum = 0, index;
+	GLint ci, cj, r, rMax, centerI, centerJ;
+	GLdouble *eye = cam->translation;
+	GLdouble size = terrain->chunkSize * terrain->spacing;
+	pthread_mutex_lock(&(terrain->mutex));
+	for (k = 0; k < terrain->residentNum; k += 1) {
+		index = terrain->resident[k];
+		terrainChunk *chunk = &(terrain->chunks[index]);
+		int distant = (terrainChunkDistance(terrain, index / terrain->chunkNumJ,
+			index % terrain->chunkNumJ, eye) > terrain->evictRadius);
+		if (chunk->status == terrainQUEUED && distant)
+			chunk->status = terrainEMPTY;
+		else if (chunk->status == terrainBUILT &&
+				(distant || chunk->vert == NULL))
+			terrainUnload(chunk);
+		else if (chunk->status == terrainLOADED && distant)
+			terrainUnload(chunk);
+		else if (chunk->status == terrainBUILT && uploadNum < uploadMax) {
+			terrainUpload(terrain, chunk);
+			chunk->status = terrainLOADED;
+			uploadNum += 1;
+		}
+		if (chunk->status != terrainEMPTY) {
+			terrain->resident[kept] = index;
+			kept += 1;
+		}
+	}
+	terrain->residentNum = kept;
+	/* Walk square rings of chunks outward from the camera's chunk. */
+	centerI = (GLint)floor(eye[0] / size);
+	centerJ = (GLint)floor(eye[1] / size);
+	rMax = (GLint)ceil(terrain->loadRadius / size) + 1;
+	for (r = 0; r <= rMax; r += 1)
+		for (ci = centerI - r; ci <= centerI + r; ci += 1)
+			for (cj = centerJ - r; cj <= centerJ + r; cj += 1) {
+				if (abs(ci - centerI) != r && abs(cj - centerJ) != r)
+					continue;
+				if (ci < 0 || ci >= (GLint)terrain->chunkNumI || cj < 0 ||
+						cj >= (GLint)terrain->chunkNumJ)
+					continue;
+				index = ci * terrain->chunkNumJ + cj;
+				if (terrain->chunks[index].status != terrainEMPTY ||
+						terrainChunkDistance(terrain, ci, cj, eye) >
+						terrain->loadRadius)
+					continue;
+				terrain->chunks[index].status = terrainQUEUED;
+				terrain->resident[terrain->residentNum] = index;
+				terrain->residentNum += 1;
+				queuedNum += 1;
+			}
+	if (queuedNum > 0)
+		pthread_cond_broadcast(&(terrain->cond));
+	pthread_mutex_unlock(&(terrain->mutex));
+	/* From here on, only the OpenGL thread's own fields are touched. */
+	terrainChooseLevels(terrain, eye);
+	terrain->loadedNum = 0;
+	for (k = 0; k < terrain->residentNum; k += 1)
+		if (terrain->chunks[terrain->resident[k]].level >= 0)
+			terrain->loadedNum += 1;
+}
+
+/* Draws the loaded chunks that might be in the camera's viewing volume, using
+the shader program whose attribute locations were given to terrainInitialize.
+The caller sets that program and its uniforms beforehand. The terrain is in
+world coordinates, so the modeling transformation, if any, is the identity. */
+void terrainRender(terrainTerrain *terrain, camCamera *cam) {
+	GLuint k, e, mask, count;
+	GLint neighbor;
+	GLdouble planes[6][4];
+	camFrustumPlanes(cam, planes);
+	terrain->drawnNum = 0;
+	terrain->drawnTriNum = 0;
+	for (k = 0; k < terrain->residentNum; k += 1) {
+		terrainChunk *chunk = &(terrain->chunks[terrain->resident[k]]);
+		if (chunk->level < 0 || camFrustumContains(planes, chunk->center,
+				chunk->radius, chunk->halfSize) == 0)
+			continue;
+		mask = 0;
+		for (e = terrainEDGEIMIN; e <= terrainEDGEJMAX; e *= 2) {
+			neighbor = terrainNeighbor(terrain, terrain->resident[k], e);
+			if (neighbor >= 0 && terrain->chunks[neighbor].level > chunk->level)
+				mask |= e;
+		}
+		count = terrain->indexCount[chunk->level][mask];
+		glBindVertexArray(chunk->vao);
+		glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, BUFFER_OFFSET(
+			terrain->indexStart[chunk->level][mask] * sizeof(GLuint)));
+		terrain->drawnNum += 1;
+		terrain->drawnTriNum += count / 3;
+	}
+	glBindVertexArray(0);
+}
+
+/* Stops the worker threads, waiting for any builds in progress, and
+deallocates the terrain's resources. */
+void terrainDestroy(terrainTerrain *terrain) {
+	GLuint k;
+	pthread_mutex_lock(&(terrain->mutex));
+	terrain->quitting = 1;
+	pthread_cond_broadcast(&(terrain->cond));
+	pthread_mutex_unlock(&(terrain->mutex));
+	for (k = 0; k < terrain->threadNum; k += 1)
+		pthread_join(terrain->threads[k], NULL);
+	for (k = 0; k < terrain->residentNum; k += 1)
+		terrainUnload(&(terrain->chunks[terrain->resident[k]]));
+	glDeleteBuffers(1, &(terrain->indexBuffer));
+	free(terrain->chunks);
+	free(terrain->resident);
+	munmap((void *)terrain->heights, terrain->mappedSize);
+	pthread_cond_destroy(&(terrain->cond));
+	pthread_mutex_destroy(&(terrain->mutex));
+}
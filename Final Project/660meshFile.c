@@ -0,0 +1,1104 @@
+/*** Importing OBJ and PLY files ***/
+
+/* meshInitializeFile builds a mesh from a Wavefront OBJ file or a binary PLY
+file, with the same attributes as the 3D convenience initializers: XYZ, ST,
+NOP. The file is mapped into memory and parsed in place, on several threads,
+without allocating anything per line. A file without texture coordinates gets
+ST = (0, 0). A file that is missing some normals gets smooth normals
+throughout, as from meshSmoothNormals. In an OBJ file, polygons are split into
+triangle fans, and each distinct combination of position, texture coordinates,
+and normal indices becomes one vertex. Groups, materials, and the like are
+ignored.
+
+Parsing a large text file still takes a while, so meshCacheLoad saves the
+finished mesh beside the file, with the extension .meshcache, stamped with
+the file's size and modification time. On later runs, if the stamp still
+matches, the cache file is mapped into memory, and its triangles and vertices
+are used as they are, with no parsing at all. In particular, meshGLInitialize
+can upload them straight from the mapping:
+	meshCache cache;
+	meshCacheLoad(&cache, "bunny.obj", 0);
+	meshGLInitialize(&meshGL, &(cache.mesh), 3, attrDims, vaoNum);
+	meshCacheDestroy(&cache);
+meshInitializeFileCached does the same, but copies the cache into a mesh of
+its own. */
+
+#define meshFILEPARALLELMIN 1048576
+#define meshFILETOKENMAX 64
+#define meshCACHEMAGIC 0x3148534D
+#define meshCACHEVERSION 2
+#define meshCACHEHEADER 8
+
+/* The powers of ten that doubles represent exactly. */
+const GLdouble meshFilePowers[23] = {1.0e0, 1.0e1, 1.0e2, 1.0e3, 1.0e4,
+	1.0e5, 1.0e6, 1.0e7, 1.0e8, 1.0e9, 1.0e10, 1.0e11, 1.0e12, 1.0e13, 1.0e14,
+	1.0e15, 1.0e16, 1.0e17, 1.0e18, 1.0e19, 1.0e20, 1.0e21, 1.0e22};
+
+/* Maps the whole file at path into memory, read-only. Returns the mapping, of
+*size bytes, or NULL on failure. The user must eventually munmap it. */
+const char *meshFileMap(const char *path, size_t *size) {
+	struct stat info;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "meshFileMap: could not open %s.\n", path);
+		return NULL;
+	}
+	if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+		fprintf(stderr, "meshFileMap: %s is empty.\n", path);
+		close(fd);
+		return NULL;
+	}
+	*size = info.st_size;
+	void *mapped = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED) {
+		fprintf(stderr, "meshFileMap: could not map %s.\n", path);
+		return NULL;
+	}
+	return (const char *)mapped;
+}
+
+/* Helper function for the importers. Runs jobNum jobs, each of jobSize bytes
+in jobs, through work, one per thread. As in meshNormalsParallel, the first job
+runs on this thread, as does any job whose thread cannot start. */
+void meshFileRun(void *(*work)(void *), void *jobs, size_t jobSize,
+		GLuint jobNum) {
+	pthread_t threads[meshTHREADMAX];
+	int started[meshTHREADMAX];
+	GLuint i;
+	for (i = 1; i < jobNum; i += 1)
+		started[i] = (pthread_create(&(threads[i]), NULL, work,
+			(char *)jobs + i * jobSize) == 0);
+	work(jobs);
+	for (i = 1; i < jobNum; i += 1)
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			work((char *)jobs + i * jobSize);
+}
+
+/* Helper function for the importers. Returns the number of threads to use for
+a file of the given size: threadNum, or one per processor if threadNum is 0,
+but only one for a small file. Returns 0 if threadNum is too large. */
+GLuint meshFileThreadNum(GLuint threadNum, size_t size) {
+	if (threadNum == 0) {
+		long procNum = sysconf(_SC_NPROCESSORS_ONLN);
+		threadNum = (procNum < 1 ? 1 : (GLuint)procNum);
+		if (threadNum > meshTHREADMAX)
+			threadNum = meshTHREADMAX;
+	}
+	if (threadNum > meshTHREADMAX)
+		return 0;
+	if (size < meshFILEPARALLELMIN)
+		threadNum = 1;
+	return threadNum;
+}
+
+/* Returns 1 if c separates tokens within a line, 0 if not. */
+int meshFileIsSpace(char c) {
+	return (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f');
+}
+
+/* Advances p past spaces and tabs, but not past the end of the line. */
+const char *meshFileSkipSpace(const char *p, const char *end) {
+	while (p < end && meshFileIsSpace(*p))
+		p += 1;
+	return p;
+}
+
+/* Parses a decimal number, as strtod would, from the text at *p, which ends
+before end. On success, advances *p past the number and returns 0. Numbers of
+at most 19 significant digits, with a small enough exponent, are converted
+exactly with one multiplication or division by a power of ten, which is
+correctly rounded. The rest, and oddities such as inf and nan, go through
+strtod. Returns non-zero if there is no number. */
+int meshFileParseDouble(const char **p, const char *end, GLdouble *x) {
+	const char *s = *p;
+	GLuint64 mantissa = 0;
+	int negative = 0, digitNum = 0, exponent = 0, anyDigit = 0, exact = 1;
+	int expValue = 0, expNegative = 0;
+	if (s < end && (*s == '-' || *s == '+')) {
+		negative = (*s == '-');
+		s += 1;
+	}
+	for (; s < end && *s >= '0' && *s <= '9'; s += 1) {
+		anyDigit = 1;
+		if (digitNum < 19) {
+			mantissa = mantissa * 10 + (*s - '0');
+			digitNum += (mantissa != 0);
+		} else {
+			exponent += 1;
+			exact = exact && (*s == '0');
+		}
+	}
+	if (s < end && *s == '.')
+		for (s += 1; s < end && *s >= '0' && *s <= '9'; s += 1) {
+			anyDigit = 1;
+			if (digitNum < 19) {
+				mantissa = mantissa * 10 + (*s - '0');
+				digitNum += (mantissa != 0);
+				exponent -= 1;
+			} else
+				exact = exact && (*s == '0');
+		}
+	if (anyDigit && s < end && (*s == 'e' || *s == 'E')) {
+		const char *e = s + 1;
+		if (e < end && (*e == '-' || *e == '+')) {
+			expNegative = (*e == '-');
+			e += 1;
+		}
+		if (e < end && *e >= '0' && *e <= '9') {
+			for (; e < end && *e >= '0' && *e <= '9'; e += 1)
+				if (expValue < 100000)
+					expValue = expValue * 10 + (*e - '0');
+			exponent += (expNegative ? -expValue : expValue);
+			s = e;
+		}
+	}
+	if (anyDigit && exact && mantissa <= (1ULL << 53) && exponent >= -22 &&
+			exponent <= 22) {
+		*x = (GLdouble)mantissa;
+		if (exponent < 0)
+			*x /= meshFilePowers[-exponent];
+		else
+			*x *= meshFilePowers[exponent];
+		if (negative)
+			*x = -*x;
+		*p = s;
+		return 0;
+	}
+	/* The slow path, on a copy, since the mapped text has no terminator. */
+	char token[meshFILETOKENMAX], *tokenEnd;
+	int length = 0;
+	for (s = *p; s < end && !meshFileIsSpace(*s) && *s != '\n' && *s != '/' &&
+			length < meshFILETOKENMAX - 1; s += 1) {
+		token[length] = *s;
+		length += 1;
+	}
+	token[length] = '\0';
+	*x = strtod(token, &tokenEnd);
+	if (tokenEnd == token)
+		return 1;
+	*p += (tokenEnd - token);
+	return 0;
+}
+
+/* Parses a decimal integer from the text at *p, which ends before end. On
+success, advances *p past it and returns 0. Returns non-zero if there is no
+integer. */
+int meshFileParseInt(const char **p, const char *end, long *value) {
+	const char *s = *p;
+	int negative = 0;
+	if (s < end && (*s == '-' || *s == '+')) {
+		negative = (*s == '-');
+		s += 1;
+	}
+	if (s >= end || *s < '0' || *s > '9')
+		return 1;
+	for (*value = 0; s < end && *s >= '0' && *s <= '9'; s += 1)
+		if (*value < 1000000000000L)
+			*value = *value * 10 + (*s - '0');
+	if (negative)
+		*value = -*value;
+	*p = s;
+	return 0;
+}
+
+
+
+/*** OBJ ***/
+
+/* A job parses the lines from start up to end. In the first pass, it counts
+its positions, texture coordinates, normals, and triangles. In the second,
+it writes them at the given starts in the shared arrays. Each triangle corner
+is three indices, of its position, texture coordinates, and normal, with -1
+for missing texture coordinates or normal. */
+typedef struct meshOBJJob meshOBJJob;
+struct meshOBJJob {
+	const char *start, *end;
+	GLuint pass;
+	GLuint vNum, vtNum, vnNum, triNum;
+	GLuint vStart, vtStart, vnStart, triStart;
+	GLdouble *positions, *texCoords, *normals;
+	GLint *corners;
+	int error;
+};
+
+/* Helper function for meshOBJWork. Parses one face corner, such as 7, 7/3,
+7//2, or 7/3/2, resolving negative (relative) indices against the numbers of
+elements so far. Returns 0 on success, non-zero on failure. */
+int meshOBJParseCorner(const char **p, const char *end, GLuint counts[3],
+		GLint corner[3]) {
+	long value;
+	GLuint k;
+	for (k = 0; k < 3; k += 1) {
+		corner[k] = -1;
+		if (k > 0) {
+			if (*p >= end || **p != '/')
+				continue;
+			*p += 1;
+			if (*p < end && **p == '/')
+				continue;
+		}
+		if (meshFileParseInt(p, end, &value) != 0)
+			return 1;
+		if (value < 0)
+			value += counts[k];
+		else
+			value -= 1;
+		if (value < 0 || value > 2147483647L)
+			return 2;
+		corner[k] = (GLint)value;
+	}
+	return 0;
+}
+
+/* Helper function for meshInitializeFileOBJ. The body of each thread, for
+either pass. */
+void *meshOBJWork(void *arg) {
+	meshOBJJob *job = (meshOBJJob *)arg;
+	const char *p = job->start, *end = job->end, *lineEnd;
+	GLuint v = 0, vt = 0, vn = 0, tri = 0, cornerNum, k, counts[3];
+	GLint first[3], previous[3], corner[3];
+	GLdouble *out;
+	while (p < end && job->error == 0) {
+		lineEnd = (const char *)memchr(p, '\n', end - p);
+		if (lineEnd == NULL)
+			lineEnd = end;
+		p = meshFileSkipSpace(p, lineEnd);
+		if (p + 1 < lineEnd && p[0] == 'v' && meshFileIsSpace(p[1])) {
+			if (job->pass == 1) {
+				out = &(job->positions[(job->vStart + v) * 3]);
+				for (k = 0, p += 1; k < 3 && job->error == 0; k += 1) {
+					p = meshFileSkipSpace(p, lineEnd);
+					job->error = meshFileParseDouble(&p, lineEnd, &out[k]);
+				}
+			}
+			v += 1;
+		} else if (p + 2 < lineEnd && p[0] == 'v' && p[1] == 't' &&
+				meshFileIsSpace(p[2])) {
+			if (job->pass == 1) {
+				out = &(job->texCoords[(job->vtStart + vt) * 2]);
+				p = meshFileSkipSpace(p + 2, lineEnd);
+				job->error = meshFileParseDouble(&p, lineEnd, &out[0]);
+				p = meshFileSkipSpace(p, lineEnd);
+				if (meshFileParseDouble(&p, lineEnd, &out[1]) != 0)
+					out[1] = 0.0;
+			}
+			vt += 1;
+		} else if (p + 2 < lineEnd && p[0] == 'v' && p[1] == 'n' &&
+				meshFileIsSpace(p[2])) {
+			if (job->pass == 1) {
+				out = &(job->normals[(job->vnStart + vn) * 3]);
+				for (k = 0, p += 2; k < 3 && job->error == 0; k += 1) {
+					p = meshFileSkipSpace(p, lineEnd);
+					job->error = meshFileParseDouble(&p, lineEnd, &out[k]);
+				}
+			}
+			vn += 1;
+		} else if (p + 1 < lineEnd && p[0] == 'f' && meshFileIsSpace(p[1])) {
+			counts[0] = job->vStart + v;
+			counts[1] = job->vtStart + vt;
+			counts[2] = job->vnStart + vn;
+			for (cornerNum = 0, p += 1; ; cornerNum += 1) {
+				p = meshFileSkipSpace(p, lineEnd);
+				if (p == lineEnd)
+					break;
+				if (job->pass == 0) {
+					while (p < lineEnd && !meshFileIsSpace(*p))
+						p += 1;
+					continue;
+				}
+				if (meshOBJParseCorner(&p, lineEnd, counts, corner) != 0) {
+					job->error = 1;
+					break;
+				}
+				/* A fan of triangles around the first corner. */
+				if (cornerNum == 0)
+					memcpy(first, corner, sizeof(first));
+				else if (cornerNum >= 2) {
+					GLint *triangle = &(job->corners[(job->triStart + tri) * 9]);
+					memcpy(&triangle[0], first, sizeof(first));
+					memcpy(&triangle[3], previous, sizeof(previous));
+					memcpy(&triangle[6], corner, sizeof(corner));
+					tri += 1;
+				}
+				memcpy(previous, corner, sizeof(corner));
+			}
+			if (job->pass == 0 && cornerNum >= 3)
+				tri += cornerNum - 2;
+		}
+		p = lineEnd + 1;
+	}
+	job->vNum = v;
+	job->vtNum = vt;
+	job->vnNum = vn;
+	job->triNum = tri;
+	return NULL;
+}
+
+/* Helper function for meshInitializeFileOBJ. Returns a hash of a triangle
+corner's three indices. */
+GLuint meshOBJHash(const GLint corner[3]) {
+	GLuint hash = (GLuint)corner[0] * 2654435761u;
+	hash = (hash ^ (GLuint)corner[1]) * 2246822519u;
+	hash = (hash ^ (GLuint)corner[2]) * 3266489917u;
+	return hash ^ (hash >> 15);
+}
+
+/* Helper function for meshInitializeFileOBJ. Makes the mesh from the parsed
+elements, with one vertex per distinct corner. Returns 0 on success, non-zero
+on failure. */
+int meshOBJAssemble(meshMesh *mesh, meshOBJJob *total, GLuint threadNum) {
+	GLuint cornerNum = total->triNum * 3, vertNum = 0, capacity = 1, i, k;
+	GLuint hash, *table, *vertOf, *firstOf;
+	GLint *corner;
+	int missingNormal = 0;
+	while (capacity < 2 * cornerNum)
+		capacity *= 2;
+	/* table holds 1 + the index of a vertex's first corner, or 0 if empty. */
+	table = (GLuint *)calloc(capacity, sizeof(GLuint));
+	vertOf = (GLuint *)malloc(2 * cornerNum * sizeof(GLuint));
+	if (table == NULL || vertOf == NULL) {
+		fprintf(stderr, "meshInitializeFile: malloc failed.\n");
+		free(table);
+		free(vertOf);
+		return 1;
+	}
+	/* vertOf maps each corner to its vertex, and firstOf maps each vertex to
+	its first corner. */
+	firstOf = &vertOf[cornerNum];
+	for (i = 0; i < cornerNum; i += 1) {
+		corner = &(total->corners[i * 3]);
+		if ((GLuint)corner[0] >= total->vNum || (corner[1] >= 0 &&
+				(GLuint)corner[1] >= total->vtNum) || (corner[2] >= 0 &&
+				(GLuint)corner[2] >= total->vnNum)) {
+			fprintf(stderr, "meshInitializeFile: face index out of range.\n");
+			free(table);
+			free(vertOf);
+			return 2;
+		}
+		for (hash = meshOBJHash(corner) & (capacity - 1); table[hash] != 0;
+				hash = (hash + 1) & (capacity - 1))
+			if (memcmp(corner, &(total->corners[(table[hash] - 1) * 3]),
+					3 * sizeof(GLint)) == 0)
+				break;
+		if (table[hash] == 0) {
+			table[hash] = i + 1;
+			vertOf[i] = vertNum;
+			firstOf[vertNum] = i;
+			vertNum += 1;
+		} else
+			vertOf[i] = vertOf[table[hash] - 1];
+	}
+	if (meshInitialize(mesh, total->triNum, vertNum, 3 + 2 + 3) != 0) {
+		fprintf(stderr, "meshInitializeFile: malloc failed.\n");
+		free(table);
+		free(vertOf);
+		return 3;
+	}
+	for (i = 0; i < cornerNum; i += 1)
+		mesh->tri[i] = vertOf[i];
+	free(table);
+	for (k = 0; k < vertNum; k += 1) {
+		corner = &(total->corners[firstOf[k] * 3]);
+		GLdouble *vert = meshGetVertexPointer(mesh, k);
+		vecCopy(3, &(total->positions[corner[0] * 3]), vert);
+		if (corner[1] >= 0)
+			vecCopy(2, &(total->texCoords[corner[1] * 2]), &vert[3]);
+		else
+			vert[3] = vert[4] = 0.0;
+		if (corner[2] >= 0)
+			vecCopy(3, &(total->normals[corner[2] * 3]), &vert[5]);
+		else {
+			vec3Set(&vert[5], 0.0, 0.0, 0.0);
+			missingNormal = 1;
+		}
+	}
+	free(vertOf);
+	if (missingNormal && meshSmoothNormalsParallel(mesh, 5, threadNum) != 0)
+		meshSmoothNormals(mesh, 5);
+	return 0;
+}
+
+/* Builds a mesh from the OBJ text of the given size, on threadNum threads (or
+one per processor if threadNum is 0). Returns 0 on success, non-zero on
+failure. On success, don't forget to call meshDestroy when finished. */
+int meshInitializeFileOBJ(meshMesh *mesh, const char *text, size_t size,
+		GLuint threadNum) {
+	meshOBJJob jobs[meshTHREADMAX], total;
+	GLuint i, pass;
+	int error = 0;
+	threadNum = meshFileThreadNum(threadNum, size);
+	if (threadNum == 0) {
+		fprintf(stderr, "meshInitializeFile: too many threads.\n");
+		return 1;
+	}
+	/* Cut the text into one range of whole lines per thread. */
+	const char *start = text, *end = text + size, *cut;
+	for (i = 0; i < threadNum; i += 1) {
+		cut = text + (size_t)((GLdouble)size * (i + 1) / threadNum);
+		if (i + 1 == threadNum)
+			cut = end;
+		else if (cut < start)
+			cut = start;
+		else {
+			cut = (const char *)memchr(cut, '\n', end - cut);
+			cut = (cut == NULL ? end : cut + 1);
+		}
+		jobs[i].start = start;
+		jobs[i].end = cut;
+		jobs[i].error = 0;
+		start = cut;
+	}
+	memset(&total, 0, sizeof(total));
+	for (pass = 0; pass < 2 && error == 0; pass += 1) {
+		for (i = 0; i < threadNum; i += 1)
+			jobs[i].pass = pass;
+		meshFileRun(meshOBJWork, jobs, sizeof(meshOBJJob), threadNum);
+		if (pass == 1) {
+			for (i = 0; i < threadNum; i += 1)
+				error = error || jobs[i].error;
+			continue;
+		}
+		/* Each job's elements follow those of the jobs before it. */
+		for (i = 0; i < threadNum; i += 1) {
+			jobs[i].vStart = total.vNum;
+			jobs[i].vtStart = total.vtNum;
+			jobs[i].vnStart = total.vnNum;
+			jobs[i].triStart = total.triNum;
+			total.vNum += jobs[i].vNum;
+			total.vtNum += jobs[i].vtNum;
+			total.vnNum += jobs[i].vnNum;
+			total.triNum += jobs[i].triNum;
+		}
+		if (total.vNum == 0 || total.triNum == 0) {
+			fprintf(stderr, "meshInitializeFile: no triangles.\n");
+			return 2;
+		}
+		total.positions = (GLdouble *)malloc((total.vNum * 3 +
+			total.vtNum * 2 + total.vnNum * 3) * sizeof(GLdouble));
+		total.corners = (GLint *)malloc((size_t)total.triNum * 9 *
+			sizeof(GLint));
+		if (total.positions == NULL || total.corners == NULL) {
+			fprintf(stderr, "meshInitializeFile: malloc failed.\n");
+			free(total.positions);
+			free(total.corners);
+			return 3;
+		}
+		total.texCoords = &(total.positions[total.vNum * 3]);
+		total.normals = &(total.texCoords[total.vtNum * 2]);
+		for (i = 0; i < threadNum; i += 1) {
+			jobs[i].positions = total.positions;
+			jobs[i].texCoords = total.texCoords;
+			jobs[i].normals = total.normals;
+			jobs[i].corners = total.corners;
+		}
+	}
+	if (error != 0)
+		fprintf(stderr, "meshInitializeFile: malformed OBJ.\n");
+	else
+		error = meshOBJAssemble(mesh, &total, threadNum);
+	free(total.positions);
+	free(total.corners);
+	return (error != 0 ? 4 : 0);
+}
+
+
+
+/*** PLY ***/
+
+/* Only binary PLY files are supported, in either byte order. Vertices may
+have any properties; those named x, y, z, nx, ny, nz, and s, t (or u, v, or
+texture_u, texture_v) become attributes. Faces need a list property named
+vertex_indices (or vertex_index). Other elements are skipped. */
+
+#define meshPLYELEMENTMAX 16
+#define meshPLYPROPERTYMAX 32
+#define meshPLYNAMEMAX 32
+
+typedef struct meshPLYProperty meshPLYProperty;
+struct meshPLYProperty {
+	char name[meshPLYNAMEMAX + 1];
+	/* For a list, type is the type of the items, and countType that of the
+	count in front of them. */
+	GLuint type, countType, list, offset;
+};
+
+typedef struct meshPLYElement meshPLYElement;
+struct meshPLYElement {
+	char name[meshPLYNAMEMAX + 1];
+	GLuint count, propertyNum, stride, hasList;
+	meshPLYProperty properties[meshPLYPROPERTYMAX];
+	const GLubyte *data;
+};
+
+/* The PLY scalar types, in order, with their sizes. */
+const char *meshPLYTypeNames[16] = {"char", "uchar", "short", "ushort",
+	"int", "uint", "float", "double", "int8", "uint8", "int16", "uint16",
+	"int32", "uint32", "float32", "float64"};
+const GLuint meshPLYTypeSizes[8] = {1, 1, 2, 2, 4, 4, 4, 8};
+
+/* Returns the type number of the named PLY type, or 8 if there is none. */
+GLuint meshPLYType(const char *name) {
+	GLuint i;
+	for (i = 0; i < 16; i += 1)
+		if (strcmp(name, meshPLYTypeNames[i]) == 0)
+			return i % 8;
+	return 8;
+}
+
+/* Reads a value of the given type at bytes, swapping its bytes if swap is
+non-zero. */
+GLdouble meshPLYRead(const GLubyte *bytes, GLuint type, int swap) {
+	GLubyte copy[8];
+	GLuint i, size = meshPLYTypeSizes[type];
+	for (i = 0; i < size; i += 1)
+		copy[i] = bytes[swap ? size - 1 - i : i];
+	switch (type) {
+		case 0: return *(signed char *)copy;
+		case 1: return *(unsigned char *)copy;
+		case 2: { short v; memcpy(&v, copy, 2); return v; }
+		case 3: { unsigned short v; memcpy(&v, copy, 2); return v; }
+		case 4: { GLint v; memcpy(&v, copy, 4); return v; }
+		case 5: { GLuint v; memcpy(&v, copy, 4); return v; }
+		case 6: { GLfloat v; memcpy(&v, copy, 4); return v; }
+		default: { GLdouble v; memcpy(&v, copy, 8); return v; }
+	}
+}
+
+/* Helper function for meshPLYParseHeader. Copies the line at *p into line,
+which holds lineSize bytes, and advances *p past it. Returns 0 on success,
+non-zero at the end of the text or if the line is too long. */
+int meshPLYLine(const char **p, const char *end, char *line,
+		size_t lineSize) {
+	const char *lineEnd = (const char *)memchr(*p, '\n', end - *p);
+	if (lineEnd == NULL || (size_t)(lineEnd - *p) >= lineSize)
+		return 1;
+	memcpy(line, *p, lineEnd - *p);
+	line[lineEnd - *p] = '\0';
+	if (lineEnd > *p && line[lineEnd - *p - 1] == '\r')
+		line[lineEnd - *p - 1] = '\0';
+	*p = lineEnd + 1;
+	return 0;
+}
+
+/* Reads the PLY header at the start of text. Fills elements with its
+elements, sets *elementNum and *swap, and returns the start of the data, or
+NULL on failure. */
+const GLubyte *meshPLYParseHeader(const char *text, size_t size,
+		meshPLYElement elements[], GLuint *elementNum, int *swap) {
+	const char *p = text, *end = text + size;
+	char line[256], word[3][meshPLYNAMEMAX + 1];
+	unsigned int count;
+	GLuint one = 1, bigEndian = 0, format = 0;
+	meshPLYElement *element = NULL;
+	*elementNum = 0;
+	if (meshPLYLine(&p, end, line, sizeof(line)) != 0 ||
+			strcmp(line, "ply") != 0)
+		return NULL;
+	while (meshPLYLine(&p, end, line, sizeof(line)) == 0) {
+		int wordNum = sscanf(line, "%32s %32s %32s", word[0], word[1],
+			word[2]);
+		if (wordNum < 1)
+			continue;
+		if (strcmp(word[0], "end_header") == 0) {
+			if (format == 0)
+				return NULL;
+			*swap = (bigEndian != (*(GLubyte *)&one == 0));
+			return (const GLubyte *)p;
+		}
+		if (strcmp(word[0], "format") == 0 && wordNum >= 2) {
+			if (strcmp(word[1], "binary_little_endian") == 0)
+				format = 1;
+			else if (strcmp(word[1], "binary_big_endian") == 0) {
+				format = 1;
+				bigEndian = 1;
+			} else {
+				fprintf(stderr, "meshInitializeFile: PLY format %s is not "
+					"supported.\n", word[1]);
+				return NULL;
+			}
+		} else if (strcmp(word[0], "element") == 0 && wordNum == 3) {
+			if (*elementNum == meshPLYELEMENTMAX ||
+					sscanf(word[2], "%u", &count) != 1)
+				return NULL;
+			element = &(elements[*elementNum]);
+			*elementNum += 1;
+			strcpy(element->name, word[1]);
+			element->count = count;
+			element->propertyNum = 0;
+			element->stride = 0;
+			element->hasList = 0;
+		} else if (strcmp(word[0], "property") == 0 && element != NULL) {
+			if (element->propertyNum == meshPLYPROPERTYMAX)
+				return NULL;
+			meshPLYProperty *property =
+				&(element->properties[element->propertyNum]);
+			element->propertyNum += 1;
+			property->offset = element->stride;
+			if (wordNum == 3 && strcmp(word[1], "list") != 0) {
+				property->list = 0;
+				property->type = meshPLYType(word[1]);
+				strcpy(property->name, word[2]);
+				if (property->type == 8)
+					return NULL;
+				element->stride += meshPLYTypeSizes[property->type];
+			} else {
+				char types[2][meshPLYNAMEMAX + 1], name[meshPLYNAMEMAX + 1];
+				if (sscanf(line, "property list %32s %32s %32s", types[0],
+						types[1], name) != 3)
+					return NULL;
+				property->list = 1;
+				property->countType = meshPLYType(types[0]);
+				property->type = meshPLYType(types[1]);
+				strcpy(property->name, name);
+				if (property->countType == 8 || property->type == 8)
+					return NULL;
+				element->hasList = 1;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Helper function for meshPLYLocate. Returns the number of bytes in the
+element's record at bytes, which ends before end, or 0 if it runs past end. */
+size_t meshPLYRecordSize(meshPLYElement *element, const GLubyte *bytes,
+		const GLubyte *end, int swap) {
+	size_t size = 0;
+	GLuint k;
+	if (!element->hasList)
+		return (bytes + element->stride <= end ? element->stride : 0);
+	for (k = 0; k < element->propertyNum; k += 1) {
+		meshPLYProperty *property = &(element->properties[k]);
+		if (!property->list) {
+			size += meshPLYTypeSizes[property->type];
+			continue;
+		}
+		if (bytes + size + meshPLYTypeSizes[property->countType] > end)
+			return 0;
+		GLdouble count = meshPLYRead(bytes + size, property->countType, swap);
+		if (count < 0.0)
+			return 0;
+		size += meshPLYTypeSizes[property->countType] +
+			(size_t)count * meshPLYTypeSizes[property->type];
+	}
+	return (bytes + size <= end ? size : 0);
+}
+
+/* Returns the start of the property at index within the element's record at
+bytes, which meshPLYRecordSize has already checked. */
+const GLubyte *meshPLYField(meshPLYElement *element, const GLubyte *bytes,
+		GLuint index, int swap) {
+	GLuint k;
+	for (k = 0; k < index; k += 1) {
+		meshPLYProperty *property = &(element->properties[k]);
+		if (property->list)
+			bytes += meshPLYTypeSizes[property->countType] +
+				(size_t)meshPLYRead(bytes, property->countType, swap) *
+				meshPLYTypeSizes[property->type];
+		else
+			bytes += meshPLYTypeSizes[property->type];
+	}
+	return bytes;
+}
+
+/* A job decodes the vertices from start up to end. offsets holds the offsets
+of x, y, z, s, t, nx, ny, nz within a vertex record, or -1 for those that the
+file lacks, and types holds their types. */
+typedef struct meshPLYJob meshPLYJob;
+struct meshPLYJob {
+	meshMesh *mesh;
+	meshPLYElement *element;
+	GLuint start, end;
+	GLint offsets[8];
+	GLuint types[8];
+	int swap;
+};
+
+/* Helper function for meshInitializeFilePLY. The body of each thread. */
+void *meshPLYWork(void *arg) {
+	meshPLYJob *job = (meshPLYJob *)arg;
+	GLuint i, k;
+	for (i = job->start; i < job->end; i += 1) {
+		const GLubyte *record = job->element->data +
+			(size_t)i * job->element->stride;
+		GLdouble *vert = meshGetVertexPointer(job->mesh, i);
+		for (k = 0; k < 8; k += 1)
+			vert[k] = (job->offsets[k] < 0 ? 0.0 :
+				meshPLYRead(record + job->offsets[k], job->types[k], job->swap));
+	}
+	return NULL;
+}
+
+/* Builds a mesh from the binary PLY file of the given size, on threadNum
+threads (or one per processor if threadNum is 0). Returns 0 on success,
+non-zero on failure. On success, don't forget to call meshDestroy when
+finished. */
+int meshInitializeFilePLY(meshMesh *mesh, const char *text, size_t size,
+		GLuint threadNum) {
+	meshPLYElement elements[meshPLYELEMENTMAX];
+	meshPLYElement *vertices = NULL, *faces = NULL;
+	meshPLYJob jobs[meshTHREADMAX];
+	GLuint elementNum, i, k, e, triNum = 0, listIndex = 0;
+	int swap;
+	const char *names[8][4] = {{"x"}, {"y"}, {"z"},
+		{"s", "u", "texture_u", "texture_s"},
+		{"t", "v", "texture_v", "texture_t"}, {"nx"}, {"ny"}, {"nz"}};
+	threadNum = meshFileThreadNum(threadNum, size);
+	if (threadNum == 0) {
+		fprintf(stderr, "meshInitializeFile: too many threads.\n");
+		return 1;
+	}
+	const GLubyte *data = meshPLYParseHeader(text, size, elements,
+		&elementNum, &swap);
+	const GLubyte *end = (const GLubyte *)text + size;
+	if (data == NULL) {
+		fprintf(stderr, "meshInitializeFile: bad PLY header.\n");
+		return 2;
+	}
+	/* Find where each element's records start. Elements with lists, such as
+	the faces, must be walked record by record. */
+	for (e = 0; e < elementNum; e += 1) {
+		meshPLYElement *element = &(elements[e]);
+		element->data = data;
+		if (strcmp(element->name, "vertex") == 0)
+			vertices = element;
+		else if (strcmp(element->name, "face") == 0)
+			faces = element;
+		if (!element->hasList) {
+			if ((size_t)(end - data) / (element->stride > 0 ?
+					element->stride : 1) < element->count)
+				data = NULL;
+			else
+				data += (size_t)element->count * element->stride;
+		} else
+			for (i = 0; i < element->count && data != NULL; i += 1) {
+				size_t recordSize = meshPLYRecordSize(element, data, end, swap);
+				data = (recordSize == 0 ? NULL : data + recordSize);
+			}
+		if (data == NULL) {
+			fprintf(stderr, "meshInitializeFile: PLY %s data is cut short.\n",
+				element->name);
+			return 3;
+		}
+	}
+	if (vertices == NULL || faces == NULL || vertices->hasList) {
+		fprintf(stderr, "meshInitializeFile: PLY needs vertex and face "
+			"elements.\n");
+		return 4;
+	}
+	for (k = 0; k < faces->propertyNum; k += 1)
+		if (faces->properties[k].list &&
+				(strcmp(faces->properties[k].name, "vertex_indices") == 0 ||
+				strcmp(faces->properties[k].name, "vertex_index") == 0))
+			break;
+	if (k == faces->propertyNum) {
+		fprintf(stderr, "meshInitializeFile: PLY faces have no indices.\n");
+		return 5;
+	}
+	listIndex = k;
+	/* Count the triangles in the fans. */
+	data = faces->data;
+	for (i = 0; i < faces->count; i += 1) {
+		const GLubyte *field = meshPLYField(faces, data, listIndex, swap);
+		GLuint count = (GLuint)meshPLYRead(field,
+			faces->properties[listIndex].countType, swap);
+		triNum += (count >= 3 ? count - 2 : 0);
+		data += meshPLYRecordSize(faces, data, end, swap);
+	}
+	if (meshInitialize(mesh, triNum, vertices->count, 3 + 2 + 3) != 0) {
+		fprintf(stderr, "meshInitializeFile: malloc failed.\n");
+		return 6;
+	}
+	/* Decode the vertices in parallel. */
+	for (i = 0; i < threadNum; i += 1) {
+		jobs[i].mesh = mesh;
+		jobs[i].element = vertices;
+		jobs[i].start = (GLuint)((GLdouble)vertices->count * i / threadNum);
+		jobs[i].end = (GLuint)((GLdouble)vertices->count * (i + 1) /
+			threadNum);
+		jobs[i].swap = swap;
+		for (k = 0; k < 8; k += 1) {
+			jobs[i].offsets[k] = -1;
+			for (e = 0; e < vertices->propertyNum; e += 1) {
+				meshPLYProperty *property = &(vertices->properties[e]);
+				GLuint n;
+				for (n = 0; n < 4 && names[k][n] != NULL; n += 1)
+					if (strcmp(property->name, names[k][n]) == 0) {
+						jobs[i].offsets[k] = property->offset;
+						jobs[i].types[k] = property->type;
+					}
+			}
+		}
+	}
+	GLint *offsets = jobs[0].offsets;
+	meshFileRun(meshPLYWork, jobs, sizeof(meshPLYJob), threadNum);
+	/* Then the faces, in order, as fans. */
+	GLuint tri = 0, first, previous, index;
+	int error = 0;
+	data = faces->data;
+	for (i = 0; i < faces->count && error == 0; i += 1) {
+		const GLubyte *field = meshPLYField(faces, data, listIndex, swap);
+		meshPLYProperty *list = &(faces->properties[listIndex]);
+		GLuint count = (GLuint)meshPLYRead(field, list->countType, swap);
+		field += meshPLYTypeSizes[list->countType];
+		for (k = 0; k < count; k += 1) {
+			GLdouble value = meshPLYRead(field, list->type, swap);
+			field += meshPLYTypeSizes[list->type];
+			if (value < 0.0 || value >= vertices->count) {
+				error = 1;
+				break;
+			}
+			index = (GLuint)value;
+			if (k == 0)
+				first = index;
+			else if (k >= 2) {
+				meshSetTriangle(mesh, tri, first, previous, index);
+				tri += 1;
+			}
+			previous = index;
+		}
+		data += meshPLYRecordSize(faces, data, end, swap);
+	}
+	if (error != 0) {
+		fprintf(stderr, "meshInitializeFile: face index out of range.\n");
+		meshDestroy(mesh);
+		return 7;
+	}
+	if ((offsets[5] < 0 || offsets[6] < 0 || offsets[7] < 0) &&
+			meshSmoothNormalsParallel(mesh, 5, threadNum) != 0)
+		meshSmoothNormals(mesh, 5);
+	return 0;
+}
+
+
+
+/*** Files and caches ***/
+
+/* Builds a mesh from the OBJ or binary PLY file at path, according to its
+extension, on threadNum threads (at most meshTHREADMAX), or one per processor
+if threadNum is 0. Vertices that are exactly equal, and vertices that no
+triangle uses, are welded away, as by meshWeld(mesh, 0.0, 0.0), and the
+mesh's bounds are computed. Returns 0 on success, non-zero on failure. On
+success, don't forget to call meshDestroy when finished. */
+int meshInitializeFile(meshMesh *mesh, const char *path, GLuint threadNum) {
+	size_t size, length = strlen(path);
+	char extension[4] = {0, 0, 0, 0};
+	GLuint i;
+	int error;
+	if (length >= 4 && path[length - 4] == '.')
+		for (i = 0; i < 3; i += 1)
+			extension[i] = (char)(path[length - 3 + i] | 0x20);
+	if (strcmp(extension, "obj") != 0 && strcmp(extension, "ply") != 0) {
+		fprintf(stderr, "meshInitializeFile: %s is not .obj or .ply.\n", path);
+		return 1;
+	}
+	const char *text = meshFileMap(path, &size);
+	if (text == NULL)
+		return 2;
+	if (strcmp(extension, "obj") == 0)
+		error = meshInitializeFileOBJ(mesh, text, size, threadNum);
+	else
+		error = meshInitializeFilePLY(mesh, text, size, threadNum);
+	munmap((void *)text, size);
+	if (error != 0) {
+		fprintf(stderr, "meshInitializeFile: could not import %s.\n", path);
+		return 3;
+	}
+	mesh->meshType = MESH_TYPE_UNSUPPORTED;
+	mesh->geom = NULL;
+	mesh->body = NULL;
+	/* Exporters often repeat vertices. Welding exactly changes nothing but the
+	numbering, and it computes the bounds. */
+	if (meshWeld(mesh, 0.0, 0.0) != 0)
+		meshComputeBounds(mesh);
+	return 0;
+}
+
+/* Feel free to read from this struct's members, but don't write to them. mesh
+is a mesh whose triangles and vertices live either in a mapping of the cache
+file or in memory from meshInitialize. Don't call meshDestroy on it. */
+typedef struct meshCache meshCache;
+struct meshCache {
+	meshMesh mesh;
+	void *base;
+	size_t baseSize;
+	int mapped;
+};
+
+/* Helper function for the cache. A cache file is a header of meshCACHEHEADER
+GLuints, the mesh's bounds as 7 GLdoubles, the triangles, padding to a
+multiple of 8 bytes, and the vertices. Returns the file's size, and sets
+*vertOffset to the offset of the vertices. */
+size_t meshCacheLayOut(GLuint triNum, GLuint vertNum, GLuint attrDim,
+		size_t *vertOffset) {
+	size_t offset = meshCACHEHEADER * sizeof(GLuint) + 7 * sizeof(GLdouble) +
+		(size_t)triNum * 3 * sizeof(GLuint);
+	*vertOffset = (offset + 7) & ~(size_t)7;
+	return *vertOffset + (size_t)vertNum * attrDim * sizeof(GLdouble);
+}
+
+/* Helper function for meshCacheLoad. Tries to map a cache file whose stamp
+matches the source file's. Returns 0 on success, non-zero on failure. */
+int meshCacheMap(meshCache *cache, const char *cachePath,
+		struct stat *source) {
+	struct stat info;
+	size_t vertOffset;
+	int fd = open(cachePath, O_RDONLY);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t)(meshCACHEHEADER *
+			sizeof(GLuint) + 7 * sizeof(GLdouble))) {
+		close(fd);
+		return 2;
+	}
+	cache->baseSize = info.st_size;
+	cache->base = mmap(NULL, cache->baseSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (cache->base == MAP_FAILED)
+		return 3;
+	GLuint *header = (GLuint *)cache->base;
+	if (header[0] != meshCACHEMAGIC || header[1] != meshCACHEVERSION ||
+			header[5] != (GLuint)source->st_size ||
+			header[6] != (GLuint)((GLuint64)source->st_size >> 32) ||
+			header[7] != (GLuint)source->st_mtime ||
+			meshCacheLayOut(header[2], header[3], header[4], &vertOffset) !=
+			cache->baseSize) {
+		munmap(cache->base, cache->baseSize);
+		return 4;
+	}
+	GLdouble *bounds = (GLdouble *)&header[meshCACHEHEADER];
+	cache->mesh.triNum = header[2];
+	cache->mesh.vertNum = header[3];
+	cache->mesh.attrDim = header[4];
+	cache->mesh.tri = (GLuint *)&bounds[7];
+	cache->mesh.vert = (GLdouble *)((GLubyte *)cache->base + vertOffset);
+	vecCopy(3, &bounds[0], cache->mesh.center);
+	vecCopy(3, &bounds[3], cache->mesh.halfSize);
+	cache->mesh.radius = bounds[6];
+	cache->mesh.meshType = MESH_TYPE_UNSUPPORTED;
+	cache->mesh.geom = NULL;
+	cache->mesh.body = NULL;
+	cache->mapped = 1;
+	return 0;
+}
+
+/* Helper function for meshCacheLoad. Imports the source file and tries to
+save it to the cache file. Returns 0 on success, non-zero on failure. */
+int meshCacheBuild(meshCache *cache, const char *path, const char *cachePath,
+		struct stat *source, GLuint threadNum) {
+	meshMesh *mesh = &(cache->mesh);
+	size_t vertOffset, size;
+	GLuint header[meshCACHEHEADER];
+	GLdouble bounds[7];
+	GLubyte padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	if (meshInitializeFile(mesh, path, threadNum) != 0)
+		return 1;
+	cache->base = NULL;
+	cache->baseSize = 0;
+	cache->mapped = 0;
+	size = meshCacheLayOut(mesh->triNum, mesh->vertNum, mesh->attrDim,
+		&vertOffset);
+	header[0] = meshCACHEMAGIC;
+	header[1] = meshCACHEVERSION;
+	header[2] = mesh->triNum;
+	header[3] = mesh->vertNum;
+	header[4] = mesh->attrDim;
+	header[5] = (GLuint)source->st_size;
+	header[6] = (GLuint)((GLuint64)source->st_size >> 32);
+	header[7] = (GLuint)source->st_mtime;
+	vecCopy(3, mesh->center, &bounds[0]);
+	vecCopy(3, mesh->halfSize, &bounds[3]);
+	bounds[6] = mesh->radius;
+	size_t triSize = (size_t)mesh->triNum * 3 * sizeof(GLuint);
+	size_t padSize = vertOffset - sizeof(header) - sizeof(bounds) - triSize;
+	size_t vertSize = size - vertOffset;
+	/* Write to a temporary file and rename it, so that no other process ever
+	maps a half-written cache. Failure here costs only speed later. */
+	char *tempPath = (char *)malloc(strlen(cachePath) + 5);
+	if (tempPath == NULL)
+		return 0;
+	sprintf(tempPath, "%s.tmp", cachePath);
+	FILE *file = fopen(tempPath, "wb");
+	if (file == NULL ||
+			fwrite(header, 1, sizeof(header), file) != sizeof(header) ||
+			fwrite(bounds, 1, sizeof(bounds), file) != sizeof(bounds) ||
+			fwrite(mesh->tri, 1, triSize, file) != triSize ||
+			fwrite(padding, 1, padSize, file) != padSize ||
+			fwrite(mesh->vert, 1, vertSize, file) != vertSize) {
+		fprintf(stderr, "meshCacheLoad: could not write %s.\n", tempPath);
+		if (file != NULL)
+			fclose(file);
+		remove(tempPath);
+	} else if (fclose(file) != 0 || rename(tempPath, cachePath) != 0) {
+		fprintf(stderr, "meshCacheLoad: could not write %s.\n", cachePath);
+		remove(tempPath);
+	}
+	free(tempPath);
+	return 0;
+}
+
+/* Loads the mesh in the OBJ or binary PLY file at path, from its cache file if
+that is up to date, and otherwise by importing it, on threadNum threads as in
+meshInitializeFile, and saving a new cache file. Safe to call from any thread,
+since it makes no OpenGL calls. Returns 0 on success, non-zero on failure. On
+success, the user must call meshCacheDestroy when finished with the cache. */
+int meshCacheLoad(meshCache *cache, const char *path, GLuint threadNum) {
+	struct stat source;
+	int error = 0;
+	if (stat(path, &source) != 0) {
+		fprintf(stderr, "meshCacheLoad: could not open %s.\n", path);
+		return 1;
+	}
+	char *cachePath = (char *)malloc(strlen(path) + 11);
+	if (cachePath == NULL)
+		return 2;
+	sprintf(cachePath, "%s.meshcache", path);
+	if (meshCacheMap(cache, cachePath, &source) != 0)
+		error = meshCacheBuild(cache, path, cachePath, &source, threadNum);
+	free(cachePath);
+	return error;
+}
+
+/* Deallocates the resources backing the cache, including its mesh. */
+void meshCacheDestroy(meshCache *cache) {
+	if (cache->mapped)
+		munmap(cache->base, cache->baseSize);
+	else
+		meshDestroy(&(cache->mesh));
+}
+
+/* Like meshInitializeFile, but through the cache, as in meshCacheLoad. Returns
+0 on success, non-zero on failure. On success, don't forget to call
+meshDestroy when finished. */
+int meshInitializeFileCached(meshMesh *mesh, const char *path,
+		GLuint threadNum) {
+	meshCache cache;
+	if (meshCacheLoad(&cache, path, threadNum) != 0)
+		return 1;
+	/* A freshly imported mesh is simply handed over. */
+	if (!cache.mapped) {
+		*mesh = cache.mesh;
+		return 0;
+	}
+	if (meshInitialize(mesh, cache.mesh.triNum, cache.mesh.vertNum,
+			cache.mesh.attrDim) != 0) {
+		fprintf(stderr, "meshInitializeFileCached: malloc failed.\n");
+		meshCacheDestroy(&cache);
+		return 2;
+	}
+	memcpy(mesh->tri, cache.mesh.tri,
+		(size_t)mesh->triNum * 3 * sizeof(GLuint));
+	memcpy(mesh->vert, cache.mesh.vert,
+		(size_t)mesh->vertNum * mesh->attrDim * sizeof(GLdouble));
+	vecCopy(3, cache.mesh.center, mesh->center);
+	vecCopy(3, cache.mesh.halfSize, mesh->halfSize);
+	mesh->radius = cache.mesh.radius;
+	mesh->meshType = MESH_TYPE_UNSUPPORTED;
+	mesh->geom = NULL;
+	mesh->body = NULL;
+	meshCacheDestroy(&cache);
+	return 0;
+}
@@ -0,0 +1,503 @@
+/*
+ * mathBenchmark.c
+ * CS 311
+ * Carleton College
+ * Times the vector and matrix kernels of 530vector.c and 590matrix.c over
+ * large randomized batches, and checks the faster variants (the SIMD, float,
+ * quaternion, and 3x4 affine kernels) against the plain double reference.
+ */
+
+
+
+/* On macOS, compile with...
+	clang++ -O2 mathBenchmark.c
+and run with an optional batch size, as in
+	./a.out 65536
+Each benchmark prints its time per operation and its throughput. Each check
+prints the largest error it saw and the bound that it allows. The program
+exits with status 0 if every check passes and 1 otherwise, so it can guard
+changes to the math kernels. Compare timings only between runs on the same
+machine with the same compiler flags (try -mavx, too). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <float.h>
+#include <GL/gl3w.h>
+#include <sys/time.h>
+
+double getTime(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec * 0.000001;
+}
+
+#include "530vector.c"
+#include "590matrix.c"
+
+
+
+/*** Data ***/
+
+/* The inputs are drawn once, so that every benchmark and check sees the same
+batch. The 4x4 matrices are isometries, built from the same rotations and
+translations as rots and trans. */
+GLuint num;
+GLdouble (*mats)[4][4], (*matsB)[4][4], (*matsOut)[4][4];
+GLdouble (*affines)[3][4], (*affinesB)[3][4], (*affinesOut)[3][4];
+GLdouble (*rots)[3][3], (*rotsOut)[3][3];
+GLdouble (*trans)[3], (*axes)[3], *angles;
+GLdouble (*us)[3], (*vs)[3], (*as)[3], (*bs)[3];
+GLdouble (*vecs)[4], (*vecsOut)[4];
+GLfloat (*matsGL)[4][4], (*matsGLB)[4][4], (*matsGLOut)[4][4];
+GLfloat (*vecsGL)[4], (*vecsGLOut)[4];
+GLint *parents;
+/* Every benchmark adds one of its outputs here, so that the compiler cannot
+discard its work. */
+volatile GLdouble benchSink;
+
+/* Returns a uniformly random number in [lo, hi]. */
+GLdouble benchRandom(GLdouble lo, GLdouble hi) {
+	return lo + (hi - lo) * ((GLdouble)rand() / RAND_MAX);
+}
+
+/* Places a uniformly random unit vector into axis. */
+void benchRandomAxis(GLdouble axis[3]) {
+	GLdouble v[3];
+	do {
+		vec3Set(v, benchRandom(-1.0, 1.0), benchRandom(-1.0, 1.0),
+			benchRandom(-1.0, 1.0));
+	} while (vec3Length(v) < 0.1 || vec3Length(v) > 1.0);
+	vecUnit(3, v, axis);
+}
+
+/* Helper function for benchInitialize. */
+void *benchAllocate(size_t size) {
+	void *block = malloc(num * size);
+	if (block == NULL)
+		fprintf(stderr, "benchAllocate: malloc failed.\n");
+	return block;
+}
+
+/* Deallocates the batch. */
+void benchDestroy(void) {
+	free(mats); free(matsB); free(matsOut);
+	free(affines); free(affinesB); free(affinesOut);
+	free(rots); free(rotsOut);
+	free(trans); free(axes); free(angles);
+	free(us); free(vs); free(as); free(bs);
+	free(vecs); free(vecsOut);
+	free(matsGL); free(matsGLB); free(matsGLOut);
+	free(vecsGL); free(vecsGLOut);
+	free(parents);
+}
+
+/* Allocates and fills a batch of the given size. Returns 0 on success,
+non-zero on failure. On success, the user must call benchDestroy when
+finished. */
+int benchInitialize(GLuint batchNum) {
+	GLuint k;
+	GLdouble w[3], rotB[3][3], transB[3];
+	num = batchNum;
+	mats = (GLdouble (*)[4][4])benchAllocate(sizeof(mats[0]));
+	matsB = (GLdouble (*)[4][4])benchAllocate(sizeof(matsB[0]));
+	matsOut = (GLdouble (*)[4][4])benchAllocate(sizeof(matsOut[0]));
+	affines = (GLdouble (*)[3][4])benchAllocate(sizeof(affines[0]));
+	affinesB = (GLdouble (*)[3][4])benchAllocate(sizeof(affinesB[0]));
+	affinesOut = (GLdouble (*)[3][4])benchAllocate(sizeof(affinesOut[0]));
+	rots = (GLdouble (*)[3][3])benchAllocate(sizeof(rots[0]));
+	rotsOut = (GLdouble (*)[3][3])benchAllocate(sizeof(rotsOut[0]));
+	trans = (GLdouble (*)[3])benchAllocate(sizeof(trans[0]));
+	axes = (GLdouble (*)[3])benchAllocate(sizeof(axes[0]));
+	angles = (GLdouble *)benchAllocate(sizeof(angles[0]));
+	us = (GLdouble (*)[3])benchAllocate(sizeof(us[0]));
+	vs = (GLdouble (*)[3])benchAllocate(sizeof(vs[0]));
+	as = (GLdouble (*)[3])benchAllocate(sizeof(as[0]));
+	bs = (GLdouble (*)[3])benchAllocate(sizeof(bs[0]));
+	vecs = (GLdouble (*)[4])benchAllocate(sizeof(vecs[0]));
+	vecsOut = (GLdouble (*)[4])benchAllocate(sizeof(vecsOut[0]));
+	matsGL = (GLfloat (*)[4][4])benchAllocate(sizeof(matsGL[0]));
+	matsGLB = (GLfloat (*)[4][4])benchAllocate(sizeof(matsGLB[0]));
+	matsGLOut = (GLfloat (*)[4][4])benchAllocate(sizeof(matsGLOut[0]));
+	vecsGL = (GLfloat (*)[4])benchAllocate(sizeof(vecsGL[0]));
+	vecsGLOut = (GLfloat (*)[4])benchAllocate(sizeof(vecsGLOut[0]));
+	parents = (GLint *)benchAllocate(sizeof(parents[0]));
+	if (mats == NULL || matsB == NULL || matsOut == NULL || affines == NULL ||
+			affinesB == NULL || affinesOut == NULL || rots == NULL ||
+			rotsOut == NULL || trans == NULL || axes == NULL ||
+			angles == NULL || us == NULL || vs == NULL || as == NULL ||
+			bs == NULL || vecs == NULL || vecsOut == NULL || matsGL == NULL ||
+			matsGLB == NULL || matsGLOut == NULL || vecsGL == NULL ||
+			vecsGLOut == NULL || parents == NULL) {
+		benchDestroy();
+		return 1;
+	}
+	srand(311);
+	for (k = 0; k < num; k += 1) {
+		benchRandomAxis(axes[k]);
+		angles[k] = benchRandom(-M_PI, M_PI);
+		mat33AngleAxisRotation(angles[k], axes[k], rots[k]);
+		vec3Set(trans[k], benchRandom(-10.0, 10.0), benchRandom(-10.0, 10.0),
+			benchRandom(-10.0, 10.0));
+		mat44Isometry(rots[k], trans[k], mats[k]);
+		mat34Isometry(rots[k], trans[k], affines[k]);
+		benchRandomAxis(w);
+		mat33AngleAxisRotation(benchRandom(-M_PI, M_PI), w, rotB);
+		vec3Set(transB, benchRandom(-10.0, 10.0), benchRandom(-10.0, 10.0),
+			benchRandom(-10.0, 10.0));
+		mat44Isometry(rotB, transB, matsB[k]);
+		mat34Isometry(rotB, transB, affinesB[k]);
+		mat44OpenGL(mats[k], matsGL[k]);
+		mat44OpenGL(matsB[k], matsGLB[k]);
+		/* u and v are perpendicular, and so are a and b. */
+		benchRandomAxis(us[k]);
+		benchRandomAxis(w);
+		vec3Cross(us[k], w, vs[k]);
+		vecUnit(3, vs[k], vs[k]);
+		mat331Multiply(rotB, us[k], as[k]);
+		mat331Multiply(rotB, vs[k], bs[k]);
+		vec4Set(vecs[k], benchRandom(-10.0, 10.0), benchRandom(-10.0, 10.0),
+			benchRandom(-10.0, 10.0), 1.0);
+		vecOpenGL(4, vecs[k], vecsGL[k]);
+		/* Chains of eight nodes, each the child of the one before. */
+		parents[k] = (k % 8 == 0 ? -1 : (GLint)k - 1);
+	}
+	return 0;
+}
+
+
+
+/*** Benchmarks ***/
+
+void benchMat444Multiply(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat444Multiply(mats[k], matsB[k], matsOut[k]);
+	benchSink = benchSink + matsOut[num - 1][0][3];
+}
+
+void benchMat34Compose(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat34Compose(affines[k], affinesB[k], affinesOut[k]);
+	benchSink = benchSink + affinesOut[num - 1][0][3];
+}
+
+void benchMatGL444Multiply(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		matGL444Multiply(matsGL[k], matsGLB[k], matsGLOut[k]);
+	benchSink = benchSink + matsGLOut[num - 1][3][0];
+}
+
+void benchMatGL444ComposeBatch(void) {
+	matGL444ComposeBatch(num, parents, matsGL, matsGLOut);
+	benchSink = benchSink + matsGLOut[num - 1][3][0];
+}
+
+void benchMat441Multiply(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat441Multiply(mats[k], vecs[k], vecsOut[k]);
+	benchSink = benchSink + vecsOut[num - 1][0];
+}
+
+void benchMat34TransformPoint(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat34TransformPoint(affines[k], vecs[k], vecsOut[k]);
+	benchSink = benchSink + vecsOut[num - 1][0];
+}
+
+void benchMatGL441MultiplyBatch(void) {
+	matGL441MultiplyBatch(matsGL[0], num, vecsGL, vecsGLOut);
+	benchSink = benchSink + vecsGLOut[num - 1][0];
+}
+
+void benchMat33AngleAxisRotation(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat33AngleAxisRotation(angles[k], axes[k], rotsOut[k]);
+	benchSink = benchSink + rotsOut[num - 1][0][0];
+}
+
+void benchQuatRotation(void) {
+	GLdouble q[4];
+	for (GLuint k = 0; k < num; k += 1) {
+		quatAngleAxis(angles[k], axes[k], q);
+		quatRotation(q, rotsOut[k]);
+	}
+	benchSink = benchSink + rotsOut[num - 1][0][0];
+}
+
+void benchMat33BasisRotation(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat33BasisRotation(us[k], vs[k], as[k], bs[k], rotsOut[k]);
+	benchSink = benchSink + rotsOut[num - 1][0][0];
+}
+
+void benchMat44InverseIsometry(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat44InverseIsometry(rots[k], trans[k], matsOut[k]);
+	benchSink = benchSink + matsOut[num - 1][0][3];
+}
+
+void benchMat34InverseIsometry(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat34InverseIsometry(rots[k], trans[k], affinesOut[k]);
+	benchSink = benchSink + affinesOut[num - 1][0][3];
+}
+
+void benchVecUnit(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		vecUnit(3, vecs[k], vecsOut[k]);
+	benchSink = benchSink + vecsOut[num - 1][0];
+}
+
+void benchMat44OpenGL(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat44OpenGL(mats[k], matsGLOut[k]);
+	benchSink = benchSink + matsGLOut[num - 1][3][0];
+}
+
+void benchMat44OpenGLBatch(void) {
+	mat44OpenGLBatch(num, mats, matsGLOut);
+	benchSink = benchSink + matsGLOut[num - 1][3][0];
+}
+
+void benchMat34OpenGL(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		mat34OpenGL(affines[k], (GLfloat (*)[4])matsGLOut[k]);
+	benchSink = benchSink + matsGLOut[num - 1][0][3];
+}
+
+void benchVecOpenGL(void) {
+	for (GLuint k = 0; k < num; k += 1)
+		vecOpenGL(4, vecs[k], vecsGLOut[k]);
+	benchSink = benchSink + vecsGLOut[num - 1][0];
+}
+
+/* Runs the kernel over the whole batch, again and again for at least a fifth
+of a second, and prints the time per element and the throughput. */
+void benchRun(const char *name, void (*kernel)(void)) {
+	GLuint repNum = 0;
+	double start = getTime(), elapsed;
+	kernel();
+	start = getTime();
+	do {
+		kernel();
+		repNum += 1;
+		elapsed = getTime() - start;
+	} while (elapsed < 0.2);
+	double nanos = elapsed * 1.0e9 / ((double)repNum * num);
+	printf("bench: %-28s %9.2f ns/op %9.1f Mop/s\n", name, nanos,
+		1.0e3 / nanos);
+}
+
+
+
+/*** Accuracy ***/
+
+/* The plain C products that mat444Multiply must match exactly, whether or not
+it uses SIMD: the same products, added in the same order. */
+void benchReference444(GLdouble m[4][4], GLdouble n[4][4],
+		GLdouble mTimesN[4][4]) {
+	for (int i = 0; i < 4; i += 1)
+		for (int j = 0; j < 4; j += 1)
+			mTimesN[i][j] = m[i][0] * n[0][j] + m[i][1] * n[1][j] +
+				m[i][2] * n[2][j] + m[i][3] * n[3][j];
+}
+
+GLuint failNum = 0;
+
+/* Prints the result of one check, which fails if err exceeds bound. */
+void benchCheck(const char *name, double err, double bound) {
+	int pass = (err <= bound);
+	printf("check: %-40s max error %9.3g, bound %9.3g %s\n", name, err,
+		bound, (pass ? "ok" : "FAILED"));
+	if (!pass)
+		failNum += 1;
+}
+
+/* Returns the largest difference between corresponding entries of the
+dim-dimensional arrays v and w. */
+double benchMaxDiff(GLuint dim, GLdouble v[], GLdouble w[]) {
+	double err = 0.0;
+	for (GLuint i = 0; i < dim; i += 1)
+		if (fabs(v[i] - w[i]) > err)
+			err = fabs(v[i] - w[i]);
+	return err;
+}
+
+/* Returns the largest difference between the float matrix in OpenGL's layout
+and the double matrix, relative to the scale of each entry. For a product,
+the scale of entry (i, j) is the sum of the magnitudes of its terms, and a
+float kernel that rounds correctly at each step stays within a few
+FLT_EPSILON of the double product, relative to that scale. */
+double benchRelativeDiffGL(GLfloat openGL[4][4], GLdouble m[4][4],
+		GLdouble scale[4][4]) {
+	double err = 0.0, diff;
+	for (int i = 0; i < 4; i += 1)
+		for (int j = 0; j < 4; j += 1) {
+			diff = fabs(openGL[j][i] - m[i][j]) / scale[i][j];
+			if (diff > err)
+				err = diff;
+		}
+	return err;
+}
+
+/* Runs every check. Returns the number of failures. */
+GLuint benchCheckAll(void) {
+	GLdouble ref[4][4], scale[4][4], full[4][4], inv[3][4], q[4];
+	GLdouble world[8][4][4], v[4];
+	GLfloat ref32[4][4];
+	double err[12] = {0.0};
+	GLuint k, c;
+	for (k = 0; k < num; k += 1) {
+		/* The SIMD 4x4 product is bit for bit the plain one. */
+		mat444Multiply(mats[k], matsB[k], matsOut[k]);
+		benchReference444(mats[k], matsB[k], ref);
+		err[0] = fmax(err[0], benchMaxDiff(16, (GLdouble *)matsOut[k],
+			(GLdouble *)ref));
+		/* So is the SIMD conversion to floats. */
+		mat44OpenGL(mats[k], matsGLOut[k]);
+		for (int i = 0; i < 4; i += 1)
+			for (int j = 0; j < 4; j += 1) {
+				ref32[j][i] = (GLfloat)mats[k][i][j];
+				err[1] = fmax(err[1], fabs(matsGLOut[k][j][i] - ref32[j][i]));
+			}
+		/* The 3x4 composition adds the same products, minus the zeros. */
+		mat34Compose(affines[k], affinesB[k], affinesOut[k]);
+		mat44Affine(affinesOut[k], full);
+		err[2] = fmax(err[2], benchMaxDiff(16, (GLdouble *)full,
+			(GLdouble *)ref));
+		/* Both 3x4 inverses match the 4x4 inverse. */
+		mat44InverseIsometry(rots[k], trans[k], ref);
+		mat34InverseIsometry(rots[k], trans[k], affinesOut[k]);
+		mat34InvertIsometry(affines[k], inv);
+		err[3] = fmax(err[3], benchMaxDiff(12, (GLdouble *)affinesOut[k],
+			(GLdouble *)ref));
+		err[3] = fmax(err[3], benchMaxDiff(12, (GLdouble *)inv,
+			(GLdouble *)ref));
+		/* The float product, against the double product of the same
+		(rounded) inputs. */
+		matGL444Multiply(matsGL[k], matsGLB[k], matsGLOut[k]);
+		mat444Multiply(mats[k], matsB[k], ref);
+		for (int i = 0; i < 4; i += 1)
+			for (int j = 0; j < 4; j += 1)
+				scale[i][j] = fabs(mats[k][i][0] * matsB[k][0][j]) +
+					fabs(mats[k][i][1] * matsB[k][1][j]) +
+					fabs(mats[k][i][2] * matsB[k][2][j]) +
+					fabs(mats[k][i][3] * matsB[k][3][j]) + DBL_MIN;
+		err[4] = fmax(err[4], benchRelativeDiffGL(matsGLOut[k], ref, scale));
+		/* The reference for the batched float transform, below. */
+		mat441Multiply(mats[0], vecs[k], vecsOut[k]);
+		/* Quaternions against Rodrigues' formula, and back. */
+		quatAngleAxis(angles[k], axes[k], q);
+		quatRotation(q, rotsOut[k]);
+		err[6] = fmax(err[6], benchMaxDiff(9, (GLdouble *)rotsOut[k],
+			(GLdouble *)rots[k]));
+		quatFromRotation(rots[k], q);
+		quatRotation(q, rotsOut[k]);
+		err[7] = fmax(err[7], benchMaxDiff(9, (GLdouble *)rotsOut[k],
+			(GLdouble *)rots[k]));
+		/* The basis rotation takes u to a and v to b, up to the rounding in
+		a, b, and the cross products, which is several times that of one
+		product. */
+		mat33BasisRotation(us[k], vs[k], as[k], bs[k], rotsOut[k]);
+		mat331Multiply(rotsOut[k], us[k], v);
+		err[8] = fmax(err[8], benchMaxDiff(3, v, as[k]));
+		mat331Multiply(rotsOut[k], vs[k], v);
+		err[8] = fmax(err[8], benchMaxDiff(3, v, bs[k]));
+		/* The fixed-dimension functions match the general ones exactly. */
+		err[9] = fmax(err[9], fabs(vec3Dot(vecs[k], us[k]) -
+			vecDot(3, vecs[k], us[k])));
+		err[9] = fmax(err[9], fabs(vec3Length(vecs[k]) -
+			vecLength(3, vecs[k])));
+		/* Unit vectors have length 1. */
+		vecUnit(3, vecs[k], v);
+		err[10] = fmax(err[10], fabs(vec3Length(v) - 1.0));
+	}
+	/* The batched float transform of points, with the same scale as the
+	float product. */
+	matGL441MultiplyBatch(matsGL[0], num, vecsGL, vecsGLOut);
+	for (k = 0; k < num; k += 1)
+		for (int i = 0; i < 4; i += 1) {
+			double s = fabs(mats[0][i][0] * vecs[k][0]) +
+				fabs(mats[0][i][1] * vecs[k][1]) +
+				fabs(mats[0][i][2] * vecs[k][2]) +
+				fabs(mats[0][i][3] * vecs[k][3]) + DBL_MIN;
+			err[5] = fmax(err[5], fabs(vecsOut[k][i] - vecsGLOut[k][i]) / s);
+		}
+	/* The float composition of chains of eight, against the double chains.
+	Each level rounds its local matrix to floats and then its product, so it
+	can add up to about 8 FLT_EPSILON, relative to the size of the
+	translations. */
+	matGL444ComposeBatch(num, parents, matsGL, matsGLOut);
+	for (k = 0; k < num; k += 1) {
+		c = k % 8;
+		if (c == 0)
+			mat44Copy(mats[k], world[0]);
+		else
+			mat444Multiply(world[c - 1], mats[k], world[c]);
+		for (int i = 0; i < 4; i += 1)
+			for (int j = 0; j < 4; j += 1)
+				err[11] = fmax(err[11], fabs(matsGLOut[k][j][i] -
+					world[c][i][j]) / (1.0 + fabs(world[c][i][j])));
+	}
+	printf("check: %u elements, %s kernels\n", num,
+		(matSIMD ? "SIMD" : "plain C"));
+	benchCheck("mat444Multiply, plain C order", err[0], 0.0);
+	benchCheck("mat44OpenGL, plain C conversion", err[1], 0.0);
+	benchCheck("mat34Compose vs mat444Multiply", err[2], 0.0);
+	benchCheck("mat34 inverses vs mat44InverseIsometry", err[3], 0.0);
+	benchCheck("matGL444Multiply vs double", err[4], 4.0 * FLT_EPSILON);
+	benchCheck("matGL441MultiplyBatch vs double", err[5],
+		4.0 * FLT_EPSILON);
+	benchCheck("matGL444ComposeBatch vs double, depth 8", err[11],
+		8.0 * 8.0 * FLT_EPSILON);
+	benchCheck("quatRotation vs mat33AngleAxisRotation", err[6],
+		32.0 * DBL_EPSILON);
+	benchCheck("quatFromRotation round trip", err[7], 32.0 * DBL_EPSILON);
+	benchCheck("mat33BasisRotation takes u, v to a, b", err[8],
+		64.0 * DBL_EPSILON);
+	benchCheck("vec3Dot, vec3Length vs general", err[9], 0.0);
+	benchCheck("vecUnit length", err[10], 2.0 * DBL_EPSILON);
+	return failNum;
+}
+
+
+
+/*** Main ***/
+
+int main(int argc, char **argv) {
+	GLuint batchNum = 65536;
+	if (argc > 1)
+		batchNum = (GLuint)strtoul(argv[1], NULL, 10);
+	if (batchNum < 8) {
+		fprintf(stderr, "main: the batch size must be at least 8.\n");
+		return 1;
+	}
+	if (benchInitialize(batchNum) != 0)
+		return 1;
+	printf("bench: %u elements, %s kernels\n", num,
+		(matSIMD ? "SIMD" : "plain C"));
+	benchRun("mat444Multiply", benchMat444Multiply);
+	benchRun("mat34Compose", benchMat34Compose);
+	benchRun("matGL444Multiply", benchMatGL444Multiply);
+	benchRun("matGL444ComposeBatch", benchMatGL444ComposeBatch);
+	benchRun("mat441Multiply", benchMat441Multiply);
+	benchRun("mat34TransformPoint", benchMat34TransformPoint);
+	benchRun("matGL441MultiplyBatch", benchMatGL441MultiplyBatch);
+	benchRun("mat33AngleAxisRotation", benchMat33AngleAxisRotation);
+	benchRun("quatAngleAxis + quatRotation", benchQuatRotation);
+	benchRun("mat33BasisRotation", benchMat33BasisRotation);
+	benchRun("mat44InverseIsometry", benchMat44InverseIsometry);
+	benchRun("mat34InverseIsometry", benchMat34InverseIsometry);
+	benchRun("vecUnit", benchVecUnit);
+	benchRun("mat44OpenGL", benchMat44OpenGL);
+	benchRun("mat44OpenGLBatch", benchMat44OpenGLBatch);
+	benchRun("mat34OpenGL", benchMat34OpenGL);
+	benchRun("vecOpenGL", benchVecOpenGL);
+	GLuint failures = benchCheckAll();
+	if (failures > 0)
+		printf("check: %u checks FAILED\n", failures);
+	else
+		printf("check: all checks passed\n");
+	benchDestroy();
+	return (failures > 0);
+}
@@ -0,0 +1,203 @@
+/*
+ * meshBenchmark.c
+ * CS 311
+ * Carleton College
+ * Times normal generation on a large landscape mesh: meshSmoothNormals and
+ * meshFlatNormals against their parallel versions, with varying numbers of
+ * threads, and checks that every version computes the same normals. Also
+ * times welding a triangle soup back into the landscape with meshWeld.
+ */
+
+
+
+/* On macOS, compile with...
+	clang++ -O2 meshBenchmark.c /usr/local/gl3w/src/gl3w.o -lode -framework OpenGL -framework CoreFoundation
+(580mesh.c calls OpenGL and ODE, so both must be linked, even though the
+benchmark never opens a window) and run with an optional landscape size, as in
+	./a.out 2048
+for a 2048 x 2048 landscape of about 4 million vertices and 8 million
+triangles. The program exits with status 0 if the parallel normals match the
+serial ones exactly and meshWeld restores the landscape, and 1 otherwise. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+#include <GL/gl3w.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <ode/ode.h>
+
+double getTime(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec * 0.000001;
+}
+
+#include "530vector.c"
+#include "580mesh.c"
+
+
+
+/* Returns the largest difference between the normals (attributes n, n + 1,
+n + 2) of the two meshes, which must have the same vertices. */
+double benchNormalDiff(meshMesh *mesh, GLdouble *vert, GLuint n) {
+	double err = 0.0;
+	GLuint i, k;
+	for (i = 0; i < mesh->vertNum; i += 1)
+		for (k = n; k < n + 3; k += 1)
+			err = fmax(err, fabs(mesh->vert[i * mesh->attrDim + k] -
+				vert[i * mesh->attrDim + k]));
+	return err;
+}
+
+/* Times the normal function, which is either serial (if threadNum is 0) or
+parallel, on the mesh. Runs it repeatedly, for at least half a second, and
+prints the best time. Returns the difference between its normals and the
+reference normals in vert. Before each run, the normals are cleared, so that
+a function that does nothing cannot pass. */
+double benchNormals(const char *name, meshMesh *mesh, GLuint smooth,
+		GLuint threadNum, GLdouble *vert) {
+	double best = -1.0, start, elapsed, total = 0.0;
+	GLuint i;
+	while (total < 0.5) {
+		for (i = 0; i < mesh->vertNum; i += 1)
+			vec3Set(&(mesh->vert[i * mesh->attrDim + 5]), 0.0, 0.0, 0.0);
+		start = getTime();
+		if (threadNum == 0 && smooth)
+			meshSmoothNormals(mesh, 5);
+		else if (threadNum == 0)
+			meshFlatNormals(mesh, 5);
+		else if (smooth)
+			meshSmoothNormalsParallel(mesh, 5, threadNum);
+		else
+			meshFlatNormalsParallel(mesh, 5, threadNum);
+		elapsed = getTime() - start;
+		total += elapsed;
+		if (best < 0.0 || elapsed < best)
+			best = elapsed;
+	}
+	if (threadNum == 0)
+		printf("bench: %-24s serial     %9.2f ms %9.2f ns/vertex\n", name,
+			best * 1.0e3, best * 1.0e9 / mesh->vertNum);
+	else
+		printf("bench: %-24s %2u threads %9.2f ms %9.2f ns/vertex\n", name,
+			threadNum, best * 1.0e3, best * 1.0e9 / mesh->vertNum);
+	return benchNormalDiff(mesh, vert, 5);
+}
+
+/* Times meshWeld on a triangle soup made from the mesh, with three vertices
+of its own for each triangle, each moved by up to jitter in every attribute.
+Welding with a tolerance a little bigger than the jitter should give back the
+mesh's vertex count, with every corner within the tolerance of the original.
+Returns 0 if it does, and 1 otherwise. */
+int benchWeld(meshMesh *mesh, GLdouble jitter) {
+	meshMesh soup;
+	GLuint i, k, m, *tri;
+	GLdouble *v, *w, tol = 2.0 * jitter;
+	if (meshInitialize(&soup, mesh->triNum, mesh->triNum * 3,
+			mesh->attrDim) != 0) {
+		fprintf(stderr, "benchWeld: meshInitialize failed.\n");
+		return 1;
+	}
+	srand(311);
+	for (i = 0; i < mesh->triNum; i += 1) {
+		tri = meshGetTrianglePointer(mesh, i);
+		meshSetTriangle(&soup, i, i * 3, i * 3 + 1, i * 3 + 2);
+		for (k = 0; k < 3; k += 1) {
+			v = meshGetVertexPointer(&soup, i * 3 + k);
+			vecCopy(mesh->attrDim, meshGetVertexPointer(mesh, tri[k]), v);
+			for (m = 0; m < mesh->attrDim; m += 1)
+				v[m] += jitter * ((GLdouble)rand() / RAND_MAX - 0.5);
+		}
+	}
+	double start = getTime();
+	int error = meshWeld(&soup, tol, tol);
+	double elapsed = getTime() - start;
+	printf("bench: %-24s jitter %-7g %9.2f ms, %u vertices to %u\n", "meshWeld",
+		jitter, elapsed * 1.0e3, mesh->triNum * 3, soup.vertNum);
+	if (error != 0)
+		return 1;
+	error = (soup.vertNum != mesh->vertNum || soup.triNum != mesh->triNum);
+	for (i = 0; i < mesh->triNum && error == 0; i += 1)
+		for (k = 0; k < 3; k += 1) {
+			v = meshGetVertexPointer(mesh, mesh->tri[i * 3 + k]);
+			w = meshGetVertexPointer(&soup, soup.tri[i * 3 + k]);
+			for (m = 0; m < mesh->attrDim; m += 1)
+				if (fabs(v[m] - w[m]) > tol)
+					error = 1;
+		}
+	meshDestroy(&soup);
+	return error;
+}
+
+int main(int argc, char **argv) {
+	GLuint size = 1024, i, j, threadNum, failNum = 0, smooth;
+	meshMesh mesh;
+	if (argc > 1)
+		size = (GLuint)strtoul(argv[1], NULL, 10);
+	if (size < 2) {
+		fprintf(stderr, "main: the size must be at least 2.\n");
+		return 1;
+	}
+	/* Rolling hills, with enough detail that neighboring triangles differ. */
+	GLdouble *zs = (GLdouble *)malloc(size * size * sizeof(GLdouble));
+	if (zs == NULL) {
+		fprintf(stderr, "main: malloc failed.\n");
+		return 1;
+	}
+	for (i = 0; i < size; i += 1)
+		for (j = 0; j < size; j += 1)
+			zs[i * size + j] = 20.0 * sin(i * 0.05) * cos(j * 0.03) +
+				3.0 * sin(i * 0.7 + j * 1.3) + 0.5 * cos(i * j * 0.01);
+	double start = getTime();
+	if (meshInitializeLandscape(&mesh, size, size, 1.0, zs) != 0) {
+		free(zs);
+		return 1;
+	}
+	printf("bench: %u x %u landscape, %u vertices, %u triangles, "
+		"built in %.2f ms\n", size, size, mesh.vertNum, mesh.triNum,
+		(getTime() - start) * 1.0e3);
+	free(zs);
+	GLdouble *vert = (GLdouble *)malloc(mesh.vertNum * mesh.attrDim *
+		sizeof(GLdouble));
+	if (vert == NULL) {
+		fprintf(stderr, "main: malloc failed.\n");
+		meshDestroy(&mesh);
+		return 1;
+	}
+	printf("bench: %ld processors\n", sysconf(_SC_NPROCESSORS_ONLN));
+	for (smooth = 0; smooth < 2; smooth += 1) {
+		const char *name = (smooth ? "meshSmoothNormals" : "meshFlatNormals");
+		/* The serial normals are the reference. */
+		benchNormals(name, &mesh, smooth, 0, mesh.vert);
+		memcpy(vert, mesh.vert, mesh.vertNum * mesh.attrDim *
+			sizeof(GLdouble));
+		/* Beyond the number of processors, the timings only show the cost of
+		oversubscription, but the check still means something. */
+		for (threadNum = 1; threadNum <= meshTHREADMAX; threadNum *= 2) {
+			double err = benchNormals(name, &mesh, smooth, threadNum, vert);
+			if (err != 0.0) {
+				printf("check: %s with %u threads differs from serial by %g\n",
+					name, threadNum, err);
+				failNum += 1;
+			}
+		}
+	}
+	/* Exact welding, and welding that has to look in neighboring cubes. */
+	for (i = 0; i < 2; i += 1)
+		if (benchWeld(&mesh, (i == 0 ? 0.0 : 1.0e-9)) != 0) {
+			printf("check: meshWeld did not restore the landscape\n");
+			failNum += 1;
+		}
+	if (failNum > 0)
+		printf("check: %u checks FAILED\n", failNum);
+	else
+		printf("check: parallel normals match serial normals exactly, and "
+			"meshWeld restores the landscape\n");
+	free(vert);
+	meshDestroy(&mesh);
+	return (failNum > 0);
+}
@@ -0,0 +1,230 @@
+/*
+ * meshFileBenchmark.c
+ * CS 311
+ * Carleton College
+ * Times importing a large landscape mesh from OBJ and binary PLY files, with
+ * varying numbers of threads and through the mesh cache, and checks that
+ * every import reproduces the original mesh exactly.
+ */
+
+
+
+/* On macOS, compile with...
+	clang++ -O2 meshFileBenchmark.c /usr/local/gl3w/src/gl3w.o -lode -framework OpenGL -framework CoreFoundation
+(580mesh.c calls OpenGL and ODE, so both must be linked, even though the
+benchmark never opens a window) and run with an optional landscape size, as in
+	./a.out 1024
+for a 1024 x 1024 landscape of about 1 million vertices and 2 million
+triangles. The program writes meshFileBenchmark.obj, meshFileBenchmark.ply,
+and their caches to the current directory, and removes them when done. It
+exits with status 0 if all checks pass, and 1 otherwise. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+#include <GL/gl3w.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ode/ode.h>
+
+double getTime(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec * 0.000001;
+}
+
+#include "530vector.c"
+#include "580mesh.c"
+#include "660meshFile.c"
+
+#define BENCHOBJ "meshFileBenchmark.obj"
+#define BENCHPLY "meshFileBenchmark.ply"
+
+/* Writes the mesh as OBJ, with every number printed so that it reads back
+exactly. Vertex i becomes position, texture coordinates, and normal i. Returns
+0 on success, non-zero on failure. */
+int benchWriteOBJ(meshMesh *mesh, const char *path) {
+	GLuint i;
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+		return 1;
+	fprintf(file, "# %u vertices, %u triangles\n", mesh->vertNum, mesh->triNum);
+	for (i = 0; i < mesh->vertNum; i += 1) {
+		GLdouble *v = meshGetVertexPointer(mesh, i);
+		fprintf(file, "v %.17g %.17g %.17g\n", v[0], v[1], v[2]);
+	}
+	for (i = 0; i < mesh->vertNum; i += 1) {
+		GLdouble *v = meshGetVertexPointer(mesh, i);
+		fprintf(file, "vt %.17g %.17g\n", v[3], v[4]);
+	}
+	for (i = 0; i < mesh->vertNum; i += 1) {
+		GLdouble *v = meshGetVertexPointer(mesh, i);
+		fprintf(file, "vn %.17g %.17g %.17g\n", v[5], v[6], v[7]);
+	}
+	for (i = 0; i < mesh->triNum; i += 1) {
+		GLuint *t = meshGetTrianglePointer(mesh, i);
+		fprintf(file, "f %u/%u/%u %u/%u/%u %u/%u/%u\n", t[0] + 1, t[0] + 1,
+			t[0] + 1, t[1] + 1, t[1] + 1, t[1] + 1, t[2] + 1, t[2] + 1,
+			t[2] + 1);
+	}
+	return (fclose(file) != 0);
+}
+
+/* Writes the mesh as binary PLY, with double attributes, so that it reads
+back exactly. Returns 0 on success, non-zero on failure. */
+int benchWritePLY(meshMesh *mesh, const char *path) {
+	GLuint i, one = 1;
+	GLubyte three = 3;
+	FILE *file = fopen(path, "wb");
+	if (file == NULL)
+		return 1;
+	fprintf(file, "ply\nformat %s 1.0\nelement vertex %u\n"
+		"property double x\nproperty double y\nproperty double z\n"
+		"property double s\nproperty double t\nproperty double nx\n"
+		"property double ny\nproperty double nz\nelement face %u\n"
+		"property list uchar uint vertex_indices\nend_header\n",
+		(*(GLubyte *)&one ? "binary_little_endian" : "binary_big_endian"),
+		mesh->vertNum, mesh->triNum);
+	fwrite(mesh->vert, sizeof(GLdouble), mesh->vertNum * mesh->attrDim, file);
+	for (i = 0; i < mesh->triNum; i += 1) {
+		fwrite(&three, 1, 1, file);
+		fwrite(meshGetTrianglePointer(mesh, i), sizeof(GLuint), 3, file);
+	}
+	return (fclose(file) != 0);
+}
+
+/* Returns 0 if every corner of every triangle of the imported mesh has the
+same attributes as in the original, and 1 otherwise. The imported mesh may
+number its vertices differently. */
+int benchCompare(meshMesh *original, meshMesh *imported) {
+	GLuint i, k;
+	if (imported->triNum != original->triNum ||
+			imported->attrDim != original->attrDim)
+		return 1;
+	for (i = 0; i < original->triNum; i += 1)
+		for (k = 0; k < 3; k += 1)
+			if (memcmp(meshGetVertexPointer(original, original->tri[i * 3 + k]),
+					meshGetVertexPointer(imported, imported->tri[i * 3 + k]),
+					original->attrDim * sizeof(GLdouble)) != 0)
+				return 1;
+	return 0;
+}
+
+/* Checks meshFileParseDouble against strtod on numbers in several formats.
+Returns the number of mismatches. */
+GLuint benchCheckParse(void) {
+	const char *formats[5] = {"%.17g", "%g", "%.6f", "%.3e", "%.20e"};
+	char text[64], *end;
+	GLuint i, k, failNum = 0;
+	GLdouble x, parsed;
+	srand(311);
+	for (i = 0; i < 100000; i += 1) {
+		x = ((GLdouble)rand() / RAND_MAX - 0.5) *
+			pow(10.0, (GLdouble)(rand() % 40 - 20));
+		for (k = 0; k < 5; k += 1) {
+			snprintf(text, sizeof(text), formats[k], x);
+			const char *p = text;
+			if (meshFileParseDouble(&p, text + strlen(text), &parsed) != 0 ||
+					parsed != strtod(text, &end) || p != end) {
+				if (failNum < 10)
+					printf("check: %s parsed as %.17g\n", text, parsed);
+				failNum += 1;
+			}
+		}
+	}
+	return failNum;
+}
+
+/* Times loading the mesh at path with the given function, and prints and
+returns the time. */
+double benchLoad(const char *name, const char *path, GLuint threadNum,
+		int cached, meshMesh *mesh) {
+	double start = getTime();
+	int error = (cached ? meshInitializeFileCached(mesh, path, threadNum) :
+		meshInitializeFile(mesh, path, threadNum));
+	double elapsed = getTime() - start;
+	if (error != 0)
+		return -1.0;
+	printf("bench: %-28s %2u threads %9.2f ms\n", name, threadNum,
+		elapsed * 1.0e3);
+	return elapsed;
+}
+
+int main(int argc, char **argv) {
+	GLuint size = 512, i, j, threadNum, failNum = 0, f;
+	meshMesh mesh, imported;
+	const char *paths[2] = {BENCHOBJ, BENCHPLY};
+	if (argc > 1)
+		size = (GLuint)strtoul(argv[1], NULL, 10);
+	if (size < 2) {
+		fprintf(stderr, "main: the size must be at least 2.\n");
+		return 1;
+	}
+	failNum = benchCheckParse();
+	printf("check: %u numbers parsed differently from strtod\n", failNum);
+	GLdouble *zs = (GLdouble *)malloc(size * size * sizeof(GLdouble));
+	if (zs == NULL) {
+		fprintf(stderr, "main: malloc failed.\n");
+		return 1;
+	}
+	for (i = 0; i < size; i += 1)
+		for (j = 0; j < size; j += 1)
+			zs[i * size + j] = 20.0 * sin(i * 0.05) * cos(j * 0.03) +
+				3.0 * sin(i * 0.7 + j * 1.3);
+	if (meshInitializeLandscape(&mesh, size, size, 0.1, zs) != 0) {
+		free(zs);
+		return 1;
+	}
+	free(zs);
+	if (benchWriteOBJ(&mesh, BENCHOBJ) != 0 ||
+			benchWritePLY(&mesh, BENCHPLY) != 0) {
+		fprintf(stderr, "main: could not write the files.\n");
+		meshDestroy(&mesh);
+		return 1;
+	}
+	printf("bench: %u x %u landscape, %u vertices, %u triangles\n", size, size,
+		mesh.vertNum, mesh.triNum);
+	for (f = 0; f < 2; f += 1) {
+		char cachePath[64];
+		snprintf(cachePath, sizeof(cachePath), "%s.meshcache", paths[f]);
+		remove(cachePath);
+		for (threadNum = 1; threadNum <= meshTHREADMAX; threadNum *= 2) {
+			int loaded = (benchLoad(paths[f], paths[f], threadNum, 0,
+				&imported) >= 0.0);
+			if (!loaded || benchCompare(&mesh, &imported) != 0) {
+				printf("check: %s with %u threads differs\n", paths[f],
+					threadNum);
+				failNum += 1;
+			}
+			if (loaded)
+				meshDestroy(&imported);
+		}
+		/* The first cached load imports and writes the cache; the second maps
+		it. */
+		const char *names[2] = {"  building cache", "  from cache"};
+		for (i = 0; i < 2; i += 1) {
+			int loaded = (benchLoad(names[i], paths[f], 0, 1, &imported) >= 0.0);
+			if (!loaded || benchCompare(&mesh, &imported) != 0) {
+				printf("check: %s through the cache differs\n", paths[f]);
+				failNum += 1;
+			}
+			if (loaded)
+				meshDestroy(&imported);
+		}
+		remove(cachePath);
+	}
+	remove(BENCHOBJ);
+	remove(BENCHPLY);
+	meshDestroy(&mesh);
+	if (failNum > 0)
+		printf("check: %u checks FAILED\n", failNum);
+	else
+		printf("check: every import matches the original mesh exactly\n");
+	return (failNum > 0);
+}
@@ -22,9 +22,16 @@
 #include <stdlib.h>
 #include <math.h>
 #include <stdarg.h>
+#include <string.h>
 #include <GL/gl3w.h>
 #include <GLFW/glfw3.h>
 #include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <ode/ode.h>
 
 double getTime(void) {
@@ -39,9 +46,14 @@ double getTime(void) {
 #include "590matrix.c"
 #include "520camera.c"
 #include "590texture.c"
+#include "600queue.c"
+#include "610indirect.c"
 #include "580scene.c"
+#include "620cull.c"
 #include "560light.c"
 #include "590shadow.c"
+#include "630cluster.c"
+#include "640budget.c"
 
 // === ODE globals ====
 static dWorldID world;
@@ -56,7 +68,13 @@ static dReal stepsize = 0.1;
 
 
 camCamera cam;
-texTexture texGrass, texSun, texBox, texA, texB, texC;
+texTexture texGrass, texSun, texBox, texBouncy;
+texLoader loader;
+/* The GPU memory that the program may use, in bytes. Beyond it, the least
+recently rendered textures lose their largest mipmaps. Press N to halve it,
+and M to print the usage. */
+#define GPU_BUDGET (64 * 1024 * 1024)
+budgetBudget budget;
 shadowProgram sdwProg;
 
 meshGLMesh ground_GL, sun_GL;
@@ -74,14 +92,44 @@ sceneNode boxNodes[NUM_BOXES];
 
 lightLight light;
 shadowMap sdwMap;
+/* Colored lamps around the stack, which share one shadow atlas. */
+#define NUM_LAMPS 3
+lightLight lamps[NUM_LAMPS];
+shadowAtlas atlas;
+shadowProgram atlasProg;
+/* An omnidirectional lantern beside the stack, with a shadow cube. */
+lightLight lantern;
+shadowCube sdwCube;
+shadowProgram cubeProg;
+/* A field of small lights over the ground, which only the cluster grid makes
+affordable. The lamps go through the grid with them, and the grid's uniform
+block holds clusterLIGHTMAX lights in all. */
+#define NUM_FIREFLIES (clusterLIGHTMAX - NUM_LAMPS)
+lightLight fireflies[NUM_FIREFLIES];
+clusterGrid clusters;
+queueQueue sdwQueue, mainQueue, atlasQueue, cubeQueue;
+sceneFlat flat;
+/* Whether the context is OpenGL 4.3 or later, so that the whole scene can be
+submitted through one indirect batch. */
+int indirect;
+indirectBatch batch;
+/* Whether the batch's draws are culled on the GPU, as they are whenever the
+culler can be initialized. Pressing V checks the next frame's cull against the
+CPU's. */
+int gpuCull, verifyCull = 0;
+cullCuller culler;
 
 GLuint program;
 GLint viewingLoc, modelingLoc;
-GLint unifLocs[1], textureLocs[1];
-GLint attrLocs[3];
+GLint unifLocs[2], textureLocs[1];
+GLint attrLocs[3], instanceLoc;
 GLint lightPosLoc, lightColLoc, lightAttLoc, lightDirLoc, lightCosLoc;
 GLint camPosLoc;
 GLint viewingSdwLoc, textureSdwLoc;
+GLint viewingLampLocs[NUM_LAMPS], textureAtlasLoc;
+GLint omniPosLoc, omniColLoc, omniAttLoc, omniFarLoc, textureOmniLoc;
+GLint clusterDimsLoc, clusterScaleLoc, clusterDepthLoc, clusterForwardLoc;
+GLint clusterGridLoc, clusterIndicesLoc;
 
 
 void handleError(int error, const char *description) {
@@ -100,6 +148,15 @@ void handleKey(GLFWwindow *window, int key, int scancode, int action, int mods)
 	// int superCommandIsDown = mods & GLFW_MOD_SUPER;
 	if (action == GLFW_PRESS && key == GLFW_KEY_L) {
 		camSwitchProjectionType(&cam);
+	} else if (action == GLFW_PRESS && key == GLFW_KEY_M) {
+		budgetPrint(&budget, stderr);
+	} else if (action == GLFW_PRESS && key == GLFW_KEY_V) {
+		verifyCull = 1;
+	} else if (action == GLFW_PRESS && key == GLFW_KEY_N) {
+		/* Squeeze the budget, to watch the textures give up their mipmaps. */
+		budgetSetLimit(&budget, budget.limit / 2);
+		fprintf(stderr, "handleKey: budget limit now %.1f MB.\n",
+			budget.limit / 1048576.0);
 	} else if (action == GLFW_PRESS || action == GLFW_REPEAT) {
 		if (key == GLFW_KEY_O)
 			camAddTheta(&cam, -0.1);
@@ -170,30 +227,30 @@ midway through, then does not properly deallocate all resources. But that's
 okay, because the program terminates almost immediately after this function
 returns. */
 int initializeScene(void) {
-	if (texInitializeFile(&texGrass, "grass.jpg", GL_LINEAR, GL_LINEAR,
-    		GL_REPEAT, GL_REPEAT) != 0)
-    	return 1;
-    if (texInitializeFile(&texSun, "sun.jpg", GL_LINEAR, GL_LINEAR,
-    		GL_REPEAT, GL_REPEAT) != 0)
-    	return 1;
-    if (texInitializeFile(&texBox, "box.jpg", GL_LINEAR, GL_LINEAR,
-    		GL_REPEAT, GL_REPEAT) != 0)
-    	return 1;
-    if (texInitializeFile(&texA, "a.jpg", GL_LINEAR, GL_LINEAR,
-    		GL_REPEAT, GL_REPEAT) != 0)
-    	return 1;
-    if (texInitializeFile(&texB, "b.jpg", GL_LINEAR, GL_LINEAR,
-    		GL_REPEAT, GL_REPEAT) != 0)
-    	return 1;
-    if (texInitializeFile(&texC, "c.jpg", GL_LINEAR, GL_LINEAR,
-    		GL_REPEAT, GL_REPEAT) != 0)
-    	return 1;
+	/* The images decode in the background, or come straight from their
+	caches. Until each one is uploaded, its texture shows a gray placeholder.
+	Every texture is an array, so that the shader needs only one sampler type.
+	The bouncies' three images are layers of one array, so that bouncies with
+	different images need no texture bind between them. */
+	texTexture *texs[3] = {&texGrass, &texSun, &texBox};
+	char *paths[3] = {"grass.jpg", "sun.jpg", "box.jpg"};
+	char *bouncyPaths[3] = {"a.jpg", "b.jpg", "c.jpg"};
+	int i;
+	if (texLoaderInitialize(&loader, 4) != 0)
+		return 1;
+	for (i = 0; i < 3; i += 1)
+		if (texInitializeArrayAsync(&loader, texs[i], 1, &paths[i], 0, 0,
+				GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, GL_REPEAT, GL_REPEAT) != 0)
+			return 1;
+	if (texInitializeArrayAsync(&loader, &texBouncy, 3, bouncyPaths, 1024,
+			1024, GL_LINEAR_MIPMAP_LINEAR, GL_LINEAR, GL_REPEAT,
+			GL_REPEAT) != 0)
+		return 1;
 
 
 	meshMesh mesh;
 	GLuint attrDims[3] = {3, 2, 3};
 	int vaoNums = 2;
-	int i;
 
 	// ==== initialize meshGLMeshes for boxNodes
 	int boxXL = 40;
@@ -205,8 +262,9 @@ int initializeScene(void) {
 			return 1;
 		}
 		meshGLInitialize(&boxGLs[i], &mesh, 3, attrDims, vaoNums);
+		meshGLPositionsInitialize(&boxGLs[i], &mesh);
 		meshGLVAOInitialize(&boxGLs[i], 0, attrLocs);
-		meshGLVAOInitialize(&boxGLs[i], 1, sdwProg.attrLocs);
+		meshGLPositionVAOInitialize(&boxGLs[i], 1, sdwProg.attrLocs[0]);
 		meshDestroy(&mesh);
 	}
 
@@ -219,8 +277,9 @@ int initializeScene(void) {
 					return 1;
 				}
 				meshGLInitialize(&bouncyGLs[i], &mesh, 3, attrDims, vaoNums);
+				meshGLPositionsInitialize(&bouncyGLs[i], &mesh);
 				meshGLVAOInitialize(&bouncyGLs[i], 0, attrLocs);
-				meshGLVAOInitialize(&bouncyGLs[i], 1, sdwProg.attrLocs);
+				meshGLPositionVAOInitialize(&bouncyGLs[i], 1, sdwProg.attrLocs[0]);
 				meshDestroy(&mesh);
 				break;
 			} case (1): {
@@ -228,8 +287,9 @@ int initializeScene(void) {
 					return 1;
 				}
 				meshGLInitialize(&bouncyGLs[i], &mesh, 3, attrDims, vaoNums);
+				meshGLPositionsInitialize(&bouncyGLs[i], &mesh);
 				meshGLVAOInitialize(&bouncyGLs[i], 0, attrLocs);
-				meshGLVAOInitialize(&bouncyGLs[i], 1, sdwProg.attrLocs);
+				meshGLPositionVAOInitialize(&bouncyGLs[i], 1, sdwProg.attrLocs[0]);
 				meshDestroy(&mesh);
 				break;
 			} case (2): {
@@ -237,8 +297,9 @@ int initializeScene(void) {
 					return 1;
 				}
 				meshGLInitialize(&bouncyGLs[i], &mesh, 3, attrDims, vaoNums);
+				meshGLPositionsInitialize(&bouncyGLs[i], &mesh);
 				meshGLVAOInitialize(&bouncyGLs[i], 0, attrLocs);
-				meshGLVAOInitialize(&bouncyGLs[i], 1, sdwProg.attrLocs);
+				meshGLPositionVAOInitialize(&bouncyGLs[i], 1, sdwProg.attrLocs[0]);
 				meshDestroy(&mesh);
 				break;
 			} default: {
@@ -255,11 +316,11 @@ int initializeScene(void) {
 	z = 0;
 	for (i = NUM_BOXES - 1; i >= 0; i --) {
 		if (i != NUM_BOXES - 1) {
-			if (sceneInitialize(&boxNodes[i], 3, 1, &boxGLs[i], NULL, &boxNodes[i + 1], world) != 0) {
+			if (sceneInitialize(&boxNodes[i], 4, 1, &boxGLs[i], NULL, &boxNodes[i + 1], world) != 0) {
 				return 2;
 			}
 		} else {
-			if (sceneInitialize(&boxNodes[i], 3, 1, &boxGLs[i], NULL, NULL, world) != 0) {
+			if (sceneInitialize(&boxNodes[i], 4, 1, &boxGLs[i], NULL, NULL, world) != 0) {
 				return 2;
 			}
 		}
@@ -279,11 +340,11 @@ int initializeScene(void) {
 	// ==== initialize scenes for bouncies
 	for (i = NUM_BOUNCIES - 1; i >= 0 ; i --) { // build bouncies in reverse order (because of children issues)
 		if (i != NUM_BOUNCIES - 1) {
-			if (sceneInitialize(&bouncies[i], 3, 1, &bouncyGLs[i], NULL, &bouncies[i + 1], world) != 0) {
+			if (sceneInitialize(&bouncies[i], 4, 1, &bouncyGLs[i], NULL, &bouncies[i + 1], world) != 0) {
 				return 2;
 			}
 		} else { // last thing in node list is 
-			if (sceneInitialize(&bouncies[i], 3, 1, &bouncyGLs[i], NULL, &boxNodes[0], world) != 0) {
+			if (sceneInitialize(&bouncies[i], 4, 1, &bouncyGLs[i], NULL, &boxNodes[0], world) != 0) {
 				return 2;
 			}
 		}
@@ -310,8 +371,9 @@ int initializeScene(void) {
 		return 1;
 	}
 	meshGLInitialize(&sun_GL, &mesh, 3, attrDims, vaoNums);
+	meshGLPositionsInitialize(&sun_GL, &mesh);
 	meshGLVAOInitialize(&sun_GL, 0, attrLocs);
-	meshGLVAOInitialize(&sun_GL, 1, sdwProg.attrLocs);
+	meshGLPositionVAOInitialize(&sun_GL, 1, sdwProg.attrLocs[0]);
 	meshDestroy(&mesh);
 
 
@@ -321,18 +383,23 @@ int initializeScene(void) {
 		return 1;
 	}
 	meshGLInitialize(&ground_GL, &mesh, 3, attrDims, vaoNums);
+	meshGLPositionsInitialize(&ground_GL, &mesh);
 	meshGLVAOInitialize(&ground_GL, 0, attrLocs);
-	meshGLVAOInitialize(&ground_GL, 1, sdwProg.attrLocs);
+	meshGLPositionVAOInitialize(&ground_GL, 1, sdwProg.attrLocs[0]);
 	meshDestroy(&mesh);
 
-	if (sceneInitialize(&sun_node, 3, 1, &sun_GL, NULL, &bouncies[0], world) != 0)
+	if (sceneInitialize(&sun_node, 4, 1, &sun_GL, NULL, &bouncies[0], world) != 0)
 		return 2;
-	if (sceneInitialize(&ground_node, 3, 1, &ground_GL, NULL, &sun_node, world) != 0)
+	if (sceneInitialize(&ground_node, 4, 1, &ground_GL, NULL, &sun_node, world) != 0)
 		return 2;
 
 
     dBodySetKinematic(ground_node.meshGL->body);
     dBodySetKinematic(sun_node.meshGL->body);
+	/* The ground and the sun never move, so their shadows go into the cached
+	static layer. Everything that ODE simulates is drawn every frame. */
+	sceneSetStatic(&ground_node, 1);
+	sceneSetStatic(&sun_node, 1);
 	x = 0.0;
 	y = 0.0;
 	z = 0.0;
@@ -340,43 +407,83 @@ int initializeScene(void) {
 	z = 495.0;
 	dBodySetPosition(sun_node.meshGL->body, x, y, z);
 
+	/* Each node's uniforms are its specular color and its texture layer. */
 	texTexture *tex;
+	double unif[4] = {0.0, 0.0, 0.0, 0.0};
 	tex = &texGrass;
 	sceneSetTexture(&ground_node, &tex);
+	sceneSetUniform(&ground_node, unif);
 	tex = &texSun;
 	sceneSetTexture(&sun_node, &tex);
+	sceneSetUniform(&sun_node, unif);
 
 
 	tex = &texBox;
 	for (i = 0; i < NUM_BOXES; i++) {
 		sceneSetTexture(&boxNodes[i], &tex);
+		sceneSetUniform(&boxNodes[i], unif);
 	}
 
+	tex = &texBouncy;
 	for (i = 0; i < NUM_BOUNCIES; i ++) {
-		switch(i % 3) {
-			case(0): {
-				tex = &texA;
-				sceneSetTexture(&bouncies[i], &tex);
-				break;
-			} case(1): {
-				tex = &texB;
-				sceneSetTexture(&bouncies[i], &tex);
-				break;
-			} case(2): {
-				tex = &texC;
-				sceneSetTexture(&bouncies[i], &tex);
-				break;
-			} default: {
-				printf("something went wrong\n");
-				break;
-			}
-		}
-		
+		unif[3] = i % 3;
+		sceneSetTexture(&bouncies[i], &tex);
+		sceneSetUniform(&bouncies[i], unif);
 	}
+	if (sceneFlatInitialize(&flat, &ground_node) != 0)
+		return 3;
+
+	// ==== on OpenGL 4.3, pack every mesh into one indirect batch
+	if (indirect) {
+		meshGLMesh *meshGLs[NUM_BOXES + NUM_BOUNCIES + 2];
+		for (i = 0; i < NUM_BOXES; i++)
+			meshGLs[i] = &boxGLs[i];
+		for (i = 0; i < NUM_BOUNCIES; i++)
+			meshGLs[NUM_BOXES + i] = &bouncyGLs[i];
+		meshGLs[NUM_BOXES + NUM_BOUNCIES] = &sun_GL;
+		meshGLs[NUM_BOXES + NUM_BOUNCIES + 1] = &ground_GL;
+		if (indirectInitialize(&batch, NUM_BOXES + NUM_BOUNCIES + 2, meshGLs,
+				vaoNums) != 0)
+			return 4;
+		indirectVAOInitialize(&batch, 0, attrLocs, instanceLoc);
+		indirectPositionVAOInitialize(&batch, 1, sdwProg.attrLocs[0],
+			sdwProg.instanceLoc);
+		/* Pass 0 draws the moving shadow casters, pass 1 is the main pass,
+		pass 2 draws the static shadow casters, pass 3 draws every caster into
+		the lamps' shadow atlas, and pass 4 draws the casters near the lantern
+		into its shadow cube. Only the main pass samples textures. If the
+		culler fails, then the CPU culls as before. */
+		GLuint flags[5] = {cullDYNAMIC, cullGROUPED, cullSTATIC, 0, 0};
+		gpuCull = (cullInitialize(&culler, &flat, &batch, 5, flags) == 0);
+	}
+
+	// ==== account for GPU memory
+	if (budgetInitialize(&budget, GPU_BUDGET) != 0)
+		return 5;
+	budgetAddTexture(&budget, &texGrass, "grass");
+	budgetAddTexture(&budget, &texSun, "sun");
+	budgetAddTexture(&budget, &texBox, "box");
+	budgetAddTexture(&budget, &texBouncy, "bouncies");
+	for (i = 0; i < NUM_BOXES; i++)
+		budgetAddMesh(&budget, &boxGLs[i], "box");
+	for (i = 0; i < NUM_BOUNCIES; i++)
+		budgetAddMesh(&budget, &bouncyGLs[i], "bouncy");
+	budgetAddMesh(&budget, &sun_GL, "sun");
+	budgetAddMesh(&budget, &ground_GL, "ground");
+	if (indirect)
+		budgetAddBatch(&budget, &batch, "batch");
+	budgetAddShadowMap(&budget, &sdwMap, "shadow map");
+	budgetAddShadowAtlas(&budget, &atlas, "shadow atlas");
+	budgetAddShadowCube(&budget, &sdwCube, "shadow cube");
 	return 0;
 }
 
 void destroyScene(void) {
+	if (gpuCull)
+		cullDestroy(&culler);
+	if (indirect)
+		indirectDestroy(&batch);
+	sceneFlatDestroy(&flat);
 	sceneDestroyRecursively(&ground_node);
 }
 
@@ -389,28 +496,111 @@ int initializeCameraLight(void) {
 	camSetControls(&cam, camPERSPECTIVE, M_PI / 6.0, 6.0, 1000.0, 1000.0, 1500.0,
 								 M_PI / 4.0, M_PI / 4.0, vec);
 	lightSetType(&light, lightSPOT);
-	vecSet(3, vec, 0.0, 0.0, 500.0);
+	vec3Set(vec, 0.0, 0.0, 500.0);
 	lightShineFrom(&light, vec, M_PI , M_PI);
-	vecSet(3, vec, 1.0, 1.0, 1.0);
+	vec3Set(vec, 1.0, 1.0, 1.0);
 	lightSetColor(&light, vec);
-	vecSet(3, vec, 1.0, 0.0, 0.0);
+	vec3Set(vec, 1.0, 0.0, 0.0);
 	lightSetAttenuation(&light, vec);
 	lightSetSpotAngle(&light, M_PI / 2);
+	/* Aim the lamps at the stack from around it. */
+	GLdouble lampPositions[NUM_LAMPS][3] = {
+		{400.0, 80.0, 250.0}, {-300.0, 300.0, 250.0}, {80.0, -350.0, 200.0}};
+	GLdouble lampColors[NUM_LAMPS][3] = {
+		{1.0, 0.6, 0.3}, {0.3, 0.5, 1.0}, {0.4, 1.0, 0.4}};
+	GLdouble target[3] = {80.0, 80.0, 0.0}, dir[3];
+	int i;
+	for (i = 0; i < NUM_LAMPS; i += 1) {
+		lightSetType(&lamps[i], lightSPOT);
+		vecSubtract(3, target, lampPositions[i], dir);
+		lightShineFrom(&lamps[i], lampPositions[i],
+			acos(dir[2] / vecLength(3, dir)), atan2(dir[1], dir[0]));
+		lightSetColor(&lamps[i], lampColors[i]);
+		vec3Set(vec, 1.0, 0.0, 0.000004);
+		lightSetAttenuation(&lamps[i], vec);
+		lightSetSpotAngle(&lamps[i], M_PI / 3.0);
+	}
+	lightSetType(&lantern, lightOMNI);
+	vec3Set(vec, -150.0, 250.0, 150.0);
+	lightSetTranslation(&lantern, vec);
+	vec3Set(vec, 0.8, 0.7, 0.5);
+	lightSetColor(&lantern, vec);
+	vec3Set(vec, 1.0, 0.0, 0.00002);
+	lightSetAttenuation(&lantern, vec);
+	/* Spread the fireflies over the ground in a grid, hovering just above it,
+	with every fourth one a spot light aimed straight down. */
+	for (i = 0; i < NUM_FIREFLIES; i += 1) {
+		vec3Set(vec, 75.0 * (i % 16) - 562.5, 75.0 * (i / 16) - 562.5, 20.0);
+		if (i % 4 == 3) {
+			lightSetType(&fireflies[i], lightSPOT);
+			lightShineFrom(&fireflies[i], vec, M_PI, 0.0);
+			lightSetSpotAngle(&fireflies[i], M_PI / 2.0);
+		} else {
+			lightSetType(&fireflies[i], lightOMNI);
+			lightSetTranslation(&fireflies[i], vec);
+		}
+		vec3Set(vec, 0.5 + 0.5 * sin(2.4 * i), 0.5 + 0.5 * sin(2.4 * i + 2.1),
+			0.5 + 0.5 * sin(2.4 * i + 4.2));
+		lightSetColor(&fireflies[i], vec);
+		vec3Set(vec, 0.25, 0.0, 0.004);
+		lightSetAttenuation(&fireflies[i], vec);
+	}
+	if (clusterInitialize(&clusters, 12, 12, 16) != 0)
+		return 5;
 	/* Configure shadow mapping. */
-	if (shadowProgramInitialize(&sdwProg, 3) != 0)
+	if (indirect) {
+		if (shadowProgramInitializeIndirect(&sdwProg, 3) != 0)
+			return 1;
+	} else if (shadowProgramInitialize(&sdwProg, 3) != 0)
 		return 1;
 	if (shadowMapInitialize(&sdwMap, 1024, 1024) != 0)
 		return 2;
+	if (shadowProgramInitializeAtlas(&atlasProg, 3, indirect) != 0)
+		return 1;
+	if (shadowAtlasInitialize(&atlas, 1024) != 0)
+		return 2;
+	if (shadowProgramInitializeCube(&cubeProg, 3, indirect) != 0)
+		return 1;
+	if (shadowCubeInitialize(&sdwCube, 512) != 0)
+		return 2;
+	/* Configure the render queues. The shadow pass samples no textures. */
+	GLuint unifDims[2] = {3, 1};
+	if (queueInitialize(&sdwQueue, 1, sdwProg.modelingLoc, 0, NULL, NULL, 0,
+			NULL) != 0)
+		return 3;
+	if (queueInitialize(&mainQueue, 0, modelingLoc, 2, unifDims, unifLocs, 1,
+			textureLocs) != 0)
+		return 4;
+	if (queueInitialize(&atlasQueue, 1, atlasProg.modelingLoc, 0, NULL, NULL, 0,
+			NULL) != 0)
+		return 3;
+	if (queueInitialize(&cubeQueue, 1, cubeProg.modelingLoc, 0, NULL, NULL, 0,
+			NULL) != 0)
+		return 3;
 	return 0;
 }
 
-/* Returns 0 on success, non-zero on failure. */
+/* Returns 0 on success, non-zero on failure. The same code serves OpenGL 3.2
+and the indirect batch on OpenGL 4.3, where the modeling matrix, specular
+color, and texture layer come from the batch's per-draw data instead of
+uniforms. The header
+picks the GLSL version and sets INDIRECT accordingly. Besides the main light,
+with its own shadow map, up to LAMPMAX lamps share the shadow atlas, and an
+omnidirectional light has a shadow cube. The lamps and the fireflies come
+through the cluster grid, and a light whose record names an atlas entry is
+shadowed by it. */
 int initializeShaderProgram(void) {
-
-	GLchar vertexCode[] = "\
-		#version 140\n\
+	GLchar header[128];
+	if (indirect)
+		snprintf(header, sizeof(header),
+			"#version 430\n#define INDIRECT 1\n#define LAMPMAX %d\n"
+			"#define CLUSTERLIGHTMAX %d\n", NUM_LAMPS, clusterLIGHTMAX);
+	else
+		snprintf(header, sizeof(header),
+			"#version 140\n#define INDIRECT 0\n#define LAMPMAX %d\n"
+			"#define CLUSTERLIGHTMAX %d\n", NUM_LAMPS, clusterLIGHTMAX);
+	GLchar vertexBody[] = "\
 		uniform mat4 viewing;\
-		uniform mat4 modeling;\
 		uniform mat4 viewingSdw;\
 		in vec3 position;\
 		in vec2 texCoords;\
@@ -418,24 +608,48 @@ int initializeShaderProgram(void) {
 		out vec3 fragPos;\
 		out vec3 normalDir;\
 		out vec2 st;\
-		out vec4 fragSdw;\
-		void main(void) {\
+		out vec4 fragSdw;\n\
+		#if INDIRECT\n\
+		struct Instance {\
+			mat3x4 modeling;\
+			vec4 unif;\
+		};\
+		layout(std430, binding = 0) buffer Instances {\
+			Instance instances[];\
+		};\
+		in uint instance;\
+		flat out vec3 specular;\
+		flat out float layer;\n\
+		#else\n\
+		uniform mat3x4 modeling;\n\
+		#endif\n\
+		void main(void) {\n\
+			#if INDIRECT\n\
+			mat3x4 modeling = instances[instance].modeling;\
+			specular = vec3(instances[instance].unif);\
+			layer = instances[instance].unif.w;\n\
+			#endif\n\
 			mat4 scaleBias = mat4(\
 				0.5, 0.0, 0.0, 0.0, \
 				0.0, 0.5, 0.0, 0.0, \
 				0.0, 0.0, 0.5, 0.0, \
 				0.5, 0.5, 0.5, 1.0);\
-			vec4 worldPos = modeling * vec4(position, 1.0);\
+			vec4 worldPos = vec4(vec4(position, 1.0) * modeling, 1.0);\
 			gl_Position = viewing * worldPos;\
 			fragSdw = scaleBias * viewingSdw * worldPos;\
 			fragPos = vec3(worldPos);\
-			normalDir = vec3(modeling * vec4(normal, 0.0));\
+			normalDir = vec4(normal, 0.0) * modeling;\
 			st = texCoords;\
 		}";
-	GLchar fragmentCode[] = "\
-		#version 140\n\
-		uniform sampler2D texture0;\
+	GLchar fragmentBody[] = "\
+		uniform sampler2DArray texture0;\n\
+		#if INDIRECT\n\
+		flat in vec3 specular;\
+		flat in float layer;\n\
+		#else\n\
 		uniform vec3 specular;\
+		uniform float layer;\n\
+		#endif\n\
 		uniform vec3 camPos;\
 		uniform vec3 lightPos;\
 		uniform vec3 lightCol;\
@@ -443,13 +657,35 @@ int initializeShaderProgram(void) {
 		uniform vec3 lightAim;\
 		uniform float lightCos;\
 		uniform sampler2DShadow textureSdw;\
+		uniform mat4 viewingLamp[LAMPMAX];\
+		uniform sampler2DShadow textureAtlas;\
+		uniform vec3 omniPos;\
+		uniform vec3 omniCol;\
+		uniform vec3 omniAtt;\
+		uniform float omniFar;\
+		uniform samplerCubeShadow textureOmni;\
+		struct Light {\
+			vec4 position;\
+			vec4 color;\
+			vec4 attenuation;\
+			vec4 direction;\
+		};\
+		layout(std140) uniform Lights {\
+			Light lights[CLUSTERLIGHTMAX];\
+		};\
+		uniform usamplerBuffer clusterGrid;\
+		uniform usamplerBuffer clusterIndices;\
+		uniform ivec3 clusterDims;\
+		uniform vec4 clusterScale;\
+		uniform vec2 clusterDepth;\
+		uniform vec3 clusterForward;\
 		in vec3 fragPos;\
 		in vec3 normalDir;\
 		in vec2 st;\
 		in vec4 fragSdw;\
 		out vec4 fragColor;\
 		void main(void) {\
-			vec3 diffuse = vec3(texture(texture0, st));\
+			vec3 diffuse = vec3(texture(texture0, vec3(st, layer)));\
 			vec3 litDir = normalize(lightPos - fragPos);\
 			float diffInt, specInt = 0.0;\
 			if (dot(lightAim, -litDir) < lightCos)\
@@ -461,17 +697,63 @@ int initializeShaderProgram(void) {
 			specInt *= sdw;\
 			vec3 diffRefl = max(0.6, diffInt) * lightCol * diffuse;\
 			vec3 specRefl = specInt * lightCol * specular;\
+			mat4 scaleBias = mat4(\
+				0.5, 0.0, 0.0, 0.0, \
+				0.0, 0.5, 0.0, 0.0, \
+				0.0, 0.0, 0.5, 0.0, \
+				0.5, 0.5, 0.5, 1.0);\
+			vec3 normal = normalize(normalDir);\
+			vec3 toOmni = omniPos - fragPos;\
+			float omniDist = length(toOmni);\
+			float omniInt = max(0.0, dot(normal, toOmni / omniDist)) /\
+				(omniAtt.x + omniAtt.y * omniDist +\
+				omniAtt.z * omniDist * omniDist);\
+			vec3 fromOmni = fragPos + 0.01 * omniDist * normal - omniPos;\
+			omniInt *= texture(textureOmni,\
+				vec4(fromOmni, length(fromOmni) / omniFar - 0.001));\
+			diffRefl += omniInt * omniCol * diffuse;\
+			float depth = dot(fragPos - camPos, clusterForward);\
+			ivec3 cluster = ivec3(\
+				gl_FragCoord.xy * clusterScale.xy + clusterScale.zw,\
+				log(max(depth / clusterDepth.x, 1.0)) * clusterDepth.y);\
+			cluster = clamp(cluster, ivec3(0), clusterDims - 1);\
+			uvec2 run = texelFetch(clusterGrid, (cluster.z * clusterDims.y +\
+				cluster.y) * clusterDims.x + cluster.x).rg;\
+			for (uint k = 0u; k < run.y; k += 1u) {\
+				Light light = lights[texelFetch(clusterIndices,\
+					int(run.x + k)).r];\
+				vec3 toLight = light.position.xyz - fragPos;\
+				float dist = length(toLight);\
+				vec3 lightDir = toLight / dist;\
+				float lightInt = max(0.0, dot(normal, lightDir)) /\
+					(light.attenuation.x + light.attenuation.y * dist +\
+					light.attenuation.z * dist * dist);\
+				if (dist > light.attenuation.w ||\
+						dot(light.direction.xyz, -lightDir) < light.color.w)\
+					lightInt = 0.0;\
+				else if (light.direction.w >= 0.0)\
+					lightInt *= textureProj(textureAtlas, scaleBias *\
+						viewingLamp[int(light.direction.w)] *\
+						vec4(fragPos, 1.0));\
+				diffRefl += lightInt * light.color.rgb * diffuse;\
+			}\
 			fragColor = vec4(diffRefl + specRefl, 1.0);\
 		}";
+	GLchar vertexCode[sizeof(vertexBody) + sizeof(header)];
+	GLchar fragmentCode[sizeof(fragmentBody) + sizeof(header)];
+	snprintf(vertexCode, sizeof(vertexCode), "%s%s", header, vertexBody);
+	snprintf(fragmentCode, sizeof(fragmentCode), "%s%s", header, fragmentBody);
 	program = makeProgram(vertexCode, fragmentCode);
 	if (program != 0) {
 		glUseProgram(program);
 		attrLocs[0] = glGetAttribLocation(program, "position");
 		attrLocs[1] = glGetAttribLocation(program, "texCoords");
 		attrLocs[2] = glGetAttribLocation(program, "normal");
+		instanceLoc = glGetAttribLocation(program, "instance");
 		viewingLoc = glGetUniformLocation(program, "viewing");
 		modelingLoc = glGetUniformLocation(program, "modeling");
 		unifLocs[0] = glGetUniformLocation(program, "specular");
+		unifLocs[1] = glGetUniformLocation(program, "layer");
 		textureLocs[0] = glGetUniformLocation(program, "texture0");
 		camPosLoc = glGetUniformLocation(program, "camPos");
 		lightPosLoc = glGetUniformLocation(program, "lightPos");
@@ -481,6 +763,26 @@ int initializeShaderProgram(void) {
 		lightCosLoc = glGetUniformLocation(program, "lightCos");
 		viewingSdwLoc = glGetUniformLocation(program, "viewingSdw");
 		textureSdwLoc = glGetUniformLocation(program, "textureSdw");
+		textureAtlasLoc = glGetUniformLocation(program, "textureAtlas");
+		omniPosLoc = glGetUniformLocation(program, "omniPos");
+		omniColLoc = glGetUniformLocation(program, "omniCol");
+		omniAttLoc = glGetUniformLocation(program, "omniAtt");
+		omniFarLoc = glGetUniformLocation(program, "omniFar");
+		textureOmniLoc = glGetUniformLocation(program, "textureOmni");
+		clusterDimsLoc = glGetUniformLocation(program, "clusterDims");
+		clusterScaleLoc = glGetUniformLocation(program, "clusterScale");
+		clusterDepthLoc = glGetUniformLocation(program, "clusterDepth");
+		clusterForwardLoc = glGetUniformLocation(program, "clusterForward");
+		clusterGridLoc = glGetUniformLocation(program, "clusterGrid");
+		clusterIndicesLoc = glGetUniformLocation(program, "clusterIndices");
+		glUniformBlockBinding(program,
+			glGetUniformBlockIndex(program, "Lights"), clusterBINDING);
+		GLchar name[32];
+		int i;
+		for (i = 0; i < NUM_LAMPS; i += 1) {
+			snprintf(name, sizeof(name), "viewingLamp[%d]", i);
+			viewingLampLocs[i] = glGetUniformLocation(program, name);
+		}
 	}
 	return (program == 0);
 }
@@ -519,7 +821,7 @@ static void nearCallback (void *data, dGeomID o1, dGeomID o2) {
    bodies in the physics simulation*/
 void nodeUpdateTransRot(sceneNode* node) {
 	const dReal *pos = dBodyGetPosition(node->meshGL->body);
-	const dReal *rot = dBodyGetRotation(node->meshGL->body);
+	const dReal *quat = dBodyGetQuaternion(node->meshGL->body);
 	dReal x,y,z;
 	int changed = 0;
 	// if some thing goes out of bounds in this scene, put it back in
@@ -548,29 +850,40 @@ void nodeUpdateTransRot(sceneNode* node) {
 	}
 
 
-	node->translation[0] = pos[0];
-   	node->translation[1] = pos[1];
-	node->translation[2] = pos[2];
-
-
-	// ODE rotation vec is in the following convention
-	// r00 r01 r02 x
-	// r10 r11 r12 y
-	// r20 r21 r22 z
-	// where x, y, z are undefined
-	node->rotation[0][0] = rot[0];
-	node->rotation[0][1] = rot[1];
-	node->rotation[0][2] = rot[2];
-	node->rotation[1][0] = rot[4];
-	node->rotation[1][1] = rot[5];
-	node->rotation[1][2] = rot[6];
-	node->rotation[2][0] = rot[8];
-	node->rotation[2][1] = rot[9];
-	node->rotation[2][2] = rot[10];
+	// the setters mark the node dirty only if it actually moved
+	sceneSetTranslation(node, pos);
+
+
+	// ODE's quaternion is (w, x, y, z), just as the node stores it
+	sceneSetQuaternion(node, quat);
 	
 }
 
 
+/* Draws the queue, through the indirect batch if the programs are the
+INDIRECT ones. Those programs read each draw's modeling matrix and uniforms
+from the batch's per-draw data, and have no modeling uniform, so queueRender
+cannot stand in for them. If the batch cannot draw the queue, then the pass is
+skipped. */
+void renderQueue(queueQueue *queue) {
+	if (!indirect)
+		queueRender(queue);
+	else if (indirectRender(&batch, queue) != 0)
+		fprintf(stderr, "renderQueue: indirectRender failed; pass skipped.\n");
+}
+
+/* Draws the shadow casters that are static or dynamic, as which says, into
+the shadow map that is being rendered. pass is the culler's pass for them. */
+void renderShadowCasters(GLuint which, GLuint pass, GLdouble planes[6][4]) {
+	if (gpuCull)
+		cullRender(&culler, &flat, &batch, pass, sdwProg.program, 1, 0, NULL);
+	else {
+		queueBegin(&sdwQueue, &(sdwMap.camera));
+		sceneFlatQueue(&flat, sdwProg.program, planes, which, &sdwQueue);
+		renderQueue(&sdwQueue);
+	}
+}
+
 void render(void) {
 
 	// before anything is drawn, update the node's position
@@ -586,18 +899,81 @@ void render(void) {
 
 
 
-	GLdouble identity[4][4];
-	mat44Identity(identity);
+	/* Recompute the modeling matrices and bounds of the nodes that moved. */
+	sceneFlatUpdate(&flat);
 
 	/* Save the viewport transformation. */
 	GLint viewport[4];
 
 	glGetIntegerv(GL_VIEWPORT, viewport);
-	GLint sdwTextureLocs[1] = {-1};
-	shadowMapRender(&sdwMap, &sdwProg, &light, -1000.0, -1.0);
-	sceneRender(&ground_node, identity, sdwProg.modelingLoc, 0, NULL, NULL, 1,
-		sdwTextureLocs);
-
+	/* Each pass culls against its own viewing volume. So casters outside the
+	camera's view still cast shadows, as long as the light can see them. */
+	GLdouble planes[5][6][4];
+	/* Fit the shadow map's camera to what the viewer can see. */
+	shadowMapFit(&sdwMap, &light, &cam, &flat, -1000.0, -1.0);
+	if (flat.staticChanged)
+		shadowMapInvalidate(&sdwMap);
+	camFrustumPlanes(&(sdwMap.camera), planes[0]);
+	camFrustumPlanes(&cam, planes[1]);
+	camFrustumPlanes(&(sdwMap.camera), planes[2]);
+	/* The atlas pass keeps every caster. The geometry shader culls each
+	triangle against each lamp. */
+	for (i = 0; i < 6; i += 1)
+		vec4Set(planes[3][i], 0.0, 0.0, 0.0, 1.0);
+	/* The lantern's pass keeps the casters within its reach. */
+	shadowCubeUpdate(&sdwCube, &lantern, -1000.0, -1.0);
+	shadowCubePlanes(&sdwCube, planes[4]);
+	/* One dispatch culls for all five passes. */
+	if (gpuCull) {
+		cullCull(&culler, &flat, planes);
+		if (verifyCull)
+			cullVerify(&culler, &flat, planes, stderr);
+	}
+	verifyCull = 0;
+	/* The static casters are drawn only when the cached layer is stale. The
+	moving casters are drawn every frame, on top of a copy of it. */
+	if (shadowMapStaticRender(&sdwMap, &sdwProg)) {
+		renderShadowCasters(sceneSTATIC, 2, planes[0]);
+		shadowMapUnrender();
+	}
+	shadowMapRender(&sdwMap, &sdwProg);
+	renderShadowCasters(sceneDYNAMIC, 0, planes[0]);
+	shadowMapUnrender();
+	/* All of the lamps' shadows take one more pass. */
+	lightLight *lampPtrs[NUM_LAMPS];
+	for (i = 0; i < NUM_LAMPS; i += 1)
+		lampPtrs[i] = &lamps[i];
+	shadowAtlasUpdate(&atlas, NUM_LAMPS, lampPtrs, &cam, -1000.0, -1.0);
+	/* Sort the lamps and the fireflies into the clusters of the camera's view.
+	Lamp i is shadowed by the atlas's ith region. */
+	lightLight *clusterPtrs[NUM_LAMPS + NUM_FIREFLIES];
+	GLint clusterShadows[NUM_LAMPS + NUM_FIREFLIES];
+	for (i = 0; i < NUM_LAMPS + NUM_FIREFLIES; i += 1) {
+		clusterPtrs[i] = (i < NUM_LAMPS ? &lamps[i] :
+			&fireflies[i - NUM_LAMPS]);
+		clusterShadows[i] = (i < NUM_LAMPS ? i : -1);
+	}
+	clusterUpdate(&clusters, NUM_LAMPS + NUM_FIREFLIES, clusterPtrs,
+		clusterShadows, &cam);
+	shadowAtlasRender(&atlas, &atlasProg);
+	if (gpuCull)
+		cullRender(&culler, &flat, &batch, 3, atlasProg.program, 1, 0, NULL);
+	else {
+		queueBegin(&atlasQueue, &cam);
+		sceneFlatQueue(&flat, atlasProg.program, NULL, sceneALL, &atlasQueue);
+		renderQueue(&atlasQueue);
+	}
+	shadowAtlasUnrender();
+	/* All six faces of the lantern's shadow cube take one more. */
+	shadowCubeRender(&sdwCube, &cubeProg);
+	if (gpuCull)
+		cullRender(&culler, &flat, &batch, 4, cubeProg.program, 1, 0, NULL);
+	else {
+		queueBegin(&cubeQueue, &cam);
+		sceneFlatQueue(&flat, cubeProg.program, planes[4], sceneALL,
+			&cubeQueue);
+		renderQueue(&cubeQueue);
+	}
 
 	/* Finish preparing the shadow maps, restore the viewport, and begin to
 	render the scene. */
@@ -616,9 +992,23 @@ void render(void) {
 	lightRender(&light, lightPosLoc, lightColLoc, lightAttLoc, lightDirLoc,
 		lightCosLoc);
 	shadowRender(&sdwMap, viewingSdwLoc, GL_TEXTURE7, 7, textureSdwLoc);
-	GLuint unifDims[1] = {3};
-	sceneRender(&ground_node, identity, modelingLoc, 1, unifDims, unifLocs, 0, textureLocs);
+	shadowRenderAtlas(&atlas, viewingLampLocs, GL_TEXTURE6, 6, textureAtlasLoc);
+	lightRender(&lantern, omniPosLoc, omniColLoc, omniAttLoc, -1, -1);
+	shadowRenderCube(&sdwCube, omniFarLoc, GL_TEXTURE5, 5, textureOmniLoc);
+	clusterRender(&clusters, viewport, clusterDimsLoc, clusterScaleLoc,
+		clusterDepthLoc, clusterForwardLoc, 3, clusterGridLoc,
+		clusterIndicesLoc);
+	if (gpuCull)
+		cullRender(&culler, &flat, &batch, 1, program, 0, 1, textureLocs);
+	else {
+		queueBegin(&mainQueue, &cam);
+		sceneFlatQueue(&flat, program, planes[1], sceneALL, &mainQueue);
+		renderQueue(&mainQueue);
+	}
 	shadowUnrender(GL_TEXTURE7);
+	shadowUnrenderAtlas(GL_TEXTURE6);
+	shadowUnrenderCube(GL_TEXTURE5);
+	clusterUnrender(3);
 
 	
 }
@@ -650,12 +1040,19 @@ int main(void) {
 		fprintf(stderr, "main: glfwInit failed.\n");
 		return 1;
 	}
+	/* Ask for OpenGL 4.3, for indirect rendering. If that fails (as on macOS),
+	then settle for 3.2. */
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
 	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 	GLFWwindow *window;
 	window = glfwCreateWindow(768, 768, "Shadows", NULL, NULL);
+	if (window == NULL) {
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+		window = glfwCreateWindow(768, 768, "Shadows", NULL, NULL);
+	}
 	if (window == NULL) {
 		fprintf(stderr, "main: glfwCreateWindow failed.\n");
 		glfwTerminate();
@@ -673,6 +1070,7 @@ int main(void) {
 
 	fprintf(stderr, "main: OpenGL %s, GLSL %s.\n",
 					glGetString(GL_VERSION), glGetString(GL_SHADING_LANGUAGE_VERSION));
+	indirect = indirectIsSupported();
 	/* We no longer do glDepthRange(1.0, 0.0). Instead we have changed our
 	projection matrices. */
 	glEnable(GL_DEPTH_TEST);
@@ -700,13 +1098,31 @@ int main(void) {
 
 		dJointGroupEmpty(contactgroup);
 
+		texLoaderUpload(&loader, 1);
 		render();
+		if (budgetUpdate(&budget) > 0)
+			budgetPrint(&budget, stderr);
 		glfwSwapBuffers(window);
 		glfwPollEvents();
 	}
 	/* Deallocate more resources than ever. */
 	shadowProgramDestroy(&sdwProg);
 	shadowMapDestroy(&sdwMap);
+	shadowProgramDestroy(&atlasProg);
+	shadowAtlasDestroy(&atlas);
+	shadowProgramDestroy(&cubeProg);
+	shadowCubeDestroy(&sdwCube);
+	clusterDestroy(&clusters);
+	texLoaderDestroy(&loader);
+	texDestroy(&texGrass);
+	texDestroy(&texSun);
+	texDestroy(&texBox);
+	texDestroy(&texBouncy);
+	budgetDestroy(&budget);
+	queueDestroy(&sdwQueue);
+	queueDestroy(&mainQueue);
+	queueDestroy(&atlasQueue);
+	queueDestroy(&cubeQueue);
 	glDeleteProgram(program);
 	destroyScene();
 	glfwDestroyWindow(window);
@@ -0,0 +1,273 @@
+/*
+ * terrainDemo.c
+ * CS 311
+ * Carleton College
+ * Flies the camera over a streaming terrain, whose chunks are built in the
+ * background as they come into range and evicted as they fall behind.
+ */
+
+
+
+/* On macOS, compile with...
+	clang++ terrainDemo.c /usr/local/gl3w/src/gl3w.o -lglfw -lode -framework OpenGL -framework CoreFoundation
+On the first run, the program writes a 2049 x 2049 heightmap of 16 MB to
+terrainDemo.raw, which later runs reuse. Press W to toggle wireframe, which
+shows the levels of detail and the stitched edges between them, L to switch
+projection, and P to pause the flight. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <stdarg.h>
+#include <string.h>
+#include <GL/gl3w.h>
+#include <GLFW/glfw3.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <ode/ode.h>
+
+double getTime(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec * 0.000001;
+}
+
+#include "500shader.c"
+#include "530vector.c"
+#include "580mesh.c"
+#include "590matrix.c"
+#include "520camera.c"
+#include "650terrain.c"
+
+#define DEMOPATH "terrainDemo.raw"
+#define DEMOSIZE 2049
+#define DEMOCHUNK 64
+#define DEMOSPACING 2.0
+
+camCamera cam;
+terrainTerrain terrain;
+GLuint program;
+GLint viewingLoc, eyeLoc, fogLoc;
+int wireframe = 0, paused = 0;
+double flightTime = 0.0;
+
+void handleError(int error, const char *description) {
+	fprintf(stderr, "handleError: %d\n%s\n", error, description);
+}
+
+void handleResize(GLFWwindow *window, int width, int height) {
+	glViewport(0, 0, width, height);
+	camSetWidthHeight(&cam, width, height);
+}
+
+void handleKey(GLFWwindow *window, int key, int scancode, int action,
+		int mods) {
+	if (action != GLFW_PRESS)
+		return;
+	if (key == GLFW_KEY_W) {
+		wireframe = !wireframe;
+		glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
+	} else if (key == GLFW_KEY_L)
+		camSwitchProjectionType(&cam);
+	else if (key == GLFW_KEY_P)
+		paused = !paused;
+}
+
+/* Returns a pseudorandom number in [0, 1] for the lattice point (i, j). */
+double demoHash(int i, int j) {
+	unsigned int h = (unsigned int)i * 73856093u ^ (unsigned int)j * 19349663u;
+	h = (h ^ (h >> 13)) * 1274126177u;
+	return (h ^ (h >> 16)) / 4294967295.0;
+}
+
+/* Returns smoothly interpolated value noise at (x, y). */
+double demoNoise(double x, double y) {
+	int i = (int)floor(x), j = (int)floor(y);
+	double s = x - i, t = y - j;
+	s = s * s * (3.0 - 2.0 * s);
+	t = t * t * (3.0 - 2.0 * t);
+	return (1.0 - s) * ((1.0 - t) * demoHash(i, j) + t * demoHash(i, j + 1)) +
+		s * ((1.0 - t) * demoHash(i + 1, j) + t * demoHash(i + 1, j + 1));
+}
+
+/* Writes the demo's heightmap, several octaves of value noise shaped into
+valleys and ridges, unless the file is already there. Returns 0 on success,
+non-zero on failure. */
+int writeHeightmap(void) {
+	struct stat info;
+	GLuint i, j, k;
+	if (stat(DEMOPATH, &info) == 0 &&
+			info.st_size == (off_t)DEMOSIZE * DEMOSIZE * sizeof(GLfloat))
+		return 0;
+	FILE *file = fopen(DEMOPATH, "wb");
+	GLfloat *row = (GLfloat *)malloc(DEMOSIZE * sizeof(GLfloat));
+	if (file == NULL || row == NULL) {
+		fprintf(stderr, "writeHeightmap: cannot write %s.\n", DEMOPATH);
+		if (file != NULL)
+			fclose(file);
+		free(row);
+		return 1;
+	}
+	for (i = 0; i < DEMOSIZE; i += 1) {
+		for (j = 0; j < DEMOSIZE; j += 1) {
+			double height = 0.0, amplitude = 1.0, frequency = 1.0 / 256.0;
+			for (k = 0; k < 7; k += 1) {
+				height += amplitude * demoNoise(i * frequency, j * frequency);
+				amplitude *= 0.5;
+				frequency *= 2.0;
+			}
+			height = height / 2.0;
+			row[j] = (GLfloat)(300.0 * height * height * height);
+		}
+		if (fwrite(row, sizeof(GLfloat), DEMOSIZE, file) != DEMOSIZE) {
+			fprintf(stderr, "writeHeightmap: cannot write %s.\n", DEMOPATH);
+			fclose(file);
+			free(row);
+			return 2;
+		}
+	}
+	fclose(file);
+	free(row);
+	return 0;
+}
+
+int initializeShaderProgram(void) {
+	GLchar vertexCode[] = "\
+		#version 140\n\
+		uniform mat4 viewing;\
+		in vec3 position;\
+		in vec2 texCoords;\
+		in vec3 normal;\
+		out vec3 fragPos;\
+		out vec3 normalDir;\
+		void main() {\
+			fragPos = position;\
+			normalDir = normal;\
+			gl_Position = viewing * vec4(position, 1.0);\
+		}";
+	GLchar fragmentCode[] = "\
+		#version 140\n\
+		uniform vec3 eye;\
+		uniform float fog;\
+		in vec3 fragPos;\
+		in vec3 normalDir;\
+		out vec4 fragColor;\
+		void main() {\
+			vec3 norDir = normalize(normalDir);\
+			vec3 grass = vec3(0.3, 0.5, 0.2);\
+			vec3 rock = vec3(0.45, 0.4, 0.35);\
+			vec3 snow = vec3(0.95, 0.95, 1.0);\
+			vec3 diffuse = mix(rock, grass, smoothstep(0.75, 0.9, norDir.z));\
+			diffuse = mix(diffuse, snow, smoothstep(180.0, 220.0, fragPos.z));\
+			vec3 sunDir = normalize(vec3(1.0, 0.5, 1.0));\
+			float intensity = max(0.0, dot(norDir, sunDir));\
+			vec3 color = diffuse * (0.25 + 0.75 * intensity);\
+			float haze = smoothstep(0.5 * fog, fog, distance(fragPos, eye));\
+			fragColor = vec4(mix(color, vec3(0.6, 0.7, 0.85), haze), 1.0);\
+		}";
+	program = makeProgram(vertexCode, fragmentCode);
+	if (program == 0)
+		return 1;
+	glUseProgram(program);
+	viewingLoc = glGetUniformLocation(program, "viewing");
+	eyeLoc = glGetUniformLocation(program, "eye");
+	fogLoc = glGetUniformLocation(program, "fog");
+	return 0;
+}
+
+/* Moves the camera along its circuit over the middle of the terrain, keeping
+it above the ground, and looking ahead. */
+void updateCamera(void) {
+	GLdouble center = 0.5 * (DEMOSIZE - 1) * DEMOSPACING;
+	GLdouble radius = 0.35 * (DEMOSIZE - 1) * DEMOSPACING;
+	GLdouble angle = 0.05 * flightTime, position[3];
+	vec3Set(position, center + radius * cos(angle),
+		center + radius * sin(angle), 0.0);
+	position[2] = terrainHeight(&terrain, position[0], position[1]) + 60.0;
+	camLookFrom(&cam, position, 0.55 * M_PI, angle + 0.5 * M_PI + 0.3);
+}
+
+void render(void) {
+	glClearColor(0.6, 0.7, 0.85, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	glUseProgram(program);
+	camRender(&cam, viewingLoc);
+	GLfloat vec[3];
+	vecOpenGL(3, cam.translation, vec);
+	glUniform3fv(eyeLoc, 1, vec);
+	glUniform1f(fogLoc, terrain.loadRadius);
+	terrainRender(&terrain, &cam);
+}
+
+int main(void) {
+	double oldTime, newTime = getTime();
+	glfwSetErrorCallback(handleError);
+	if (writeHeightmap() != 0)
+		return 1;
+	if (glfwInit() == 0) {
+		fprintf(stderr, "main: glfwInit failed.\n");
+		return 1;
+	}
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 2);
+	glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+	GLFWwindow *window = glfwCreateWindow(768, 768, "Terrain", NULL, NULL);
+	if (window == NULL) {
+		fprintf(stderr, "main: glfwCreateWindow failed.\n");
+		glfwTerminate();
+		return 2;
+	}
+	glfwSetWindowSizeCallback(window, handleResize);
+	glfwSetKeyCallback(window, handleKey);
+	glfwMakeContextCurrent(window);
+	if (gl3wInit() != 0) {
+		fprintf(stderr, "main: gl3wInit failed.\n");
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return 3;
+	}
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+	glCullFace(GL_BACK);
+	if (initializeShaderProgram() != 0)
+		return 4;
+	GLint attrLocs[3] = {glGetAttribLocation(program, "position"),
+		glGetAttribLocation(program, "texCoords"),
+		glGetAttribLocation(program, "normal")};
+	long threadNum = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+	threadNum = (threadNum < 1 ? 1 : threadNum);
+	threadNum = (threadNum > terrainTHREADMAX ? terrainTHREADMAX : threadNum);
+	if (terrainInitialize(&terrain, DEMOPATH, DEMOSIZE, DEMOSIZE, DEMOCHUNK,
+			DEMOSPACING, attrLocs, threadNum) != 0) {
+		glDeleteProgram(program);
+		return 5;
+	}
+	terrainSetDistances(&terrain, 1200.0, 160.0);
+	camSetFrustum(&cam, camPERSPECTIVE, M_PI / 4.0, 10.0, 150.0, 768.0,
+		768.0);
+	while (glfwWindowShouldClose(window) == 0) {
+		oldTime = newTime;
+		newTime = getTime();
+		if (!paused)
+			flightTime += newTime - oldTime;
+		if (floor(newTime) - floor(oldTime) >= 1.0)
+			fprintf(stderr, "main: %f frames/sec, %d chunks loaded, %d drawn, "
+				"%d triangles\n", 1.0 / (newTime - oldTime), terrain.loadedNum,
+				terrain.drawnNum, terrain.drawnTriNum);
+		updateCamera();
+		terrainUpdate(&terrain, &cam, 4);
+		render();
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+	}
+	terrainDestroy(&terrain);
+	glDeleteProgram(program);
+	glfwDestroyWindow(window);
+	glfwTerminate();
+	return 0;
+}